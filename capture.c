@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include "capture.h"
+#include "utils.h"
+
+/* Slot of the capture ring: the record, then the datagram */
+typedef struct capture_slot {
+	Capture_record record;
+	char data[CAPTURE_MAX_DATAGRAM];
+} Capture_slot;
+
+
+/* Body of the writer thread: append the records of the ring to the capture file */
+static void *capture_loop(void *arg)
+{
+    Capture *capture = (Capture *) arg;
+
+    // The signals are handled by the main thread
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    while (1)
+    {
+        // Read the flag first: the ingest thread is stopped, so the drain below sees its last datagrams
+        bool stopping = atomic_load(&capture->stopping);
+
+        Capture_slot *slot;
+        while ((slot = (Capture_slot *) ring_peek(&capture->ring)) != NULL)
+        {
+            fwrite(&slot->record, sizeof(Capture_record), 1, capture->file);
+            fwrite(slot->data, slot->record.len, 1, capture->file);
+            ring_pop(&capture->ring);
+
+            atomic_fetch_add_explicit(&capture->captured, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&capture->bytes, slot->record.len, memory_order_relaxed);
+        }
+
+        if (stopping)
+            break;
+
+        // The records are on disk before the writer sleeps (a crash loses only the ring)
+        fflush(capture->file);
+
+        if (ring_prepare_sleep(&capture->ring))
+        {
+            struct pollfd pfd = {capture->ring.data_efd, POLLIN, 0};
+            poll(&pfd, 1, -1);
+            ring_finish_sleep(&capture->ring);
+        }
+    }
+
+    return NULL;
+}
+
+
+bool capture_start(Capture *capture, const char *path)
+{
+    memset(capture, 0, sizeof(Capture));
+    capture->path = path;
+
+    capture->file = fopen(path, "wb");
+    if (capture->file == NULL)
+        return false;
+    setvbuf(capture->file, NULL, _IOFBF, CAPTURE_FILE_BUF);
+
+    Capture_file_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version     = CAPTURE_VERSION;
+    hdr.record_size = sizeof(Capture_record);
+    fwrite(&hdr, sizeof(hdr), 1, capture->file);
+
+    ring_init(&capture->ring, CAPTURE_RING_SLOTS, sizeof(Capture_slot));
+
+    int ret = pthread_create(&capture->thread, NULL, capture_loop, capture);
+    DIE(ret != 0, "[ERROR]: Couldn't create the capture thread!\n");
+    return true;
+}
+
+
+void capture_stop(Capture *capture)
+{
+    if (capture->file == NULL)
+        return;
+
+    // Wake the writer, it exits after the last records
+    atomic_store(&capture->stopping, 1);
+    uint64_t one = 1;
+    write(capture->ring.data_efd, &one, sizeof(one));
+    pthread_join(capture->thread, NULL);
+
+    if (ferror(capture->file) || fclose(capture->file) != 0)
+        fprintf(stderr, "[ERROR]: Couldn't write the capture file!\n");
+    capture->file = NULL;
+    ring_destroy(&capture->ring);
+}
+
+
+void capture_datagram(Capture *capture, const char *data, size_t len, const struct sockaddr_in *from, uint64_t rx_ns)
+{
+    // Never wait for the writer, the ingest thread must keep up with the socket
+    Capture_slot *slot = (Capture_slot *) ring_reserve(&capture->ring);
+    if (slot == NULL)
+    {
+        atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    slot->record.rx_ns  = rx_ns;
+    slot->record.addr   = from->sin_addr.s_addr;
+    slot->record.port   = from->sin_port;
+    slot->record.len    = MIN(len, CAPTURE_MAX_DATAGRAM);
+    memcpy(slot->data, data, slot->record.len);
+    ring_push(&capture->ring);
+}
+
+
+void capture_wake(Capture *capture)
+{
+    ring_wake_consumer(&capture->ring);
+}
+
+
+void capture_print_stats(Capture *capture, FILE *file)
+{
+    if (capture->file == NULL)
+        return;
+
+    fprintf(file, "Capture %s: %lu datagrams (%lu bytes) written, %lu dropped.\n", capture->path,
+            atomic_load(&capture->captured), atomic_load(&capture->bytes), atomic_load(&capture->dropped));
+}
@@ -0,0 +1,69 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "ring.h"
+
+/* Capture constants */
+#define CAPTURE_MAGIC			"PCCP"		// First bytes of a capture file
+#define CAPTURE_VERSION			1
+#define CAPTURE_RING_SLOTS		4096		// Datagrams between the ingest thread and the capture writer
+#define CAPTURE_MAX_DATAGRAM	2048		// Longest datagram kept in a capture slot (longer ones are cut)
+#define CAPTURE_FILE_BUF		(1 << 20)	// Buffer of the capture file (the writer does big writes)
+
+/* Header of the capture file, followed by the records until the end of the file */
+typedef struct capture_file_hdr {
+	char 	 magic[4];
+	uint32_t version;
+	uint32_t record_size;		// Size of `Capture_record` (the datagram follows each record)
+	uint32_t reserved;
+} Capture_file_hdr;
+
+/* Record of a datagram in the capture file (little endian, as written by the server) */
+typedef struct capture_record {
+	uint64_t rx_ns;				// Kernel receive timestamp (CLOCK_REALTIME)
+	uint32_t addr;				// Source address (network order)
+	uint16_t port;				// Source port (network order)
+	uint16_t len;				// Length of the datagram that follows
+} Capture_record;
+
+/* Capture of the UDP ingest stream */
+/*
+ * -> The ingest thread copies every received datagram in `ring` and never waits for the writer
+ *    (a datagram that finds the ring full is counted in `dropped`, not captured)
+ * -> The writer thread appends the records to the file, through a big stdio buffer
+ */
+typedef struct capture {
+	FILE 	   *file;						// NULL - the capture is disabled
+	const char *path;
+	Spsc_ring 	ring;
+	pthread_t 	thread;
+	_Atomic int stopping;				// The writer exits once the ring is empty
+
+	_Atomic uint64_t captured;			// Records written (writer thread)
+	_Atomic uint64_t bytes;				// Bytes of datagrams written (writer thread)
+	_Atomic uint64_t dropped;			// Datagrams not captured, the ring was full (ingest thread)
+} Capture;
+
+
+/* Open the capture file (truncated) and start the writer thread, return false if the file can't be opened */
+bool 	capture_start(Capture *capture, const char *path);
+
+/* Write the captured datagrams still in the ring, stop the writer thread and close the file */
+void 	capture_stop(Capture *capture);
+
+/* Ingest thread: capture a datagram received from `from` at `rx_ns` */
+void 	capture_datagram(Capture *capture, const char *data, size_t len, const struct sockaddr_in *from, uint64_t rx_ns);
+
+/* Ingest thread: wake the writer (call it once per batch of datagrams) */
+void 	capture_wake(Capture *capture);
+
+/* Print the counters of the capture */
+void 	capture_print_stats(Capture *capture, FILE *file);
+
+#endif
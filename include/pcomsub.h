@@ -0,0 +1,74 @@
+#ifndef _PCOMSUB_H_
+#define _PCOMSUB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+
+/* A connection to a server (created by `pcomsub_connect()`) */
+/*
+ * -> The socket is non-blocking: the application polls the descriptors given by `pcomsub_poll_fds()`
+ *    (with those of its other connections) and calls `pcomsub_dispatch()` once they're ready
+ * -> The messages are handed to the callbacks in place (in the receive buffer, the shared ring or the
+ *    multicast datagram), so a message and its strings are valid only until the callback returns
+ * -> A connection is used by a single thread, several connections may share the thread
+ */
+typedef struct pcomsub Pcomsub;
+
+/* A message of a topic, as decoded by the library */
+typedef struct pcomsub_msg {
+	const char *topic;			// Not null terminated if it has `topic_len` == 50 bytes
+	size_t 		topic_len;
+	uint8_t 	type;			// 0 - INT, 1 - SHORT_REAL, 2 - FLOAT, 3 - STRING
+	const char *payload;		// The value formatted by the server (null terminated)
+	const char *ip;				// Address of the publisher
+	uint16_t 	port;			// Port of the publisher
+	uint32_t 	seq;			// Sequence number on the SF stream of the topic (0 - the topic isn't SF)
+} Pcomsub_msg;
+
+/* Callbacks of a connection (any of them may be NULL), each one gets the `user` of `pcomsub_connect()` */
+typedef struct pcomsub_callbacks {
+	void (*on_msg)(Pcomsub *sub, const Pcomsub_msg *msg, void *user);
+	void (*on_notice)(Pcomsub *sub, const char *text, void *user);		// Text sent by the server (e.g. an error)
+	void (*on_warning)(Pcomsub *sub, const char *text, void *user);		// The library fell back (e.g. a group can't be joined)
+} Pcomsub_callbacks;
+
+
+/**
+ * Connect to the server `ip`:`port` as the client `id`, and ask for the SF messages stored meanwhile
+ * With `shm_path`, the messages come through a shared ring (or through TCP if the ring can't be mapped)
+ * Return NULL (and set `errno`) if the connection fails
+*/
+Pcomsub *pcomsub_connect(const char *id, const char *ip, uint16_t port, const char *shm_path,
+						 const Pcomsub_callbacks *callbacks, void *user);
+
+/**
+ * Subscribe to `num_topics` topics with the same `sf` (0/1) and options
+ * (`opts`: NULL, or e.g. "rate=10 every=2 if between 10 20")
+ * Return -1 (`errno` = EINVAL) if an option is invalid, 0 otherwise
+*/
+int 	 pcomsub_subscribe(Pcomsub *sub, const char **topics, int num_topics, int sf, const char *opts);
+
+/* Unsubscribe from `num_topics` topics, return 0 */
+int 	 pcomsub_unsubscribe(Pcomsub *sub, const char **topics, int num_topics);
+
+/* Number of descriptors of the connection (the size `pcomsub_poll_fds()` needs) */
+int 	 pcomsub_num_fds(Pcomsub *sub);
+
+/**
+ * Fill `fds` with the descriptors to poll and lower `*timeout_ms` (-1 - infinite) to the next deadline of the connection
+ * Return the number of descriptors, or -1 (`errno` = ENOSPC) if they don't fit in `max_fds`
+*/
+int 	 pcomsub_poll_fds(Pcomsub *sub, struct pollfd *fds, int max_fds, int *timeout_ms);
+
+/**
+ * Handle what's ready after a poll (`fds` may hold the descriptors of other connections, they're skipped):
+ * receive the messages, run the callbacks and send the due acks, without blocking
+ * Return -1 if the connection is lost (`errno` = ECONNRESET, or ETIMEDOUT if the server stopped answering)
+*/
+int 	 pcomsub_dispatch(Pcomsub *sub, const struct pollfd *fds, int num_fds);
+
+/* Acknowledge every message handed to the callbacks (so they aren't replayed), close the connection and free it */
+void 	 pcomsub_close(Pcomsub *sub);
+
+#endif
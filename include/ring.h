@@ -0,0 +1,71 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE	64		// Size of a cache line (fields written by different threads are kept apart)
+
+/* Lock-free single-producer single-consumer ring of fixed-size slots */
+/*
+ * -> The producer fills the slot returned by `ring_reserve()` and makes it visible with `ring_push()`
+ * -> The consumer reads the slot returned by `ring_peek()` and gives it back with `ring_pop()`
+ * -> Each side sleeps on an eventfd, which is written only if the other side announced it's sleeping
+ */
+typedef struct spsc_ring {
+	_Alignas(CACHE_LINE) _Atomic size_t head;		// Next slot to be written (owned by the producer)
+	size_t 	tail_cache;								// Last `tail` seen by the producer
+
+	_Alignas(CACHE_LINE) _Atomic size_t tail;		// Next slot to be read (owned by the consumer)
+	size_t 	head_cache;								// Last `head` seen by the consumer
+
+	_Alignas(CACHE_LINE) _Atomic int consumer_waiting;	// The consumer is (about to be) blocked on `data_efd`
+	_Alignas(CACHE_LINE) _Atomic int producer_waiting;	// The producer is (about to be) blocked on `space_efd`
+
+	_Alignas(CACHE_LINE) size_t mask;				// Number of slots - 1 (the number of slots is a power of 2)
+	size_t 	slot_size;								// Size of a slot (multiple of `CACHE_LINE`)
+	char 	*slots;
+	int 	data_efd;								// Wakes the consumer (new slots were pushed)
+	int 	space_efd;								// Wakes the producer (slots were popped)
+} Spsc_ring;
+
+
+/* Allocate a ring with `num_slots` (rounded up to a power of 2) slots of `slot_size` bytes */
+void 	ring_init(Spsc_ring *ring, size_t num_slots, size_t slot_size);
+
+/* Free the memory and close the eventfds of a ring */
+void 	ring_destroy(Spsc_ring *ring);
+
+/* Producer: return the next free slot (or NULL if the ring is full) */
+void   *ring_reserve(Spsc_ring *ring);
+
+/* Producer: make the slot returned by `ring_reserve()` visible to the consumer */
+void 	ring_push(Spsc_ring *ring);
+
+/* Producer: wake the consumer if it's sleeping (call it once per batch of pushes) */
+void 	ring_wake_consumer(Spsc_ring *ring);
+
+/* Producer: block until the consumer frees a slot */
+void 	ring_wait_space(Spsc_ring *ring);
+
+/* Consumer: return the oldest pushed slot (or NULL if the ring is empty) */
+void   *ring_peek(Spsc_ring *ring);
+
+/* Consumer: give back the slot returned by `ring_peek()` */
+void 	ring_pop(Spsc_ring *ring);
+
+/* Consumer: wake the producer if it's waiting for space (call it once per batch of pops) */
+void 	ring_wake_producer(Spsc_ring *ring);
+
+/**
+ * Consumer: announce that it will block on `data_efd`
+ * Return false if the ring isn't empty (the consumer must not block)
+*/
+bool 	ring_prepare_sleep(Spsc_ring *ring);
+
+/* Consumer: called after waking up (reset `data_efd` and the announcement) */
+void 	ring_finish_sleep(Spsc_ring *ring);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+#define SHM_RING_MAGIC	0x534d4350		// "PCMS", first bytes of a shared ring
+
+/* Header of a shared ring, at the start of its memfd (the slots follow it) */
+/*
+ * -> The server is the only producer, a same-host subscriber is the only consumer
+ * -> The indexes count the slots ever pushed/popped (a slot is `index & (num_slots - 1)`)
+ * -> Each side sleeps on an eventfd, which is written only if the other side announced it's sleeping
+ * -> The subscriber maps it read-write: the server never trusts it (it keeps the geometry and `head` in `Shm_ring`)
+ */
+typedef struct shm_ring_hdr {
+	uint32_t magic;
+	uint32_t num_slots;										// Power of 2
+	uint32_t slot_size;										// Multiple of `CACHE_LINE`
+
+	_Alignas(CACHE_LINE) _Atomic uint64_t head;				// Next slot to be written (server)
+	_Alignas(CACHE_LINE) _Atomic uint64_t tail;				// Next slot to be read (subscriber)
+	_Alignas(CACHE_LINE) _Atomic int reader_waiting;		// The subscriber is (about to be) blocked on `data_efd`
+	_Alignas(CACHE_LINE) _Atomic int writer_waiting;		// The server waits for a slot (on `space_efd`)
+} Shm_ring_hdr;
+
+/* A shared ring, as mapped by one of the two processes */
+typedef struct shm_ring {
+	Shm_ring_hdr *hdr;
+	char 	 *slots;
+	size_t 	 map_len;					// Length of the mapping (header and slots)
+	uint32_t num_slots;					// Geometry of the ring, set once (create/attach) and never read back from `hdr`
+	uint32_t slot_size;
+	uint64_t head;						// Producer: next slot to be written (`hdr->head` is only its published copy)
+	uint64_t head_cache;				// Last `head` seen by the consumer
+	uint64_t tail_cache;				// Last `tail` seen by the producer
+
+	int 	 memfd;						// Memory of the ring (-1 once it's mapped by both sides)
+	int 	 data_efd;					// Wakes the subscriber (new slots were pushed)
+	int 	 space_efd;					// Wakes the server (slots were popped), -1 if the ring doesn't own it
+} Shm_ring;
+
+
+/* Server: create a ring with `num_slots` (rounded up to a power of 2) slots of `slot_size` bytes in a memfd */
+bool 	shm_ring_create(Shm_ring *ring, size_t num_slots, size_t slot_size);
+
+/* Subscriber: map the ring received from the server (the memfd is closed) */
+bool 	shm_ring_attach(Shm_ring *ring, int memfd, int data_efd, int space_efd);
+
+/* Unmap a ring and close its descriptors */
+void 	shm_ring_destroy(Shm_ring *ring);
+
+/**
+ * Producer: return the next free slot (or NULL if the ring is full)
+ * The consumer's `tail` is clamped to [head - num_slots, head], so the slot is always inside the mapping
+*/
+void   *shm_ring_reserve(Shm_ring *ring);
+
+/* Producer: make the slot returned by `shm_ring_reserve()` visible to the consumer */
+void 	shm_ring_push(Shm_ring *ring);
+
+/* Producer: wake the consumer if it's sleeping (call it once per batch of pushes) */
+void 	shm_ring_wake_reader(Shm_ring *ring);
+
+/**
+ * Producer: announce that it waits for a free slot
+ * Return false if a slot is already free (the producer must not wait)
+*/
+bool 	shm_ring_prepare_wait(Shm_ring *ring);
+
+/* Producer: called when it stops waiting (the announcement is withdrawn) */
+void 	shm_ring_finish_wait(Shm_ring *ring);
+
+/* Consumer: return the oldest pushed slot (or NULL if the ring is empty) */
+void   *shm_ring_peek(Shm_ring *ring);
+
+/* Consumer: give back the slot returned by `shm_ring_peek()` */
+void 	shm_ring_pop(Shm_ring *ring);
+
+/* Consumer: wake the producer if it's waiting for a slot (call it once per batch of pops) */
+void 	shm_ring_wake_writer(Shm_ring *ring);
+
+/**
+ * Consumer: announce that it will block on `data_efd`
+ * Return false if the ring isn't empty (the consumer must not block)
+*/
+bool 	shm_ring_prepare_sleep(Shm_ring *ring);
+
+/* Consumer: called after waking up (reset `data_efd` and the announcement) */
+void 	shm_ring_finish_sleep(Shm_ring *ring);
+
+#endif
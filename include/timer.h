@@ -0,0 +1,66 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Timer wheel constants */
+#define TIMER_TICK_MS		100			// Resolution of the timers
+#define TIMER_LEVELS		4			// Level 0 (256 ticks), then 3 levels of 64 slots (about 77 days in all)
+#define TIMER_L0_BITS		8
+#define TIMER_LN_BITS		6
+#define TIMER_L0_SLOTS		(1 << TIMER_L0_BITS)
+#define TIMER_LN_SLOTS		(1 << TIMER_LN_BITS)
+
+/* Pointer to the structure that embeds `ptr` as its `member` */
+#define container_of(ptr, type, member)	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/* A timer, embedded in the structure it belongs to (e.g. a client) */
+typedef struct timer {
+	struct timer *next;
+	struct timer *prev;						// NULL - the timer isn't pending
+	uint64_t 	 expires;					// Tick at which it fires
+	void 		 (*fn)(struct timer *timer, void *arg);
+} Timer;
+
+/* Hierarchical timer wheel */
+/*
+ * -> A timer is kept in a slot of the level that covers its delay, so adding and removing it is O(1)
+ * -> Level 0 has a slot per tick; every 256 ticks, a slot of level 1 is moved down (cascaded), and so on
+ * -> A tick only runs its own slot: the work is proportional to the timers that fire (and the cascades)
+ */
+typedef struct timer_wheel {
+	uint64_t now;							// Last tick processed
+	uint64_t now_ms;						// Time of the last `timer_wheel_advance()`
+	size_t 	 count;							// Number of pending timers
+	Timer 	 level0[TIMER_L0_SLOTS];		// Heads of the circular lists
+	Timer 	 levels[TIMER_LEVELS - 1][TIMER_LN_SLOTS];
+} Timer_wheel;
+
+
+/* Current CLOCK_MONOTONIC time in milliseconds */
+uint64_t timer_now_ms();
+
+/* Initialize an empty wheel at `now_ms` */
+void 	 timer_wheel_init(Timer_wheel *wheel, uint64_t now_ms);
+
+/* Set the callback of a timer (it's not pending) */
+void 	 timer_init(Timer *timer, void (*fn)(Timer *timer, void *arg));
+
+/* Tell if a timer is pending */
+bool 	 timer_pending(Timer *timer);
+
+/* (Re)arm a timer to fire at `expires_ms` (a time in the past fires at the next tick) */
+void 	 timer_add(Timer_wheel *wheel, Timer *timer, uint64_t expires_ms);
+
+/* Disarm a timer (nothing happens if it isn't pending) */
+void 	 timer_del(Timer_wheel *wheel, Timer *timer);
+
+/* Run the timers that expired until `now_ms` (each callback gets `arg`, it may re-arm its timer) */
+void 	 timer_wheel_advance(Timer_wheel *wheel, uint64_t now_ms, void *arg);
+
+/* Milliseconds until the next tick with work (a timer or a cascade), -1 if no timer is pending */
+long 	 timer_wheel_timeout_ms(Timer_wheel *wheel, uint64_t now_ms);
+
+#endif
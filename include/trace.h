@@ -0,0 +1,98 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Tracing constants */
+#define TRACE_BUCKETS		64			// Histogram buckets (bucket `b` counts latencies in [2^(b-1), 2^b) ns)
+#define TRACE_RECORDS		(1 << 16)	// Number of records kept for the trace file (the newest ones)
+#define TRACE_MAGIC			"PCTR"		// First bytes of a trace file
+#define TRACE_VERSION		1
+
+/* Stages of a message inside the server */
+typedef enum {
+	STAGE_SOCKET,		// Kernel receive timestamp -> `recvmmsg` returned
+	STAGE_CONVERT,		// `UDP_to_TCP`
+	STAGE_ENQUEUE,		// Ingest ring -> fanout started
+	STAGE_WRITE,		// Fanout started -> last byte handed to the socket (one sample per client, queued writes too)
+	NUM_STAGES
+} trace_stage;
+
+/* Timestamps of a sampled message (CLOCK_REALTIME, like the kernel timestamps) */
+typedef struct msg_trace {
+	bool 	 sampled;		// The timestamps below are set
+	uint64_t rx_ns;			// Kernel receive timestamp (SO_TIMESTAMPNS)
+	uint64_t recv_ns;		// `recvmmsg` returned
+	uint64_t decoded_ns;	// `UDP_to_TCP` finished
+	uint64_t fanout_ns;		// The fanout loop started sending the message
+	uint64_t write_ns;		// Slowest socket write so far (since `fanout_ns`)
+	uint32_t num_writes;	// Socket writes so far
+	uint32_t topic_hash;	// FNV-1a hash of the topic name
+} Msg_trace;
+
+/* Record of a message in the trace file (little endian, as written by the server) */
+typedef struct trace_record {
+	uint64_t rx_ns;				// Kernel receive timestamp
+	uint32_t stage_ns[NUM_STAGES];	// Latency of each stage (`STAGE_WRITE`: the slowest client)
+	uint32_t num_writes;		// Number of socket writes for this message
+	uint32_t topic_hash;		// FNV-1a hash of the topic name
+} Trace_record;
+
+/* Header of the trace file, followed by `count` records (oldest first) */
+typedef struct trace_file_hdr {
+	char 	 magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;
+} Trace_file_hdr;
+
+/* Latency histograms and the newest trace records */
+typedef struct tracer {
+	unsigned 	sample;							// Trace 1 message in `sample` (0 - disabled)
+	unsigned 	countdown;						// Messages until the next sample (ingest thread)
+	const char *file;							// Trace file written on `SIGUSR1` (NULL - disabled)
+
+	uint64_t 	hist[NUM_STAGES][TRACE_BUCKETS];	// Histograms (fanout loop)
+	uint64_t 	max_ns[NUM_STAGES];
+
+	Trace_record *records;						// Circular list of the newest records (fanout loop)
+	uint64_t 	num_records;					// Number of records ever added
+} Tracer;
+
+
+/* Current CLOCK_REALTIME time in nanoseconds */
+uint64_t now_ns();
+
+/* Return `b - a`, or 0 if the clock went backwards */
+uint64_t elapsed_ns(uint64_t a, uint64_t b);
+
+/* Parse the `--trace-sample` value (a positive number), return false if it isn't valid */
+bool 	 parse_trace_sample(const char *text, unsigned *sample);
+
+/* Initialize a tracer (`sample` = 0 disables it) */
+void 	 trace_init(Tracer *tracer, unsigned sample, const char *file);
+
+/* Free the memory of a tracer */
+void 	 trace_destroy(Tracer *tracer);
+
+/* Ingest thread: tell if the next message is sampled */
+bool 	 trace_sample_next(Tracer *tracer);
+
+/* Fanout loop: add a latency to the histogram of `stage` */
+void 	 trace_add(Tracer *tracer, trace_stage stage, uint64_t ns);
+
+/* Fanout loop: add the write latency of a sampled message to a client (when its last byte is handed to the socket) */
+void 	 trace_write(Tracer *tracer, Msg_trace *trace);
+
+/* Fanout loop: add the latencies of a sampled message, once it's written to every client (or dropped) */
+void 	 trace_msg(Tracer *tracer, Msg_trace *trace);
+
+/* Print the histograms (count and percentiles of each stage) */
+void 	 trace_print_stats(Tracer *tracer, FILE *file);
+
+/* Write the newest records in the trace file, return the number of records or -1 on error */
+int 	 trace_dump(Tracer *tracer);
+
+#endif
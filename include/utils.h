@@ -5,15 +5,33 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include "ring.h"
+#include "shm_ring.h"
+#include "trace.h"
+#include "capture.h"
+#include "timer.h"
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
@@ -37,9 +55,9 @@
 
 
 /* UDP messages constants (+1 for the null terminator) */
-#define BUFF_LEN		50 + 1 + 1500 + 1   // Maximum size of a `data chunk`
-#define TOPIC_SIZE		49 			  + 1	// Maximum size of a `topic name`
-#define PAYLOAD_SIZE	1500 		  + 1	// Maximum size of a `payload` 
+#define BUFF_LEN		(50 + 1 + 1500 + 1)  // Maximum size of a `data chunk`
+#define TOPIC_SIZE		(49 			  + 1)	// Maximum size of a `topic name`
+#define PAYLOAD_SIZE	(1500 		  + 1)	// Maximum size of a `payload` 
 
 /* Structure of an UDP message */
 typedef struct udp_msg {
@@ -48,19 +66,43 @@ typedef struct udp_msg {
 	char 	payload[PAYLOAD_SIZE];
 } UDP_msg;
 
+/* Batched publish frames constants */
+#define BATCH_MAGIC			"\0PB"		// First bytes of a batched datagram (a single message never has an empty topic)
+#define BATCH_MAGIC_LEN		3
+#define BATCH_VERSION		1
+
+/* Header of a batched datagram, followed by `count` records (the whole datagram is at most `BUFF_LEN - 1` bytes) */
+typedef struct batch_hdr {
+	char 	 magic[BATCH_MAGIC_LEN];	// `BATCH_MAGIC`
+	uint8_t  version;					// `BATCH_VERSION`
+	uint16_t count;						// Number of records (network order)
+} Batch_hdr;
+
+/* Header of a record of a batched datagram, followed by the topic name and the payload */
+typedef struct batch_rec {
+	uint8_t  topic_len;					// 1 ... `TOPIC_SIZE`
+	uint8_t  type;						// 0 - INT, 1 - SHORT_REAL, 2 - FLOAT, 3 - STRING
+	uint16_t payload_len;				// At most `PAYLOAD_SIZE - 1` (network order)
+} Batch_rec;
+
 
 /* Types of the TCP message */
 typedef enum {	
 	INT,
 	SHORT_REAL,
 	FLOAT,
-	STRING
+	STRING,
+	MCAST_JOIN,		// From the server: the topic is delivered on a multicast group (payload: "<GROUP> <PORT> <SEQ>")
+	MCAST_LEAVE,	// From the server: the topic is delivered over TCP again
+	HEARTBEAT,		// From the server: answer with `OP_HEARTBEAT` (payload: the heartbeat interval in ms)
+	TOPIC_ALIAS,	// From the server: the next messages of the topic carry its alias (payload: "<ALIAS>")
+	SHM_TOKEN		// From the server: the answer to `OP_SHM_TOKEN` (payload: the token, `SHM_TOKEN_LEN` bytes)
 } msg_type;
 
 /* TCP messages constants (+1 for the null terminator) */
-#define IP_LEN					3 * 4 + 3 				+ 1	// 4 groups of 3 + 3 dots + '\0' (e.g: "127.0.0.1")
-#define MAX_DIGITS_TCP_MSG_LEN 	9 		  				+ 1
-#define TCP_MSG_SIZE			sizeof(TCP_msg) 		+ 1
+#define IP_LEN					(3 * 4 + 3 				+ 1)	// 4 groups of 3 + 3 dots + '\0' (e.g: "127.0.0.1")
+#define MAX_DIGITS_TCP_MSG_LEN 	(9 		  				+ 1)
+#define TCP_MSG_SIZE			(sizeof(TCP_msg) 		+ 1)
 
 /* Structure of a TCP message */
 /*`Size of the message` allows me to receive the packet in chunks (TCP is stream oriented)
@@ -73,68 +115,753 @@ typedef struct tcp_msg {
 	uint16_t port;							// `PORT_CLIENT_UDP`
 
 	bool 	 from_server;					// Tell if it is an repsonse (err msg) from the server (not from the UDP clients)
+	uint32_t seq;							// Sequence number on the client-topic stream (0 if the stream isn't SF), network order
 	UDP_msg  udp_msg;						// Received msg from the UDP client with IP `ip` and PORT `port`
 } TCP_msg;
 
+/* Header of an aliased message (a subscriber that sent `OPT_ALIAS` gets the messages of the topic in this form) */
+/*
+ * -> The same fields as a `TCP_msg` until `seq`, then the alias of the topic instead of its name,
+ *    and the payload until its terminator: the message is shorter than a `TCP_msg`
+ * -> `marker` is where a `TCP_msg` has the first character of its topic (never empty for a subscribed topic)
+ */
+typedef struct alias_hdr {
+	char 	 size[MAX_DIGITS_TCP_MSG_LEN];	// Size of the message (this header and the payload)
+	char	 ip[IP_LEN];
+	uint16_t port;
+	bool 	 from_server;					// Always false
+	uint32_t seq;							// Network order
+	char 	 marker;						// '\0'
+	uint32_t alias;							// Alias of the topic, announced by a `TOPIC_ALIAS` message (network order)
+	uint8_t  type;
+} Alias_hdr;
+
+/* Content filters constants */
+#define RAW_VALUE_LEN			6			// Longest numeric payload (FLOAT: sign, module, power)
+#define FILTERED_TOPIC_SLOTS	4096		// Counters of the filtered topics, indexed by the hash of the name
+#define FILTER_TEXT_LEN			64			// Maximum length of a predicate (e.g. "between 10 20")
+
+/* A predicate on a numeric payload, compiled to an interval (values outside it match if `negate` is set) */
+typedef struct filter {
+	bool 	active;
+	bool 	lo_closed;				// `lo` is in the interval
+	bool 	hi_closed;				// `hi` is in the interval
+	bool 	negate;					// `!=` matches the values outside [lo, hi]
+	double 	lo;
+	double 	hi;
+} Filter;
+
+/* A TCP message shared by the queues of several clients */
+/*
+ * -> A message in the ingest ring may hold the raw datagram (`formatted` isn't set), when some subscribers of
+ *    its topic have filters: it's formatted by the fanout only if a subscriber gets it
+ * -> `raw_value` keeps the numeric payload of the datagram, for the filters
+ */
+typedef struct shared_msg {
+	int 	refs;							// Number of holders (freed when it drops to 0)
+	Msg_trace trace;						// Timestamps of the message (if it's sampled for tracing)
+	bool 	formatted;						// `msg` is formatted (otherwise `msg.udp_msg` is the raw datagram)
+	uint16_t raw_len;						// Length of the raw datagram
+	struct sockaddr_in from;				// Sender of the raw datagram
+	uint8_t raw_value[RAW_VALUE_LEN];		// Numeric payload of the datagram
+	Alias_hdr alias_hdr;					// Aliased form of the header, the same for every subscriber without SF
+											// (built by the first aliased write, `size` is empty until then)
+	TCP_msg msg;
+} Shared_msg;
+
+/* A message kept for a client until it's acknowledged */
+typedef struct pending_msg {
+	uint32_t 	seq;						// Sequence number of the message on its client-topic stream
+	uint64_t 	stored;						// Order in which the SF messages were stored (the oldest are evicted first)
+	uint64_t 	stored_ms;					// Time at which it was stored (SF expiry)
+	Shared_msg *msg;
+} Pending_msg;
+
+
+/* Timeouts constants */
+#define DEFAULT_HEARTBEAT_MS	5000	// A quiet connection gets a heartbeat after this long
+#define DEFAULT_IDLE_MS			15000	// A client that sent nothing for this long is disconnected
+#define SERVER_TIMEOUT_BEATS	3		// The subscriber leaves after this many heartbeat intervals without data
+
+/* Timeouts of the server, driven by the timer wheel (0 - disabled) */
+/*
+ * -> Every connected client has a timer, fired at its nearest deadline: a client that sent nothing (or got nothing)
+ *    for `heartbeat_ms` gets a heartbeat, one that sent nothing for `idle_ms` is disconnected
+ * -> Every SF topic with stored messages has a timer, fired when its oldest message is `sf_ttl_ms` old
+ */
+typedef struct timeouts {
+	uint64_t heartbeat_ms;
+	uint64_t idle_ms;
+	uint64_t sf_ttl_ms;
+
+	uint64_t heartbeats;				// Heartbeats sent
+	uint64_t idle_clients;				// Clients disconnected by the idle timeout
+	uint64_t expired_msgs;				// SF messages dropped by `sf_ttl_ms`
+} Timeouts;
+
+
+/* Memory accounting constants */
+#define MEM_LOW_WATER(b)	((b) - (b) / 16)	// The eviction stops under this usage
+#define INITIAL_SF_HEAP		64			// Initial capacity of the heap of the SF queues
+
+/* What an accounted allocation is used for */
+typedef enum {
+	MEM_CLIENTS,		// Clients, their topic lists and the `subscribers` list
+	MEM_TOPICS,			// Subscriptions, the topic index and the fanout lists
+	MEM_MSGS,			// Shared messages (stored, queued or kept for the multicast repairs)
+	MEM_QUEUES,			// SF queues, output lanes, receive buffers and shared rings
+	MEM_PEERS,			// Peer links, their buffers, the learned interests and the origins of the publishes
+	NUM_MEM_KINDS
+} mem_kind;
+
+/* Header of an accounted allocation (the caller gets the memory that follows it) */
+typedef union mem_hdr {
+	struct {
+		size_t 	 size;					// Bytes requested by the caller
+		struct client *owner;			// Client charged for the memory (NULL - shared by the server)
+		mem_kind kind;
+	};
+	max_align_t align;
+} Mem_hdr;
+
+/* Memory used by the server and the admission control of `budget` */
+/*
+ * -> Over the budget, the new clients are rejected, the new subscriptions are refused, the oldest SF messages
+ *    are evicted and the output lanes of the slow clients stop growing (their new messages are dropped)
+ * -> A failed allocation refuses the operation in the same way, instead of stopping the server
+ */
+typedef struct mem_stats {
+	size_t 	 budget;					// Maximum number of bytes (0 - unlimited)
+	size_t 	 used;						// Bytes allocated (with the headers)
+	size_t 	 peak;
+	size_t 	 by_kind[NUM_MEM_KINDS];
+	size_t 	 fixed;						// Preallocated at startup (the rings and the trace records), outside the budget
+	uint64_t failed;					// Allocations that failed
+	uint64_t rejected_clients;
+	uint64_t refused_subs;
+	uint64_t evicted_msgs;				// SF messages evicted before they were acknowledged
+	uint64_t dropped_msgs;				// Messages not queued for a slow client
+} Mem_stats;
+
 
 #define INITIAL_MAX_TCPS	10		// Initial number of stored TCP messages for a client
+
+/* Rate limiting constants */
+#define RATE_UNIT			1000		// `rate` is counted in 1/1000 messages per second
+#define RATE_MSG_COST		((uint64_t) RATE_UNIT * 1000000)	// Tokens taken by a message
+#define RATE_MAX_IDLE_US	1000000000	// Longest refill taken into account (the bucket is full by then)
 	
+struct topic_entry;
+
 /* Structure of a Topic */
 typedef struct topic {
-	char 	name[TOPIC_SIZE];		// Name of the topic
 	uint8_t sf;						// Store-and-forward (0 - disabled | 1 - enabled)
-	bool 	subscribed;				// Tell if the client is still subscribed to this topic
 
-	int 	num_of_tcps;			// Current number of stored TCP messages
+	struct topic_entry *entry;		// Entry of this topic in the server's topic index (it holds the name)
+	int 	sub_idx;				// Position of this subscription in `entry->subs`
+
+	bool 	 alias;					// The subscriber accepts the alias of the topic (`OPT_ALIAS`)
+	bool 	 alias_sent;			// The alias was announced on the current connection
+
+	uint32_t rate;					// Maximum rate, in 1/`RATE_UNIT` messages per second (0 - unlimited)
+	uint32_t every;					// Send only 1 message in `every` (0 - all)
+	uint32_t every_count;			// Messages received since the last one sent (`every`)
+	uint64_t tokens;				// Token bucket of `rate` (`rate` tokens are added every microsecond)
+	uint64_t refill_us;				// Time of the last refill of `tokens`
+	uint64_t throttled;				// Number of messages dropped by `rate` and `every`
+
+	Filter 	 filter;				// Content filter (inactive - all messages)
+	uint64_t filtered;				// Number of messages dropped by `filter`
+
+	bool 	 mcast;					// Served by the multicast group of its topic (not in the fanout list)
+
+	uint32_t next_seq;				// Sequence number of the next message on this topic (SF only)
+	int 	first_tcp;				// Position of the oldest unacknowledged message in `tcps`
+	int 	num_of_tcps;			// Current number of unacknowledged TCP messages
 	int 	max_tcps;				// Maximum number of stored TCP messages
-	TCP_msg **tcps;					// List of TCP messages for storing packets when a client disconnects
+	Pending_msg *tcps;				// Circular list of sent/stored messages, kept until the client acknowledges them
+	Timer 	expiry;					// Fires when the oldest stored message expires (`sf_ttl_ms`)
+	int 	heap_idx;				// Position in the heap of the SF queues (-1 - `tcps` is empty)
 } Topic;
 
+/* The non-empty SF queues of all the clients, a min-heap by the age of their oldest message */
+/*
+ * -> The root holds the globally oldest stored message: an eviction takes it without scanning the clients
+ * -> A queue enters the heap with its first message and leaves it when it's emptied
+ */
+typedef struct sf_heap {
+	Topic  **topics;
+	int 	 num;
+	int 	 max;
+} Sf_heap;
+
+
+/* Priority classes of the topics (each one is a lane of the clients' output queues) */
+typedef enum {
+	LANE_HIGH,		// e.g. alarms, always written first
+	LANE_NORMAL,	// Default class of a topic
+	LANE_BULK,		// e.g. telemetry, written when nothing else is waiting
+	NUM_LANES
+} lane_class;
+
+/* Output queue constants */
+#define OUT_MSG_LEN				(MAX_DIGITS_TCP_MSG_LEN + sizeof(TCP_msg))	// Bytes of a message on the wire
+#define OUT_BATCH				8			// Maximum number of messages written with a single `sendmsg`
+#define INITIAL_MAX_OUT_MSGS	16			// Initial capacity of a lane
+#define LANE_STARVATION_LIMIT	16			// A waiting lane is skipped at most this many times in a row
+#define OUT_NOTSENT_LOWAT		(16 * 1024)	// Unsent bytes in a client's socket (the rest waits in the lanes)
+#define SHM_RING_SLOTS			2048		// Messages in the shared ring of a same-host subscriber (a `TCP_msg` per slot)
+#define SHM_TOKEN_LEN			(16 + 1)	// A random 64-bit value in hex (+ '\0'), proves a ring request comes from the client
+
+/* A message waiting to be written to a client */
+typedef struct out_msg {
+	Shared_msg *msg;
+	uint32_t 	seq;				// Sequence number of the message for this client, network order
+	uint32_t 	alias;				// Alias of its topic, network order (0 - the whole `TCP_msg` is written)
+} Out_msg;
+
+/* A lane of a client's output queue */
+typedef struct out_lane {
+	int 	first;					// Position of the oldest message in `msgs`
+	int 	num;					// Current number of messages
+	int 	max;					// Capacity of `msgs`
+	int 	skipped;				// Number of messages written from other lanes since this one is waiting
+	Out_msg *msgs;					// Circular list of messages
+} Out_lane;
+
+
+/* Zero-copy constants */
+#define INITIAL_MAX_ZC_REFS		64			// Initial capacity of the zero-copy references of a socket
+#define INITIAL_MAX_ORPHANS		4			// Initial capacity of the `orphans` list
+#define ZC_ORPHAN_POLL_MS		100			// The closed connections with zero-copy sends in flight are checked this often
+
+/* A message referenced by a zero-copy write, until the kernel reports that the write is complete */
+typedef struct zc_ref {
+	uint32_t 	id;					// Counter of the `sendmsg` that referenced it (numbered per socket by the kernel)
+	Shared_msg *msg;				// NULL - released (a newer write completed before an older one)
+} Zc_ref;
+
+/* Zero-copy writes of a socket (`MSG_ZEROCOPY`) */
+/*
+ * -> The kernel sends the pages of the messages without copying them, and reports the completed writes
+ *    (ranges of counters) on the error queue of the socket: until then, each message keeps a reference
+ * -> The messages of a write are referenced in order, so the completions release them from `first`
+ */
+typedef struct zc_state {
+	bool 	 enabled;				// `SO_ZEROCOPY` is set on the socket
+	uint32_t next_id;				// Counter of the next zero-copy `sendmsg`
+	int 	 first;					// Position of the oldest reference in `refs`
+	int 	 num;					// Current number of references
+	int 	 max;					// Capacity of `refs`
+	Zc_ref 	 *refs;					// Circular list of references
+} Zc_state;
+
+/* A closed client connection with zero-copy writes in flight (its socket stays open until they complete) */
+typedef struct zc_orphan {
+	int 	 socket;
+	Zc_state zc;
+} Zc_orphan;
+
+/* Zero-copy writes of the large messages (`--zerocopy BYTES`) */
+/*
+ * -> A write of at least `min_len` bytes whose messages all have the shared sequence number (their bytes, and
+ *    the aliased headers, are in the shared messages) is sent with `MSG_ZEROCOPY`: wide fanouts of large
+ *    messages aren't copied in every socket
+ * -> The orphans are polled by `timer` until their writes complete
+ */
+typedef struct zerocopy {
+	size_t 	 min_len;					// 0 - disabled
+	Zc_orphan *orphans;
+	int 	 num_orphans;
+	int 	 max_orphans;
+	Timer 	 timer;
+
+	uint64_t writes;					// Zero-copy `sendmsg` calls
+	uint64_t msgs;						// Messages referenced by them
+	uint64_t completed;					// Writes reported complete
+	uint64_t copied;					// Completed writes that the kernel copied after all (e.g. on loopback)
+	uint64_t fallbacks;					// Writes retried with a copy (`ENOBUFS`)
+} Zerocopy;
+
+
+/* Subscription table constants */
+#define SUB_SF				0x1			// Flags of a subscription, packed under the ID of its topic
+#define SUB_DEAD			0x2
+#define SUB_FLAG_BITS		2
+#define SUB_KEY(id, flags)	((uint32_t) (id) << SUB_FLAG_BITS | (flags))
+#define SUB_ID(key)			((key) >> SUB_FLAG_BITS)
+#define INITIAL_MAX_SUB_KEYS	16		// Initial capacity of a client's subscription table
+#define INITIAL_MAX_RETIRED		8		// Initial capacity of the `retired` list
+
+/* Next sequence number of a removed SF subscription */
+typedef struct retired_seq {
+	uint32_t id;					// ID of the topic (`Topic_entry.alias`)
+	uint32_t next_seq;
+} Retired_seq;
+
+/* Subscriptions of a client: parallel arrays sorted by topic ID */
+/*
+ * -> `keys` packs the ID of each topic with its flags (`SUB_KEY`): the lookups (binary searches) and the scans
+ *    read only this array, the state of a subscription (`topics`) is read once its key matches
+ * -> An unsubscribed topic is marked `SUB_DEAD` and stays in place (a new subscribe revives it); the dead
+ *    subscriptions are removed by a compaction once they're a quarter of the table, which also shrinks it
+ * -> The subscriber keeps the last sequence number of a topic forever, so a removed SF subscription leaves
+ *    its next number in `retired` (the topic continues from it if it's subscribed again)
+ */
+typedef struct sub_table {
+	int 	 num;					// Current number of subscriptions (with the dead ones)
+	int 	 num_dead;				// Current number of dead subscriptions
+	int 	 max;					// Capacity of `keys` and `topics`
+	uint32_t *keys;
+	Topic 	 **topics;				// State of each subscription (its address is kept by the fanout list and the timers)
+
+	int 	 num_retired;			// Current number of retired sequence numbers
+	int 	 max_retired;			// Capacity of `retired`
+	Retired_seq *retired;			// Sorted by topic ID
+} Sub_table;
+
 
 /* Clients constants (+1 for the null terminator) */
-#define ID_CLIENT_LEN		10 + 1	// Maximum length of an `ID client`
-#define INITIAL_MAX_TOPICS 	10		// Initial capacity of `topics` list
+#define ID_CLIENT_LEN		(10 + 1)	// Maximum length of an `ID client`
 
 /* Structure of a TCP Client */
 typedef struct client {
 	char 	id[ID_CLIENT_LEN];	// ID of the client
 	bool 	connected;			// Client is/isn't connected to the server
+	bool 	resumed;			// The SF messages were replayed after the last (re)connection
 	int 	socket;				// Socket through which the client is connected to the server
 
-	int 	num_of_topics;		// Current number of topics at which the client is subscribed
-	int 	max_topics;			// Maximum number of topics at which a client can subscribe 
-	Topic 	**topics;			// List of subscribed topics
+	Sub_table subs;				// Subscriptions of the client (and the topics it unsubscribed from)
+
+	char 	*rx_buf;			// Bytes received from the client, not yet parsed as control frames
+	size_t 	rx_len;				// Current number of bytes in `rx_buf`
+	size_t 	rx_cap;				// Capacity of `rx_buf`
+
+	Out_lane lanes[NUM_LANES];	// Messages waiting for room in the socket, by priority class
+	Out_msg  tx[OUT_BATCH];		// Messages being written (taken from the lanes, in order)
+	int 	 tx_len;			// Current number of messages in `tx`
+	size_t 	 tx_off;			// Bytes of `tx[0]` already written
+	Zc_state zc;				// Zero-copy writes of `socket` (with `--zerocopy`)
+
+	Shm_ring *shm;				// Shared ring of a same-host subscriber (NULL - the messages go through `socket`)
+	bool 	 shm_waiting;		// The ring is full, the lanes are flushed when the subscriber frees a slot
+	char 	 shm_token[SHM_TOKEN_LEN];	// Sent through `socket`, a ring request must carry it ("" - none was asked)
+
+	size_t 	 mem_used;			// Bytes of its subscriptions, SF queues and buffers (`Mem_hdr.owner`)
+
+	Timer 	 timer;				// Heartbeats and idle timeout (pending while the client is connected)
+	uint64_t last_rx_ms;		// Last time the client sent something
+	uint64_t last_tx_ms;		// Last time a message was sent to the client (coarse, the time of the last tick)
+
+	struct client *next_by_id;	// Next client in the same bucket of the client index
 } Client;
 
+/* Hash table of the clients, by ID (a client is never removed, it may reconnect) */
+typedef struct client_index {
+	Client 	**buckets;
+	size_t 	num_buckets;
+} Client_index;
 
-/* Actions constants */
-#define ACTION_TYPE_LEN 	50
+
+/* Commands read from STDIN */
 #define SUBSCRIBE_ACTION 	"subscribe"
 #define UNSUBSCRIBE_ACTION 	"unsubscribe"
 #define EXIT_ACTION 		"exit"
+#define CMD_LINE_LEN		(1 << 16)	// Maximum length of a command (room for hundreds of topics)
+
+/* Control protocol (subscriber -> server) */
+/*
+ * Every control message is a frame: [Ctrl_hdr][record]...[record]
+ * -> `len` counts the bytes following it (opcode, count and the records)
+ * -> Each record is [Ctrl_rec][topic name (topic_len bytes, no '\0')][options (opts_len bytes)]
+ * -> Each option is [Ctrl_opt][value (len bytes)]
+ * -> The server buffers the stream, so a frame may arrive in any number of `recv` chunks
+ */
+#define OP_SUBSCRIBE		0x01	// Subscribe to every topic in the frame
+#define OP_UNSUBSCRIBE		0x02	// Unsubscribe from every topic in the frame
+#define OP_ACK				0x03	// Cumulative ack of the SF messages received on every topic in the frame (`OPT_SEQ`)
+#define OP_RESUME			0x04	// Ack like `OP_ACK`, then replay all the unacknowledged SF messages
+#define OP_MCAST_REPAIR		0x05	// Resend over TCP the multicast messages `OPT_SEQ` ... `OPT_SEQ` + `OPT_COUNT` - 1
+#define OP_HEARTBEAT		0x06	// No records, the answer to a `HEARTBEAT` message (the client is alive)
+#define OP_SHM_TOKEN		0x07	// No records, ask for a `SHM_TOKEN` message (to request a shared ring)
+
+/* Options of a topic record */
+#define OPT_SEQ				0x01	// uint32_t: last sequence number received on the topic
+#define OPT_RATE			0x02	// uint32_t: maximum rate, in 1/`RATE_UNIT` messages per second
+#define OPT_EVERY			0x03	// uint32_t: send only 1 message in N
+#define OPT_FILTER			0x04	// text: predicate on the numeric payloads (e.g. "> 30", "between 10 20")
+#define OPT_ORIGIN			0x05	// uint32_t: node whose subscribers are interested in the topic (peer links)
+#define OPT_VERSION			0x06	// uint32_t: version of that interest (peer links)
+#define OPT_MCAST			0x07	// empty: the subscriber can join the multicast group of the topic
+#define OPT_COUNT			0x08	// uint32_t: number of messages (`OP_MCAST_REPAIR`)
+#define OPT_ALIAS			0x09	// empty: the subscriber accepts aliased messages of the topic (`Alias_hdr`)
+
+#define CTRL_MAX_FRAME		(1 << 20)	// Maximum size of a control frame (a bigger one closes the connection)
+#define CTRL_RX_CHUNK		4096		// Minimum free space in a client's `rx_buf` before a `recv`
+
+/* Header of a control frame (integers in network order) */
+typedef struct ctrl_hdr {
+	uint32_t len;		// Number of bytes following this field
+	uint8_t  opcode;	// One of the `OP_*` values
+	uint16_t count;		// Number of topic records in the frame
+} Ctrl_hdr;
+
+/* Header of a topic record */
+typedef struct ctrl_rec {
+	uint8_t topic_len;	// Length of the topic name (at most `TOPIC_SIZE`)
+	uint8_t sf;			// Store-and-forward (ignored for `OP_UNSUBSCRIBE`)
+	uint8_t opts_len;	// Length of the subscription options (skipped if not understood)
+} Ctrl_rec;
+
+/* Header of an option of a topic record */
+typedef struct ctrl_opt {
+	uint8_t kind;		// One of the `OPT_*` values
+	uint8_t len;		// Length of the value
+} Ctrl_opt;
 
-/* Structure of an Action */
+/* Structure of an Action (a decoded topic record) */
 /*
- * e.g.: subscribe   <TOPIC> <SF>
- * e.g.: unsubscribe <TOPIC>
- * e.g.: exit 
+ * e.g.: subscribe   <TOPIC> [<TOPIC> ...] <SF> [rate=<MSGS_PER_SEC>] [every=<N>] [if <OP> <VALUE> [<VALUE>]]
+ * e.g.: unsubscribe <TOPIC> [<TOPIC> ...]
  */
 typedef struct action {
-	char 	type[ACTION_TYPE_LEN];
-	char 	topic[TOPIC_SIZE];
+	char 	topic[TOPIC_SIZE + 1];
+	uint8_t topic_len;
 	uint8_t sf;
+	uint32_t seq;		// `OPT_SEQ` (0 if missing)
+	uint32_t rate;		// `OPT_RATE` (0 if missing)
+	uint32_t every;		// `OPT_EVERY` (0 if missing)
+	uint32_t origin;	// `OPT_ORIGIN` (0 if missing)
+	uint32_t version;	// `OPT_VERSION` (0 if missing)
+	uint32_t count;		// `OPT_COUNT` (0 if missing)
+	bool 	 mcast;		// `OPT_MCAST` is present
+	bool 	 alias;		// `OPT_ALIAS` is present
+	Filter 	 filter;	// `OPT_FILTER` (inactive if missing)
+	bool 	 invalid;	// An option couldn't be decoded
 } Action;
 
+/* Acknowledgements (subscriber side) */
+#define ACK_EVERY			64			// Send the acks after this many SF messages
+#define ACK_INTERVAL_MS		200			// Maximum delay of an ack
+#define RX_BUF_LEN			(1 << 16)	// Size of the subscriber's receive buffer
+#define SHM_TOKEN_TIMEOUT_MS	1000	// The subscriber waits this long for its ring token (then it keeps TCP)
+#define INITIAL_MAX_ACKS	16			// Initial capacity of the `acks` list
+
+/* Sequence numbers of an SF topic, as seen by a subscriber */
+typedef struct ack_state {
+	char 	 topic[TOPIC_SIZE + 1];
+	uint32_t last_seq;		// Last sequence number received
+	uint32_t acked_seq;		// Last sequence number acknowledged to the server
+} Ack_state;
+
+/* Topic aliases constants (subscriber side) */
+#define INITIAL_MAX_ALIASES	16			// Initial capacity of the `aliases` table (power of 2)
+
+/* A topic alias announced by the server, in the subscriber's open addressing table */
+typedef struct topic_alias {
+	uint32_t alias;			// 0 - free slot
+	uint8_t  topic_len;
+	char 	 topic[TOPIC_SIZE + 1];
+} Topic_alias;
+
+/* Multicast egress constants */
+#define MCAST_TTL			1			// The multicast datagrams stay on the LAN
+#define MCAST_REPAIR_WINDOW	1024		// Newest messages of a multicast topic kept for the repairs (power of 2)
+#define MCAST_RCVBUF		(1 << 20)	// Receive buffer of a joined group (subscriber side)
+#define INITIAL_MAX_MCASTS	4			// Initial capacity of the subscriber's `mcasts` list
+
+/* Header of a multicast datagram, followed by the start of the `TCP_msg` (until the payload's end) */
+typedef struct mcast_hdr {
+	uint32_t seq;			// Sequence number of the message on its topic (network order)
+} Mcast_hdr;
+
+#define MCAST_DGRAM_LEN		(sizeof(Mcast_hdr) + sizeof(TCP_msg))	// Longest multicast datagram
+
+/* A multicast group joined by the subscriber for a topic */
+typedef struct mcast_state {
+	char 	 topic[TOPIC_SIZE + 1];
+	int 	 socket;		// Bound to the group and the port of the topic
+	uint32_t last_seq;		// Last sequence number received (or announced by the server)
+} Mcast_state;
+
+
+/* Connection handshake constants */
+#define DEFAULT_BACKLOG			4096	// Connections waiting in a listener's queue (`--backlog`, capped by `somaxconn`)
+#define ACCEPT_BURST			512		// Connections accepted per wakeup of a listener (the rest wait for the next one)
+#define HANDSHAKE_TIMEOUT_MS	5000	// A connection that didn't send its ID in this time is closed
+
+/* A connection accepted by a listener, until its ID is complete */
+/*
+ * -> The ID (`ID_CLIENT_LEN` bytes) may arrive in any number of chunks, nothing waits for it
+ * -> The bytes that follow it (e.g. the first control frames) stay in the socket
+ * -> A ring request (on the UNIX socket) sends the client's `shm_token` after the ID
+ */
+typedef struct handshake {
+	int 	 socket;
+	bool 	 shm;						// Accepted on the UNIX socket of the shared rings
+	struct sockaddr_in addr;			// Address of a TCP connection
+	char 	 id[ID_CLIENT_LEN];
+	char 	 token[SHM_TOKEN_LEN];		// Only for a ring request
+	size_t 	 len;						// Bytes of `id` (then of `token`) received
+	Timer 	 timer;						// Closes the connection after `HANDSHAKE_TIMEOUT_MS`
+} Handshake;
+
+/* Counters of the listeners */
+typedef struct accept_stats {
+	uint64_t accepted;					// Connections accepted
+	uint64_t timeouts;					// Handshakes closed by `HANDSHAKE_TIMEOUT_MS`
+	uint64_t refused;					// Connections closed at once (no memory to watch them)
+} Accept_stats;
+
+/* Event loop constants */
+#define EVENT_BATCH				256		// Events returned by a single `epoll_wait`
+#define INITIAL_MAX_CONN_SLOTS	64		// Initial capacity of the `slots` table (grows with the descriptors)
+
+/* What a descriptor watched by the main loop is */
+typedef enum {
+	CONN_NONE,				// Not watched
+	CONN_STDIN,
+	CONN_INGEST,			// Eventfd of the ingest ring
+	CONN_LISTENER,			// TCP listener of the subscribers and the peers
+	CONN_SHM_LISTENER,		// UNIX listener of the shared rings
+	CONN_SHM_SPACE,			// Eventfd written by the subscribers that free slots in their rings
+	CONN_HANDSHAKE,			// Accepted connection, until its ID is complete (`ptr` - its `Handshake`)
+	CONN_CLIENT,			// Connected subscriber (`ptr` - its `Client`)
+	CONN_PEER,				// Peer link (`ptr` - its `Peer`)
+	CONN_PEER_CONNECT		// Connection to a configured peer, in progress (`ptr` - its `Peer_addr`)
+} conn_kind;
+
+/* A descriptor watched by the main loop */
+typedef struct conn_slot {
+	conn_kind kind;
+	bool 	 writing;					// Also watched for room to write (it has queued output)
+	void 	 *ptr;
+} Conn_slot;
+
+/* Descriptors watched by the main loop (`epoll`) */
+/*
+ * -> `slots` is indexed by descriptor, so the owner of a ready socket (handshake, client or peer) is found at once,
+ *    whatever the number of connections
+ * -> The table grows with the highest descriptor, there's no limit like `FD_SETSIZE`
+ */
+typedef struct event_loop {
+	int 	  epoll_fd;
+	int 	  max_slots;				// Capacity of `slots`
+	Conn_slot *slots;
+} Event_loop;
 
-#define BACKLOG					10		// Maximum number of `waiting clients`
 #define INITIAL_CAP_SUBS_LIST	10		// Initial capacity of `subscribers` list
+#define INITIAL_CLIENT_BUCKETS	64		// Initial number of buckets in the client index
 #define VERBOSE_TRUE			"true"  // Print additional messages
+#define CONFIG_LINE_LEN			512		// Maximum length of a line in the config file
+#define STATS_ACTION			"stats"	// Print the server's statistics (STDIN command)
 
 
 /* Restore to the original padding settings of the compiler  */
 #pragma pack()
 
 
+/* Topic index constants */
+#define INITIAL_TOPIC_BUCKETS	64		// Initial number of buckets in the topic index
+#define INITIAL_MAX_SUBS		4		// Initial capacity of a topic's `subs` list
+
+struct peer;
+
+/* Interest of another node in a topic, learned from a peer link */
+typedef struct interest {
+	uint32_t origin;				// Node with the interested subscribers
+	uint32_t version;				// Newest version seen (older announcements are ignored)
+	bool 	 present;				// The node is interested (false - withdrawn, or its link was lost)
+	struct peer *from;				// Link through which the newest version came (publishes go back through it)
+} Interest;
+
+/* A subscription of a client, as seen from the topic index */
+typedef struct subscription {
+	Client 	*client;
+	Topic 	*topic;
+} Subscription;
+
+/* Structure of a topic in the server's topic index */
+typedef struct topic_entry {
+	char 	 name[TOPIC_SIZE + 1];	// Name of the topic
+	uint8_t  name_len;				// Length of `name`
+	uint32_t hash;					// Hash of `name`
+	uint32_t alias;					// Interned ID of the topic (1, 2, ... in order of creation), sent instead of `name`
+	struct topic_entry *next;		// Next entry in the same bucket
+
+	Action 	*pending;				// Record of the control frame being applied (NULL otherwise)
+	uint8_t  lane;					// Priority class of the topic (`LANE_NORMAL` unless configured)
+
+	int 	 num_subs;				// Current number of active subscriptions
+	int 	 max_subs;				// Capacity of `subs`
+	Subscription *subs;				// Active subscriptions (the fanout list of this topic)
+
+	uint32_t local_version;			// Version of this node's interest, as announced to the peers
+	int 	 num_interests;			// Current number of interests of other nodes
+	int 	 max_interests;			// Capacity of `interests`
+	Interest *interests;			// Interests of other nodes (a publish is forwarded to the links they came from)
+
+	bool 	 mcast;					// Delivered on a multicast group to the subscribers that can join it
+	struct sockaddr_in mcast_addr;	// Group and port of the topic
+	uint32_t mcast_seq;				// Sequence number of the last multicast message
+	int 	 num_mcast_subs;		// Subscriptions served by the group (they aren't in `subs`)
+	Shared_msg **mcast_window;		// Newest multicast messages, by sequence number (for the repairs)
+	uint64_t mcast_sent;			// Number of multicast datagrams
+	uint64_t mcast_repaired;		// Number of messages resent over TCP
+} Topic_entry;
+
+/* Hash table with all the topics known by the server */
+typedef struct topic_index {
+	Topic_entry **buckets;
+	size_t 	num_buckets;
+	size_t 	num_entries;
+} Topic_index;
+
+
+/* Multicast egress (a single socket sends the datagrams of all the multicast topics) */
+typedef struct mcast_egress {
+	int 	 socket;				// -1 if no topic has a multicast group
+	struct in_addr iface;			// Outgoing interface (INADDR_ANY - chosen by the routing table)
+	int 	 num_topics;			// Number of topics with a multicast group
+	uint64_t errors;				// Datagrams that couldn't be sent
+} Mcast_egress;
+
+
+/* Ingest stage constants */
+#define INGEST_RING_SLOTS	1024	// Number of decoded messages between the ingest thread and the fanout loop
+#define INGEST_BATCH		32		// Maximum number of datagrams received with a single `recvmmsg`
+#define PUB_BUF_LEN			(1 << 16)	// Receive buffer of a TCP publisher (a read takes what fits)
+#define INITIAL_MAX_PUBS	4		// Initial capacity of the `pubs` list
+
+/* A publisher streaming records over TCP (`--publish-port`), each one a `Batch_rec`, its topic and its payload */
+typedef struct publisher {
+	int 	socket;
+	struct sockaddr_in addr;		// Source of its messages
+	char 	*buf;					// Bytes received, not yet decoded (a cut record waits for the rest)
+	size_t 	len;
+} Publisher;
+
+/* The ingest stage: a thread receiving and decoding the UDP datagrams */
+/*
+ * -> The datagrams are converted directly in the slots of `ring` (`Shared_msg` with 0 references),
+ *    a batched datagram takes a slot per record
+ * -> The fanout loop borrows the slots and copies a message only if an SF queue keeps it
+ * -> The TCP publishers are read by the same thread: while the ring is full, nothing is read from them,
+ *    so their streams are slowed down by TCP's flow control instead of losing messages
+ * -> While the ring is full, the datagrams wait in the socket buffer; the ones that don't fit are dropped
+ *    by the kernel, whole, and only counted (`socket_drops`)
+ */
+typedef struct ingest {
+	int 		udp_socket;
+	Spsc_ring 	ring;
+	pthread_t 	thread;
+
+	uint16_t 	pub_port;			// Port of the TCP publishers (0 - only UDP)
+	int 		pub_listener;		// -1 without TCP publishers
+	Publisher 	*pubs;				// Connected publishers (only used by the ingest thread)
+	int 		num_pubs;
+	int 		max_pubs;
+	struct pollfd *pollfds;			// The UDP socket, the listener and the publishers
+
+	_Atomic uint64_t batches;		// Batched datagrams received
+	_Atomic uint64_t batched_msgs;	// Messages carried by them
+	_Atomic uint64_t invalid_msgs;	// Messages dropped by the decoder (too short, unknown type, cut records)
+	_Atomic uint64_t ring_waits;	// Times the thread waited for room in a full `ring`
+	_Atomic uint32_t socket_drops;	// Datagrams dropped by the kernel on a full socket buffer (`SO_RXQ_OVFL`,
+									// known once the next datagram is received)
+	_Atomic uint64_t stream_msgs;	// Messages received from the TCP publishers
+	_Atomic int 	 connected_pubs;	// Number of connected TCP publishers
+	_Atomic size_t 	 mem_used;			// Bytes of the publishers' tables and buffers (allocated by the ingest thread)
+} Ingest;
+
+
+/* Federation constants */
+#define PEER_ID_MARKER		'\x01'		// First byte of the ID sent by a peer server (client IDs are printable)
+#define PEER_TTL			8			// Maximum number of links crossed by a publish
+#define PEER_DEDUP_WINDOW	64			// Publishes of an origin accepted out of order
+#define PEER_TX_MAX			(16 << 20)	// Queued bytes of a peer link before publishes are dropped
+#define PEER_ADDR_LEN		64			// Maximum length of a `HOST:PORT` peer address
+#define INITIAL_MAX_PEERS	4			// Initial capacity of the `peers` list
+#define INITIAL_MAX_INTERESTS 2			// Initial capacity of a topic's `interests` list
+#define PEER_RETRY_MIN_MS	250			// Delay before connecting again to a configured peer
+#define PEER_RETRY_MAX_MS	8000		// The delay doubles after each failed attempt, up to this
+#define PEER_CONNECT_TIMEOUT_MS	5000	// A connection attempt that takes longer is abandoned
+
+/* Peer link frames (same header as the control frames, in both directions) */
+#define OP_PEER_HELLO		0x10	// uint32_t node ID, first frame on a link
+#define OP_INTEREST_ADD		0x11	// Topic records (`OPT_ORIGIN`, `OPT_VERSION`): the origin node is interested
+#define OP_INTEREST_DEL		0x12	// Topic records (`OPT_ORIGIN`, `OPT_VERSION`): the origin node isn't interested
+#define OP_PEER_PUBLISH		0x13	// `Peer_pub` followed by the start of the `TCP_msg` (until the payload's end)
+
+#pragma pack(1)
+
+/* Header of a publish forwarded between nodes */
+typedef struct peer_pub {
+	uint32_t origin;					// Node that received the datagram
+	uint32_t seq;						// Sequence number of the publish on its origin node
+	uint8_t  ttl;						// Links that the publish may still cross
+	uint8_t  raw_value[RAW_VALUE_LEN];	// Numeric payload of the datagram (for the filters)
+} Peer_pub;
+
+#pragma pack()
+
+/* A configured peer (`--peer HOST:PORT`), connected again whenever its link is down */
+typedef struct peer_addr {
+	char 	 addr[PEER_ADDR_LEN];
+	struct peer *peer;					// Its link (NULL - down)
+	int 	 connecting;				// Socket of the attempt in progress (-1 - none)
+	uint64_t retry_ms;					// Delay before the next attempt
+	bool 	 failing;					// The last attempt failed (reported once)
+	bool 	 loop;						// The address is this node, it's never connected again
+	Timer 	 timer;						// Next attempt (or the timeout of the one in progress)
+} Peer_addr;
+
+/* A link to another server (either side may have opened it, it's used in both directions) */
+typedef struct peer {
+	int 	 socket;
+	char 	 addr[PEER_ADDR_LEN];		// Remote address (for the messages)
+	Peer_addr *conf;					// Configured address of the link (NULL - accepted link)
+	uint32_t node_id;					// Remote node (0 until its `OP_PEER_HELLO`)
+	uint64_t mark;						// Last publish forwarded on this link
+
+	char 	 *rx_buf;					// Bytes received, not yet parsed as frames
+	size_t 	 rx_len;
+	size_t 	 rx_cap;
+
+	char 	 *tx_buf;					// Bytes waiting for room in the socket
+	size_t 	 tx_len;
+	size_t 	 tx_cap;
+	uint64_t forwarded;					// Publishes forwarded on this link (with the dropped ones)
+	uint64_t dropped;					// Publishes dropped because `tx_buf` was full
+} Peer;
+
+/* Duplicate detection for the publishes of an origin node */
+typedef struct origin_state {
+	uint32_t node;
+	uint32_t max_seq;					// Newest sequence number accepted
+	uint64_t window;					// Bit `k` is set if `max_seq - k` was accepted
+} Origin_state;
+
+/* This node and its links */
+typedef struct federation {
+	uint32_t node_id;					// ID of this node (random, so a restarted node is a new origin)
+	uint32_t next_version;				// Version of the next local interest change
+	uint32_t next_seq;					// Sequence number of the next local publish
+	uint64_t mark;						// Number of publishes forwarded
+
+	Peer_addr **peer_addrs;				// Configured peers, connected at startup (and again when their link is down)
+	int 	 num_peer_addrs;
+
+	Peer 	 **peers;					// Established links
+	int 	 num_peers;
+	int 	 max_peers;
+
+	Origin_state *origins;
+	int 	 num_origins;
+	int 	 max_origins;
+} Federation;
+
+
 /* Function definitions */
 
 /* Send a `TCP_msg` with payload `buffer` to the client with socket `client_sockt`*/
@@ -152,8 +879,86 @@ Client  *get_client_by_id(const char *id);
 */
 Client  *get_client_by_socket(int sock);
 
-/* Add a new client the list of subscribers */
-void	 add_new_client(const char *id, int req_tcp_socket);
+/* Add a new client the list of subscribers, return false if it's rejected (over the memory budget) */
+bool	 add_new_client(const char *id, int req_tcp_socket);
+
+/* Allocate `size` zeroed bytes charged to `owner` (NULL - the server), return NULL if the allocation failed */
+void 	*mem_alloc(Client *owner, mem_kind kind, size_t size);
+
+/**
+ * Resize an accounted allocation (a NULL `ptr` is allocated for `owner`, as `kind`)
+ * Return NULL if the allocation failed (`ptr` is unchanged)
+*/
+void 	*mem_realloc(Client *owner, mem_kind kind, void *ptr, size_t size);
+
+/* Free an accounted allocation */
+void 	 mem_free(void *ptr);
+
+/* Charge `delta` bytes of memory not allocated with `mem_alloc()` (e.g. a mapping) */
+void 	 mem_charge(Client *owner, mem_kind kind, ssize_t delta);
+
+/* Tell if `extra` more bytes would exceed the memory budget */
+bool 	 mem_over_budget(size_t extra);
+
+/* Set the memory budget (`BYTES[K|M|G]`), return false if it isn't valid */
+bool 	 set_mem_budget(const char *text);
+
+/* Print the memory used by the server (by kind and by client) and the admission control counters */
+void 	 print_mem_stats(FILE *file);
+
+/* Set a timeout (`heartbeat`, `idle-timeout` or `sf-ttl`) in seconds, return false if it isn't valid */
+bool 	 set_timeout(const char *key, const char *text);
+
+/* Print the counters of the heartbeats, the idle timeouts and the SF expiry */
+void 	 print_timeout_stats(FILE *file);
+
+/* Set the minimum length of the zero-copy writes, return false if it isn't valid */
+bool 	 set_zerocopy(const char *text);
+
+/* Print the counters of the zero-copy writes (if they're enabled) */
+void 	 print_zerocopy_stats(FILE *file);
+
+/* Set the backlog of the listeners, return false if it isn't valid */
+bool 	 set_backlog(const char *text);
+
+/* Create the epoll instance of the main loop */
+void 	 event_loop_init();
+
+/* Watch a descriptor for reading, as a `kind` owned by `ptr`, return false if it can't be watched (no memory) */
+bool 	 watch_fd(int fd, conn_kind kind, void *ptr);
+
+/* Give a watched descriptor to a new owner (e.g. a handshake that becomes a client) */
+void 	 set_fd_owner(int fd, conn_kind kind, void *ptr);
+
+/* Watch (or stop watching) a descriptor for room to write */
+void 	 watch_fd_output(int fd, bool on);
+
+/* Stop watching a descriptor (before it's closed) */
+void 	 unwatch_fd(int fd);
+
+/* Return the slot of a descriptor (NULL if it isn't watched) */
+Conn_slot *get_conn_slot(int fd);
+
+/**
+ * Wait until a descriptor is ready or `timeout_ms` passed (-1 - no limit), fill `events`
+ * Return the number of events (-1 if a signal interrupted the wait)
+*/
+int 	 event_loop_wait(struct epoll_event *events, int max_events, int timeout_ms);
+
+/* Accept the waiting connections of a listener (at most `ACCEPT_BURST`) and watch them */
+void 	 accept_connections(int listener, bool shm);
+
+/**
+ * Read the available bytes of a connection's ID (and of the token of a ring request)
+ * Return 0 if the connection was closed, 2 once the handshake is complete, 1 otherwise
+*/
+int 	 recv_handshake(Handshake *handshake);
+
+/* Forget a handshake (completed or failed), closing its socket if `close_socket` is set (the socket stays watched otherwise) */
+void 	 end_handshake(Handshake *handshake, bool close_socket);
+
+/* Print the counters of the listeners */
+void 	 print_accept_stats(FILE *file);
 
 /* Reconnect an old subscriber */
 void 	 reconnect_old_sub(Client *client, int req_tcp_socket);
@@ -161,14 +966,41 @@ void 	 reconnect_old_sub(Client *client, int req_tcp_socket);
 /* Disconnect a client with socket `sock` from the server */
 void 	 disconnect_client(int sock);
 
-/* Check if a client is already subscribed to a given topic */
-int 	 check_already_sub_topic(Action *action, int sock);
+/* Return the entry of a topic in the topic index (created if `create` is set, otherwise NULL if missing) */
+Topic_entry *topic_index_get(const char *name, size_t len, bool create);
+
+/**
+ * Read the available bytes from a client and apply every complete control frame
+ * Return 0 if the client closed the connection or broke the protocol, 1 otherwise
+*/
+int 	 recv_ctrl_frames(Client *client);
+
+/* Decode the (at most `count`) topic records of a frame body in `actions`, return the number of actions */
+int 	 decode_ctrl_records(int count, const char *body, size_t len, Action *actions);
+
+/* Apply a control frame with `count` records in `body` (of `len` bytes) */
+void 	 apply_ctrl_frame(Client *client, uint8_t opcode, int count, const char *body, size_t len);
+
+/* Subscribe a client to a list of topics (a binary search per topic in its subscription table) */
+void 	 subscribe_to_topics(Client *client, Action *actions, int num_actions);
 
-/* Subscribe a client to a given topic */
-void 	 subscribe_to_topic(Action *action, int sock);
+/* Unsubscribe a client from a list of topics (marked dead, then compacted once they're a quarter of the table) */
+void 	 unsubscribe_from_topics(Client *client, Action *actions, int num_actions);
 
-/* Unsubscribe a client from a given topic */
-void 	 unsubscribe_from_topic(Action *action, int sock);
+/* Release the SF messages acknowledged by a client (a binary search per topic) */
+void 	 ack_topics(Client *client, Action *actions, int num_actions);
+
+/* Apply the acks sent by a reconnected client and replay its unacknowledged SF messages */
+void 	 resume_client(Client *client, Action *actions, int num_actions);
+
+/* Resend over TCP the multicast messages lost by a client (the ones still in the repair windows) */
+void 	 repair_mcast_msgs(Client *client, Action *actions, int num_actions);
+
+/* Allocate a new shared TCP message (with one reference), NULL without memory */
+Shared_msg *new_shared_msg();
+
+/* Drop a reference to a shared TCP message */
+void 	 put_shared_msg(Shared_msg *msg);
 
 /* Convert and UDP `INT` payload to TCP payload */
 int 	 convert_to_int(UDP_msg *udp_msg, TCP_msg *tcp_msg);
@@ -182,22 +1014,176 @@ int 	 convert_to_float(UDP_msg *udp_msg, TCP_msg *tcp_msg);
 /* Convert and UDP `STRING` payload to TCP payload */
 void 	 convert_to_string(UDP_msg *udp_msg, TCP_msg *tcp_msg);
 
-/* Convert an UDP message to a TCP message */
-TCP_msg *UDP_to_TCP(UDP_msg *udp_msg, struct sockaddr_in udp_addr);
+/**
+ * Convert an UDP message (a datagram of `len` bytes) to the TCP message `tcp_msg`
+ * Return 0 if the datagram isn't valid, 1 otherwise
+*/
+int 	 UDP_to_TCP(UDP_msg *udp_msg, size_t len, struct sockaddr_in *udp_addr, TCP_msg *tcp_msg);
+
+/* Set the port of the TCP publishers (`--publish-port`), return false if it isn't valid */
+bool 	 set_publish_port(const char *text);
 
-/* Send a TCP message to a connected client */
-void 	 send_tcp_msg_to_conn_client(Client *client, TCP_msg *tcp_msg);
+/* Listen for the TCP publishers on `ingest->pub_port` (nothing happens if it's 0) */
+void 	 open_publish_listener(Ingest *ingest);
 
-/* Store a TCP message for a client (when client set SF = 1) */
-void 	 store_tcp_msg_to_unconn_client(Client *client, int topic_idx, TCP_msg *tcp_msg);
+/* Start the ingest thread, which receives the datagrams of `ingest->udp_socket` (and the TCP publishers) */
+void 	 start_ingest_thread(Ingest *ingest);
 
-/* Send a TCP message to all clients subscribed to a specific `topic` (written in the `tcp_msg` structure) */
-void 	 send_tcp_msg(TCP_msg *tcp_msg);
+/* Stop the ingest thread and free its ring */
+void 	 stop_ingest_thread(Ingest *ingest);
+
+/* Send the messages decoded by the ingest thread to their subscribers */
+void 	 fanout_ingested_msgs(Ingest *ingest);
+
+/* Print the counters of the ingest thread (batched datagrams, invalid messages, full ring and socket buffer) */
+void 	 print_ingest_stats(Ingest *ingest, FILE *file);
+
+/* Set the priority class (`high`, `normal` or `bulk`) of a topic, return false if the class is unknown */
+bool 	 set_topic_priority(const char *topic, const char *class);
+
+/* Deliver a topic on a multicast group (`GROUP:PORT`), return false if the group is invalid */
+bool 	 set_topic_multicast(const char *topic, const char *group);
+
+/* Set the outgoing interface of the multicast datagrams, return false if the address is invalid */
+bool 	 set_multicast_iface(const char *addr);
+
+/* Open the multicast socket, if a topic has a multicast group */
+void 	 open_mcast_socket();
+
+/**
+ * Load the server's config file, one setting per line (`#` starts a comment):
+ *   priority <TOPIC> <CLASS>
+ *   peer <HOST:PORT>
+ *   multicast <TOPIC> <GROUP:PORT>
+ *   multicast-if <ADDR>
+ *   mem-budget <BYTES[K|M|G]>
+ *   heartbeat | idle-timeout | sf-ttl <SECONDS>
+ *   backlog <CONNECTIONS>
+ *   publish-port <PORT>
+ *   zerocopy <BYTES>
+*/
+void 	 load_config(const char *file);
+
+/**
+ * Send a TCP message with sequence number `seq` to a connected client, in the lane of its topic
+ * -> It's written directly if nothing is waiting, otherwise it's queued
+ * -> A borrowed message (0 references) is replaced with a copy when it's queued
+ * Return false if it was dropped (the lane can't grow)
+*/
+bool 	 send_tcp_msg_to_conn_client(Client *client, Shared_msg **msg, uint32_t seq, int lane);
+
+/**
+ * Send a message of a subscribed topic, like `send_tcp_msg_to_conn_client()`, in the lane of the topic
+ * -> If the subscriber accepts aliases, the first message is preceded by a `TOPIC_ALIAS` announcement,
+ *    then the messages are written with the alias instead of the name (`Alias_hdr`)
+*/
+bool 	 send_topic_msg(Client *client, Topic *topic, Shared_msg **msg, uint32_t seq);
+
+/**
+ * Write the queued messages of a client until its socket is full
+ * (higher lanes first, a lane skipped `LANE_STARVATION_LIMIT` times is served next)
+*/
+void 	 flush_client_output(Client *client);
+
+/* Release the queued messages of a client */
+void 	 drop_client_output(Client *client);
+
+/* Answer `OP_SHM_TOKEN`: send a new token to the client through TCP (the only way another process can't get it) */
+void 	 send_shm_token(Client *client);
+
+/**
+ * Give a connected client a shared ring: its memfd and eventfds are sent on the UNIX socket `sock`
+ * (`space_efd` is shared by all the rings), return false if the client keeps receiving through TCP
+ * The request must carry the client's last token (used once), otherwise it's refused
+*/
+bool 	 attach_shm_ring(Client *client, const char *token, int sock, int space_efd);
+
+/* Write the queued messages of the clients that were waiting for a free slot in their shared ring */
+void 	 flush_shm_clients();
+
+/**
+ * Keep a TCP message until the client acknowledges it (when client set SF = 1), return its sequence number
+ * (0 if it couldn't be kept or `msg` is NULL, the client gets it like a message without SF)
+*/
+uint32_t store_tcp_msg(Client *client, Topic *topic, Shared_msg *msg);
+
+/**
+ * Send a TCP message to all clients subscribed to a specific `topic` (written in the `tcp_msg` structure)
+ * A message with 0 references is borrowed, it's copied if an SF queue (or a repair window) keeps it
+ * The subscribers served by a multicast group get a single datagram
+*/
+void 	 send_tcp_msg(Shared_msg *msg);
+
+/**
+ * Compile a predicate (`<OP> <VALUE>` with OP in >, >=, <, <=, ==, !=, or `between <LO> <HI>`)
+ * Return false if it isn't valid
+*/
+bool 	 compile_filter(const char *text, Filter *filter);
+
+/* Tell if the numeric payload of a message matches a filter (other payloads never match) */
+bool 	 filter_match(Filter *filter, Shared_msg *msg);
+
+/* Format a message that holds a raw datagram, return 0 if the datagram isn't valid */
+int 	 format_shared_msg(Shared_msg *msg);
+
+/* Initialize the federation state of this node (with a random node ID) */
+void 	 federation_init();
+
+/* Add a peer (`HOST:PORT`) to connect to at startup, return false if the address is invalid (or without memory) */
+bool 	 federation_add_peer_addr(const char *addr);
+
+/* Start connecting to the configured peers (a failed attempt, or a lost link, is retried by a timer) */
+void 	 federation_connect_peers();
+
+/* Finish a connection to a configured peer, once its socket is ready (it becomes a link, or it's retried later) */
+void 	 finish_peer_connect(Peer_addr *conf);
+
+/* Start using a connected socket as a peer link (announces this node and its interests), return NULL without memory */
+Peer 	*add_peer(int sock, const char *addr);
+
+/**
+ * Return a pointer to a peer, given its socket
+ * (or NULL if it isn't a peer link)
+*/
+Peer 	*get_peer_by_socket(int sock);
+
+/**
+ * Read the available bytes from a peer and apply every complete frame
+ * Return 0 if the link was closed or broke the protocol, 1 otherwise
+*/
+int 	 recv_peer_frames(Peer *peer);
+
+/* Write the queued bytes of a peer until its socket is full */
+void 	 flush_peer_output(Peer *peer);
+
+/* Close a peer link, withdraw the interests learned through it (from the other links too) and reconnect it later */
+void 	 remove_peer(Peer *peer);
+
+/* Announce a change of this node's interest in a topic (the first subscription or the last unsubscription) */
+void 	 federation_local_interest(Topic_entry *entry, bool present);
+
+/**
+ * Forward a publish to the peers with interested nodes, except `from`
+ * (`origin` = 0 - a local publish, numbered now)
+*/
+void 	 federation_forward(Shared_msg *msg, uint32_t origin, uint32_t seq, uint8_t ttl, Peer *from);
+
+/* Print the state of the peer links */
+void 	 print_peer_stats(FILE *file);
+
+/* Close the peer links and free the federation state */
+void 	 federation_destroy();
+
+/**
+ * Print the number of messages dropped by the filters, the rate limits and the sampling of each subscription,
+ * and the counters of the multicast topics
+*/
+void 	 print_subscription_stats(FILE *file);
 
 /* Free the allocated memory */
 void 	 dealloc_memory();
 
-/* Close all opened sockets */
-void 	 close_sockets(int fdmax, fd_set read_fds);
+/* Close all watched sockets (and the multicast socket) */
+void 	 close_sockets();
 
 #endif
@@ -11,6 +11,7 @@ import argparse
 from ipaddress import ip_address
 from utils.unpriv_port import unprivileged_port_type, get_unprivileged_port_meta
 import textwrap
+import struct
 
 
 def setup_parser():
@@ -55,23 +56,75 @@ def setup_parser():
     load.add_argument('--count', type=int,
                       help='Number of packets to be send (only used for when mode is random, default: infinity)')
     load.add_argument('--delay', help='Wait time (in ms) between two messages (default: 0)', type=int, default=0)
+    load.add_argument('--batch', type=int, default=1, metavar='N',
+                      help='Pack up to N messages in a single batched datagram (default: 1, one message per datagram)')
+    load.add_argument('--tcp', action='store_true',
+                      help='Stream the messages as records over TCP (server_port is the `--publish-port` of the server)')
 
     return parser
 
 
 def setup_socket(parsed_args):
-    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM if parsed_args.tcp else socket.SOCK_DGRAM)
     sock.bind((str(parsed_args.source_address), parsed_args.source_port))
+    if parsed_args.tcp:
+        sock.connect((str(parsed_args.server_ip), parsed_args.server_port))
     return sock
 
 
-def send_message(sock, message, parsed_args):
-    to_send = base64.standard_b64decode(message['payload_base64'])
+# Batched datagram: "\0PB", version, number of records, then (topic_len, type, payload_len, topic, payload) records
+BATCH_HEADER = struct.Struct('!3sBH')
+BATCH_RECORD = struct.Struct('!BBH')
+BATCH_MAX_LEN = 1551
+pending = []
+
+
+def send_datagram(sock, to_send, description, parsed_args):
     sent = sock.sendto(to_send, (str(parsed_args.server_ip), parsed_args.server_port))
-    print('Sent ({}/{} bytes) << {} >>'.format(sent, len(to_send), message['description']))
+    print('Sent ({}/{} bytes) << {} >>'.format(sent, len(to_send), description))
     time.sleep(parsed_args.delay / 1000)
 
 
+def flush_batch(sock, parsed_args):
+    if not pending:
+        return
+
+    frame = BATCH_HEADER.pack(b'\0PB', 1, len(pending)) + b''.join(record for record, _ in pending)
+    send_datagram(sock, frame, 'batch of {}: {}'.format(len(pending), ', '.join(d for _, d in pending)), parsed_args)
+    del pending[:]
+
+
+def make_record(to_send):
+    # The fixed size topic of a single message becomes the topic of a record
+    topic = to_send[:50].split(b'\0')[0]
+    payload = to_send[51:]
+    return BATCH_RECORD.pack(len(topic), to_send[50], len(payload)) + topic + payload
+
+
+def send_message(sock, message, parsed_args):
+    to_send = base64.standard_b64decode(message['payload_base64'])
+    if parsed_args.tcp:
+        # The stream is a sequence of records, the server stops reading (instead of dropping) when it's busy
+        record = make_record(to_send)
+        sock.sendall(record)
+        print('Sent ({} bytes) << {} >>'.format(len(record), message['description']))
+        time.sleep(parsed_args.delay / 1000)
+        return
+
+    if parsed_args.batch <= 1:
+        send_datagram(sock, to_send, message['description'], parsed_args)
+        return
+
+    record = make_record(to_send)
+
+    frame_len = BATCH_HEADER.size + sum(len(r) for r, _ in pending)
+    if pending and frame_len + len(record) > BATCH_MAX_LEN:
+        flush_batch(sock, parsed_args)
+    pending.append((record, message['description']))
+    if len(pending) == parsed_args.batch:
+        flush_batch(sock, parsed_args)
+
+
 def run_all_once(sock, parsed_args):
     for message in parsed_args.input_file:
         send_message(sock, message, parsed_args)
@@ -125,6 +178,9 @@ def main():
         print('Running in random mode..\n')
         run_random(sock, parsed_args)
 
+    flush_batch(sock, parsed_args)
+    sock.close()
+
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,1054 @@
+#include <fcntl.h>
+#include "utils.h"
+#include "pcomsub.h"
+
+/* A connection to a server */
+struct pcomsub {
+    int      socket;
+    int      error;                 // Set once the connection is lost (returned by `pcomsub_dispatch()`)
+    Pcomsub_callbacks callbacks;
+    void    *user;
+
+    char    *rx_buf;                // Bytes received from the server, not yet parsed as messages
+    size_t   rx_len;
+    char    *tx_buf;                // Control frames not yet written (the socket is non-blocking)
+    size_t   tx_len;
+    size_t   tx_cap;
+
+    Ack_state *acks;                // Sequence numbers of the SF topics
+    int      num_acks;
+    int      max_acks;
+    int      unacked;               // SF messages received since the last ack
+    uint64_t ack_deadline;          // Time of the next ack (while `unacked` > 0)
+
+    Mcast_state *mcasts;            // Multicast groups joined for the topics delivered over multicast
+    int      num_mcasts;
+    int      max_mcasts;
+
+    Topic_alias *aliases;           // Topic aliases announced by the server (open addressing, by alias)
+    int      num_aliases;
+    int      max_aliases;
+
+    Shm_ring shm;                   // Shared ring with the messages of the server (`shm_path`)
+    bool     shm_active;
+    bool     shm_sleeping;          // The ring announced the reader is sleeping (`pcomsub_poll_fds()`)
+    char     shm_token[SHM_TOKEN_LEN];  // Sent by the server through TCP, proves the ring request is ours
+
+    uint64_t server_heartbeat_ms;   // Heartbeat interval of the server (0 - it sent no heartbeat yet)
+    uint64_t server_deadline;       // Time after which the server is considered dead
+};
+
+
+/* Current CLOCK_MONOTONIC time in milliseconds */
+static uint64_t mono_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Lower `*timeout_ms` to the time left until `deadline` */
+static void lower_timeout(int *timeout_ms, uint64_t deadline, uint64_t now)
+{
+    int ms = deadline > now ? (int) MIN(deadline - now, INT32_MAX) : 0;
+    if (*timeout_ms < 0 || ms < *timeout_ms)
+        *timeout_ms = ms;
+}
+
+
+/* Report a fallback of the library */
+static void report_warning(Pcomsub *sub, const char *text)
+{
+    if (sub->callbacks.on_warning != NULL)
+        sub->callbacks.on_warning(sub, text, sub->user);
+}
+
+
+/* Write as much of the queued control frames as the socket takes */
+static void flush_tx(Pcomsub *sub)
+{
+    size_t off = 0;
+    while (off < sub->tx_len)
+    {
+        ssize_t ret = send(sub->socket, sub->tx_buf + off, sub->tx_len - off, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (ret < 0)
+        {
+            sub->error  = ECONNRESET;
+            off         = sub->tx_len;
+            break;
+        }
+        off += ret;
+    }
+
+    memmove(sub->tx_buf, sub->tx_buf + off, sub->tx_len - off);
+    sub->tx_len -= off;
+}
+
+
+/* Queue `len` bytes for the server and write what the socket takes */
+static void queue_tx(Pcomsub *sub, const char *buf, size_t len)
+{
+    if (sub->tx_cap - sub->tx_len < len)
+    {
+        size_t tx_cap   = MAX(sub->tx_cap * 2, sub->tx_len + len);
+        char *tx_buf    = (char *) realloc(sub->tx_buf, tx_cap);
+        if (tx_buf == NULL)
+        {
+            sub->error = ENOMEM;
+            return;
+        }
+
+        sub->tx_buf = tx_buf;
+        sub->tx_cap = tx_cap;
+    }
+
+    memcpy(sub->tx_buf + sub->tx_len, buf, len);
+    sub->tx_len += len;
+    flush_tx(sub);
+}
+
+
+/* Send a control frame with `opcode` for all the `num_topics` topics (each record gets the same `opts`) */
+static void send_ctrl_frame(Pcomsub *sub, uint8_t opcode, const char **topics, int num_topics, uint8_t sf,
+                            const char *opts, uint8_t opts_len)
+{
+    // Every record takes at most `sizeof(Ctrl_rec) + TOPIC_SIZE + opts_len` bytes
+    size_t cap  = sizeof(Ctrl_hdr) + num_topics * (sizeof(Ctrl_rec) + TOPIC_SIZE + opts_len);
+    char *frame = (char *) malloc(cap);
+    if (frame == NULL)
+    {
+        sub->error = ENOMEM;
+        return;
+    }
+
+    // Append the topic records
+    size_t len = sizeof(Ctrl_hdr);
+    for (int i = 0; i < num_topics; ++i)
+    {
+        Ctrl_rec *rec   = (Ctrl_rec *) (frame + len);
+        rec->topic_len  = MIN(strlen(topics[i]), TOPIC_SIZE);
+        rec->sf         = sf;
+        rec->opts_len   = opts_len;
+        memcpy(frame + len + sizeof(Ctrl_rec), topics[i], rec->topic_len);
+        memcpy(frame + len + sizeof(Ctrl_rec) + rec->topic_len, opts, opts_len);
+        len += sizeof(Ctrl_rec) + rec->topic_len + opts_len;
+    }
+
+    // Complete the header
+    Ctrl_hdr *hdr   = (Ctrl_hdr *) frame;
+    hdr->len        = htonl(len - sizeof(hdr->len));
+    hdr->opcode     = opcode;
+    hdr->count      = htons(num_topics);
+
+    queue_tx(sub, frame, len);
+    free(frame);
+}
+
+
+/* Return the ack state of a topic (created if missing, NULL without memory) */
+static Ack_state *get_ack_state(Pcomsub *sub, const char *topic)
+{
+    for (int i = 0; i < sub->num_acks; ++i)
+        if (strncmp(sub->acks[i].topic, topic, TOPIC_SIZE) == 0)
+            return &sub->acks[i];
+
+    if (sub->num_acks == sub->max_acks)
+    {
+        int max_acks    = sub->max_acks == 0 ? INITIAL_MAX_ACKS : sub->max_acks * 2;
+        Ack_state *acks = (Ack_state *) realloc(sub->acks, max_acks * sizeof(Ack_state));
+        if (acks == NULL)
+        {
+            sub->error = ENOMEM;
+            return NULL;
+        }
+
+        sub->acks       = acks;
+        sub->max_acks   = max_acks;
+    }
+
+    Ack_state *state = &sub->acks[sub->num_acks++];
+    memset(state, 0, sizeof(Ack_state));
+    strncpy(state->topic, topic, TOPIC_SIZE);
+    return state;
+}
+
+
+/* Send the last sequence numbers (of all topics for `OP_RESUME`, of the unacked ones for `OP_ACK`) */
+static void send_acks(Pcomsub *sub, uint8_t opcode)
+{
+    size_t rec_cap  = sizeof(Ctrl_rec) + TOPIC_SIZE + sizeof(Ctrl_opt) + sizeof(uint32_t);
+    char *frame     = (char *) malloc(sizeof(Ctrl_hdr) + sub->num_acks * rec_cap);
+    if (frame == NULL)
+    {
+        sub->error = ENOMEM;
+        return;
+    }
+
+    size_t len  = sizeof(Ctrl_hdr);
+    int count   = 0;
+    for (int i = 0; i < sub->num_acks; ++i)
+    {
+        Ack_state *state = &sub->acks[i];
+        if (opcode == OP_ACK && state->acked_seq == state->last_seq)
+            continue;
+
+        // Topic record with the `OPT_SEQ` option
+        Ctrl_rec *rec   = (Ctrl_rec *) (frame + len);
+        rec->topic_len  = strlen(state->topic);
+        rec->sf         = 1;
+        rec->opts_len   = sizeof(Ctrl_opt) + sizeof(uint32_t);
+        len += sizeof(Ctrl_rec);
+
+        memcpy(frame + len, state->topic, rec->topic_len);
+        len += rec->topic_len;
+
+        Ctrl_opt *opt   = (Ctrl_opt *) (frame + len);
+        opt->kind       = OPT_SEQ;
+        opt->len        = sizeof(uint32_t);
+        *(uint32_t *) (frame + len + sizeof(Ctrl_opt)) = htonl(state->last_seq);
+        len += rec->opts_len;
+
+        state->acked_seq = state->last_seq;
+        count++;
+    }
+
+    // `OP_RESUME` is sent even without records (the server waits for it)
+    if (count > 0 || opcode == OP_RESUME)
+    {
+        Ctrl_hdr *hdr   = (Ctrl_hdr *) frame;
+        hdr->len        = htonl(len - sizeof(hdr->len));
+        hdr->opcode     = opcode;
+        hdr->count      = htons(count);
+        queue_tx(sub, frame, len);
+    }
+
+    sub->unacked = 0;
+    free(frame);
+}
+
+
+/* Append an option with a uint32_t value to `opts`, return the new length */
+static uint8_t append_opt_u32(char *opts, uint8_t len, uint8_t kind, uint32_t value)
+{
+    Ctrl_opt *opt   = (Ctrl_opt *) (opts + len);
+    opt->kind       = kind;
+    opt->len        = sizeof(uint32_t);
+    *(uint32_t *) (opts + len + sizeof(Ctrl_opt)) = htonl(value);
+
+    return len + sizeof(Ctrl_opt) + sizeof(uint32_t);
+}
+
+
+/**
+ * Encode the subscription options (`rate=<MSGS_PER_SEC>`, `every=<N>`, `if <OP> <VALUE> [<VALUE>]`) in `opts`
+ * Return their length, or -1 if an option is invalid
+*/
+static int encode_sub_opts(char **tokens, int num_tokens, char *opts)
+{
+    uint8_t len = 0;
+    for (int i = 0; i < num_tokens; ++i)
+    {
+        // Room for one more option
+        if (len + sizeof(Ctrl_opt) + sizeof(uint32_t) > UINT8_MAX)
+            return -1;
+
+        char *end;
+        if (strncmp(tokens[i], "rate=", 5) == 0)
+        {
+            double rate = strtod(tokens[i] + 5, &end);
+            if (*end != '\0' || rate <= 0 || rate * RATE_UNIT > UINT32_MAX)
+                return -1;
+            len = append_opt_u32(opts, len, OPT_RATE, MAX((uint32_t) (rate * RATE_UNIT + 0.5), 1));
+        }
+        else if (strncmp(tokens[i], "every=", 6) == 0)
+        {
+            long every = strtol(tokens[i] + 6, &end, 10);
+            if (*end != '\0' || every < 1 || every > UINT32_MAX)
+                return -1;
+            len = append_opt_u32(opts, len, OPT_EVERY, every);
+        }
+        else if (strcmp(tokens[i], "if") == 0)
+        {
+            // The predicate is sent as text, the server compiles it
+            int num_values = i + 1 < num_tokens && strcmp(tokens[i + 1], "between") == 0 ? 2 : 1;
+            if (i + 1 + num_values >= num_tokens)
+                return -1;
+
+            char text[FILTER_TEXT_LEN + 1] = "";
+            for (int k = i + 1; k <= i + 1 + num_values; ++k)
+            {
+                strtod(tokens[k], &end);
+                if (k > i + 1 && *end != '\0')
+                    return -1;
+
+                if (strlen(text) + strlen(tokens[k]) + 1 > FILTER_TEXT_LEN)
+                    return -1;
+                if (k > i + 1)
+                    strcat(text, " ");
+                strcat(text, tokens[k]);
+            }
+
+            if (len + sizeof(Ctrl_opt) + strlen(text) > UINT8_MAX)
+                return -1;
+
+            Ctrl_opt *opt   = (Ctrl_opt *) (opts + len);
+            opt->kind       = OPT_FILTER;
+            opt->len        = strlen(text);
+            memcpy(opts + len + sizeof(Ctrl_opt), text, opt->len);
+            len += sizeof(Ctrl_opt) + opt->len;
+
+            i += 1 + num_values;
+        }
+        else
+            return -1;
+    }
+
+    // Any topic may be received over multicast (the server tells which ones have a group),
+    // and with its alias instead of its name
+    if (len + 2 * sizeof(Ctrl_opt) > UINT8_MAX)
+        return -1;
+
+    Ctrl_opt *opt   = (Ctrl_opt *) (opts + len);
+    opt[0].kind     = OPT_MCAST;
+    opt[0].len      = 0;
+    opt[1].kind     = OPT_ALIAS;
+    opt[1].len      = 0;
+    return len + 2 * sizeof(Ctrl_opt);
+}
+
+
+/* Return the multicast state of a topic (or NULL if the topic isn't received over multicast) */
+static Mcast_state *get_mcast_state(Pcomsub *sub, const char *topic)
+{
+    for (int i = 0; i < sub->num_mcasts; ++i)
+        if (strncmp(sub->mcasts[i].topic, topic, TOPIC_SIZE) == 0)
+            return &sub->mcasts[i];
+
+    return NULL;
+}
+
+
+/* Leave the multicast group of a topic (if it was joined) */
+static void leave_mcast_group(Pcomsub *sub, const char *topic)
+{
+    Mcast_state *state = get_mcast_state(sub, topic);
+    if (state == NULL)
+        return;
+
+    close(state->socket);
+    *state = sub->mcasts[--sub->num_mcasts];
+}
+
+
+/**
+ * Join the multicast group announced by the server for a topic (`payload`: "<GROUP> <PORT> <SEQ>")
+ * If it fails, ask the server to deliver the topic over TCP
+*/
+static void join_mcast_group(Pcomsub *sub, const char *topic, const char *payload)
+{
+    leave_mcast_group(sub, topic);
+
+    char group[IP_LEN];
+    int port;
+    uint32_t seq;
+    struct ip_mreq mreq;
+    struct sockaddr_in group_addr;
+    memset(&group_addr, 0, sizeof(group_addr));
+    int ret = sscanf(payload, "%15s %d %u", group, &port, &seq) == 3
+              && inet_aton(group, &mreq.imr_multiaddr) != 0;
+
+    // Join on the interface that reaches the server (the loopback one for a local server)
+    socklen_t len = sizeof(group_addr);
+    ret = ret && getsockname(sub->socket, (struct sockaddr *) &group_addr, &len) == 0;
+    mreq.imr_interface = group_addr.sin_addr;
+
+    int sock = -1;
+    if (ret)
+    {
+        // Bound to the group, so only its datagrams are received
+        group_addr.sin_family   = AF_INET;
+        group_addr.sin_port     = htons(port);
+        group_addr.sin_addr     = mreq.imr_multiaddr;
+
+        // Room for a burst (a lost datagram costs a repair over TCP)
+        int opt     = 1;
+        int rcvbuf  = MCAST_RCVBUF;
+        sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        ret = sock >= 0
+              && setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) == 0
+              && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) == 0
+              && bind(sock, (struct sockaddr *) &group_addr, sizeof(group_addr)) == 0
+              && setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+    }
+
+    if (ret && sub->num_mcasts == sub->max_mcasts)
+    {
+        int max_mcasts      = sub->max_mcasts == 0 ? INITIAL_MAX_MCASTS : sub->max_mcasts * 2;
+        Mcast_state *mcasts = (Mcast_state *) realloc(sub->mcasts, max_mcasts * sizeof(Mcast_state));
+        ret = mcasts != NULL;
+        if (ret)
+        {
+            sub->mcasts     = mcasts;
+            sub->max_mcasts = max_mcasts;
+        }
+    }
+
+    if (!ret)
+    {
+        char text[BUFF_LEN];
+        sprintf(text, "Couldn't join the multicast group of topic %s, receiving it over TCP.", topic);
+        report_warning(sub, text);
+        if (sock >= 0)
+            close(sock);
+
+        // Subscribe again, without `OPT_MCAST`
+        const char *topics[] = {topic};
+        Ctrl_opt opt = {OPT_ALIAS, 0};
+        send_ctrl_frame(sub, OP_SUBSCRIBE, topics, 1, 0, (char *) &opt, sizeof(opt));
+        return;
+    }
+
+    Mcast_state *state = &sub->mcasts[sub->num_mcasts++];
+    strcpy(state->topic, topic);
+    state->socket   = sock;
+    state->last_seq = seq;
+}
+
+
+/**
+ * Decode the `TCP_msg` at `raw` in `msg` (its strings point in `raw`), return true if it comes from the server itself
+ * The scalars are copied out: in the receive buffer, a message isn't aligned
+*/
+static bool decode_msg(char *raw, Pcomsub_msg *msg)
+{
+    bool from_server;
+    uint32_t seq;
+    memcpy(&from_server, raw + offsetof(TCP_msg, from_server), sizeof(from_server));
+    memcpy(&seq, raw + offsetof(TCP_msg, seq), sizeof(seq));
+    memcpy(&msg->port, raw + offsetof(TCP_msg, port), sizeof(msg->port));
+
+    char *udp_msg = raw + offsetof(TCP_msg, udp_msg);
+    udp_msg[offsetof(UDP_msg, payload) + PAYLOAD_SIZE - 1] = '\0';
+    raw[offsetof(TCP_msg, ip) + IP_LEN - 1] = '\0';
+
+    msg->topic      = udp_msg + offsetof(UDP_msg, topic);
+    msg->topic_len  = strnlen(msg->topic, TOPIC_SIZE);
+    msg->type       = (uint8_t) udp_msg[offsetof(UDP_msg, type)];
+    msg->payload    = udp_msg + offsetof(UDP_msg, payload);
+    msg->ip         = raw + offsetof(TCP_msg, ip);
+    msg->seq        = ntohl(seq);
+
+    return from_server;
+}
+
+
+/* Slot of an alias in the aliases table (its own slot, or the free slot where it would be added) */
+static Topic_alias *find_alias_slot(Topic_alias *aliases, int max_aliases, uint32_t alias)
+{
+    uint32_t slot = (alias * 2654435761u) & (max_aliases - 1);
+    while (aliases[slot].alias != 0 && aliases[slot].alias != alias)
+        slot = (slot + 1) & (max_aliases - 1);
+
+    return &aliases[slot];
+}
+
+
+/* Remember the alias of a topic, announced by the server */
+static void add_topic_alias(Pcomsub *sub, uint32_t alias, const char *topic, size_t topic_len)
+{
+    if (alias == 0)
+        return;
+
+    // Keep the table at most half full
+    if (2 * (sub->num_aliases + 1) > sub->max_aliases)
+    {
+        int max_aliases         = sub->max_aliases == 0 ? INITIAL_MAX_ALIASES : sub->max_aliases * 2;
+        Topic_alias *aliases    = (Topic_alias *) calloc(max_aliases, sizeof(Topic_alias));
+        if (aliases == NULL)
+        {
+            sub->error = ENOMEM;
+            return;
+        }
+
+        for (int i = 0; i < sub->max_aliases; ++i)
+            if (sub->aliases[i].alias != 0)
+                *find_alias_slot(aliases, max_aliases, sub->aliases[i].alias) = sub->aliases[i];
+
+        free(sub->aliases);
+        sub->aliases        = aliases;
+        sub->max_aliases    = max_aliases;
+    }
+
+    Topic_alias *entry = find_alias_slot(sub->aliases, sub->max_aliases, alias);
+    if (entry->alias == 0)
+        sub->num_aliases++;
+
+    entry->alias        = alias;
+    entry->topic_len    = topic_len;
+    memcpy(entry->topic, topic, topic_len);
+    entry->topic[topic_len] = '\0';
+}
+
+
+/* Tell if the `size` bytes at `raw` are an aliased message (`Alias_hdr` and its payload) */
+static bool is_alias_msg(const char *raw, size_t size)
+{
+    return size > sizeof(Alias_hdr) && size < sizeof(TCP_msg)
+        && raw[offsetof(Alias_hdr, from_server)] == 0 && raw[offsetof(Alias_hdr, marker)] == '\0';
+}
+
+
+/**
+ * Decode the aliased message at `raw` in `msg` (the topic points in the aliases table)
+ * Return false if its alias wasn't announced
+*/
+static bool decode_alias_msg(Pcomsub *sub, char *raw, size_t size, Pcomsub_msg *msg)
+{
+    uint32_t alias;
+    uint32_t seq;
+    memcpy(&alias, raw + offsetof(Alias_hdr, alias), sizeof(alias));
+    memcpy(&seq, raw + offsetof(Alias_hdr, seq), sizeof(seq));
+    memcpy(&msg->port, raw + offsetof(Alias_hdr, port), sizeof(msg->port));
+
+    Topic_alias *entry = sub->max_aliases == 0 ? NULL : find_alias_slot(sub->aliases, sub->max_aliases, ntohl(alias));
+    if (entry == NULL || entry->alias == 0)
+    {
+        report_warning(sub, "Dropped a message with an unknown topic alias.");
+        return false;
+    }
+
+    raw[size - 1] = '\0';
+    raw[offsetof(Alias_hdr, ip) + IP_LEN - 1] = '\0';
+
+    msg->topic      = entry->topic;
+    msg->topic_len  = entry->topic_len;
+    msg->type       = (uint8_t) raw[offsetof(Alias_hdr, type)];
+    msg->payload    = raw + sizeof(Alias_hdr);
+    msg->ip         = raw + offsetof(Alias_hdr, ip);
+    msg->seq        = ntohl(seq);
+    return true;
+}
+
+
+/* Hand a message of a topic to the application, return true if it must be acknowledged */
+static bool deliver_msg(Pcomsub *sub, const Pcomsub_msg *msg)
+{
+    // Messages of SF topics are numbered, skip the replayed ones
+    if (msg->seq != 0)
+    {
+        Ack_state *state = get_ack_state(sub, msg->topic);
+        if (state == NULL || (int32_t) (msg->seq - state->last_seq) <= 0)
+            return false;
+        state->last_seq = msg->seq;
+    }
+
+    if (sub->callbacks.on_msg != NULL)
+        sub->callbacks.on_msg(sub, msg, sub->user);
+    return msg->seq != 0;
+}
+
+
+/* Handle a decoded message from the server (received through TCP or the shared ring) */
+static void process_msg(Pcomsub *sub, Pcomsub_msg *msg, bool from_server)
+{
+    // Any message shows that the server is alive
+    if (sub->server_heartbeat_ms != 0)
+        sub->server_deadline = mono_ms() + SERVER_TIMEOUT_BEATS * sub->server_heartbeat_ms;
+
+    if (from_server)
+    {
+        char topic[TOPIC_SIZE + 1] = "";
+        memcpy(topic, msg->topic, msg->topic_len);
+
+        switch (msg->type)
+        {
+            case HEARTBEAT:
+                // The server checks that the client is alive (its interval sets the server timeout)
+                sub->server_heartbeat_ms = strtoull(msg->payload, NULL, 10);
+                sub->server_deadline     = mono_ms() + SERVER_TIMEOUT_BEATS * sub->server_heartbeat_ms;
+                send_ctrl_frame(sub, OP_HEARTBEAT, NULL, 0, 0, NULL, 0);
+                break;
+
+            case MCAST_JOIN:
+                // The server tells on which multicast group a topic is delivered
+                join_mcast_group(sub, topic, msg->payload);
+                break;
+
+            case MCAST_LEAVE:
+                leave_mcast_group(sub, topic);
+                break;
+
+            case TOPIC_ALIAS:
+                // The next messages of the topic carry this alias instead of its name
+                add_topic_alias(sub, strtoul(msg->payload, NULL, 10), msg->topic, msg->topic_len);
+                break;
+
+            case SHM_TOKEN:
+                // The answer to `OP_SHM_TOKEN`, for the ring request
+                snprintf(sub->shm_token, SHM_TOKEN_LEN, "%s", msg->payload);
+                break;
+
+            default:
+                if (sub->callbacks.on_notice != NULL)
+                    sub->callbacks.on_notice(sub, msg->payload, sub->user);
+        }
+        return;
+    }
+
+    if (!deliver_msg(sub, msg))
+        return;
+
+    // Acknowledge the SF messages in batches
+    if (sub->unacked++ == 0)
+        sub->ack_deadline = mono_ms() + ACK_INTERVAL_MS;
+    if (sub->unacked >= ACK_EVERY)
+        send_acks(sub, OP_ACK);
+}
+
+
+/* Receive the messages of the server's socket */
+static void recv_tcp_msgs(Pcomsub *sub)
+{
+    ssize_t ret = recv(sub->socket, sub->rx_buf + sub->rx_len, RX_BUF_LEN - sub->rx_len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    // The server closed the connection
+    if (ret <= 0)
+    {
+        sub->error = ECONNRESET;
+        return;
+    }
+    sub->rx_len += ret;
+
+    // Every message is the `size` followed by the actual message (TCP is stream oriented)
+    size_t off = 0;
+    while (sub->rx_len - off >= MAX_DIGITS_TCP_MSG_LEN)
+    {
+        char size_str[MAX_DIGITS_TCP_MSG_LEN + 1];
+        memcpy(size_str, sub->rx_buf + off, MAX_DIGITS_TCP_MSG_LEN);
+        size_str[MAX_DIGITS_TCP_MSG_LEN] = '\0';
+
+        int size = atoi(size_str);
+        if (size <= 0 || size > sizeof(TCP_msg))
+        {
+            sub->error = EPROTO;
+            return;
+        }
+
+        // Wait for the rest of the message
+        if (sub->rx_len - off < MAX_DIGITS_TCP_MSG_LEN + size)
+            break;
+
+        // The message is handled in the buffer
+        char *raw = sub->rx_buf + off + MAX_DIGITS_TCP_MSG_LEN;
+        off += MAX_DIGITS_TCP_MSG_LEN + size;
+
+        Pcomsub_msg msg;
+        if (is_alias_msg(raw, size))
+        {
+            if (decode_alias_msg(sub, raw, size, &msg))
+                process_msg(sub, &msg, false);
+            continue;
+        }
+
+        // A short message is completed with zeros first
+        TCP_msg short_msg;
+        if (size < sizeof(TCP_msg))
+        {
+            memset(&short_msg, 0, sizeof(TCP_msg));
+            memcpy(&short_msg, raw, size);
+            raw = (char *) &short_msg;
+        }
+
+        bool from_server = decode_msg(raw, &msg);
+        process_msg(sub, &msg, from_server);
+    }
+
+    // Keep only the incomplete message
+    memmove(sub->rx_buf, sub->rx_buf + off, sub->rx_len - off);
+    sub->rx_len -= off;
+}
+
+
+/* Receive a multicast datagram, asking the server to resend over TCP the messages lost before it */
+static void recv_mcast_msg(Pcomsub *sub, Mcast_state *state)
+{
+    // The datagram ends with the payload (terminated here if it was cut)
+    char dgram[MCAST_DGRAM_LEN];
+    int ret = recv(state->socket, dgram, sizeof(dgram), MSG_DONTWAIT);
+    if (ret < (int) (sizeof(Mcast_hdr) + offsetof(TCP_msg, udp_msg) + offsetof(UDP_msg, payload)))
+        return;
+    if (ret < sizeof(dgram))
+        dgram[ret] = '\0';
+
+    Pcomsub_msg msg;
+    decode_msg(dgram + sizeof(Mcast_hdr), &msg);
+
+    // Several topics may share a group
+    if (strncmp(msg.topic, state->topic, TOPIC_SIZE) != 0)
+        return;
+
+    // Skip the old (or already repaired) messages
+    uint32_t seq;
+    memcpy(&seq, dgram, sizeof(seq));
+    seq             = ntohl(seq);
+    int32_t ahead   = (int32_t) (seq - state->last_seq);
+    if (ahead <= 0)
+        return;
+
+    if (ahead > 1)
+    {
+        // Gap: the server resends the lost messages over TCP
+        char opts[2 * (sizeof(Ctrl_opt) + sizeof(uint32_t))];
+        uint8_t len = append_opt_u32(opts, 0, OPT_SEQ, state->last_seq + 1);
+        len = append_opt_u32(opts, len, OPT_COUNT, MIN(ahead - 1, MCAST_REPAIR_WINDOW));
+
+        const char *topics[] = {state->topic};
+        send_ctrl_frame(sub, OP_MCAST_REPAIR, topics, 1, 0, opts, len);
+    }
+    state->last_seq = seq;
+
+    deliver_msg(sub, &msg);
+}
+
+
+/**
+ * Ask the server for a token through TCP and wait for it (the messages received meanwhile are handled)
+ * Return false if it didn't come in `SHM_TOKEN_TIMEOUT_MS`
+*/
+static bool wait_shm_token(Pcomsub *sub)
+{
+    // The server answers once the client is registered (the TCP handshake is over)
+    sub->shm_token[0] = '\0';
+    send_ctrl_frame(sub, OP_SHM_TOKEN, NULL, 0, 0, NULL, 0);
+
+    uint64_t deadline = mono_ms() + SHM_TOKEN_TIMEOUT_MS;
+    while (sub->shm_token[0] == '\0' && sub->error == 0)
+    {
+        int timeout_ms = -1;
+        uint64_t now = mono_ms();
+        if (now >= deadline)
+            return false;
+        lower_timeout(&timeout_ms, deadline, now);
+
+        struct pollfd pfd = {sub->socket, POLLIN | (sub->tx_len > 0 ? POLLOUT : 0), 0};
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret < 0 && errno != EINTR)
+            return false;
+
+        if (pfd.revents & POLLOUT)
+            flush_tx(sub);
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+            recv_tcp_msgs(sub);
+    }
+
+    return sub->shm_token[0] != '\0';
+}
+
+
+/**
+ * Ask the server (on its UNIX socket `path`) for a shared ring
+ * Return true if the ring is mapped (the messages don't come through TCP anymore)
+*/
+static bool request_shm_ring(Pcomsub *sub, const char *path, const char *client_id)
+{
+    if (!wait_shm_token(sub))
+        return false;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return false;
+
+    // The server finds the TCP client by its ID, then checks the token it sent to it
+    char request[ID_CLIENT_LEN + SHM_TOKEN_LEN];
+    memcpy(request, client_id, ID_CLIENT_LEN);
+    memcpy(request + ID_CLIENT_LEN, sub->shm_token, SHM_TOKEN_LEN);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || send(sock, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+    {
+        close(sock);
+        return false;
+    }
+
+    // [status] with the memfd, `data_efd` and `space_efd` of the ring
+    char status = 0;
+    struct iovec iov = {&status, sizeof(status)};
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov         = &iov;
+    hdr.msg_iovlen      = 1;
+    hdr.msg_control     = control.buf;
+    hdr.msg_controllen  = sizeof(control.buf);
+
+    int ret = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    close(sock);
+
+    struct cmsghdr *cmsg = ret == sizeof(status) ? CMSG_FIRSTHDR(&hdr) : NULL;
+    if (status != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return false;
+
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (!shm_ring_attach(&sub->shm, fds[0], fds[1], fds[2]) || sub->shm.slot_size < sizeof(TCP_msg))
+    {
+        shm_ring_destroy(&sub->shm);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Handle the messages of the shared ring (at most a ring of them, so the other connections aren't delayed) */
+static void drain_shm_ring(Pcomsub *sub)
+{
+    uint32_t count = 0;
+    char *slot;
+    while (count < sub->shm.num_slots && (slot = (char *) shm_ring_peek(&sub->shm)) != NULL)
+    {
+        // The message is handled in its slot
+        Pcomsub_msg msg;
+        bool from_server = decode_msg(slot, &msg);
+        process_msg(sub, &msg, from_server);
+        shm_ring_pop(&sub->shm);
+        count++;
+    }
+
+    if (count > 0)
+        shm_ring_wake_writer(&sub->shm);
+}
+
+
+Pcomsub *pcomsub_connect(const char *id, const char *ip, uint16_t port, const char *shm_path,
+                         const Pcomsub_callbacks *callbacks, void *user)
+{
+    // The ID is sent with its null terminator, in a fixed size field
+    char client_id[ID_CLIENT_LEN] = "";
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family    = AF_INET;
+    serv_addr.sin_port      = htons(port);
+    if (strlen(id) >= ID_CLIENT_LEN || inet_aton(ip, &serv_addr.sin_addr) == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    strcpy(client_id, id);
+
+    Pcomsub *sub = (Pcomsub *) calloc(1, sizeof(Pcomsub));
+    if (sub == NULL)
+        return NULL;
+
+    sub->rx_buf = (char *) malloc(RX_BUF_LEN);
+    sub->socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sub->user   = user;
+    if (callbacks != NULL)
+        sub->callbacks = *callbacks;
+
+    // First, connect and send the client's ID (blocking, the handshake is short)
+    int opt = 1;
+    if (sub->rx_buf == NULL || sub->socket < 0
+        || connect(sub->socket, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0
+        || send(sub->socket, client_id, ID_CLIENT_LEN, MSG_NOSIGNAL) != ID_CLIENT_LEN
+        || setsockopt(sub->socket, IPPROTO_TCP, TCP_NODELAY, (char *) &opt, sizeof(int)) < 0
+        || fcntl(sub->socket, F_SETFL, fcntl(sub->socket, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        int error = errno;
+        if (sub->socket >= 0)
+            close(sub->socket);
+        free(sub->rx_buf);
+        free(sub);
+        errno = error;
+        return NULL;
+    }
+
+    // A same-host subscriber receives its messages through a shared ring (or through TCP if it can't be mapped)
+    if (shm_path != NULL)
+    {
+        sub->shm_active = request_shm_ring(sub, shm_path, client_id);
+        if (!sub->shm_active)
+            report_warning(sub, "Couldn't map the shared ring, receiving through TCP.");
+    }
+
+    // Ask for the SF messages stored while the client was disconnected
+    send_acks(sub, OP_RESUME);
+    return sub;
+}
+
+
+int pcomsub_subscribe(Pcomsub *sub, const char **topics, int num_topics, int sf, const char *opts)
+{
+    // The options are split in a copy
+    char *text = strdup(opts != NULL ? opts : "");
+    if (text == NULL)
+        return -1;
+
+    char *tokens[UINT8_MAX];
+    int num_tokens = 0;
+    char *save;
+    for (char *aux = strtok_r(text, " \t\n", &save); aux != NULL; aux = strtok_r(NULL, " \t\n", &save))
+    {
+        if (num_tokens == UINT8_MAX)
+        {
+            num_tokens = -1;
+            break;
+        }
+        tokens[num_tokens++] = aux;
+    }
+
+    char encoded[UINT8_MAX];
+    int len = num_tokens < 0 ? -1 : encode_sub_opts(tokens, num_tokens, encoded);
+    free(text);
+    if (len < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Send all the topics in a single frame
+    send_ctrl_frame(sub, OP_SUBSCRIBE, topics, num_topics, sf, encoded, len);
+    return 0;
+}
+
+
+int pcomsub_unsubscribe(Pcomsub *sub, const char **topics, int num_topics)
+{
+    send_ctrl_frame(sub, OP_UNSUBSCRIBE, topics, num_topics, 0, NULL, 0);
+    for (int i = 0; i < num_topics; ++i)
+        leave_mcast_group(sub, topics[i]);
+
+    return 0;
+}
+
+
+int pcomsub_num_fds(Pcomsub *sub)
+{
+    return 1 + sub->shm_active + sub->num_mcasts;
+}
+
+
+int pcomsub_poll_fds(Pcomsub *sub, struct pollfd *fds, int max_fds, int *timeout_ms)
+{
+    if (max_fds < pcomsub_num_fds(sub))
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // The socket is polled for writing only while control frames wait
+    int num_fds = 0;
+    fds[num_fds++] = (struct pollfd) {sub->socket, POLLIN | (sub->tx_len > 0 ? POLLOUT : 0), 0};
+
+    // Block only if the shared ring is empty
+    if (sub->shm_active)
+    {
+        fds[num_fds++]      = (struct pollfd) {sub->shm.data_efd, POLLIN, 0};
+        sub->shm_sleeping   = shm_ring_prepare_sleep(&sub->shm);
+        if (!sub->shm_sleeping)
+            *timeout_ms = 0;
+    }
+
+    for (int i = 0; i < sub->num_mcasts; ++i)
+        fds[num_fds++] = (struct pollfd) {sub->mcasts[i].socket, POLLIN, 0};
+
+    // Wake up for the pending acks and the server timeout
+    uint64_t now = mono_ms();
+    if (sub->unacked > 0)
+        lower_timeout(timeout_ms, sub->ack_deadline, now);
+    if (sub->server_heartbeat_ms != 0)
+        lower_timeout(timeout_ms, sub->server_deadline, now);
+
+    return num_fds;
+}
+
+
+int pcomsub_dispatch(Pcomsub *sub, const struct pollfd *fds, int num_fds)
+{
+    if (sub->shm_sleeping)
+    {
+        shm_ring_finish_sleep(&sub->shm);
+        sub->shm_sleeping = false;
+    }
+
+    // Handle the messages of the shared ring
+    if (sub->shm_active)
+        drain_shm_ring(sub);
+
+    for (int k = 0; k < num_fds && sub->error == 0; ++k)
+    {
+        if (fds[k].revents == 0)
+            continue;
+
+        if (fds[k].fd == sub->socket)
+        {
+            if (fds[k].revents & POLLOUT)
+                flush_tx(sub);
+            if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+                recv_tcp_msgs(sub);
+            continue;
+        }
+
+        // Datagrams of the multicast topics (a group left meanwhile isn't found)
+        for (int i = 0; i < sub->num_mcasts; ++i)
+            if (sub->mcasts[i].socket == fds[k].fd)
+                recv_mcast_msg(sub, &sub->mcasts[i]);
+    }
+
+    uint64_t now = mono_ms();
+    if (sub->unacked > 0 && now >= sub->ack_deadline)
+        send_acks(sub, OP_ACK);
+
+    // Nothing came from the server for several heartbeat intervals
+    if (sub->error == 0 && sub->server_heartbeat_ms != 0 && now >= sub->server_deadline)
+        sub->error = ETIMEDOUT;
+
+    if (sub->error != 0)
+    {
+        errno = sub->error;
+        return -1;
+    }
+    return 0;
+}
+
+
+void pcomsub_close(Pcomsub *sub)
+{
+    // Acknowledge everything that was handed to the application, so it isn't replayed
+    if (sub->error == 0)
+    {
+        send_acks(sub, OP_ACK);
+        fcntl(sub->socket, F_SETFL, fcntl(sub->socket, F_GETFL) & ~O_NONBLOCK);
+        flush_tx(sub);
+    }
+
+    for (int i = 0; i < sub->num_mcasts; ++i)
+        close(sub->mcasts[i].socket);
+    if (sub->shm_active)
+        shm_ring_destroy(&sub->shm);
+    close(sub->socket);
+
+    free(sub->aliases);
+    free(sub->mcasts);
+    free(sub->acks);
+    free(sub->tx_buf);
+    free(sub->rx_buf);
+    free(sub);
+}
@@ -0,0 +1,749 @@
+#include "utils.h"
+
+// Index of all the topics known by the server
+extern Topic_index topic_index;
+
+// This node and its links
+extern Federation federation;
+
+// Descriptors watched by the main loop
+extern Event_loop event_loop;
+
+// Timers of the server (the reconnections of the configured peers)
+extern Timer_wheel timers;
+
+
+void federation_init()
+{
+    memset(&federation, 0, sizeof(Federation));
+
+    // A new ID on every start, so the peers never mistake a restarted node for the old one
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    federation.node_id      = ((uint32_t) getpid() * 2654435761u) ^ (uint32_t) ts.tv_nsec ^ (uint32_t) ts.tv_sec;
+    if (federation.node_id == 0)
+        federation.node_id  = 1;
+
+    federation.next_version = 1;
+    federation.next_seq     = 1;
+}
+
+
+bool federation_add_peer_addr(const char *addr)
+{
+    // `HOST:PORT`
+    const char *port = strrchr(addr, ':');
+    if (port == NULL || port == addr || atoi(port + 1) <= 0 || strlen(addr) >= PEER_ADDR_LEN)
+        return false;
+
+    // Without memory, the peer isn't added
+    Peer_addr **peer_addrs = (Peer_addr **) mem_realloc(NULL, MEM_PEERS, federation.peer_addrs,
+                                                        (federation.num_peer_addrs + 1) * sizeof(Peer_addr *));
+    if (peer_addrs == NULL)
+        return false;
+    federation.peer_addrs = peer_addrs;
+
+    Peer_addr *conf = (Peer_addr *) mem_alloc(NULL, MEM_PEERS, sizeof(Peer_addr));
+    if (conf == NULL)
+        return false;
+    strcpy(conf->addr, addr);
+    conf->connecting    = -1;
+    conf->retry_ms      = PEER_RETRY_MIN_MS;
+    federation.peer_addrs[federation.num_peer_addrs++] = conf;
+
+    return true;
+}
+
+
+/* Try the configured peer again after its current delay (doubled for the next failure) */
+static void retry_peer_later(Peer_addr *conf)
+{
+    timer_add(&timers, &conf->timer, timer_now_ms() + conf->retry_ms);
+    conf->retry_ms = MIN(conf->retry_ms * 2, PEER_RETRY_MAX_MS);
+}
+
+
+/* Give up the attempt in progress (or a failed one) and retry later */
+static void fail_peer_connect(Peer_addr *conf)
+{
+    if (conf->connecting >= 0)
+    {
+        unwatch_fd(conf->connecting);
+        close(conf->connecting);
+        conf->connecting = -1;
+    }
+
+    if (!conf->failing)
+        fprintf(stderr, "[ERROR]: Couldn't connect to peer %s, retrying!\n", conf->addr);
+    conf->failing = true;
+    retry_peer_later(conf);
+}
+
+
+/* Open a non-blocking TCP connection to a configured peer (finished by `finish_peer_connect()`) */
+static void start_peer_connect(Peer_addr *conf)
+{
+    char host[PEER_ADDR_LEN];
+    strcpy(host, conf->addr);
+    char *port = strrchr(host, ':');
+    *port++ = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family     = AF_INET;
+    hints.ai_socktype   = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        fail_peer_connect(conf);
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(sock < 0, "[ERROR]: Couldn't create the peer socket!\n");
+
+    int ret = connect(sock, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if ((ret < 0 && errno != EINPROGRESS) || !watch_fd(sock, CONN_PEER_CONNECT, conf))
+    {
+        close(sock);
+        fail_peer_connect(conf);
+        return;
+    }
+
+    // The socket is writable once the connection is established (or failed)
+    conf->connecting = sock;
+    watch_fd_output(sock, true);
+    timer_add(&timers, &conf->timer, timer_now_ms() + PEER_CONNECT_TIMEOUT_MS);
+}
+
+
+/* Timer of a configured peer: abandon the attempt in progress, or start a new one */
+static void peer_addr_timer(Timer *timer, void *arg)
+{
+    Peer_addr *conf = container_of(timer, Peer_addr, timer);
+
+    if (conf->connecting >= 0)
+        fail_peer_connect(conf);
+    else if (conf->peer == NULL)
+        start_peer_connect(conf);
+}
+
+
+void federation_connect_peers()
+{
+    for (int i = 0; i < federation.num_peer_addrs; ++i)
+    {
+        timer_init(&federation.peer_addrs[i]->timer, peer_addr_timer);
+        start_peer_connect(federation.peer_addrs[i]);
+    }
+}
+
+
+void finish_peer_connect(Peer_addr *conf)
+{
+    int sock = conf->connecting;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0)
+    {
+        fail_peer_connect(conf);
+        return;
+    }
+
+    // The ID of a peer starts with a byte that a subscriber can't send (it fits in the empty socket)
+    char id[ID_CLIENT_LEN] = {PEER_ID_MARKER, 'P', 'E', 'E', 'R'};
+    if (send(sock, id, ID_CLIENT_LEN, MSG_NOSIGNAL) != ID_CLIENT_LEN)
+    {
+        fail_peer_connect(conf);
+        return;
+    }
+
+    // Disable Nagle's algorithm
+    int opt = 1;
+    int ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &opt, sizeof(int));
+    DIE(ret < 0, "[ERROR]: Couldn't disable the Nagle's algorithm!\n");
+
+    timer_del(&timers, &conf->timer);
+    watch_fd_output(sock, false);
+    // Without memory for the link, the connection is retried later
+    Peer *peer = add_peer(sock, conf->addr);
+    if (peer == NULL)
+    {
+        fail_peer_connect(conf);
+        return;
+    }
+
+    conf->connecting    = -1;
+    conf->failing       = false;
+    conf->retry_ms      = PEER_RETRY_MIN_MS;
+    conf->peer          = peer;
+    peer->conf          = conf;
+}
+
+
+/**
+ * Send `len` bytes on a peer link, queueing what doesn't fit in the socket
+ * (a `droppable` frame is dropped if the link is congested or the server is out of memory;
+ * another frame that can't be queued breaks the link, which is closed when its socket is read)
+*/
+static void peer_send(Peer *peer, const char *buf, size_t len, bool droppable)
+{
+    if (peer->tx_len == 0)
+    {
+        // Nothing is waiting, so the frame can be written directly
+        ssize_t ret = send(peer->socket, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return;
+        if (ret == len)
+            return;
+        if (ret > 0)
+        {
+            buf += ret;
+            len -= ret;
+        }
+    }
+    else if (droppable && peer->tx_len + len > PEER_TX_MAX)
+    {
+        peer->dropped++;
+        return;
+    }
+
+    // Make room for the rest of the frame (over the memory budget, only the frames that can't be dropped grow it)
+    if (peer->tx_cap - peer->tx_len < len)
+    {
+        size_t tx_cap   = MAX(peer->tx_cap * 2, peer->tx_len + len);
+        char *tx_buf    = droppable && mem_over_budget(tx_cap - peer->tx_cap)
+                        ? NULL : (char *) mem_realloc(NULL, MEM_PEERS, peer->tx_buf, tx_cap);
+        if (tx_buf == NULL)
+        {
+            if (droppable)
+                peer->dropped++;
+            else
+                shutdown(peer->socket, SHUT_RDWR);
+            return;
+        }
+
+        peer->tx_buf = tx_buf;
+        peer->tx_cap = tx_cap;
+    }
+
+    memcpy(peer->tx_buf + peer->tx_len, buf, len);
+    peer->tx_len += len;
+    watch_fd_output(peer->socket, true);
+}
+
+
+/* Send a frame with a single interest record (`OP_INTEREST_ADD` / `OP_INTEREST_DEL`) */
+static void send_interest(Peer *peer, uint8_t opcode, Topic_entry *entry, uint32_t origin, uint32_t version)
+{
+    char frame[sizeof(Ctrl_hdr) + sizeof(Ctrl_rec) + TOPIC_SIZE + 2 * (sizeof(Ctrl_opt) + sizeof(uint32_t))];
+    size_t len = sizeof(Ctrl_hdr);
+
+    Ctrl_rec *rec   = (Ctrl_rec *) (frame + len);
+    rec->topic_len  = entry->name_len;
+    rec->sf         = 0;
+    rec->opts_len   = 2 * (sizeof(Ctrl_opt) + sizeof(uint32_t));
+    len += sizeof(Ctrl_rec);
+
+    memcpy(frame + len, entry->name, entry->name_len);
+    len += entry->name_len;
+
+    // The origin node and the version of its interest
+    uint8_t kinds[]     = {OPT_ORIGIN, OPT_VERSION};
+    uint32_t values[]   = {origin, version};
+    for (int k = 0; k < 2; ++k)
+    {
+        Ctrl_opt *opt   = (Ctrl_opt *) (frame + len);
+        opt->kind       = kinds[k];
+        opt->len        = sizeof(uint32_t);
+        *(uint32_t *) (frame + len + sizeof(Ctrl_opt)) = htonl(values[k]);
+        len += sizeof(Ctrl_opt) + sizeof(uint32_t);
+    }
+
+    Ctrl_hdr *hdr   = (Ctrl_hdr *) frame;
+    hdr->len        = htonl(len - sizeof(hdr->len));
+    hdr->opcode     = opcode;
+    hdr->count      = htons(1);
+    peer_send(peer, frame, len, false);
+}
+
+
+Peer *add_peer(int sock, const char *addr)
+{
+    // Make room in the `peers` list
+    if (federation.num_peers == federation.max_peers)
+    {
+        int max_peers   = federation.max_peers == 0 ? INITIAL_MAX_PEERS : federation.max_peers * 2;
+        Peer **peers    = (Peer **) mem_realloc(NULL, MEM_PEERS, federation.peers, max_peers * sizeof(Peer *));
+        if (peers == NULL)
+            return NULL;
+
+        federation.peers        = peers;
+        federation.max_peers    = max_peers;
+    }
+
+    Peer *peer = (Peer *) mem_alloc(NULL, MEM_PEERS, sizeof(Peer));
+    if (peer == NULL)
+        return NULL;
+    peer->socket = sock;
+    strncpy(peer->addr, addr, PEER_ADDR_LEN - 1);
+
+    federation.peers[federation.num_peers++] = peer;
+    set_fd_owner(sock, CONN_PEER, peer);
+    printf("Peer %s connected.\n", peer->addr);
+
+    // Announce this node
+    char hello[sizeof(Ctrl_hdr) + sizeof(uint32_t)];
+    Ctrl_hdr *hdr   = (Ctrl_hdr *) hello;
+    hdr->len        = htonl(sizeof(hello) - sizeof(hdr->len));
+    hdr->opcode     = OP_PEER_HELLO;
+    hdr->count      = 0;
+    *(uint32_t *) (hello + sizeof(Ctrl_hdr)) = htonl(federation.node_id);
+    peer_send(peer, hello, sizeof(hello), false);
+
+    // Announce every interest known by this node (its own and the ones learned from the other links),
+    // with the withdrawals, so the ones made while the link was down reach the peer
+    for (size_t i = 0; i < topic_index.num_buckets; ++i)
+    {
+        for (Topic_entry *entry = topic_index.buckets[i]; entry != NULL; entry = entry->next)
+        {
+            if (entry->num_subs + entry->num_mcast_subs > 0)
+                send_interest(peer, OP_INTEREST_ADD, entry, federation.node_id, entry->local_version);
+            else if (entry->local_version != 0)
+                send_interest(peer, OP_INTEREST_DEL, entry, federation.node_id, entry->local_version);
+
+            for (int k = 0; k < entry->num_interests; ++k)
+            {
+                Interest *interest = &entry->interests[k];
+                if (interest->from != peer)
+                    send_interest(peer, interest->present ? OP_INTEREST_ADD : OP_INTEREST_DEL,
+                                  entry, interest->origin, interest->version);
+            }
+        }
+    }
+
+    return peer;
+}
+
+
+Peer *get_peer_by_socket(int sock)
+{
+    Conn_slot *slot = get_conn_slot(sock);
+    return slot != NULL && slot->kind == CONN_PEER ? (Peer *) slot->ptr : NULL;
+}
+
+
+void federation_local_interest(Topic_entry *entry, bool present)
+{
+    entry->local_version = federation.next_version++;
+
+    for (int i = 0; i < federation.num_peers; ++i)
+        send_interest(federation.peers[i], present ? OP_INTEREST_ADD : OP_INTEREST_DEL,
+                      entry, federation.node_id, entry->local_version);
+}
+
+
+/**
+ * Apply an interest announcement received from `peer` and pass it on to the other links
+ * Return false without memory for it (the link is closed, the peer announces it again when it comes back)
+*/
+static bool apply_interest(Peer *peer, Action *action, bool present)
+{
+    // The announcements of this node come back through the loops of the topology
+    if (action->origin == 0 || action->origin == federation.node_id)
+        return true;
+
+    Topic_entry *entry  = topic_index_get(action->topic, action->topic_len, true);
+    if (entry == NULL)
+        return false;
+
+    Interest *interest  = NULL;
+    for (int k = 0; k < entry->num_interests && interest == NULL; ++k)
+        if (entry->interests[k].origin == action->origin)
+            interest = &entry->interests[k];
+
+    // Only a newer version is applied (and flooded), so every announcement crosses each link once
+    // The same version only changes the state of a lost link: a withdrawal that came along the link of the interest,
+    // or an announcement that finds it withdrawn (a link came back); the origin's own changes always have a new version
+    if (interest != NULL)
+    {
+        int32_t age = (int32_t) (action->version - interest->version);
+        bool repair = age == 0 && interest->present != present && (present || interest->from == peer);
+        if (age < 0 || (age == 0 && !repair))
+            return true;
+    }
+
+    if (interest == NULL)
+    {
+        if (entry->num_interests == entry->max_interests)
+        {
+            int max_interests   = entry->max_interests == 0 ? INITIAL_MAX_INTERESTS : entry->max_interests * 2;
+            Interest *interests = (Interest *) mem_realloc(NULL, MEM_PEERS, entry->interests, max_interests * sizeof(Interest));
+            if (interests == NULL)
+                return false;
+
+            entry->interests        = interests;
+            entry->max_interests    = max_interests;
+        }
+
+        interest            = &entry->interests[entry->num_interests++];
+        interest->origin    = action->origin;
+    }
+
+    interest->version   = action->version;
+    interest->present   = present;
+    interest->from      = peer;
+
+    for (int i = 0; i < federation.num_peers; ++i)
+        if (federation.peers[i] != peer)
+            send_interest(federation.peers[i], present ? OP_INTEREST_ADD : OP_INTEREST_DEL,
+                          entry, action->origin, action->version);
+    return true;
+}
+
+
+/* Tell if a publish wasn't seen before (it may come through several links; without memory for a new origin, it's dropped) */
+static bool accept_publish(uint32_t origin, uint32_t seq)
+{
+    Origin_state *state = NULL;
+    for (int k = 0; k < federation.num_origins && state == NULL; ++k)
+        if (federation.origins[k].node == origin)
+            state = &federation.origins[k];
+
+    if (state == NULL)
+    {
+        if (federation.num_origins == federation.max_origins)
+        {
+            int max_origins         = federation.max_origins == 0 ? INITIAL_MAX_PEERS : federation.max_origins * 2;
+            Origin_state *origins   = (Origin_state *) mem_realloc(NULL, MEM_PEERS, federation.origins,
+                                                                   max_origins * sizeof(Origin_state));
+            if (origins == NULL)
+                return false;
+
+            federation.origins      = origins;
+            federation.max_origins  = max_origins;
+        }
+
+        state           = &federation.origins[federation.num_origins++];
+        state->node     = origin;
+        state->max_seq  = seq;
+        state->window   = 1;
+        return true;
+    }
+
+    // Newer than everything seen: slide the window
+    int32_t ahead = (int32_t) (seq - state->max_seq);
+    if (ahead > 0)
+    {
+        state->window   = ahead >= PEER_DEDUP_WINDOW ? 1 : (state->window << ahead) | 1;
+        state->max_seq  = seq;
+        return true;
+    }
+
+    // Older: accepted once, if it's still in the window
+    uint32_t behind = -ahead;
+    if (behind >= PEER_DEDUP_WINDOW || (state->window & (1ULL << behind)))
+        return false;
+
+    state->window |= 1ULL << behind;
+    return true;
+}
+
+
+/* Deliver a publish received from `peer` and forward it to the other interested links */
+static void apply_publish(Peer *peer, const char *body, size_t len)
+{
+    if (len < sizeof(Peer_pub) || len - sizeof(Peer_pub) > sizeof(TCP_msg))
+        return;
+
+    Peer_pub *pub   = (Peer_pub *) body;
+    uint32_t origin = ntohl(pub->origin);
+    uint32_t seq    = ntohl(pub->seq);
+    if (origin == federation.node_id || !accept_publish(origin, seq))
+        return;
+
+    // The message is formatted by the origin node, the rest of it is zeroed (without memory, it's dropped)
+    Shared_msg *msg = new_shared_msg();
+    if (msg == NULL)
+        return;
+
+    memcpy(msg->raw_value, pub->raw_value, RAW_VALUE_LEN);
+    memcpy(&msg->msg, body + sizeof(Peer_pub), len - sizeof(Peer_pub));
+    sprintf(msg->msg.size, "%lu", sizeof(TCP_msg));
+    msg->msg.from_server    = false;
+    msg->msg.seq            = 0;
+    msg->msg.udp_msg.payload[PAYLOAD_SIZE - 1] = '\0';
+
+    if (pub->ttl > 1)
+        federation_forward(msg, origin, seq, pub->ttl - 1, peer);
+    send_tcp_msg(msg);
+    put_shared_msg(msg);
+}
+
+
+void federation_forward(Shared_msg *msg, uint32_t origin, uint32_t seq, uint8_t ttl, Peer *from)
+{
+    if (federation.num_peers == 0 || ttl == 0)
+        return;
+
+    Topic_entry *entry = topic_index_get(msg->msg.udp_msg.topic, strnlen(msg->msg.udp_msg.topic, TOPIC_SIZE), false);
+    if (entry == NULL || entry->num_interests == 0)
+        return;
+
+    // The frame is built for the first interested link, and each link gets it once
+    char frame[sizeof(Ctrl_hdr) + sizeof(Peer_pub) + sizeof(TCP_msg)];
+    size_t len      = 0;
+    uint64_t mark   = ++federation.mark;
+
+    for (int k = 0; k < entry->num_interests; ++k)
+    {
+        Interest *interest  = &entry->interests[k];
+        Peer *peer          = interest->from;
+        if (!interest->present || peer == NULL || peer == from || peer->mark == mark)
+            continue;
+        peer->mark = mark;
+
+        // The origin node doesn't need its own publish
+        if (origin != 0 && peer->node_id == origin)
+            continue;
+
+        if (len == 0)
+        {
+            // A local publish is numbered only if it leaves this node
+            if (origin == 0)
+            {
+                origin  = federation.node_id;
+                seq     = federation.next_seq++;
+            }
+
+            if (!msg->formatted && !format_shared_msg(msg))
+                return;
+
+            Peer_pub *pub   = (Peer_pub *) (frame + sizeof(Ctrl_hdr));
+            pub->origin     = htonl(origin);
+            pub->seq        = htonl(seq);
+            pub->ttl        = ttl;
+            memcpy(pub->raw_value, msg->raw_value, RAW_VALUE_LEN);
+
+            // The message until the end of its payload
+            size_t msg_len  = offsetof(TCP_msg, udp_msg) + offsetof(UDP_msg, payload)
+                            + strnlen(msg->msg.udp_msg.payload, PAYLOAD_SIZE - 1) + 1;
+            memcpy(frame + sizeof(Ctrl_hdr) + sizeof(Peer_pub), &msg->msg, msg_len);
+            len = sizeof(Ctrl_hdr) + sizeof(Peer_pub) + msg_len;
+
+            Ctrl_hdr *hdr   = (Ctrl_hdr *) frame;
+            hdr->len        = htonl(len - sizeof(hdr->len));
+            hdr->opcode     = OP_PEER_PUBLISH;
+            hdr->count      = htons(1);
+        }
+
+        peer_send(peer, frame, len, true);
+        peer->forwarded++;
+    }
+}
+
+
+/* Apply a frame received from a peer, return 0 if the link must be closed */
+static int apply_peer_frame(Peer *peer, uint8_t opcode, int count, const char *body, size_t len)
+{
+    switch (opcode)
+    {
+        case OP_PEER_HELLO:
+            if (len < sizeof(uint32_t))
+                return 0;
+            peer->node_id = ntohl(*(uint32_t *) body);
+
+            // A node configured as its own peer (its address isn't tried again)
+            if (peer->node_id == federation.node_id)
+            {
+                if (peer->conf != NULL)
+                    peer->conf->loop = true;
+                return 0;
+            }
+            break;
+
+        case OP_INTEREST_ADD:
+        case OP_INTEREST_DEL:
+        {
+            // A frame that can't hold its records breaks the protocol
+            if (count > len / sizeof(Ctrl_rec))
+                return 0;
+
+            // Without memory, the link is closed (its interests are announced again when it comes back)
+            Action *actions = (Action *) mem_alloc(NULL, MEM_PEERS, MAX(count, 1) * sizeof(Action));
+            if (actions == NULL)
+                return 0;
+
+            int ok          = 1;
+            int num_actions = decode_ctrl_records(count, body, len, actions);
+            for (int i = 0; i < num_actions && ok; ++i)
+                ok = apply_interest(peer, &actions[i], opcode == OP_INTEREST_ADD);
+
+            mem_free(actions);
+            if (!ok)
+                return 0;
+            break;
+        }
+
+        case OP_PEER_PUBLISH:
+            apply_publish(peer, body, len);
+            break;
+
+        default:
+            // Unknown frame, skip it
+            break;
+    }
+
+    return 1;
+}
+
+
+int recv_peer_frames(Peer *peer)
+{
+    // Make room for a new chunk (without memory, the link is closed)
+    if (peer->rx_cap - peer->rx_len < CTRL_RX_CHUNK)
+    {
+        size_t rx_cap   = MAX(peer->rx_cap * 2, peer->rx_len + CTRL_RX_CHUNK);
+        char *rx_buf    = (char *) mem_realloc(NULL, MEM_PEERS, peer->rx_buf, rx_cap);
+        if (rx_buf == NULL)
+            return 0;
+
+        peer->rx_buf    = rx_buf;
+        peer->rx_cap    = rx_cap;
+    }
+
+    // An accepted link is non-blocking, it may have nothing to read after all
+    int ret = recv(peer->socket, peer->rx_buf + peer->rx_len, peer->rx_cap - peer->rx_len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 1;
+    if (ret <= 0)
+        return 0;
+    peer->rx_len += ret;
+
+    // Apply every complete frame
+    size_t off = 0;
+    while (peer->rx_len - off >= sizeof(Ctrl_hdr))
+    {
+        Ctrl_hdr *hdr   = (Ctrl_hdr *) (peer->rx_buf + off);
+        size_t len      = ntohl(hdr->len);
+        if (len < sizeof(Ctrl_hdr) - sizeof(hdr->len) || len > CTRL_MAX_FRAME)
+            return 0;
+
+        size_t frame_len = sizeof(hdr->len) + len;
+        if (peer->rx_len - off < frame_len)
+            break;
+
+        if (!apply_peer_frame(peer, hdr->opcode, ntohs(hdr->count),
+                              peer->rx_buf + off + sizeof(Ctrl_hdr), frame_len - sizeof(Ctrl_hdr)))
+            return 0;
+        off += frame_len;
+    }
+
+    // Keep only the incomplete frame
+    memmove(peer->rx_buf, peer->rx_buf + off, peer->rx_len - off);
+    peer->rx_len -= off;
+
+    return 1;
+}
+
+
+void flush_peer_output(Peer *peer)
+{
+    ssize_t ret = send(peer->socket, peer->tx_buf, peer->tx_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        // The link is broken, it's removed when its socket is read
+        peer->tx_len = 0;
+    }
+    else if (ret > 0)
+    {
+        memmove(peer->tx_buf, peer->tx_buf + ret, peer->tx_len - ret);
+        peer->tx_len -= ret;
+    }
+
+    if (peer->tx_len == 0)
+        watch_fd_output(peer->socket, false);
+}
+
+
+void remove_peer(Peer *peer)
+{
+    printf("Peer %s disconnected.\n", peer->addr);
+    unwatch_fd(peer->socket);
+    close(peer->socket);
+
+    // Remove it from the `peers` list
+    for (int i = 0; i < federation.num_peers; ++i)
+    {
+        if (federation.peers[i] == peer)
+        {
+            federation.peers[i] = federation.peers[--federation.num_peers];
+            break;
+        }
+    }
+
+    // Withdraw the interests learned through this link, on the other links too (the nodes that forward their
+    // publishes here would keep them forever); they are announced again when a link comes back
+    for (size_t i = 0; i < topic_index.num_buckets; ++i)
+    {
+        for (Topic_entry *entry = topic_index.buckets[i]; entry != NULL; entry = entry->next)
+        {
+            for (int k = 0; k < entry->num_interests; ++k)
+            {
+                Interest *interest = &entry->interests[k];
+                if (interest->from != peer)
+                    continue;
+
+                interest->from = NULL;
+                if (!interest->present)
+                    continue;
+
+                interest->present = false;
+                for (int j = 0; j < federation.num_peers; ++j)
+                    send_interest(federation.peers[j], OP_INTEREST_DEL, entry, interest->origin, interest->version);
+            }
+        }
+    }
+
+    // A configured peer is connected again
+    if (peer->conf != NULL)
+    {
+        peer->conf->peer = NULL;
+        if (!peer->conf->loop)
+            retry_peer_later(peer->conf);
+    }
+
+    mem_free(peer->rx_buf);
+    mem_free(peer->tx_buf);
+    mem_free(peer);
+}
+
+
+void print_peer_stats(FILE *file)
+{
+    fprintf(file, "Node %08x: %d peers.\n", federation.node_id, federation.num_peers);
+    for (int i = 0; i < federation.num_peers; ++i)
+    {
+        Peer *peer = federation.peers[i];
+        fprintf(file, "Peer %s (node %08x): %lu queued bytes, %lu forwarded, %lu dropped publishes.\n",
+                peer->addr, peer->node_id, peer->tx_len, peer->forwarded, peer->dropped);
+    }
+}
+
+
+void federation_destroy()
+{
+    // The sockets are closed with the other ones
+    for (int i = 0; i < federation.num_peers; ++i)
+    {
+        mem_free(federation.peers[i]->rx_buf);
+        mem_free(federation.peers[i]->tx_buf);
+        mem_free(federation.peers[i]);
+    }
+    mem_free(federation.peers);
+
+    for (int i = 0; i < federation.num_peer_addrs; ++i)
+        mem_free(federation.peer_addrs[i]);
+    mem_free(federation.peer_addrs);
+    mem_free(federation.origins);
+}
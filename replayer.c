@@ -0,0 +1,238 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+/* Replay constants */
+#define REPLAY_BATCH		64			// Maximum number of datagrams sent with a single `sendmmsg`
+#define REPLAY_SPIN_NS		50000		// Sleep only until this close to a send time, then send the due datagrams
+
+
+/* Print the correct usage of the program */
+void usage(FILE *file, const char *exec_name)
+{
+    fprintf(file, "Usage: %s [OPTIONS] [CAPTURE_FILE] [SERVER_IP] [SERVER_PORT]\n", exec_name);
+    fprintf(file, "\t--speed N\treplay N times faster than the capture (default 1)\n");
+    fprintf(file, "\t--max\t\tsend the datagrams as fast as possible\n");
+    fprintf(file, "\t--loop N\treplay the file N times (default 1)\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Sleep until the CLOCK_MONOTONIC time `when_ns` */
+static void sleep_until(uint64_t when_ns)
+{
+    struct timespec ts = {when_ns / 1000000000ULL, when_ns % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+
+/**
+ * Find the datagrams of a capture (mapped at `data`, `size` bytes)
+ * Return the number of records, their offsets are stored in `*offsets`
+*/
+static size_t index_records(const char *data, size_t size, size_t **offsets)
+{
+    Capture_file_hdr hdr;
+    DIE(size < sizeof(hdr), "[ERROR]: The capture file is too short!\n");
+    memcpy(&hdr, data, sizeof(hdr));
+    DIE(memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0, "[ERROR]: Not a capture file!\n");
+    DIE(hdr.version != CAPTURE_VERSION || hdr.record_size != sizeof(Capture_record),
+        "[ERROR]: Unsupported capture version!\n");
+
+    size_t count    = 0;
+    size_t cap      = 1024;
+    *offsets        = (size_t *) malloc(cap * sizeof(size_t));
+    DIE(*offsets == NULL, "[ERROR]: Allocation error!\n");
+
+    size_t off = sizeof(hdr);
+    while (off + sizeof(Capture_record) <= size)
+    {
+        Capture_record record;
+        memcpy(&record, data + off, sizeof(record));
+
+        // A server killed while writing leaves the last record incomplete
+        if (off + sizeof(record) + record.len > size)
+        {
+            fprintf(stderr, "The last record is truncated, it's skipped.\n");
+            break;
+        }
+
+        if (count == cap)
+        {
+            cap         *= 2;
+            *offsets    = (size_t *) realloc(*offsets, cap * sizeof(size_t));
+            DIE(*offsets == NULL, "[ERROR]: Allocation error!\n");
+        }
+        (*offsets)[count++] = off;
+        off += sizeof(record) + record.len;
+    }
+
+    return count;
+}
+
+
+int main(int argc, char *argv[])
+{
+    /* Parse the options */
+    double speed    = 1;
+    bool max_speed  = false;
+    int loops       = 1;
+
+    static struct option long_opts[] = {
+        {"speed", required_argument, NULL, 's'},
+        {"max",   no_argument,       NULL, 'm'},
+        {"loop",  required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                speed = atof(optarg);
+                if (speed <= 0)
+                    usage(stderr, argv[0]);
+                break;
+            case 'm':
+                max_speed = true;
+                break;
+            case 'l':
+                loops = atoi(optarg);
+                if (loops <= 0)
+                    usage(stderr, argv[0]);
+                break;
+            default:
+                usage(stderr, argv[0]);
+        }
+    }
+
+    /* Sanity check for arguments */
+    if (argc - optind < 3)
+        usage(stderr, argv[0]);
+
+    /* Map the capture file */
+    int fd = open(argv[optind], O_RDONLY);
+    DIE(fd < 0, "[ERROR]: Couldn't open the capture file!\n");
+
+    struct stat st;
+    int ret = fstat(fd, &st);
+    DIE(ret < 0, "[ERROR]: Couldn't read the capture file!\n");
+    DIE(st.st_size == 0, "[ERROR]: The capture file is empty!\n");
+
+    char *data = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    DIE(data == MAP_FAILED, "[ERROR]: Couldn't map the capture file!\n");
+    close(fd);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    size_t *offsets;
+    size_t count = index_records(data, st.st_size, &offsets);
+
+    /* Server address */
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family    = AF_INET;
+    serv_addr.sin_port      = htons(atoi(argv[optind + 2]));
+    ret = inet_aton(argv[optind + 1], &serv_addr.sin_addr);
+    DIE(ret == 0, "[ERROR]: Invalid server IP!\n");
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(sockfd < 0, "[ERROR]: Couldn't create the UDP socket!\n");
+
+    // The datagrams go to a single server, so the socket is connected (no address per message)
+    ret = connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
+    DIE(ret < 0, "[ERROR]: Couldn't connect the UDP socket!\n");
+
+    struct mmsghdr  msgs[REPLAY_BATCH];
+    struct iovec    iovs[REPLAY_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    uint64_t sent       = 0;
+    uint64_t bytes      = 0;
+    uint64_t late       = 0;    // Datagrams sent more than 1 ms after their time
+    uint64_t start_ns   = mono_ns();
+
+    for (int loop = 0; loop < loops && count > 0; ++loop)
+    {
+        // Each loop keeps the gaps of the capture, from its first datagram
+        Capture_record first;
+        memcpy(&first, data + offsets[0], sizeof(first));
+        uint64_t loop_ns    = mono_ns();
+        uint64_t prev_rx_ns = first.rx_ns;
+        uint64_t offset_ns  = 0;
+
+        size_t k = 0;
+        while (k < count)
+        {
+            // Gather the datagrams which are due (all of them at maximum speed)
+            int n = 0;
+            uint64_t now = mono_ns();
+            while (k < count && n < REPLAY_BATCH)
+            {
+                Capture_record record;
+                memcpy(&record, data + offsets[k], sizeof(record));
+
+                // A clock step back in the capture doesn't reorder the replay
+                if (record.rx_ns > prev_rx_ns)
+                    offset_ns += (uint64_t) ((record.rx_ns - prev_rx_ns) / speed);
+                prev_rx_ns = record.rx_ns;
+
+                uint64_t due_ns = loop_ns + offset_ns;
+                if (!max_speed && due_ns > now)
+                {
+                    // Send what's gathered first (the next pass finds this datagram again, with no gap)
+                    if (n > 0)
+                        break;
+                    if (due_ns - now > REPLAY_SPIN_NS)
+                        sleep_until(due_ns - REPLAY_SPIN_NS);
+                    while ((now = mono_ns()) < due_ns)
+                        ;
+                }
+                else if (!max_speed && now - due_ns > 1000000)
+                {
+                    late++;
+                }
+
+                iovs[n].iov_base            = (char *) data + offsets[k] + sizeof(record);
+                iovs[n].iov_len             = record.len;
+                msgs[n].msg_hdr.msg_iov     = &iovs[n];
+                msgs[n].msg_hdr.msg_iovlen  = 1;
+                bytes += record.len;
+                n++;
+                k++;
+            }
+
+            // `sendmmsg` may send only a part of the batch
+            for (int done = 0; done < n; )
+            {
+                ret = sendmmsg(sockfd, msgs + done, n - done, 0);
+                if (ret < 0 && (errno == EINTR || errno == ENOBUFS || errno == ECONNREFUSED))
+                    continue;
+                DIE(ret < 0, "[ERROR]: Couldn't send the datagrams!\n");
+                done += ret;
+            }
+            sent += n;
+        }
+    }
+
+    double elapsed = (mono_ns() - start_ns) / 1e9;
+    printf("Sent %lu datagrams (%lu bytes) in %.3f s (%.0f datagrams/s), %lu late.\n",
+           sent, bytes, elapsed, elapsed > 0 ? sent / elapsed : 0.0, late);
+
+    free(offsets);
+    munmap(data, st.st_size);
+    close(sockfd);
+    return 0;
+}
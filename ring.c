@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ring.h"
+#include "utils.h"
+
+// Memory used by the server (a ring is preallocated, outside the budget)
+extern Mem_stats mem_stats;
+
+
+void ring_init(Spsc_ring *ring, size_t num_slots, size_t slot_size)
+{
+    memset(ring, 0, sizeof(Spsc_ring));
+
+    // Round the number of slots up to a power of 2 (indexes are masked, not divided)
+    size_t count = 1;
+    while (count < num_slots)
+        count <<= 1;
+
+    ring->mask      = count - 1;
+    ring->slot_size = (slot_size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+    ring->slots     = (char *) aligned_alloc(CACHE_LINE, count * ring->slot_size);
+    DIE(ring->slots == NULL, "[ERROR]: Allocation error!\n");
+    mem_stats.fixed += count * ring->slot_size;
+
+    ring->data_efd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    DIE(ring->data_efd < 0, "[ERROR]: Couldn't create the eventfd of the ring!\n");
+
+    ring->space_efd = eventfd(0, EFD_CLOEXEC);
+    DIE(ring->space_efd < 0, "[ERROR]: Couldn't create the eventfd of the ring!\n");
+}
+
+
+void ring_destroy(Spsc_ring *ring)
+{
+    close(ring->data_efd);
+    close(ring->space_efd);
+    free(ring->slots);
+    mem_stats.fixed -= (ring->mask + 1) * ring->slot_size;
+}
+
+
+void *ring_reserve(Spsc_ring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    // Read the consumer's `tail` only when the cached one says the ring is full
+    if (head - ring->tail_cache > ring->mask)
+    {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_cache > ring->mask)
+            return NULL;
+    }
+
+    return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+
+void ring_push(Spsc_ring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+void ring_wake_consumer(Spsc_ring *ring)
+{
+    // Pairs with the store in `ring_prepare_sleep()`: one of the two sides sees the other's write
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->consumer_waiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->consumer_waiting, 0))
+    {
+        uint64_t one = 1;
+        write(ring->data_efd, &one, sizeof(one));
+    }
+}
+
+
+void ring_wait_space(Spsc_ring *ring)
+{
+    atomic_store(&ring->producer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // The consumer may have freed slots before it saw the announcement
+    if (ring_reserve(ring) != NULL)
+    {
+        atomic_store(&ring->producer_waiting, 0);
+        return;
+    }
+
+    uint64_t value;
+    read(ring->space_efd, &value, sizeof(value));
+}
+
+
+void *ring_peek(Spsc_ring *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    // Read the producer's `head` only when the cached one says the ring is empty
+    if (tail == ring->head_cache)
+    {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->head_cache)
+            return NULL;
+    }
+
+    return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+
+void ring_pop(Spsc_ring *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+
+void ring_wake_producer(Spsc_ring *ring)
+{
+    // Pairs with the store in `ring_wait_space()`
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->producer_waiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->producer_waiting, 0))
+    {
+        uint64_t one = 1;
+        write(ring->space_efd, &one, sizeof(one));
+    }
+}
+
+
+bool ring_prepare_sleep(Spsc_ring *ring)
+{
+    atomic_store(&ring->consumer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Recheck after the announcement, the producer may have pushed before it saw it
+    if (ring_peek(ring) != NULL)
+    {
+        atomic_store(&ring->consumer_waiting, 0);
+        return false;
+    }
+
+    return true;
+}
+
+
+void ring_finish_sleep(Spsc_ring *ring)
+{
+    atomic_store(&ring->consumer_waiting, 0);
+
+    uint64_t value;
+    read(ring->data_efd, &value, sizeof(value));
+}
@@ -9,32 +9,224 @@ Client **subscribers;
 size_t subs_curr_cap;
 size_t subs_max_cap;
 
+// Index of all the topics known by the server
+Topic_index topic_index;
+
+// Number of filtered subscriptions, by topic hash (read by the ingest thread)
+_Atomic int filtered_topics[FILTERED_TOPIC_SLOTS];
+
+// Ingest stage (receives and decodes the UDP datagrams and the TCP publishers' streams)
+Ingest ingest = {.pub_listener = -1};
+
+// Latency histograms of the sampled messages
+Tracer tracer;
+
+// Capture of the UDP ingest stream (disabled if its file is NULL)
+Capture capture;
+
+// Set by `SIGUSR1`, the trace file is written by the main loop
+volatile sig_atomic_t dump_trace = 0;
+
+// Descriptors watched by the main loop (the clients and peers with queued messages are also watched for writing)
+Event_loop event_loop;
+
+// Index of the clients by ID
+Client_index client_index;
+
+// This node and its links to the other servers
+Federation federation;
+
+// Socket of the multicast topics (opened if a topic has a multicast group)
+Mcast_egress mcast_egress = {.socket = -1};
+
+// Memory used by the server (and its budget)
+Mem_stats mem_stats;
+
+// Timers of the clients and of the SF topics
+Timer_wheel timers;
+
+// Heartbeat interval, idle timeout and SF expiry (and their counters)
+Timeouts timeouts = {.heartbeat_ms = DEFAULT_HEARTBEAT_MS, .idle_ms = DEFAULT_IDLE_MS};
+
+// Queue length of the listeners (`--backlog`) and their counters
+int listen_backlog = DEFAULT_BACKLOG;
+Accept_stats accept_stats;
+
+// Zero-copy writes (`--zerocopy`), their orphaned sockets and their counters
+Zerocopy zerocopy;
+
 
 /* Print the correct usage of the program */
 void usage(FILE *file, const char *exec_name)
 {
-    fprintf(file, "Usage: %s [SERVER_PORT] <VERBOSE>\n", exec_name);
+    fprintf(file, "Usage: %s [OPTIONS] [SERVER_PORT] <VERBOSE>\n", exec_name);
     fprintf(file, "\t<VERBOSE> is an optional argument: true/false\n");
+    fprintf(file, "\t--trace-sample N\ttrace the latency of 1 message in N\n");
+    fprintf(file, "\t--trace-file FILE\twrite the newest traced messages in FILE on SIGUSR1\n");
+    fprintf(file, "\t--capture FILE\t\tappend every received datagram to FILE (see `replayer`)\n");
+    fprintf(file, "\t--priority TOPIC=CLASS\tpriority class of a topic: high/normal/bulk\n");
+    fprintf(file, "\t--peer HOST:PORT\tforward the publishes to the server HOST:PORT (repeatable)\n");
+    fprintf(file, "\t--multicast TOPIC=GROUP:PORT\tdeliver a topic on a multicast group\n");
+    fprintf(file, "\t--multicast-if ADDR\toutgoing interface of the multicast datagrams (e.g. 127.0.0.1)\n");
+    fprintf(file, "\t--mem-budget BYTES[K|M|G]\tadmission control: refuse new clients and subscriptions, evict SF messages\n");
+    fprintf(file, "\t--heartbeat SECONDS\theartbeat interval of the quiet connections (default 5, 0 disables)\n");
+    fprintf(file, "\t--idle-timeout SECONDS\tdisconnect the clients that sent nothing for this long (default 15, 0 disables)\n");
+    fprintf(file, "\t--sf-ttl SECONDS\tdrop the stored SF messages older than this (default 0, kept until acknowledged)\n");
+    fprintf(file, "\t--backlog N\t\tconnections waiting in the listeners' queues (default 4096)\n");
+    fprintf(file, "\t--publish-port PORT\taccept TCP publishers on PORT (lossless, flow controlled streams of records)\n");
+    fprintf(file, "\t--zerocopy BYTES\twrite the batches of whole messages of at least BYTES with MSG_ZEROCOPY (default 0, disabled)\n");
+    fprintf(file, "\t--shm PATH\t\tgive shared rings to the same-host subscribers that connect to PATH\n");
+    fprintf(file, "\t--config FILE\t\tload the settings of FILE (e.g. `priority TOPIC CLASS`, `peer HOST:PORT`)\n");
     exit(EXIT_FAILURE);
 }
 
 
+/* `SIGUSR1` handler */
+void request_trace_dump(int signum)
+{
+    dump_trace = 1;
+}
+
+
 int main(int argc, char *argv[])
 {
+    /* Parse the options */
+    unsigned trace_sample    = 0;
+    const char *trace_file   = NULL;
+    const char *shm_path     = NULL;
+    const char *capture_path = NULL;
+
+    static struct option long_opts[] = {
+        {"trace-sample", required_argument, NULL, 's'},
+        {"trace-file",   required_argument, NULL, 'f'},
+        {"capture",      required_argument, NULL, 'C'},
+        {"priority",     required_argument, NULL, 'p'},
+        {"peer",         required_argument, NULL, 'P'},
+        {"multicast",    required_argument, NULL, 'm'},
+        {"multicast-if", required_argument, NULL, 'i'},
+        {"shm",          required_argument, NULL, 'S'},
+        {"mem-budget",   required_argument, NULL, 'M'},
+        {"heartbeat",    required_argument, NULL, 'H'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"sf-ttl",       required_argument, NULL, 'T'},
+        {"backlog",      required_argument, NULL, 'B'},
+        {"publish-port", required_argument, NULL, 'U'},
+        {"zerocopy",     required_argument, NULL, 'Z'},
+        {"config",       required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // The configured peers are kept by the federation
+    federation_init();
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:", long_opts, NULL)) != -1)
+    {
+        char *class, *group;
+        switch (opt)
+        {
+            case 's':
+                if (!parse_trace_sample(optarg, &trace_sample))
+                    usage(stderr, argv[0]);
+                break;
+            case 'f':
+                trace_file = optarg;
+                break;
+            case 'C':
+                capture_path = optarg;
+                break;
+            case 'p':
+                // The topic name ends at the last '='
+                class = strrchr(optarg, '=');
+                if (class == NULL)
+                    usage(stderr, argv[0]);
+                *class++ = '\0';
+                if (!set_topic_priority(optarg, class))
+                    usage(stderr, argv[0]);
+                break;
+            case 'm':
+                // The topic name ends at the last '='
+                group = strrchr(optarg, '=');
+                if (group == NULL)
+                    usage(stderr, argv[0]);
+                *group++ = '\0';
+                if (!set_topic_multicast(optarg, group))
+                    usage(stderr, argv[0]);
+                break;
+            case 'i':
+                if (!set_multicast_iface(optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'P':
+                if (!federation_add_peer_addr(optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'S':
+                shm_path = optarg;
+                break;
+            case 'M':
+                if (!set_mem_budget(optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'H':
+                if (!set_timeout("heartbeat", optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'I':
+                if (!set_timeout("idle-timeout", optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'T':
+                if (!set_timeout("sf-ttl", optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'B':
+                if (!set_backlog(optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'U':
+                if (!set_publish_port(optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'Z':
+                if (!set_zerocopy(optarg))
+                    usage(stderr, argv[0]);
+                break;
+            case 'c':
+                load_config(optarg);
+                break;
+            default:
+                usage(stderr, argv[0]);
+        }
+    }
+
     /* Sanity check for arguments */
-    if (argc < 2)
+    if (argc - optind < 1)
         usage(stderr, argv[0]);
 
     /* Check if the `verbose` argument was given */
-    if (argc > 2)
+    if (argc - optind > 1)
     {
-        if (strcmp(argv[2], VERBOSE_TRUE) == 0)
+        if (strcmp(argv[optind + 1], VERBOSE_TRUE) == 0)
             verbose = true;
     }
     
-    /* Convert the given port in `argv[1]` to integer */
-    int port_number = atoi(argv[1]);
-    DIE(port_number == 0, "[ERROR]: Couldn't convert the str `argv[1]` to int!\n");
+    /* Convert the given port to integer */
+    int port_number = atoi(argv[optind]);
+    DIE(port_number == 0, "[ERROR]: Couldn't convert the given port to int!\n");
+
+    /* A trace file without sampling traces every message */
+    if (trace_file != NULL && trace_sample == 0)
+        trace_sample = 1;
+    trace_init(&tracer, trace_sample, trace_file);
+
+    /* `SIGUSR1` interrupts `epoll_wait()` and writes the trace file */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_trace_dump;
+    sigemptyset(&action.sa_mask);
+    int ret = sigaction(SIGUSR1, &action, NULL);
+    DIE(ret < 0, "[ERROR]: Couldn't set the SIGUSR1 handler!\n");
 
     /* Disable buffering */
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
@@ -42,27 +234,18 @@ int main(int argc, char *argv[])
     /* Declare sockets */
     struct sockaddr_in udp_addr;    // UDP socket
     struct sockaddr_in tcp_addr;    // TCP socket
-    struct sockaddr_in sub_addr;    // Subscriber socket
-
-    /* Declare sets */
-    fd_set read_fds;    // Read set used in `select()`
-    fd_set temp_fds;    // Temporary set
-
-    /* Clear sets */
-    FD_ZERO(&read_fds); // Clear the `read_fds` set
-    FD_ZERO(&temp_fds); // Clear the `temp_fds` set
 
-    /* Socket address lengths */
-    socklen_t udp_len = sizeof(struct sockaddr_in);
-    socklen_t tcp_len = sizeof(struct sockaddr_in);
+    /* Create the epoll instance (the watched descriptors are indexed by the `event_loop` slots) */
+    event_loop_init();
+    struct epoll_event events[EVENT_BATCH];
 
 
     /* Create UDP socket */
     int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
     DIE(udp_socket < 0, "[ERROR]: Couldn't create the UDP socket!\n");
 
-    /* Create TCP socket (listener) */
-    int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+    /* Create TCP socket (listener, a burst of connections is accepted until it would block) */
+    int tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     DIE(tcp_socket < 0, "[ERROR]: Couldn't create the TCP socket!\n");
 
 
@@ -80,105 +263,251 @@ int main(int argc, char *argv[])
 
 
     /* Bind UDP socket */
-    int ret = bind(udp_socket, (struct sockaddr *) &udp_addr, sizeof(struct sockaddr));
+    ret = bind(udp_socket, (struct sockaddr *) &udp_addr, sizeof(struct sockaddr));
     DIE(ret < 0, "[ERROR]: Couldn't bind the UDP socket!\n");
 
-    /* Bind TCP socket */
+    /* Bind TCP socket (a restarted server gets its port back while the links of the old one are in TIME_WAIT) */
+    int reuse = 1;
+    ret     = setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    DIE(ret < 0, "[ERROR]: Couldn't reuse the address of the TCP socket!\n");
     ret     = bind(tcp_socket, (struct sockaddr *) &tcp_addr, sizeof(struct sockaddr));
     DIE(ret < 0, "[ERROR]: Couldn't bind the TCP socket!\n");
 
     
     /* Listen on the TCP socket for clients */
-    ret = listen(tcp_socket, BACKLOG);
+    ret = listen(tcp_socket, listen_backlog);
     DIE(ret < 0, "[ERROR]: Couldn't listen on TCP socket!\n");
 
+    /* Open the socket of the multicast topics */
+    open_mcast_socket();
+
+    /* Listen on the UNIX socket of the shared rings (same-host subscribers) */
+    int shm_socket      = -1;
+    int shm_space_efd   = -1;
+    if (shm_path != NULL)
+    {
+        struct sockaddr_un shm_addr;
+        memset(&shm_addr, 0, sizeof(shm_addr));
+        shm_addr.sun_family = AF_UNIX;
+        DIE(strlen(shm_path) >= sizeof(shm_addr.sun_path), "[ERROR]: The shared ring path is too long!\n");
+        strcpy(shm_addr.sun_path, shm_path);
+
+        // A socket left by a previous run
+        unlink(shm_path);
+
+        shm_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        DIE(shm_socket < 0, "[ERROR]: Couldn't create the UNIX socket!\n");
+
+        ret = bind(shm_socket, (struct sockaddr *) &shm_addr, sizeof(shm_addr));
+        DIE(ret < 0, "[ERROR]: Couldn't bind the UNIX socket!\n");
+
+        ret = listen(shm_socket, listen_backlog);
+        DIE(ret < 0, "[ERROR]: Couldn't listen on the UNIX socket!\n");
+
+        // Written by the subscribers when they free slots in their rings (all the rings share it)
+        shm_space_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        DIE(shm_space_efd < 0, "[ERROR]: Couldn't create the eventfd of the shared rings!\n");
+    }
+
+    /* Start the capture writer before the ingest thread, which feeds it */
+    if (capture_path != NULL)
+        DIE(!capture_start(&capture, capture_path), "[ERROR]: Couldn't open the capture file!\n");
+
+    /* Listen for the TCP publishers (read by the ingest thread) */
+    open_publish_listener(&ingest);
+
+    /* Start the ingest thread, it owns the UDP socket (and the publishers' listener) from now on */
+    ingest.udp_socket = udp_socket;
+    start_ingest_thread(&ingest);
+    int ingest_efd = ingest.ring.data_efd;
 
-    /* Add UDP, TCP and STDIN sockets in the `read_fds` set */
-    FD_SET(udp_socket,   &read_fds);
-    FD_SET(tcp_socket,   &read_fds);
-    FD_SET(STDIN_FILENO, &read_fds);
-    int fdmax       = MAX(udp_socket, tcp_socket);
-    int prev_fdmax  = fdmax;
+    /* Watch the ingest eventfd, TCP and STDIN sockets */
+    bool watched = watch_fd(ingest_efd, CONN_INGEST, NULL) && watch_fd(tcp_socket, CONN_LISTENER, NULL);
 
+    /* A STDIN that can't be watched (e.g. a regular file) gives no commands */
+    watch_fd(STDIN_FILENO, CONN_STDIN, NULL);
 
-    /* Declare UDP and TCP messages */
-    UDP_msg *udp_msg;
-    TCP_msg *tcp_msg;
-    Action  *action;
+    /* Watch the UNIX socket and the eventfd of the shared rings */
+    if (shm_socket >= 0)
+        watched = watched && watch_fd(shm_socket, CONN_SHM_LISTENER, NULL) && watch_fd(shm_space_efd, CONN_SHM_SPACE, NULL);
+    DIE(!watched, "[ERROR]: Couldn't watch the sockets!\n");
+
+    /* Start the timer wheel (heartbeats, idle timeouts, SF expiry and the reconnections of the peers) */
+    timer_wheel_init(&timers, timer_now_ms());
+
+    /* Open the links to the configured peers */
+    federation_connect_peers();
 
     /* Initialize the `subscribers` list */
     subs_curr_cap   = 0;
     subs_max_cap    = INITIAL_CAP_SUBS_LIST;
-    subscribers     = (Client **) calloc(subs_max_cap, sizeof(Client *));
+    subscribers     = (Client **) mem_alloc(NULL, MEM_CLIENTS, subs_max_cap * sizeof(Client *));
     DIE(subscribers == NULL, "[ERROR]: Allocation error!\n");
 
     char buffer[BUFF_LEN];
     while (1)
     {
-        temp_fds = read_fds;
-        ret = select(fdmax + 1, &temp_fds, NULL, NULL, NULL);
-        DIE(ret < 0, "[ERROR]: Couldn't select a socket!\n");
+        // Run the expired timers (an idle client is disconnected, its socket isn't watched anymore)
+        timer_wheel_advance(&timers, timer_now_ms(), NULL);
+
+        // Fan out the decoded messages, then block only if the ingest ring is empty
+        fanout_ingested_msgs(&ingest);
+        bool sleeping = ring_prepare_sleep(&ingest.ring);
 
-        /* Iterate through sockets */
-        for (int i = 0; i <= fdmax; ++i)
+        // A sleep lasts until the next timer at most
+        int timeout_ms = sleeping ? (int) timer_wheel_timeout_ms(&timers, timer_now_ms()) : 0;
+        int num_events = event_loop_wait(events, EVENT_BATCH, timeout_ms);
+
+        if (sleeping)
+            ring_finish_sleep(&ingest.ring);
+
+        if (dump_trace)
         {
-            if (!FD_ISSET(i, &temp_fds))
+            dump_trace = 0;
+            int count = trace_dump(&tracer);
+            if (count < 0)
+                fprintf(stderr, "[ERROR]: Couldn't write the trace file!\n");
+            else
+                printf("Wrote %d traced messages to %s.\n", count, tracer.file);
+        }
+
+        /* Iterate through the ready sockets (none if a signal interrupted the wait) */
+        for (int e = 0; e < num_events; ++e)
+        {
+            // An earlier event of the batch may have closed the socket
+            int i           = events[e].data.fd;
+            Conn_slot *slot = get_conn_slot(i);
+            if (slot == NULL)
+                continue;
+
+            // A client's (or peer's) socket has room for its queued messages
+            if (events[e].events & EPOLLOUT)
+            {
+                if (slot->kind == CONN_CLIENT)
+                    flush_client_output((Client *) slot->ptr);
+                else if (slot->kind == CONN_PEER)
+                    flush_peer_output((Peer *) slot->ptr);
+                else if (slot->kind == CONN_PEER_CONNECT)
+                    finish_peer_connect((Peer_addr *) slot->ptr);
+
+                // The slots may have moved (or the socket may be gone)
+                if ((slot = get_conn_slot(i)) == NULL)
+                    continue;
+            }
+
+            // An error or a hang up is seen by the next read
+            if (!(events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
                 continue;
 
             memset(buffer, 0, BUFF_LEN);
-            if (i == STDIN_FILENO)
+            if (slot->kind == CONN_STDIN)
             {
-                // STDIN fd (only `exit` command)
-                fscanf(stdin, "%s", buffer);
-                if (strcmp(buffer, EXIT_ACTION) == 0)
+                // STDIN fd (`exit` and `stats` commands), a closed STDIN isn't watched anymore
+                if (fscanf(stdin, "%s", buffer) == EOF)
+                    unwatch_fd(STDIN_FILENO);
+                else if (strcmp(buffer, EXIT_ACTION) == 0)
                 {
+                    unwatch_fd(ingest_efd);
+                    stop_ingest_thread(&ingest);
+                    capture_stop(&capture);
+                    trace_destroy(&tracer);
+                    federation_destroy();
                     dealloc_memory();
-                    close_sockets(fdmax, read_fds);
+                    close_sockets();
+                    if (shm_path != NULL)
+                        unlink(shm_path);
                     return 0;
                 }
+                else if (strcmp(buffer, STATS_ACTION) == 0)
+                {
+                    trace_print_stats(&tracer, stdout);
+                    capture_print_stats(&capture, stdout);
+                    print_ingest_stats(&ingest, stdout);
+                    print_subscription_stats(stdout);
+                    print_peer_stats(stdout);
+                    print_mem_stats(stdout);
+                    print_timeout_stats(stdout);
+                    print_accept_stats(stdout);
+                    print_zerocopy_stats(stdout);
+                }
+            }
+            else if (slot->kind == CONN_INGEST)
+            {
+                // Decoded messages are waiting in the ingest ring (fanned out before the next `select`)
+                continue;
             }
-            else if (i == udp_socket)
+            else if (slot->kind == CONN_SHM_SPACE)
             {
-                memset(buffer, 0, BUFF_LEN);
-                // UDP socket
-                ret = recvfrom(udp_socket, buffer, BUFF_LEN, 0, (struct sockaddr *) &udp_addr, &udp_len);
-                DIE(ret < 0, "[ERROR]: Couldn't receive data on UDP socket!\n");
-
-                // Convert from UDP to TCP packet and send the message
-                udp_msg = (UDP_msg *) buffer;
-                tcp_msg = (TCP_msg *) UDP_to_TCP(udp_msg, udp_addr);
-                DIE(tcp_msg == NULL, "[ERROR]: Couldn't convert the UDP message to TCP message!\n");
-                send_tcp_msg(tcp_msg);
+                // Subscribers freed slots in their shared rings
+                uint64_t value;
+                read(shm_space_efd, &value, sizeof(value));
+                flush_shm_clients();
             }
-            else if (i == tcp_socket)
+            else if (slot->kind == CONN_LISTENER || slot->kind == CONN_SHM_LISTENER)
             {
-                // Connection request on the listener TCP socket
-                int req_tcp_socket = accept(tcp_socket, (struct sockaddr *) &sub_addr, &tcp_len);
-                DIE(req_tcp_socket < 0, "[ERROR]: Couldn't accept a TCP client!\n");
+                // Connection requests (their IDs are received without blocking, by the handshakes)
+                accept_connections(i, slot->kind == CONN_SHM_LISTENER);
+            }
+            else if (slot->kind == CONN_HANDSHAKE)
+            {
+                // The ID of a new connection (maybe a part of it)
+                Handshake *handshake = (Handshake *) slot->ptr;
+                int ret = recv_handshake(handshake);
+                if (ret == 0)
+                {
+                    end_handshake(handshake, true);
+                    continue;
+                }
 
-                // Disable Nagle's algorithm
-                int opt = 1;
-                ret = setsockopt(req_tcp_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &opt, sizeof(int));
-                DIE(ret < 0, "[ERROR]: Couldn't disable the Nagle's algorithm!\n");
+                if (ret == 1)
+                    continue;
 
-                // Add the `req_tcp_socket` to the `read_fds` set
-                FD_SET(req_tcp_socket, &read_fds);
+                strcpy(buffer, handshake->id);
+                struct sockaddr_in sub_addr = handshake->addr;
 
-                // Update `fdmax`
-                prev_fdmax  = fdmax;
-                fdmax       = MAX(fdmax, req_tcp_socket);
+                // A same-host subscriber (already connected through TCP) asks for a shared ring, with its token
+                if (handshake->shm)
+                {
+                    Client *client = get_client_by_id(buffer);
+                    if (attach_shm_ring(client, handshake->token, i, shm_space_efd))
+                        printf("Client %s uses a shared ring.\n", client->id);
 
-                // First, receive the client's ID (this is the first thing sent by the `client` to the `server`)
-                ret = recv(req_tcp_socket, buffer, BUFF_LEN, 0);
-                DIE(ret < 0, "[ERROR]: Couldn't receive the client's ID!\n");
+                    // The ring is set, the request socket isn't needed anymore
+                    end_handshake(handshake, true);
+                    continue;
+                }
+
+                // The socket now belongs to a client (or a peer)
+                end_handshake(handshake, false);
+                int req_tcp_socket = i;
+
+                // Another server opened a link to this one
+                if (buffer[0] == PEER_ID_MARKER)
+                {
+                    char addr[PEER_ADDR_LEN];
+                    sprintf(addr, "%s:%d", inet_ntoa(sub_addr.sin_addr), ntohs(sub_addr.sin_port));
+                    if (add_peer(req_tcp_socket, addr) == NULL)
+                    {
+                        printf("Peer %s rejected: out of memory.\n", addr);
+                        unwatch_fd(req_tcp_socket);
+                        close(req_tcp_socket);
+                    }
+                    continue;
+                }
 
                 // Check for ID duplicates (another client already has this ID)
                 Client *client = get_client_by_id(buffer);
                 if (client == NULL)
                 {
-                    // Create a new `client` and add it to the `subscribers` list
-                    add_new_client(buffer, req_tcp_socket);
-                    printf("New client %s connected from %s:%d.\n", buffer, inet_ntoa(sub_addr.sin_addr), ntohs(sub_addr.sin_port));
+                    // Create a new `client` and add it to the `subscribers` list (rejected over the memory budget)
+                    if (add_new_client(buffer, req_tcp_socket))
+                        printf("New client %s connected from %s:%d.\n", buffer, inet_ntoa(sub_addr.sin_addr), ntohs(sub_addr.sin_port));
+                    else
+                    {
+                        printf("Client %s rejected: out of memory.\n", buffer);
+                        unwatch_fd(req_tcp_socket);
+                        close(req_tcp_socket);
+                    }
                 }
                 else
                 {
@@ -197,12 +526,7 @@ int main(int argc, char *argv[])
                         }
 
                         // Another client is already connected, close the socket
-                        FD_CLR(req_tcp_socket, &read_fds);
-
-                        // Use the last `fdmax`, because the current socket will be closed
-                        fdmax = prev_fdmax;
-
-                        // Close the current socket
+                        unwatch_fd(req_tcp_socket);
                         close(req_tcp_socket);
                     }
                     else
@@ -213,37 +537,39 @@ int main(int argc, char *argv[])
                     }
                 }
             }
-            else
+            else if (slot->kind == CONN_PEER_CONNECT)
             {
-                // Received a TCP message from a connected subscriber
-                ret = recv(i, buffer, sizeof(Action), 0);
-                DIE(ret < 0, "[ERROR]: Couldn't receive the message from a connected client!\n");
-                if (ret == 0)
+                // A connection to a configured peer failed
+                finish_peer_connect((Peer_addr *) slot->ptr);
+            }
+            else if (slot->kind == CONN_PEER)
+            {
+                // Received frames from a peer
+                Peer *peer = (Peer *) slot->ptr;
+                if (recv_peer_frames(peer) == 0)
+                    remove_peer(peer);
+            }
+            else if (slot->kind == CONN_CLIENT)
+            {
+                // Received control frames from a connected subscriber
+                Client *client = (Client *) slot->ptr;
+                if (recv_ctrl_frames(client) == 0)
                 {
-                    // The client stopped the communication
+                    // The client stopped the communication (its socket is closed and not watched anymore)
                     disconnect_client(i);
-
-                    // The client has disconnected, so we can close the socket
-                    FD_CLR(i, &read_fds);
-
-                    // Use the last `fdmax`, because the current socket was closed
-                    fdmax = prev_fdmax;
-                }
-                else
-                {
-                    // `subscribe` or `unsubscribe` actions
-                    action = (Action *) buffer;
-
-                    if (strcmp(action->type, SUBSCRIBE_ACTION) == 0)
-                        subscribe_to_topic(action, i);
-                    else if (strcmp(action->type, UNSUBSCRIBE_ACTION) == 0)
-                        unsubscribe_from_topic(action, i);
                 }
             }
         }
     }
 
+    unwatch_fd(ingest_efd);
+    stop_ingest_thread(&ingest);
+    capture_stop(&capture);
+    trace_destroy(&tracer);
+    federation_destroy();
     dealloc_memory();
-    close_sockets(fdmax, read_fds);
+    close_sockets();
+    if (shm_path != NULL)
+        unlink(shm_path);
     return 0;
 }
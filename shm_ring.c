@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "shm_ring.h"
+#include "utils.h"
+
+
+/* Size of the header, rounded up so the first slot starts on a cache line */
+static size_t shm_hdr_len()
+{
+    return (sizeof(Shm_ring_hdr) + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+}
+
+
+bool shm_ring_create(Shm_ring *ring, size_t num_slots, size_t slot_size)
+{
+    memset(ring, 0, sizeof(Shm_ring));
+    ring->space_efd = -1;
+
+    // Round the number of slots up to a power of 2 (indexes are masked, not divided)
+    size_t count = 1;
+    while (count < num_slots)
+        count <<= 1;
+    slot_size = (slot_size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+
+    ring->map_len   = shm_hdr_len() + count * slot_size;
+    ring->memfd     = memfd_create("pcom-ring", MFD_CLOEXEC);
+    if (ring->memfd < 0)
+        return false;
+
+    if (ftruncate(ring->memfd, ring->map_len) < 0)
+    {
+        close(ring->memfd);
+        return false;
+    }
+
+    ring->hdr = (Shm_ring_hdr *) mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (ring->hdr == MAP_FAILED)
+    {
+        close(ring->memfd);
+        return false;
+    }
+
+    // A new memfd is zeroed, so the indexes and the flags start at 0
+    // (the header only advertises the geometry, the server keeps using its own copy)
+    ring->num_slots         = count;
+    ring->slot_size         = slot_size;
+    ring->hdr->magic        = SHM_RING_MAGIC;
+    ring->hdr->num_slots    = count;
+    ring->hdr->slot_size    = slot_size;
+    ring->slots             = (char *) ring->hdr + shm_hdr_len();
+
+    ring->data_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    DIE(ring->data_efd < 0, "[ERROR]: Couldn't create the eventfd of the shared ring!\n");
+
+    return true;
+}
+
+
+bool shm_ring_attach(Shm_ring *ring, int memfd, int data_efd, int space_efd)
+{
+    memset(ring, 0, sizeof(Shm_ring));
+    ring->memfd     = -1;
+    ring->data_efd  = data_efd;
+    ring->space_efd = space_efd;
+
+    struct stat st;
+    if (fstat(memfd, &st) < 0 || st.st_size < shm_hdr_len())
+    {
+        close(memfd);
+        return false;
+    }
+
+    ring->map_len   = st.st_size;
+    ring->hdr       = (Shm_ring_hdr *) mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (ring->hdr == MAP_FAILED)
+    {
+        ring->hdr = NULL;
+        return false;
+    }
+
+    // The slots must fit in the mapping (the geometry is read once)
+    ring->num_slots = ring->hdr->num_slots;
+    ring->slot_size = ring->hdr->slot_size;
+    ring->slots     = (char *) ring->hdr + shm_hdr_len();
+    return ring->hdr->magic == SHM_RING_MAGIC && ring->num_slots > 0 && (ring->num_slots & (ring->num_slots - 1)) == 0
+        && shm_hdr_len() + (size_t) ring->num_slots * ring->slot_size <= ring->map_len;
+}
+
+
+void shm_ring_destroy(Shm_ring *ring)
+{
+    if (ring->hdr != NULL)
+        munmap(ring->hdr, ring->map_len);
+    if (ring->memfd >= 0)
+        close(ring->memfd);
+    if (ring->data_efd >= 0)
+        close(ring->data_efd);
+    if (ring->space_efd >= 0)
+        close(ring->space_efd);
+}
+
+
+void *shm_ring_reserve(Shm_ring *ring)
+{
+    uint64_t head = ring->head;
+
+    // Read the consumer's `tail` only when the cached one says the ring is full
+    if (head - ring->tail_cache >= ring->num_slots)
+    {
+        // A broken consumer may write anything there: a `tail` ahead of `head` means an empty ring,
+        // one more than `num_slots` behind means a full ring
+        uint64_t tail = atomic_load_explicit(&ring->hdr->tail, memory_order_acquire);
+        if ((int64_t) (head - tail) < 0)
+            tail = head;
+        else if (head - tail > ring->num_slots)
+            tail = head - ring->num_slots;
+
+        ring->tail_cache = tail;
+        if (head - tail >= ring->num_slots)
+            return NULL;
+    }
+
+    return ring->slots + (head & (ring->num_slots - 1)) * ring->slot_size;
+}
+
+
+void shm_ring_push(Shm_ring *ring)
+{
+    ring->head++;
+    atomic_store_explicit(&ring->hdr->head, ring->head, memory_order_release);
+}
+
+
+void shm_ring_wake_reader(Shm_ring *ring)
+{
+    // Pairs with the store in `shm_ring_prepare_sleep()`: one of the two sides sees the other's write
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->hdr->reader_waiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->hdr->reader_waiting, 0))
+    {
+        uint64_t one = 1;
+        write(ring->data_efd, &one, sizeof(one));
+    }
+}
+
+
+bool shm_ring_prepare_wait(Shm_ring *ring)
+{
+    atomic_store(&ring->hdr->writer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // The consumer may have freed slots before it saw the announcement
+    if (shm_ring_reserve(ring) != NULL)
+    {
+        atomic_store(&ring->hdr->writer_waiting, 0);
+        return false;
+    }
+
+    return true;
+}
+
+
+void shm_ring_finish_wait(Shm_ring *ring)
+{
+    atomic_store(&ring->hdr->writer_waiting, 0);
+}
+
+
+void *shm_ring_peek(Shm_ring *ring)
+{
+    uint64_t tail = atomic_load_explicit(&ring->hdr->tail, memory_order_relaxed);
+
+    // Read the producer's `head` only when the cached one says the ring is empty
+    if (tail == ring->head_cache)
+    {
+        ring->head_cache = atomic_load_explicit(&ring->hdr->head, memory_order_acquire);
+        if (tail == ring->head_cache)
+            return NULL;
+    }
+
+    return ring->slots + (tail & (ring->num_slots - 1)) * ring->slot_size;
+}
+
+
+void shm_ring_pop(Shm_ring *ring)
+{
+    uint64_t tail = atomic_load_explicit(&ring->hdr->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->hdr->tail, tail + 1, memory_order_release);
+}
+
+
+void shm_ring_wake_writer(Shm_ring *ring)
+{
+    // Pairs with the store in `shm_ring_prepare_wait()`
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->hdr->writer_waiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->hdr->writer_waiting, 0))
+    {
+        uint64_t one = 1;
+        write(ring->space_efd, &one, sizeof(one));
+    }
+}
+
+
+bool shm_ring_prepare_sleep(Shm_ring *ring)
+{
+    atomic_store(&ring->hdr->reader_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Recheck after the announcement, the producer may have pushed before it saw it
+    if (shm_ring_peek(ring) != NULL)
+    {
+        atomic_store(&ring->hdr->reader_waiting, 0);
+        return false;
+    }
+
+    return true;
+}
+
+
+void shm_ring_finish_sleep(Shm_ring *ring)
+{
+    atomic_store(&ring->hdr->reader_waiting, 0);
+
+    uint64_t value;
+    read(ring->data_efd, &value, sizeof(value));
+}
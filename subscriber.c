@@ -1,4 +1,6 @@
 #include "utils.h"
+#include "pcomsub.h"
+
 
 /* Return the appropriate string, given the type as integer */
 char *enum_to_str(uint8_t type)
@@ -21,25 +23,89 @@ char *enum_to_str(uint8_t type)
 }
 
 
+/* Display a message received from the server */
+void print_msg(Pcomsub *sub, const Pcomsub_msg *msg, void *user)
+{
+    printf("%s:%d - %.*s - %s - %s\n", msg->ip, msg->port, (int) msg->topic_len, msg->topic,
+                                       enum_to_str(msg->type), msg->payload);
+}
+
+
+/* Display a text sent by the server (e.g. an error) */
+void print_notice(Pcomsub *sub, const char *text, void *user)
+{
+    printf("%s", text);
+}
+
+
+/* Display a fallback of the library */
+void print_warning(Pcomsub *sub, const char *text, void *user)
+{
+    fprintf(stderr, "%s\n", text);
+}
+
+
+/* Split `line` in whitespace separated tokens, return the number of tokens */
+int split_tokens(char *line, char **tokens, int max_tokens)
+{
+    int num_tokens = 0;
+    for (char *aux = strtok(line, " \t\n"); aux != NULL && num_tokens < max_tokens; aux = strtok(NULL, " \t\n"))
+        tokens[num_tokens++] = aux;
+
+    return num_tokens;
+}
+
+
+/* Join `num_tokens` tokens in `text`, separated by spaces */
+void join_tokens(char **tokens, int num_tokens, char *text)
+{
+    text[0] = '\0';
+    for (int i = 0; i < num_tokens; ++i)
+    {
+        if (i > 0)
+            strcat(text, " ");
+        strcat(text, tokens[i]);
+    }
+}
+
+
 /* Print the correct usage of the program */
 void usage(FILE *file, const char *exec_name)
 {
-    //                         argv[1]     argv[2]      argv[3]
-    fprintf(file, "Usage: %s [CLIENT_ID] [SERVER_IP] [SERVER_PORT]\n", exec_name);
+    //                                   argv[1]     argv[2]      argv[3]
+    fprintf(file, "Usage: %s [OPTIONS] [CLIENT_ID] [SERVER_IP] [SERVER_PORT]\n", exec_name);
+    fprintf(file, "\t--shm PATH\treceive the messages through a shared ring (the server runs with `--shm PATH`)\n");
     exit(EXIT_FAILURE);
 }
 
 
 int main(int argc, char *argv[])
 {
+    /* Parse the options */
+    const char *shm_path = NULL;
+
+    static struct option long_opts[] = {
+        {"shm", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1)
+    {
+        if (opt == 's')
+            shm_path = optarg;
+        else
+            usage(stderr, argv[0]);
+    }
+
     /* Sanity check for arguments */
-    if (argc < 3)
+    if (argc - optind < 3)
         usage(stderr, argv[0]);
 
     /* Rename the arguments */
-    char *client_id   = argv[1];
-    char *server_ip   = argv[2];
-    char *server_port = argv[3];
+    char *client_id   = argv[optind];
+    char *server_ip   = argv[optind + 1];
+    char *server_port = argv[optind + 2];
 
     /* Convert the given port in `argv[3]` to integer */
     int port_number = atoi(server_port);
@@ -47,161 +113,115 @@ int main(int argc, char *argv[])
 
     /* Disable buffering */
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
-    
-    /* Declare server socket */
-    struct sockaddr_in serv_addr;
-
-    /* Declare sets */
-    fd_set read_fds;    // Read set used in `select()`
-    fd_set temp_fds;    // Temporary set
-
-    /* Clear sets */
-    FD_ZERO(&read_fds); // Clear the `read_fds` set
-    FD_ZERO(&temp_fds); // Clear the `temp_fds` set
-
-    /* Create server socket */
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    DIE(sockfd < 0, "[ERROR]: Couldn't create the server socket!\n");
-
-    /* Initialize server socket */
-	memset((char *) &serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family         = AF_INET;
-	serv_addr.sin_port           = htons(port_number);
-	int ret                      = inet_aton(server_ip, &serv_addr.sin_addr);
-    DIE(ret == 0, "[ERROR]: Couldn't convert the `server ip` from dotted format into binary form!\n");
-
-    /* Add server and STDIN sockets in the `read_fds` set */
-    FD_SET(sockfd,  &read_fds);
-    FD_SET(STDIN_FILENO, &read_fds);
-
-    /* Connect to the server */
-    ret = connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
-    DIE(ret < 0, "[ERROR]: Couldn't connect to the server!\n");
-
-    /* First, send the cilent's ID */
-    ret = send(sockfd, client_id, ID_CLIENT_LEN, 0);
-    DIE(ret < 0, "[ERROR]: Couldn't send the client's ID to the server!\n");
-
-    /* Disable Nagle's algorithm */
-    int opt = 1;
-    ret = setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *) &opt, sizeof(int));
-    DIE(ret < 0, "[ERROR]: Couldn't disable the Nagle's algorithm!\n");
-
-    /* Declare an TCP message */
-    TCP_msg *tcp_msg;
-
-    /* Declare an action */
-    Action action;
-    
-    char action_buffer[BUFF_LEN];
-    char tcp_msg_buffer[TCP_MSG_SIZE];
+
+    /* Connect to the server (the library sends the ID and asks for the stored SF messages) */
+    Pcomsub_callbacks callbacks = {print_msg, print_notice, print_warning};
+    Pcomsub *sub = pcomsub_connect(client_id, server_ip, port_number, shm_path, &callbacks, NULL);
+    DIE(sub == NULL, "[ERROR]: Couldn't connect to the server!\n");
+
+    /* Descriptors to poll: STDIN, then the ones of the connection */
+    int max_fds = 1 + pcomsub_num_fds(sub);
+    struct pollfd *fds = (struct pollfd *) malloc(max_fds * sizeof(struct pollfd));
+    DIE(fds == NULL, "[ERROR]: Allocation error!\n");
+
+    /* Tokens of a command (the command itself and its arguments) */
+    char **tokens = (char **) calloc(CMD_LINE_LEN / 2, sizeof(char *));
+    DIE(tokens == NULL, "[ERROR]: Allocation error!\n");
+
+    char *action_buffer = (char *) malloc(CMD_LINE_LEN);
+    DIE(action_buffer == NULL, "[ERROR]: Allocation error!\n");
+
+    char *opts_text = (char *) malloc(CMD_LINE_LEN);
+    DIE(opts_text == NULL, "[ERROR]: Allocation error!\n");
     while (1)
     {
-        temp_fds = read_fds;
-        ret = select(sockfd + 1, &temp_fds, NULL, NULL, NULL);
-        DIE(ret < 0, "[ERROR]: Couldn't select a socket!\n");
+        // The joined multicast groups add descriptors
+        if (max_fds < 1 + pcomsub_num_fds(sub))
+        {
+            max_fds = 2 * (1 + pcomsub_num_fds(sub));
+            fds     = (struct pollfd *) realloc(fds, max_fds * sizeof(struct pollfd));
+            DIE(fds == NULL, "[ERROR]: Reallocation error!\n");
+        }
+
+        int timeout_ms  = -1;
+        fds[0]          = (struct pollfd) {STDIN_FILENO, POLLIN, 0};
+        int num_fds     = pcomsub_poll_fds(sub, fds + 1, max_fds - 1, &timeout_ms);
+        DIE(num_fds < 0, "[ERROR]: Couldn't poll the connection!\n");
+
+        int ret = poll(fds, 1 + num_fds, timeout_ms);
+        DIE(ret < 0 && errno != EINTR, "[ERROR]: Couldn't poll the sockets!\n");
 
-        if (FD_ISSET(STDIN_FILENO, &temp_fds))
+        // Messages, acks and heartbeats of the connection
+        if (pcomsub_dispatch(sub, fds + 1, ret < 0 ? 0 : num_fds) < 0)
+        {
+            if (errno == ETIMEDOUT)
+                fprintf(stderr, "Server timed out.\n");
+            else
+                DIE(errno != ECONNRESET, "[ERROR]: Couldn't receive the TCP message from the server!\n");
+            break;
+        }
+
+        if (ret > 0 && (fds[0].revents & (POLLIN | POLLHUP)))
         {
             /* Client sends something to the server (STDIN) */
-            memset(action_buffer, 0, BUFF_LEN);
-            fgets(action_buffer, BUFF_LEN - 1, stdin);
+            memset(action_buffer, 0, CMD_LINE_LEN);
+            if (fgets(action_buffer, CMD_LINE_LEN - 1, stdin) == NULL)
+                break;
             if (strncmp(action_buffer, EXIT_ACTION, strlen(EXIT_ACTION)) == 0)
                 break;
 
-            if (strncmp(action_buffer, SUBSCRIBE_ACTION, strlen(SUBSCRIBE_ACTION)) == 0)
+            int num_tokens = split_tokens(action_buffer, tokens, CMD_LINE_LEN / 2);
+            if (num_tokens == 0)
+                continue;
+
+            if (strcmp(tokens[0], SUBSCRIBE_ACTION) == 0)
             {
-                // Action format: subscribe <TOPIC> <SF>
-                char *aux = strtok(action_buffer, " "); // subscribe
-                if (aux == NULL)
-                    continue;
-                strcpy(action.type, aux);
-                
-                aux = strtok(NULL, " ");                // <TOPIC>
-                if (aux == NULL)
+                // Action format: subscribe <TOPIC> [<TOPIC> ...] <SF> [<OPTION> ...]
+                // The options start at the first `key=value` or `if` token
+                int num_args = 2;
+                while (num_args < num_tokens && strchr(tokens[num_args], '=') == NULL && strcmp(tokens[num_args], "if") != 0)
+                    num_args++;
+
+                int num_topics = num_args - 2;
+                if (num_topics < 1)
                     continue;
-                strcpy(action.topic, aux);
 
-                aux = strtok(NULL, " ");                // <SF>
-                if (aux == NULL)
+                // Send all the topics in a single frame
+                join_tokens(tokens + num_args, num_tokens - num_args, opts_text);
+                if (pcomsub_subscribe(sub, (const char **) tokens + 1, num_topics, atoi(tokens[num_args - 1]), opts_text) < 0)
+                {
+                    fprintf(stderr, "Invalid subscribe option.\n");
                     continue;
-                if (aux[strlen(aux) - 1] == '\n')
-                    aux[strlen(aux) - 1] =  '\0';
-                action.sf = atoi(aux);
+                }
 
-                // Send the `action` to the `server`
-                ret = send(sockfd, (char *) &action, sizeof(Action), 0);
-                DIE(ret < 0, "[ERROR]: Couldn't send the `action` to the `server`!\n");
-
-                printf("Subscribed to topic.\n");
+                if (num_topics == 1)
+                    printf("Subscribed to topic.\n");
+                else
+                    printf("Subscribed to %d topics.\n", num_topics);
             }
-            else if (strncmp(action_buffer, UNSUBSCRIBE_ACTION, strlen(UNSUBSCRIBE_ACTION)) == 0)
+            else if (strcmp(tokens[0], UNSUBSCRIBE_ACTION) == 0)
             {
-                // Action format: unsubscribe <TOPIC>
-                char *aux = strtok(action_buffer, " "); // unsubscribe
-                if (aux == NULL)
-                    continue;
-                strcpy(action.type, aux);
-                
-                aux = strtok(NULL, " ");                // <TOPIC>
-                if (aux == NULL)
+                // Action format: unsubscribe <TOPIC> [<TOPIC> ...]
+                int num_topics = num_tokens - 1;
+                if (num_topics < 1)
                     continue;
-                if (aux[strlen(aux) - 1] == '\n')
-                    aux[strlen(aux) - 1] =  '\0';
-                strcpy(action.topic, aux);
-            
-                // Send the `action` to the `server`
-                ret = send(sockfd, (char *) &action, sizeof(Action), 0);
-                DIE(ret < 0, "[ERROR]: Couldn't send the `action` to the `server`!\n");
-
-                printf("Unsubscribed from topic.\n");
-            }
-        }
-        else if (FD_ISSET(sockfd, &temp_fds))
-        {
-            /* Client received something (size of the packet) from the server */
-            memset(tcp_msg_buffer, 0, TCP_MSG_SIZE + 1);
-            ret = recv(sockfd, tcp_msg_buffer, MAX_DIGITS_TCP_MSG_LEN, 0);
-            DIE(ret < 0, "[ERROR]: Couldn't receive the size of the TCP message from the server!\n");
-
-            // Server closed the `main` connection
-            if (ret == 0)
-                break;
-            
-            int size = atoi(tcp_msg_buffer);
-            DIE(size == 0, "[ERROR]: Couldn't convert the TCP message size from `str` to `int`!\n");
-
-            // Receive the actual message
-            memset(tcp_msg_buffer, 0, TCP_MSG_SIZE + 1);
-            int got = 0;
-            while (got < size)
-            {
-                ret = recv(sockfd, tcp_msg_buffer, size, 0);
-                DIE(ret < 0, "[ERROR]: Couldn't receive the TCP message from the server!\n");
 
-                // Server closed the `main` connection
-                if (ret == 0)
-                    break;
+                pcomsub_unsubscribe(sub, (const char **) tokens + 1, num_topics);
 
-                got += ret;
+                if (num_topics == 1)
+                    printf("Unsubscribed from topic.\n");
+                else
+                    printf("Unsubscribed from %d topics.\n", num_topics);
             }
-
-            // Convert the bitstream to TCP_msg struct
-            tcp_msg = (TCP_msg *) tcp_msg_buffer;
-
-            if (!tcp_msg->from_server)
-            {
-                // Display the received message
-                printf("%s:%d - %s - %s - %s\n", tcp_msg->ip, tcp_msg->port, tcp_msg->udp_msg.topic,
-                                                 enum_to_str(tcp_msg->udp_msg.type), tcp_msg->udp_msg.payload);
-            }
-            else
-                printf("%s", tcp_msg->udp_msg.payload);
-
         }
     }
 
-    // Close the socket
-    close(sockfd);
+    // Acknowledge everything that was displayed, so it isn't replayed
+    pcomsub_close(sub);
+
+    free(opts_text);
+    free(action_buffer);
+    free(tokens);
+    free(fds);
     return 0;
 }
@@ -5,6 +5,8 @@ import time
 import os
 import pprint
 import json
+import socket
+import struct
 
 from contextlib import contextmanager
 from subprocess import Popen, PIPE, STDOUT
@@ -23,6 +25,45 @@ udp_client_path = "pcom_hw2_udp_client"
 # default size of test output line
 test_output_line_size = 40
 
+# a client of `libpcomsub`: ./pcomsub_client ID PORT DURATION_MS [SF_TOPIC], prints the payloads it receives
+pcomsub_client_src = r"""
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pcomsub.h"
+
+static void on_msg(Pcomsub *sub, const Pcomsub_msg *msg, void *user)
+{
+    printf("%.*s - %s - %u\n", (int) msg->topic_len, msg->topic, msg->payload, msg->seq);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    Pcomsub_callbacks callbacks = {on_msg, NULL, NULL};
+    Pcomsub *sub = pcomsub_connect(argv[1], "127.0.0.1", atoi(argv[2]), NULL, &callbacks, NULL);
+    if (sub == NULL)
+        return 1;
+    if (argc > 4)
+        pcomsub_subscribe(sub, (const char **) &argv[4], 1, 1, NULL);
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        struct pollfd fds[8];
+        int timeout_ms  = 50;
+        int num_fds     = pcomsub_poll_fds(sub, fds, 8, &timeout_ms);
+        poll(fds, num_fds, timeout_ms);
+        if (pcomsub_dispatch(sub, fds, num_fds) < 0)
+            return 1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < atoi(argv[3]));
+
+    pcomsub_close(sub);
+    return 0;
+}
+"""
+
 ####### Test utils #######
 # dictionary containing test IDs and their statuses
 tests = {
@@ -47,6 +88,45 @@ tests = {
   "c2_restart_sf": "not executed",
   "quick_flow": "not executed",
   "server_stop": "not executed",
+  "frame_split": "not executed",
+  "frame_oversized": "not executed",
+  "frame_count": "not executed",
+  "sf_resume_order": "not executed",
+  "sf_resume_acked": "not executed",
+  "federation_forward": "not executed",
+  "federation_withdraw": "not executed",
+  "federation_reconnect": "not executed",
+  "shm_ring": "not executed",
+  "shm_fallback": "not executed",
+  "publish_batch": "not executed",
+  "publish_tcp": "not executed",
+  "timer_heartbeat": "not executed",
+  "timer_idle": "not executed",
+  "timer_sf_ttl": "not executed",
+  "mem_evict": "not executed",
+  "mem_refuse": "not executed",
+  "mem_alive": "not executed",
+  "filter_int": "not executed",
+  "throttle_rate": "not executed",
+  "throttle_every": "not executed",
+  "priority_lanes": "not executed",
+  "mcast_delivery": "not executed",
+  "mcast_repair": "not executed",
+  "capture_replay": "not executed",
+  "pcomsub_delivery": "not executed",
+  "pcomsub_sf_resume": "not executed",
+  "handshake_stalled": "not executed",
+  "handshake_aborted": "not executed",
+  "handshake_timeout": "not executed",
+  "alias_announce": "not executed",
+  "alias_decode": "not executed",
+  "zerocopy_delivery": "not executed",
+  "zerocopy_orphan": "not executed",
+  "sub_churn_delivery": "not executed",
+  "sub_churn_replay": "not executed",
+  "sub_churn_shrink": "not executed",
+  "ingest_overflow": "not executed",
+  "ingest_order": "not executed",
 }
 
 def pass_test(test):
@@ -323,6 +403,115 @@ def check_two_subscribers(c1, c2, topics, topic_id):
   success = check_subscriber_output(c1, "1", target)
   return check_subscriber_output(c2, "2", target) and success
 
+def start_server_on(server_port, args=[]):
+  """Starts another server (with extra arguments) on its own port."""
+  server = Process(["./server"] + args + [server_port])
+  server.start()
+  sleep(1)
+  return server
+
+def start_subscriber_on(id, server_port, args=[]):
+  """Starts a subscriber connected to the server on another port."""
+  client = Process(["./subscriber"] + args + [id, ip, server_port])
+  client.start()
+  sleep(1)
+  return client
+
+def stop_process(proc):
+  """Stops a server or a subscriber with `exit` (or kills it if it doesn't stop)."""
+  if proc.is_alive():
+    proc.send_input("exit")
+    sleep(0.5)
+  proc.finish()
+
+def wait_for_output(proc, target, tout=2, error=False):
+  """Reads lines of a process until one contains `target`, returns that line (or False on a timeout)."""
+  while True:
+    out = proc.get_error_timeout(tout) if error else proc.get_output_timeout(tout)
+    if out == "timeout" or out == "":
+      return False
+    if target in out:
+      return out
+
+def send_string(server_port, topic, value):
+  """Sends a single STRING message to a server on another port."""
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  sock.sendto(topic.encode().ljust(50, b"\0") + bytes([3]) + value.encode(), (ip, int(server_port)))
+  sock.close()
+
+def ctrl_frame(opcode, topics, sf=0, opts=b""):
+  """Builds a control frame: [len][opcode][count], then a (topic_len, sf, opts_len) record per topic."""
+  body = bytes([opcode]) + struct.pack("!H", len(topics))
+  for topic in topics:
+    body += bytes([len(topic), sf, len(opts)]) + topic.encode() + opts
+  return struct.pack("!I", len(body)) + body
+
+def recv_frames(sock, tout=1):
+  """Receives the stream of a raw TCP client until it's quiet, splits it into messages (each one after its size)."""
+  sock.settimeout(tout)
+  data = b""
+  try:
+    while True:
+      chunk = sock.recv(65536)
+      if not chunk:
+        break
+      data += chunk
+  except socket.timeout:
+    pass
+
+  # Every message is its size (10 bytes) and a `TCP_msg` (or an `Alias_hdr` and its payload)
+  frames = []
+  off = 0
+  while off + 10 <= len(data):
+    size = int(data[off:off + 10].split(b"\0")[0])
+    frames.append(data[off + 10:off + 10 + size])
+    off += 10 + size
+  return frames
+
+def recv_msgs(sock, tout=1):
+  """Receives the messages of a raw TCP client until it's quiet, returns their (from_server, type, topic, payload)."""
+  return [(msg[28], msg[83], msg[33:83].split(b"\0")[0].decode(), msg[84:].split(b"\0")[0].decode())
+          for msg in recv_frames(sock, tout)]
+
+def recv_topics(sock, tout=1):
+  """Receives the messages of a raw TCP client until it's quiet, returns their (topic, payload) pairs."""
+  # The server's own messages are skipped
+  return [(topic, payload) for from_server, _, topic, payload in recv_msgs(sock, tout) if from_server == 0]
+
+def check_publish_path(client, id, topics, server_port, args):
+  """Publishes one message per topic with extra UDP client arguments, checks that the subscriber receives them."""
+  print("Generating one message for each topic (" + " ".join(args) + ")")
+  for topic in topics:
+    client.send_input("subscribe " + topic.name + " 0")
+    wait_for_output(client, "Subscribed to topic.")
+
+  udpcl = Process(["python3", "udp_client.py"] + args + [ip, server_port], udp_client_path)
+  udpcl.start()
+  while udpcl.get_output_timeout(1) not in ["", "timeout"]:
+    pass
+  udpcl.finish()
+
+  success = True
+  for topic in topics:
+    success = check_subscriber_output(client, id, topic.print()) and success
+  return success
+
+def send_int(server_port, topic, value):
+  """Sends a single INT message to a server on another port."""
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  sock.sendto(topic.encode().ljust(50, b"\0") + bytes([0, 1 if value < 0 else 0]) + struct.pack("!I", abs(value)),
+              (ip, int(server_port)))
+  sock.close()
+
+def read_values(client, topic, type="INT"):
+  """Reads the values a subscriber prints for a topic, until it's quiet."""
+  values = []
+  while True:
+    out = client.get_output_timeout(1)
+    if topic + " - " + type + " - " not in out:
+      return values
+    values.append(out.split(" - ")[-1].strip())
+
 ####### Test functions #######
 def run_test_compile():
   """Tests that the server and subscriber compile."""
@@ -618,6 +807,939 @@ def run_test_server_stop(server, c1):
   if success:
     pass_test("server_stop")
 
+def run_test_frames():
+  """Tests the parsing of the control frames sent by a raw TCP client."""
+  fail_test("frame_split")
+  fail_test("frame_oversized")
+  fail_test("frame_count")
+  frame_port = "12350"
+
+  print("Starting a server for the control frames")
+  server = start_server_on(frame_port)
+
+  # Two frames (subscribe to three topics, unsubscribe from one) written a few bytes at a time
+  print("Sending two control frames in 3-byte chunks")
+  sock = socket.create_connection((ip, int(frame_port)))
+  sock.sendall(b"F1".ljust(10, b"\0") + b"\0")
+  data = ctrl_frame(1, ["frame_a", "frame_b", "frame_c"]) + ctrl_frame(2, ["frame_c"])
+  for i in range(0, len(data), 3):
+    sock.sendall(data[i:i + 3])
+    sleep(0.01)
+  sleep(0.5)
+
+  for topic in ["frame_a", "frame_b", "frame_c"]:
+    send_string(frame_port, topic, "value of " + topic)
+
+  msgs = recv_topics(sock)
+  if msgs == [("frame_a", "value of frame_a"), ("frame_b", "value of frame_b")]:
+    pass_test("frame_split")
+  else:
+    print("Error: F1 received " + str(msgs))
+  sock.close()
+
+  # A frame over the maximum size closes the connection
+  print("Sending an oversized control frame")
+  sock = socket.create_connection((ip, int(frame_port)))
+  sock.sendall(b"F2".ljust(10, b"\0") + b"\0")
+  sock.sendall(struct.pack("!IBH", (1 << 20) + 1, 1, 1))
+  sock.settimeout(2)
+  try:
+    closed = sock.recv(100) == b""
+  except ConnectionResetError:
+    closed = True
+  except socket.timeout:
+    closed = False
+
+  if closed:
+    pass_test("frame_oversized")
+  else:
+    print("Error: the connection of F2 wasn't closed")
+  sock.close()
+
+  # A frame with more records announced than it can hold is refused (without counting them)
+  print("Sending a control frame with a forged record count")
+  sock = socket.create_connection((ip, int(frame_port)))
+  sock.sendall(b"F3".ljust(10, b"\0") + b"\0")
+  forged = ctrl_frame(1, ["frame_d"])
+  sock.sendall(forged[:5] + struct.pack("!H", 65535) + forged[7:])
+  sleep(0.5)
+  send_string(frame_port, "frame_d", "forged")
+  refused = recv_topics(sock) == []
+
+  sock.sendall(ctrl_frame(1, ["frame_d"]))
+  sleep(0.5)
+  send_string(frame_port, "frame_d", "valid")
+  msgs = recv_topics(sock)
+  server.send_input("stats")
+  if refused and msgs == [("frame_d", "valid")] and wait_for_output(server, "Refused subscriptions: 0"):
+    pass_test("frame_count")
+  else:
+    print("Error: F3 received " + str(msgs) + " after a forged count")
+  sock.close()
+
+  stop_process(server)
+
+def run_test_sf_resume():
+  """Tests that a subscriber gets its missed SF messages in order on resume, and the acked ones only once."""
+  fail_test("sf_resume_order")
+  fail_test("sf_resume_acked")
+  sf_port = "12351"
+
+  print("Starting a server for the SF resume")
+  server = start_server_on(sf_port)
+  c = start_subscriber_on("S1", sf_port)
+  c.send_input("subscribe sf_topic 1")
+  if not wait_for_output(c, "Subscribed to topic."):
+    print("Error: S1 not subscribed to sf_topic")
+  stop_process(c)
+
+  # The messages published while S1 is away come back in their order
+  print("Generating five SF messages while S1 is disconnected")
+  for i in range(5):
+    send_string(sf_port, "sf_topic", "sf" + str(i))
+    sleep(0.05)
+
+  c = start_subscriber_on("S1", sf_port)
+  ok = True
+  for i in range(5):
+    ok = check_subscriber_output(c, "S1", "sf_topic - STRING - sf" + str(i)) and ok
+  if ok:
+    pass_test("sf_resume_order")
+
+  # Once acknowledged, they aren't replayed by the next resume
+  sleep(1)
+  stop_process(c)
+  send_string(sf_port, "sf_topic", "sf5")
+  sleep(0.2)
+
+  c = start_subscriber_on("S1", sf_port)
+  if check_subscriber_output(c, "S1", "sf_topic - STRING - sf5"):
+    extra = c.get_output_timeout(1)
+    if extra == "timeout":
+      pass_test("sf_resume_acked")
+    else:
+      print("Error: S1 received [" + extra.rstrip() + "] again")
+
+  stop_process(c)
+  stop_process(server)
+
+def run_test_federation():
+  """Tests the forwarding between several servers linked with `--peer`."""
+  fail_test("federation_forward")
+  fail_test("federation_withdraw")
+  fail_test("federation_reconnect")
+  port_a, port_b, port_c, port_d = "12352", "12353", "12354", "12355"
+
+  # A <- B: a publish on A reaches the subscriber of B
+  print("Starting two linked servers")
+  server_a = start_server_on(port_a)
+  server_b = start_server_on(port_b, ["--peer", ip + ":" + port_a])
+  c = start_subscriber_on("P1", port_b)
+  c.send_input("subscribe fed_topic 0")
+  wait_for_output(c, "Subscribed to topic.")
+  sleep(0.5)
+
+  send_string(port_a, "fed_topic", "from A")
+  if check_subscriber_output(c, "P1", "fed_topic - STRING - from A"):
+    pass_test("federation_forward")
+
+  # Once the subscriber unsubscribes, A stops forwarding the topic (its link counts only the first publish)
+  c.send_input("unsubscribe fed_topic")
+  wait_for_output(c, "Unsubscribed from topic.")
+  stop_process(c)
+  sleep(0.5)
+  send_string(port_a, "fed_topic", "nobody")
+  sleep(0.5)
+  server_a.send_input("stats")
+  if wait_for_output(server_a, "1 forwarded"):
+    pass_test("federation_withdraw")
+  else:
+    print("Error: A forwarded a topic without subscribers")
+
+  # C is started before its peer D: the link comes up when D does
+  print("Starting a server before its peer")
+  server_c = start_server_on(port_c, ["--peer", ip + ":" + port_d])
+  c = start_subscriber_on("P2", port_c)
+  c.send_input("subscribe fed_late 0")
+  wait_for_output(c, "Subscribed to topic.")
+  server_d = start_server_on(port_d)
+  sleep(3)
+
+  send_string(port_d, "fed_late", "from D")
+  if check_subscriber_output(c, "P2", "fed_late - STRING - from D"):
+    pass_test("federation_reconnect")
+
+  stop_process(c)
+  for server in [server_a, server_b, server_c, server_d]:
+    stop_process(server)
+
+def run_test_shm():
+  """Tests the delivery through a shared ring, and the TCP fallback when it can't be mapped."""
+  fail_test("shm_ring")
+  fail_test("shm_fallback")
+  shm_port, shm_path = "12356", "/tmp/pcom_test_shm.sock"
+
+  print("Starting a server with shared rings")
+  server = start_server_on(shm_port, ["--shm", shm_path])
+
+  # a subscriber on the same host maps its ring and receives through it
+  c = start_subscriber_on("S1", shm_port, ["--shm", shm_path])
+  if not wait_for_output(server, "Client S1 uses a shared ring."):
+    print("Error: S1 didn't get a shared ring")
+  else:
+    c.send_input("subscribe shm_topic 0")
+    wait_for_output(c, "Subscribed to topic.")
+    send_string(shm_port, "shm_topic", "through the ring")
+    if check_subscriber_output(c, "S1", "shm_topic - STRING - through the ring"):
+      pass_test("shm_ring")
+  stop_process(c)
+
+  # a subscriber that can't reach the UNIX socket warns and keeps receiving through TCP
+  c = start_subscriber_on("S2", shm_port, ["--shm", shm_path + ".missing"])
+  if not wait_for_output(c, "Couldn't map the shared ring, receiving through TCP.", error=True):
+    print("Error: S2 didn't report the missing shared ring")
+  else:
+    c.send_input("subscribe shm_topic 0")
+    wait_for_output(c, "Subscribed to topic.")
+    send_string(shm_port, "shm_topic", "through TCP")
+    if check_subscriber_output(c, "S2", "shm_topic - STRING - through TCP"):
+      pass_test("shm_fallback")
+
+  stop_process(c)
+  stop_process(server)
+
+def run_test_batch(topics):
+  """Tests that the messages of batched datagrams are all delivered."""
+  fail_test("publish_batch")
+  batch_port = "12357"
+
+  server = start_server_on(batch_port)
+  c = start_subscriber_on("B1", batch_port)
+  if check_publish_path(c, "B1", topics, batch_port, ["--batch", "4"]):
+    pass_test("publish_batch")
+
+  stop_process(c)
+  stop_process(server)
+
+def run_test_tcp_publish(topics):
+  """Tests that the messages streamed by a TCP publisher are all delivered."""
+  fail_test("publish_tcp")
+  tcp_port, publish_port = "12358", "12359"
+
+  server = start_server_on(tcp_port, ["--publish-port", publish_port])
+  c = start_subscriber_on("T1", tcp_port)
+  if check_publish_path(c, "T1", topics, publish_port, ["--tcp"]):
+    pass_test("publish_tcp")
+
+  stop_process(c)
+  stop_process(server)
+
+def run_test_timers():
+  """Tests the heartbeats, the idle timeout and the SF expiry."""
+  fail_test("timer_heartbeat")
+  fail_test("timer_idle")
+  fail_test("timer_sf_ttl")
+  timer_port, idle_port = "12360", "12361"
+
+  print("Starting a server with heartbeats and an SF TTL")
+  server = start_server_on(timer_port, ["--heartbeat", "0.5", "--sf-ttl", "1"])
+
+  # A quiet connection gets a heartbeat (type 6) after an interval
+  sock = socket.create_connection((ip, int(timer_port)))
+  sock.sendall(b"H1".ljust(10, b"\0") + b"\0")
+  msgs = recv_msgs(sock, 1.5)
+  if any(from_server == 1 and type == 6 for from_server, type, _, _ in msgs):
+    pass_test("timer_heartbeat")
+  else:
+    print("Error: H1 didn't get a heartbeat, received " + str(msgs))
+  sock.close()
+
+  # An SF message older than the TTL isn't replayed on reconnect (the newer one is)
+  c = start_subscriber_on("T1", timer_port)
+  c.send_input("subscribe sf_ttl 1")
+  wait_for_output(c, "Subscribed to topic.")
+  stop_process(c)
+  send_string(timer_port, "sf_ttl", "expired")
+  sleep(2)
+  send_string(timer_port, "sf_ttl", "fresh")
+  c = start_subscriber_on("T1", timer_port)
+  if check_subscriber_output(c, "T1", "sf_ttl - STRING - fresh"):
+    pass_test("timer_sf_ttl")
+  stop_process(c)
+  stop_process(server)
+
+  # Without heartbeats, a client that sends nothing is still disconnected by the idle timeout
+  print("Starting a server with an idle timeout and no heartbeats")
+  server = start_server_on(idle_port, ["--heartbeat", "0", "--idle-timeout", "1"])
+  sock = socket.create_connection((ip, int(idle_port)))
+  sock.sendall(b"I1".ljust(10, b"\0") + b"\0")
+  sock.settimeout(3)
+  try:
+    closed = sock.recv(100) == b""
+  except ConnectionResetError:
+    closed = True
+  except socket.timeout:
+    closed = False
+
+  if closed and wait_for_output(server, "Client I1 timed out."):
+    pass_test("timer_idle")
+  else:
+    print("Error: the idle client I1 wasn't disconnected")
+  sock.close()
+  stop_process(server)
+
+def run_test_mem_budget():
+  """Tests a server under a small memory budget: SF eviction, refused subscriptions and clients."""
+  fail_test("mem_evict")
+  fail_test("mem_refuse")
+  fail_test("mem_alive")
+  mem_port, num_msgs = "12362", 1000
+
+  print("Starting a server with a 160K memory budget")
+  server = start_server_on(mem_port, ["--mem-budget", "160K"])
+
+  # Far more SF messages than the budget holds: the oldest are evicted, the newest are kept in order
+  c = start_subscriber_on("M1", mem_port)
+  c.send_input("subscribe mem_sf 1")
+  wait_for_output(c, "Subscribed to topic.")
+  stop_process(c)
+
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  for i in range(num_msgs):
+    sock.sendto(b"mem_sf".ljust(50, b"\0") + bytes([0, 0]) + struct.pack("!I", i), (ip, int(mem_port)))
+    sleep(0.0005)
+  sock.close()
+  sleep(0.5)
+
+  c = start_subscriber_on("M1", mem_port)
+  values = []
+  while True:
+    out = c.get_output_timeout(1)
+    if "mem_sf - INT - " not in out:
+      break
+    values.append(int(out.split(" - ")[-1]))
+  stop_process(c)
+
+  if len(values) > 0 and values[0] > 0 and values[-1] == num_msgs - 1 and values == sorted(values):
+    pass_test("mem_evict")
+  else:
+    print("Error: M1 received " + str(len(values)) + " SF messages, from " + str(values[:1]) + " to " + str(values[-1:]))
+
+  # Fill the budget with subscriptions (in small frames at the end, so little room is left)
+  sock = socket.create_connection((ip, int(mem_port)))
+  sock.sendall(b"R1".ljust(10, b"\0") + b"\0")
+  for k in range(100):
+    sock.sendall(ctrl_frame(1, ["mem_t" + str(i) for i in range(20 * k, 20 * k + 20)]))
+    sleep(0.01)
+  for k in range(100):
+    sock.sendall(ctrl_frame(1, ["mem_u" + str(k)]))
+  sleep(0.5)
+
+  # A new client doesn't fit anymore
+  other = socket.create_connection((ip, int(mem_port)))
+  other.sendall(b"R2".ljust(10, b"\0") + b"\0")
+  other.settimeout(2)
+  try:
+    closed = other.recv(100) == b""
+  except ConnectionResetError:
+    closed = True
+  except socket.timeout:
+    closed = False
+  other.close()
+
+  server.send_input("stats")
+  refused = wait_for_output(server, "Refused subscriptions: ")
+  if closed and refused and int(refused.split(": ")[1]) > 0:
+    pass_test("mem_refuse")
+  else:
+    print("Error: R2 wasn't rejected (or no subscription was refused) over the memory budget")
+
+  # The server keeps delivering to the clients it has
+  send_string(mem_port, "mem_t0", "still here")
+  msgs = recv_topics(sock)
+  if server.is_alive() and ("mem_t0", "still here") in msgs:
+    pass_test("mem_alive")
+  else:
+    print("Error: R1 received " + str(msgs) + " under memory pressure")
+  sock.close()
+
+  stop_process(server)
+
+def run_test_filter():
+  """Tests that a filtered subscription gets only the values that pass its filter."""
+  fail_test("filter_int")
+  filter_port = "12363"
+
+  server = start_server_on(filter_port)
+  c = start_subscriber_on("F1", filter_port)
+  c.send_input("subscribe flt_int 0 if > 30")
+  wait_for_output(c, "Subscribed to topic.")
+
+  for value in [5, 25, 30, 35, -40, 100]:
+    send_int(filter_port, "flt_int", value)
+    sleep(0.05)
+
+  values = read_values(c, "flt_int")
+  if values == ["35", "100"]:
+    pass_test("filter_int")
+  else:
+    print("Error: F1 received " + str(values) + " with the filter > 30")
+
+  stop_process(c)
+  stop_process(server)
+
+def run_test_throttle():
+  """Tests the token bucket of a rate limited subscription and the sampling of 1 message in N."""
+  fail_test("throttle_rate")
+  fail_test("throttle_every")
+  throttle_port = "12364"
+
+  server = start_server_on(throttle_port)
+  c = start_subscriber_on("L1", throttle_port)
+  c.send_input("subscribe thr_rate 0 rate=5")
+  wait_for_output(c, "Subscribed to topic.")
+  c.send_input("subscribe thr_every 0 every=3")
+  wait_for_output(c, "Subscribed to topic.")
+
+  # A burst is cut to the bucket (one second of messages), and the bucket is full again a second later
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  counts = []
+  for burst in range(2):
+    for i in range(40):
+      sock.sendto(b"thr_rate".ljust(50, b"\0") + bytes([3]) + str(i).encode(), (ip, int(throttle_port)))
+    counts.append(len(read_values(c, "thr_rate", "STRING")))
+    sleep(1)
+  sock.close()
+
+  if counts == [5, 5]:
+    pass_test("throttle_rate")
+  else:
+    print("Error: L1 received " + str(counts) + " messages from bursts of 40 at rate=5")
+
+  # Sampling delivers the first message, then every third one
+  for value in range(1, 10):
+    send_int(throttle_port, "thr_every", value)
+    sleep(0.02)
+
+  values = read_values(c, "thr_every")
+  if values == ["1", "4", "7"]:
+    pass_test("throttle_every")
+  else:
+    print("Error: L1 received " + str(values) + " with every=3")
+
+  stop_process(c)
+  stop_process(server)
+
+def run_test_priority():
+  """Tests that a high priority message overtakes the bulk messages queued for a slow reader."""
+  fail_test("priority_lanes")
+  prio_port, num_bulk = "12365", 300
+
+  server = start_server_on(prio_port, ["--priority", "prio_alarm=high", "--priority", "prio_bulk=bulk"])
+
+  # A slow reader: a small receive buffer, read only at the end
+  sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+  sock.connect((ip, int(prio_port)))
+  sock.sendall(b"Q1".ljust(10, b"\0") + b"\0")
+  sock.sendall(ctrl_frame(1, ["prio_bulk", "prio_alarm"]))
+  sleep(0.5)
+
+  print("Queueing " + str(num_bulk) + " bulk messages, then an alarm")
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  for i in range(num_bulk):
+    udp.sendto(b"prio_bulk".ljust(50, b"\0") + bytes([3]) + (str(i) + " ").ljust(1000, "x").encode(), (ip, int(prio_port)))
+    sleep(0.001)
+  udp.close()
+  sleep(0.2)
+  send_string(prio_port, "prio_alarm", "alarm")
+  sleep(0.5)
+
+  topics = [topic for topic, _ in recv_topics(sock, 2)]
+  sock.close()
+
+  # The alarm is written once the messages already in the socket are read, before the rest of the backlog
+  if "prio_alarm" in topics and topics.count("prio_bulk") == num_bulk:
+    after = len(topics) - 1 - topics.index("prio_alarm")
+    if after >= num_bulk // 2:
+      pass_test("priority_lanes")
+    else:
+      print("Error: only " + str(after) + " bulk messages came after the alarm")
+  else:
+    print("Error: Q1 received " + str(topics.count("prio_bulk")) + " bulk messages, alarm: " + str("prio_alarm" in topics))
+
+  stop_process(server)
+
+def run_test_mcast():
+  """Tests the delivery of a topic on a loopback multicast group, and its repair from the window."""
+  fail_test("mcast_delivery")
+  fail_test("mcast_repair")
+  mcast_port, group_port, num_msgs = "12366", 12367, 1030
+
+  server = start_server_on(mcast_port, ["--multicast", "mc_topic=239.1.2.3:" + str(group_port),
+                                        "--multicast-if", "127.0.0.1"])
+  client = start_subscriber_on("M1", mcast_port)
+  client.send_input("subscribe mc_topic 0")
+  wait_for_output(client, "Subscribed to topic.")
+
+  # A raw client joins the group too, its repairs come over TCP
+  sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  sock.connect((ip, int(mcast_port)))
+  sock.sendall(b"M2".ljust(10, b"\0") + b"\0")
+  sock.sendall(ctrl_frame(1, ["mc_topic"], opts=bytes([7, 0])))
+  joins = [payload for _, type, _, payload in recv_msgs(sock) if type == 4]
+
+  print("Publishing " + str(num_msgs) + " messages on the multicast group")
+  for i in range(num_msgs):
+    send_int(mcast_port, "mc_topic", i)
+    sleep(0.0005)
+
+  # Every message reaches the subscriber in order, none over its TCP link
+  values = read_values(client, "mc_topic")
+  if values == [str(i) for i in range(num_msgs)] and recv_topics(sock) == []:
+    pass_test("mcast_delivery")
+  else:
+    print("Error: M1 received " + str(len(values)) + " of " + str(num_msgs) + " messages")
+
+  # Only the newest messages are still in the window
+  if len(joins) == 1:
+    first = int(joins[0].split()[2]) + 1
+    sock.sendall(ctrl_frame(5, ["mc_topic"], opts=bytes([1, 4]) + struct.pack("!I", first)
+                                               + bytes([8, 4]) + struct.pack("!I", 10)))
+    repaired = [payload for _, payload in recv_topics(sock)]
+    expected = [str(i) for i in range(num_msgs - 1024, 10)]
+    if repaired == expected:
+      pass_test("mcast_repair")
+    else:
+      print("Error: M2 got " + str(repaired) + " instead of " + str(expected))
+  else:
+    print("Error: M2 received " + str(len(joins)) + " group announcements")
+
+  sock.close()
+  stop_process(client)
+  stop_process(server)
+
+def read_msgs(client, prefix):
+  """Reads the messages a subscriber prints, until it's quiet, returns the "topic - TYPE - value" of the topics with a prefix."""
+  # The sender's address is dropped
+  msgs = []
+  while True:
+    out = client.get_output_timeout(1)
+    if out in ["", "timeout"]:
+      return msgs
+    if " - " + prefix in out:
+      msgs.append(out.split(" - ", 1)[1].strip())
+
+def run_test_capture():
+  """Tests that the replayer sends the captured datagrams to another server, in their order."""
+  fail_test("capture_replay")
+  capture_port, replay_port, capture_file, num_msgs = "12368", "12369", "test_capture.bin", 50
+  exit_if_condition(not make_target("replayer"), "Error: replayer could not be built")
+
+  # The first server captures what it receives
+  server = start_server_on(capture_port, ["--capture", capture_file])
+  client = start_subscriber_on("P1", capture_port)
+  for topic in ["cap_int", "cap_str"]:
+    client.send_input("subscribe " + topic + " 0")
+    wait_for_output(client, "Subscribed to topic.")
+
+  print("Capturing " + str(num_msgs) + " messages")
+  for i in range(num_msgs):
+    if i % 2 == 0:
+      send_int(capture_port, "cap_int", i - num_msgs // 2)
+    else:
+      send_string(capture_port, "cap_str", "value " + str(i))
+    sleep(0.002)
+  captured = read_msgs(client, "cap_")
+  stop_process(client)
+  stop_process(server)
+
+  # The second one only gets the replayed datagrams, as fast as they can be sent
+  server = start_server_on(replay_port)
+  client = start_subscriber_on("P2", replay_port)
+  for topic in ["cap_int", "cap_str"]:
+    client.send_input("subscribe " + topic + " 0")
+    wait_for_output(client, "Subscribed to topic.")
+
+  print("Replaying the capture")
+  subprocess.run(["./replayer", "--max", capture_file, ip, replay_port], stdout=PIPE, stderr=STDOUT)
+  replayed = read_msgs(client, "cap_")
+
+  if len(captured) == num_msgs and replayed == captured:
+    pass_test("capture_replay")
+  else:
+    print("Error: captured " + str(len(captured)) + " messages, replayed " + str(len(replayed)) + " (same: "
+          + str(replayed == captured) + ")")
+
+  stop_process(client)
+  stop_process(server)
+  if path.exists(capture_file):
+    os.remove(capture_file)
+
+def run_test_pcomsub():
+  """Tests a program built on `libpcomsub`: delivery through its callbacks, and the SF messages stored meanwhile."""
+  fail_test("pcomsub_delivery")
+  fail_test("pcomsub_sf_resume")
+  lib_port, num_msgs = "12370", 5
+
+  print("Building a client of libpcomsub")
+  exit_if_condition(not make_target("libpcomsub.a"), "Error: libpcomsub.a could not be built")
+  with open("pcomsub_client.c", "w") as f:
+    f.write(pcomsub_client_src)
+  subprocess.run(["gcc -Wall -Iinclude -pthread -o pcomsub_client pcomsub_client.c libpcomsub.a"], shell=True)
+  os.remove("pcomsub_client.c")
+  exit_if_condition(not path.exists("pcomsub_client"), "Error: the client of libpcomsub could not be built")
+
+  server = start_server_on(lib_port)
+
+  # The first run subscribes with SF, gets the first half and acks it when it closes
+  client = Popen(["./pcomsub_client", "L1", lib_port, "2000", "lib_sf"], stdout=PIPE, text=True)
+  sleep(0.5)
+  for i in range(num_msgs):
+    send_string(lib_port, "lib_sf", "value " + str(i))
+  first = client.communicate()[0].splitlines()
+
+  # The second half is stored while it's away, and replayed once it connects again
+  for i in range(num_msgs, 2 * num_msgs):
+    send_string(lib_port, "lib_sf", "value " + str(i))
+  sleep(0.2)
+  second = Popen(["./pcomsub_client", "L1", lib_port, "1000"], stdout=PIPE, text=True).communicate()[0].splitlines()
+
+  # (with their sequence numbers on the SF stream)
+  payloads = lambda lines: [line.split(" - ")[1] for line in lines if line.startswith("lib_sf - ")]
+  seqs = [int(line.split(" - ")[2]) for line in first + second if line.startswith("lib_sf - ")]
+  if payloads(first) == ["value " + str(i) for i in range(num_msgs)]:
+    pass_test("pcomsub_delivery")
+  else:
+    print("Error: the first run received " + str(first))
+  if payloads(second) == ["value " + str(i) for i in range(num_msgs, 2 * num_msgs)] and seqs == sorted(set(seqs)) and 0 not in seqs:
+    pass_test("pcomsub_sf_resume")
+  else:
+    print("Error: the second run received " + str(second))
+
+  stop_process(server)
+  os.remove("pcomsub_client")
+
+def run_test_handshake():
+  """Tests that the connections which don't send their IDs don't hold back the other clients."""
+  fail_test("handshake_stalled")
+  fail_test("handshake_aborted")
+  fail_test("handshake_timeout")
+  hs_port, num_conns = "12371", 20
+
+  server = start_server_on(hs_port)
+
+  # Connections which never send their IDs
+  print("Opening " + str(num_conns) + " connections without IDs")
+  silent = []
+  for _ in range(num_conns):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect((ip, int(hs_port)))
+    silent.append(sock)
+
+  # Meanwhile, a subscriber connects and a raw client sends its ID in two parts
+  client = start_subscriber_on("H1", hs_port)
+  client.send_input("subscribe hs_topic 0")
+  subscribed = wait_for_output(client, "Subscribed to topic.")
+  split = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  split.connect((ip, int(hs_port)))
+  split.sendall(b"H2\0\0")
+  sleep(0.3)
+  split.sendall(b"".ljust(7, b"\0") + ctrl_frame(1, ["hs_topic"]))
+  sleep(0.3)
+  send_string(hs_port, "hs_topic", "first")
+  if subscribed and wait_for_output(client, "hs_topic - STRING - first") and recv_topics(split) == [("hs_topic", "first")]:
+    pass_test("handshake_stalled")
+  else:
+    print("Error: H1 or H2 didn't receive the message while the handshakes were stalled")
+
+  # Connections closed (or reset) in the middle of their IDs
+  print("Closing " + str(num_conns) + " connections during their handshakes")
+  for i in range(num_conns):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect((ip, int(hs_port)))
+    if i % 2 == 0:
+      sock.sendall(b"X" + str(i).encode())
+    if i % 4 == 1:
+      sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+    sock.close()
+  sleep(0.3)
+  send_string(hs_port, "hs_topic", "second")
+  if server.is_alive() and wait_for_output(client, "hs_topic - STRING - second") and recv_topics(split) == [("hs_topic", "second")]:
+    pass_test("handshake_aborted")
+  else:
+    print("Error: the clients didn't receive the message after the aborted handshakes")
+
+  # The silent connections are closed once their handshakes time out (after 5 seconds)
+  sleep(5)
+  closed = 0
+  for sock in silent:
+    sock.settimeout(1)
+    try:
+      if sock.recv(1) == b"":
+        closed += 1
+    except (socket.timeout, ConnectionResetError):
+      pass
+    sock.close()
+  if closed == num_conns:
+    pass_test("handshake_timeout")
+  else:
+    print("Error: only " + str(closed) + " of " + str(num_conns) + " silent connections were closed")
+
+  split.close()
+  stop_process(client)
+  stop_process(server)
+
+def run_test_alias():
+  """Tests that the aliases of the topics are announced, and that the aliased messages decode to their topics."""
+  fail_test("alias_announce")
+  fail_test("alias_decode")
+  alias_port = "12372"
+  sent = [("al_a", "x1"), ("al_b", "y1"), ("al_a", "x2"), ("al_b", "y2")]
+
+  server = start_server_on(alias_port)
+
+  # A raw client accepts the aliases (`OPT_ALIAS`), another one doesn't, the subscriber's library does
+  aliased = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  aliased.connect((ip, int(alias_port)))
+  aliased.sendall(b"A1".ljust(10, b"\0") + b"\0")
+  aliased.sendall(ctrl_frame(1, ["al_a", "al_b"], opts=bytes([9, 0])))
+  plain = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  plain.connect((ip, int(alias_port)))
+  plain.sendall(b"A2".ljust(10, b"\0") + b"\0")
+  plain.sendall(ctrl_frame(1, ["al_a", "al_b"]))
+  client = start_subscriber_on("A3", alias_port)
+  for topic in ["al_a", "al_b"]:
+    client.send_input("subscribe " + topic + " 0")
+    wait_for_output(client, "Subscribed to topic.")
+
+  print("Publishing " + str(len(sent)) + " messages on two aliased topics")
+  for topic, value in sent:
+    send_string(alias_port, topic, value)
+    sleep(0.01)
+
+  # An announcement is a whole `TCP_msg` from the server, an aliased message is an `Alias_hdr`
+  # ('\0' where the topic starts, then the alias and the type) and its payload
+  aliases, announced, decoded, shorter = {}, True, [], True
+  for msg in recv_frames(aliased):
+    if msg[28] == 1 and msg[83] == 7:
+      aliases[int(msg[84:].split(b"\0")[0])] = msg[33:83].split(b"\0")[0].decode()
+    elif msg[28] == 0 and msg[33] == 0:
+      alias = struct.unpack("!I", msg[34:38])[0]
+      announced = announced and alias in aliases
+      shorter = shorter and len(msg) < 84
+      decoded.append((aliases.get(alias, "?"), msg[39:].split(b"\0")[0].decode()))
+    else:
+      decoded.append((msg[33:83].split(b"\0")[0].decode(), msg[84:].split(b"\0")[0].decode()))
+
+  if len(aliases) == 2 and len(set(aliases.values())) == 2 and announced and shorter:
+    pass_test("alias_announce")
+  else:
+    print("Error: A1 got the aliases " + str(aliases) + " (announced first: " + str(announced) + ")")
+
+  printed = read_msgs(client, "al_")
+  if decoded == sent and recv_topics(plain) == sent and printed == [topic + " - STRING - " + value for topic, value in sent]:
+    pass_test("alias_decode")
+  else:
+    print("Error: A1 decoded " + str(decoded) + ", A3 printed " + str(printed))
+
+  aliased.close()
+  plain.close()
+  stop_process(client)
+  stop_process(server)
+
+def zerocopy_stats(server):
+  """Asks a server for its stats, returns its (zero-copy writes, completed ones, closed sockets waiting, memory of the messages)."""
+  server.send_input("stats")
+  msgs = wait_for_output(server, "Memory of the messages: ")
+  zc = wait_for_output(server, "Zero-copy writes: ")
+  if not msgs or not zc:
+    return None
+  return (int(zc.split("Zero-copy writes: ")[1].split()[0]), int(zc.split("completed: ")[1].split()[0]),
+          int(zc.split("closed sockets waiting: ")[1]), int(msgs.split(": ")[1].split()[0]))
+
+def run_test_zerocopy(topics):
+  """Tests the delivery with zero-copy writes, and a client closed while its writes are in flight."""
+  fail_test("zerocopy_delivery")
+  fail_test("zerocopy_orphan")
+  zc_port, num_msgs = "12373", 2000
+
+  # (the idle timeout closes a stopped client, the live ones answer the heartbeats)
+  server = start_server_on(zc_port, ["--zerocopy", "1024", "--heartbeat", "1", "--idle-timeout", "2"])
+  c = start_subscriber_on("Z1", zc_port)
+  delivered = check_publish_path(c, "Z1", topics, zc_port, [])
+  stats = zerocopy_stats(server)
+  if delivered and stats and stats[0] > 0:
+    pass_test("zerocopy_delivery")
+  else:
+    print("Error: the messages weren't all delivered with zero-copy writes (stats: " + str(stats) + ")")
+
+  # A stopped subscriber gets a backlog of large messages, and is closed while they're in flight
+  stopped = start_subscriber_on("Z2", zc_port)
+  stopped.send_input("subscribe zc_big 0")
+  wait_for_output(stopped, "Subscribed to topic.")
+  stopped.proc.send_signal(signal.SIGSTOP)
+
+  print("Sending " + str(num_msgs) + " large messages to a stopped subscriber")
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  for i in range(num_msgs):
+    udp.sendto(b"zc_big".ljust(50, b"\0") + bytes([3]) + (str(i) + " ").ljust(1400, "x").encode(), (ip, int(zc_port)))
+    if i % 20 == 0:
+      sleep(0.002)
+  udp.close()
+  sleep(3)
+  in_flight = zerocopy_stats(server)
+
+  # Its socket is released once the kernel is done with the writes
+  stopped.proc.kill()
+  stopped.proc.wait()
+  sleep(1)
+  done = zerocopy_stats(server)
+  c.send_input("subscribe zc_after 0")
+  wait_for_output(c, "Subscribed to topic.")
+  send_string(zc_port, "zc_after", "still here")
+  if (in_flight and in_flight[2] == 1 and done and done[2] == 0 and done[0] == done[1] and done[3] == 0
+      and wait_for_output(c, "zc_after - STRING - still here")):
+    pass_test("zerocopy_orphan")
+  else:
+    print("Error: the closed socket wasn't released (stats: " + str(in_flight) + ", then " + str(done) + ")")
+
+  stop_process(c)
+  stop_process(server)
+
+def clients_memory(server):
+  """Asks a server for its stats, returns the memory of its clients (with their subscription tables)."""
+  server.send_input("stats")
+  out = wait_for_output(server, "Memory of the clients: ")
+  return int(out.split(": ")[1].split()[0]) if out else None
+
+def run_test_sub_churn():
+  """Tests that the subscription tables shrink after many unsubscribes, and that an SF topic subscribed again
+  continues its sequence numbers (delivered, and replayed after a reconnection)."""
+  fail_test("sub_churn_delivery")
+  fail_test("sub_churn_replay")
+  fail_test("sub_churn_shrink")
+  churn_port, num_topics, num_rounds = "12374", 500, 20
+
+  server = start_server_on(churn_port)
+  client = start_subscriber_on("K1", churn_port)
+  client.send_input("subscribe churn_keep churn_sf 1")
+  wait_for_output(client, "Subscribed to 2 topics.")
+  for i in range(3):
+    send_string(churn_port, "churn_sf", "a" + str(i))
+  first = read_msgs(client, "churn_")
+
+  # The SF subscription is removed (its next sequence number is retired), then many topics come and go
+  client.send_input("unsubscribe churn_sf")
+  wait_for_output(client, "Unsubscribed from topic.")
+  print("Subscribing and unsubscribing " + str(num_topics) + " topics, then " + str(num_rounds) + " rounds of 50")
+  names = " ".join("churn_" + str(k) for k in range(num_topics))
+  client.send_input("subscribe " + names + " 0")
+  wait_for_output(client, "Subscribed to " + str(num_topics) + " topics.")
+  sleep(0.2)
+  peak = clients_memory(server)
+  client.send_input("unsubscribe " + names)
+  wait_for_output(client, "Unsubscribed from " + str(num_topics) + " topics.")
+  for r in range(num_rounds):
+    names = " ".join("churn_" + str(r) + "_" + str(k) for k in range(50))
+    client.send_input("subscribe " + names + " 0")
+    wait_for_output(client, "Subscribed to 50 topics.")
+    client.send_input("unsubscribe " + names)
+    wait_for_output(client, "Unsubscribed from 50 topics.")
+  sleep(0.2)
+  end = clients_memory(server)
+
+  # Subscribed again, the SF topic continues after the numbers the subscriber has already seen
+  client.send_input("subscribe churn_sf 1")
+  wait_for_output(client, "Subscribed to topic.")
+  for i in range(2):
+    send_string(churn_port, "churn_sf", "b" + str(i))
+  send_string(churn_port, "churn_keep", "k0")
+  second = read_msgs(client, "churn_")
+  expected = ["churn_sf - STRING - a0", "churn_sf - STRING - a1", "churn_sf - STRING - a2"]
+  if first == expected and second == ["churn_sf - STRING - b0", "churn_sf - STRING - b1", "churn_keep - STRING - k0"]:
+    pass_test("sub_churn_delivery")
+  else:
+    print("Error: K1 received " + str(first) + ", then " + str(second))
+
+  # And so do the messages stored while the subscriber is away
+  stop_process(client)
+  send_string(churn_port, "churn_sf", "c0")
+  send_string(churn_port, "churn_keep", "k1")
+  client = start_subscriber_on("K1", churn_port)
+  replayed = sorted(read_msgs(client, "churn_"))
+  if replayed == ["churn_keep - STRING - k1", "churn_sf - STRING - c0"]:
+    pass_test("sub_churn_replay")
+  else:
+    print("Error: K1 got " + str(replayed) + " after its reconnection")
+
+  if peak and end and end < peak:
+    pass_test("sub_churn_shrink")
+  else:
+    print("Error: the memory of the clients went from " + str(peak) + " to " + str(end) + " bytes")
+
+  stop_process(client)
+  stop_process(server)
+
+def run_test_ingest_overflow():
+  """Tests that a burst larger than the ingest ring and the socket buffer loses whole datagrams, counted by the
+  server, and that the messages which get through keep the order of their publishers."""
+  fail_test("ingest_overflow")
+  fail_test("ingest_order")
+  ingest_port, num_batches, batch_len = "12375", 400, 50
+
+  server = start_server_on(ingest_port)
+  sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+  sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+  sock.connect((ip, int(ingest_port)))
+  sock.sendall(b"I1".ljust(10, b"\0") + b"\0")
+  sock.sendall(ctrl_frame(1, ["ovf_t"]))
+  sleep(0.5)
+
+  # Two publishers send batched datagrams (`batch_len` INT records each) to a stopped server,
+  # so the socket buffer overflows and the ring fills up once it runs again
+  print("Sending " + str(2 * num_batches) + " batches of " + str(batch_len) + " messages to a stopped server")
+  pubs = [socket.socket(socket.AF_INET, socket.SOCK_DGRAM) for _ in range(2)]
+  server.proc.send_signal(signal.SIGSTOP)
+  for b in range(num_batches):
+    for p, pub in enumerate(pubs):
+      frame = b"\0PB" + bytes([1]) + struct.pack("!H", batch_len)
+      for i in range(b * batch_len, (b + 1) * batch_len):
+        frame += bytes([5, 0]) + struct.pack("!H", 5) + b"ovf_t" + bytes([0]) + struct.pack("!I", p * 1000000 + i)
+      pub.sendto(frame, (ip, int(ingest_port)))
+  server.proc.send_signal(signal.SIGCONT)
+  for pub in pubs:
+    pub.close()
+  sleep(1)
+
+  # (the kernel gives its drop counter with the next datagram it queues)
+  send_int(ingest_port, "ovf_end", 0)
+  sleep(0.2)
+
+  values = [int(payload) for topic, payload in recv_topics(sock, 2)]
+  sock.close()
+  server.send_input("stats")
+  out = wait_for_output(server, "Waits for a full ingest ring: ")
+  waits = int(out.split(": ")[1].split(",")[0]) if out else 0
+  drops = int(out.split(": ")[2]) if out else 0
+
+  # A lost datagram takes all its messages, nothing else is lost
+  if waits > 0 and drops > 0 and len(values) + drops * batch_len == 2 * num_batches * batch_len:
+    pass_test("ingest_overflow")
+  else:
+    print("Error: received " + str(len(values)) + " messages, " + str(drops) + " dropped datagrams, "
+          + str(waits) + " waits for the ring")
+
+  # Every message is intact, and each publisher's messages come in their order
+  orders = [[v for v in values if v // 1000000 == p] for p in range(2)]
+  if (values and all(0 <= v % 1000000 < num_batches * batch_len for v in values)
+      and all(order == sorted(set(order)) for order in orders)):
+    pass_test("ingest_order")
+  else:
+    print("Error: the messages that got through aren't in their publishers' order")
+
+  stop_process(server)
+
 def h2_test():
   """Runs all the tests."""
 
@@ -695,6 +1817,63 @@ def h2_test():
   # close the server and check that C1 also closes
   run_test_server_stop(server, c1)
 
+  # send control frames in chunks (and an oversized one) and check the subscriptions
+  run_test_frames()
+
+  # resume an SF subscriber twice and check the replayed messages
+  run_test_sf_resume()
+
+  # link several servers and check the forwarding, the withdrawal and the reconnection
+  run_test_federation()
+
+  # receive through a shared ring, then fall back to TCP without one
+  run_test_shm()
+
+  # publish batched datagrams and check that every message is delivered
+  run_test_batch(topics)
+
+  # stream the messages from a TCP publisher and check that every message is delivered
+  run_test_tcp_publish(topics)
+
+  # check the heartbeats, the idle timeout and the SF expiry
+  run_test_timers()
+
+  # run a server over its memory budget
+  run_test_mem_budget()
+
+  # subscribe with a content filter
+  run_test_filter()
+
+  # limit the rate of a subscription and sample another one
+  run_test_throttle()
+
+  # write an alarm before the backlog of a slow reader
+  run_test_priority()
+
+  # deliver a topic on a loopback multicast group and repair it over TCP
+  run_test_mcast()
+
+  # capture the datagrams of a server and replay them into another one
+  run_test_capture()
+
+  # receive through the callbacks of the subscriber library
+  run_test_pcomsub()
+
+  # connect and receive while other connections don't finish their handshakes
+  run_test_handshake()
+
+  # receive the messages of some topics under their aliases
+  run_test_alias()
+
+  # write the messages with MSG_ZEROCOPY, close a client with writes in flight
+  run_test_zerocopy(topics)
+
+  # subscribe and unsubscribe many topics, then resubscribe an SF topic
+  run_test_sub_churn()
+
+  # publish faster than the ingest ring is drained
+  run_test_ingest_overflow()
+
   # clean up
   make_clean()
 
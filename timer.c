@@ -0,0 +1,192 @@
+#include <string.h>
+#include <time.h>
+#include "timer.h"
+#include "utils.h"
+
+
+uint64_t timer_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Make `head` an empty circular list */
+static void list_init(Timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+
+/* Append a timer to the list of `head` */
+static void list_add(Timer *head, Timer *timer)
+{
+    timer->next         = head;
+    timer->prev         = head->prev;
+    head->prev->next    = timer;
+    head->prev          = timer;
+}
+
+
+/* Put a timer in the slot that covers its delay (its expiry isn't before the current tick) */
+static void place_timer(Timer_wheel *wheel, Timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    if (delta < TIMER_L0_SLOTS)
+    {
+        list_add(&wheel->level0[timer->expires & (TIMER_L0_SLOTS - 1)], timer);
+        return;
+    }
+
+    // The longest delay is cut to the range of the last level
+    uint64_t max_delta = (1ULL << (TIMER_L0_BITS + (TIMER_LEVELS - 1) * TIMER_LN_BITS)) - 1;
+    if (delta > max_delta)
+        timer->expires = wheel->now + max_delta;
+
+    int level = 0;
+    int shift = TIMER_L0_BITS;
+    while (level < TIMER_LEVELS - 2 && delta >= (1ULL << (shift + TIMER_LN_BITS)))
+    {
+        level++;
+        shift += TIMER_LN_BITS;
+    }
+
+    list_add(&wheel->levels[level][(timer->expires >> shift) & (TIMER_LN_SLOTS - 1)], timer);
+}
+
+
+/* Move the timers of a slot to the lower levels */
+static void cascade(Timer_wheel *wheel, Timer *head)
+{
+    Timer *timer = head->next;
+    list_init(head);
+
+    while (timer != head)
+    {
+        Timer *next = timer->next;
+        place_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+
+void timer_wheel_init(Timer_wheel *wheel, uint64_t now_ms)
+{
+    memset(wheel, 0, sizeof(Timer_wheel));
+    wheel->now      = now_ms / TIMER_TICK_MS;
+    wheel->now_ms   = now_ms;
+
+    for (int slot = 0; slot < TIMER_L0_SLOTS; ++slot)
+        list_init(&wheel->level0[slot]);
+    for (int level = 0; level < TIMER_LEVELS - 1; ++level)
+        for (int slot = 0; slot < TIMER_LN_SLOTS; ++slot)
+            list_init(&wheel->levels[level][slot]);
+}
+
+
+void timer_init(Timer *timer, void (*fn)(Timer *timer, void *arg))
+{
+    memset(timer, 0, sizeof(Timer));
+    timer->fn = fn;
+}
+
+
+bool timer_pending(Timer *timer)
+{
+    return timer->prev != NULL;
+}
+
+
+void timer_add(Timer_wheel *wheel, Timer *timer, uint64_t expires_ms)
+{
+    timer_del(wheel, timer);
+
+    // Never early: the first tick at or after `expires_ms` (and never the tick being run)
+    timer->expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (timer->expires <= wheel->now)
+        timer->expires = wheel->now + 1;
+
+    place_timer(wheel, timer);
+    wheel->count++;
+}
+
+
+void timer_del(Timer_wheel *wheel, Timer *timer)
+{
+    if (!timer_pending(timer))
+        return;
+
+    timer->prev->next   = timer->next;
+    timer->next->prev   = timer->prev;
+    timer->next         = NULL;
+    timer->prev         = NULL;
+    wheel->count--;
+}
+
+
+void timer_wheel_advance(Timer_wheel *wheel, uint64_t now_ms, void *arg)
+{
+    wheel->now_ms   = now_ms;
+    uint64_t target = now_ms / TIMER_TICK_MS;
+
+    // Nothing to run, the empty ticks are skipped
+    if (wheel->count == 0)
+    {
+        wheel->now = MAX(wheel->now, target);
+        return;
+    }
+
+    while (wheel->now < target)
+    {
+        uint64_t now = ++wheel->now;
+
+        // Every 256 ticks, the next slot of level 1 is moved down (and every 64 of those, a slot of level 2...)
+        if ((now & (TIMER_L0_SLOTS - 1)) == 0)
+        {
+            int shift = TIMER_L0_BITS;
+            for (int level = 0; level < TIMER_LEVELS - 1; ++level, shift += TIMER_LN_BITS)
+            {
+                size_t slot = (now >> shift) & (TIMER_LN_SLOTS - 1);
+                cascade(wheel, &wheel->levels[level][slot]);
+                if (slot != 0)
+                    break;
+            }
+        }
+
+        // Detach the slot first, a callback may re-arm its timer
+        Timer expired;
+        Timer *head = &wheel->level0[now & (TIMER_L0_SLOTS - 1)];
+        if (head->next == head)
+            continue;
+
+        expired.next        = head->next;
+        expired.prev        = head->prev;
+        expired.next->prev  = &expired;
+        expired.prev->next  = &expired;
+        list_init(head);
+
+        while (expired.next != &expired)
+        {
+            Timer *timer = expired.next;
+            timer_del(wheel, timer);
+            timer->fn(timer, arg);
+        }
+    }
+}
+
+
+long timer_wheel_timeout_ms(Timer_wheel *wheel, uint64_t now_ms)
+{
+    if (wheel->count == 0)
+        return -1;
+
+    // The first busy slot of level 0, or the next cascade
+    uint64_t tick = wheel->now + 1;
+    while ((tick & (TIMER_L0_SLOTS - 1)) != 0 && wheel->level0[tick & (TIMER_L0_SLOTS - 1)].next == &wheel->level0[tick & (TIMER_L0_SLOTS - 1)])
+        tick++;
+
+    uint64_t when_ms = tick * TIMER_TICK_MS;
+    return when_ms > now_ms ? (long) (when_ms - now_ms) : 0;
+}
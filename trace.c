@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "utils.h"
+
+// Memory used by the server (the records are preallocated, outside the budget)
+extern Mem_stats mem_stats;
+
+/* Names of the stages, as printed by `trace_print_stats()` */
+static const char *stage_names[NUM_STAGES] = {
+    "socket buffer",
+    "conversion",
+    "fanout enqueue",
+    "socket write",
+};
+
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+bool parse_trace_sample(const char *text, unsigned *sample)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < 1 || value > UINT32_MAX)
+        return false;
+
+    *sample = (unsigned) value;
+    return true;
+}
+
+
+void trace_init(Tracer *tracer, unsigned sample, const char *file)
+{
+    memset(tracer, 0, sizeof(Tracer));
+    tracer->sample      = sample;
+    tracer->countdown   = 0;
+    tracer->file        = file;
+
+    // The records are needed only for the trace file
+    if (sample > 0 && file != NULL)
+    {
+        tracer->records = (Trace_record *) calloc(TRACE_RECORDS, sizeof(Trace_record));
+        DIE(tracer->records == NULL, "[ERROR]: Allocation error!\n");
+        mem_stats.fixed += TRACE_RECORDS * sizeof(Trace_record);
+    }
+}
+
+
+void trace_destroy(Tracer *tracer)
+{
+    if (tracer->records != NULL)
+        mem_stats.fixed -= TRACE_RECORDS * sizeof(Trace_record);
+    free(tracer->records);
+}
+
+
+bool trace_sample_next(Tracer *tracer)
+{
+    if (tracer->sample == 0)
+        return false;
+
+    if (tracer->countdown > 0)
+    {
+        tracer->countdown--;
+        return false;
+    }
+
+    tracer->countdown = tracer->sample - 1;
+    return true;
+}
+
+
+void trace_add(Tracer *tracer, trace_stage stage, uint64_t ns)
+{
+    // Bucket `b` holds the latencies with `b` significant bits
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    tracer->hist[stage][MIN(bucket, TRACE_BUCKETS - 1)]++;
+    tracer->max_ns[stage] = MAX(tracer->max_ns[stage], ns);
+}
+
+
+uint64_t elapsed_ns(uint64_t a, uint64_t b)
+{
+    return b > a ? b - a : 0;
+}
+
+
+void trace_write(Tracer *tracer, Msg_trace *trace)
+{
+    uint64_t ns         = elapsed_ns(trace->fanout_ns, now_ns());
+    trace->write_ns     = MAX(trace->write_ns, ns);
+    trace->num_writes++;
+    trace_add(tracer, STAGE_WRITE, ns);
+}
+
+
+void trace_msg(Tracer *tracer, Msg_trace *trace)
+{
+    uint64_t stage_ns[NUM_STAGES] = {
+        trace->rx_ns != 0 ? elapsed_ns(trace->rx_ns, trace->recv_ns) : 0,
+        elapsed_ns(trace->recv_ns, trace->decoded_ns),
+        elapsed_ns(trace->decoded_ns, trace->fanout_ns),
+        trace->write_ns,
+    };
+
+    // The socket writes are added one by one, by `trace_write()`
+    for (int stage = 0; stage < STAGE_WRITE; ++stage)
+        trace_add(tracer, stage, stage_ns[stage]);
+
+    if (tracer->records == NULL)
+        return;
+
+    Trace_record *record = &tracer->records[tracer->num_records++ % TRACE_RECORDS];
+    record->rx_ns = trace->rx_ns;
+    for (int stage = 0; stage < NUM_STAGES; ++stage)
+        record->stage_ns[stage] = MIN(stage_ns[stage], UINT32_MAX);
+    record->num_writes  = trace->num_writes;
+    record->topic_hash  = trace->topic_hash;
+}
+
+
+/* Return the upper bound of the bucket holding the `pct` percentile of a histogram (at most `max_ns`) */
+static uint64_t percentile(uint64_t *hist, uint64_t count, double pct, uint64_t max_ns)
+{
+    uint64_t rank = (uint64_t) ceil(count * pct);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < TRACE_BUCKETS; ++bucket)
+    {
+        seen += hist[bucket];
+        if (seen >= rank && seen > 0)
+            return bucket == 0 ? 0 : MIN((1ULL << bucket) - 1, max_ns);
+    }
+
+    return 0;
+}
+
+
+void trace_print_stats(Tracer *tracer, FILE *file)
+{
+    if (tracer->sample == 0)
+    {
+        fprintf(file, "Latency tracing is disabled.\n");
+        return;
+    }
+
+    fprintf(file, "%-16s %12s %12s %12s %12s %12s\n", "Latency (ns)", "count", "p50", "p90", "p99", "max");
+    for (int stage = 0; stage < NUM_STAGES; ++stage)
+    {
+        uint64_t count = 0;
+        for (int bucket = 0; bucket < TRACE_BUCKETS; ++bucket)
+            count += tracer->hist[stage][bucket];
+
+        fprintf(file, "%-16s %12lu %12lu %12lu %12lu %12lu\n", stage_names[stage], count,
+                percentile(tracer->hist[stage], count, 0.50, tracer->max_ns[stage]),
+                percentile(tracer->hist[stage], count, 0.90, tracer->max_ns[stage]),
+                percentile(tracer->hist[stage], count, 0.99, tracer->max_ns[stage]),
+                tracer->max_ns[stage]);
+    }
+}
+
+
+int trace_dump(Tracer *tracer)
+{
+    if (tracer->records == NULL)
+        return -1;
+
+    FILE *file = fopen(tracer->file, "wb");
+    if (file == NULL)
+        return -1;
+
+    uint64_t count  = MIN(tracer->num_records, TRACE_RECORDS);
+    uint64_t first  = tracer->num_records - count;
+
+    Trace_file_hdr hdr;
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version     = TRACE_VERSION;
+    hdr.record_size = sizeof(Trace_record);
+    hdr.count       = count;
+    fwrite(&hdr, sizeof(hdr), 1, file);
+
+    // Oldest record first
+    for (uint64_t k = first; k < tracer->num_records; ++k)
+        fwrite(&tracer->records[k % TRACE_RECORDS], sizeof(Trace_record), 1, file);
+
+    int ret = ferror(file) ? -1 : (int) count;
+    fclose(file);
+    return ret;
+}
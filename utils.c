@@ -9,438 +9,3782 @@ extern Client **subscribers;
 extern size_t subs_curr_cap;
 extern size_t subs_max_cap;
 
+// Index of all the topics known by the server
+extern Topic_index topic_index;
+
+// Number of filtered subscriptions, by topic hash (read by the ingest thread)
+extern _Atomic int filtered_topics[FILTERED_TOPIC_SLOTS];
+
+// Ingest stage (its TCP publishers are set by `--publish-port`)
+extern Ingest ingest;
+
+// Latency histograms of the sampled messages
+extern Tracer tracer;
+
+// Capture of the UDP ingest stream (`--capture`)
+extern Capture capture;
+
+// Socket of the multicast topics
+extern Mcast_egress mcast_egress;
+
+// Descriptors watched by the main loop
+extern Event_loop event_loop;
+
+// Index of the clients by ID
+extern Client_index client_index;
+
+// Memory used by the server (and its budget)
+extern Mem_stats mem_stats;
+
+// Timers of the clients and of the SF topics
+extern Timer_wheel timers;
+
+// Heartbeat interval, idle timeout and SF expiry (and their counters)
+extern Timeouts timeouts;
+
+// Queue length of the listeners (`--backlog`) and their counters
+extern int listen_backlog;
+extern Accept_stats accept_stats;
+
+// Zero-copy writes (`--zerocopy`), their orphaned sockets and their counters
+extern Zerocopy zerocopy;
+
+// Number of SF messages ever stored (orders the evictions)
+static uint64_t num_stored;
+
+// Non-empty SF queues, the one with the oldest message first
+static Sf_heap sf_heap;
+
+// Names of the priority classes (indexed by `lane_class`)
+static const char *lane_names[NUM_LANES] = {"high", "normal", "bulk"};
+
 // General usage buffer
 char buffer[BUFF_LEN];
 
 
 void respose_with_err_msg(const char *buffer, int client_sock)
 {
+    // The messages of a connected client are queued, to keep the stream in order
+    Client *client = get_client_by_socket(client_sock);
+    if (client != NULL)
+    {
+        // Without memory, the answer is dropped
+        Shared_msg *msg         = new_shared_msg();
+        if (msg == NULL)
+        {
+            mem_stats.dropped_msgs++;
+            return;
+        }
+
+        msg->msg.from_server    = true;
+        sprintf(msg->msg.size, "%lu", sizeof(TCP_msg));
+        strcpy(msg->msg.udp_msg.payload, buffer);
+
+        send_tcp_msg_to_conn_client(client, &msg, 0, LANE_HIGH);
+        put_shared_msg(msg);
+        return;
+    }
+
     // Create a new TCP message
-    TCP_msg *tcp_msg = (TCP_msg *) calloc(1, sizeof(TCP_msg));
-    DIE(tcp_msg == NULL, "[ERROR]: Allocation error!\n");
-    tcp_msg->from_server = true;
+    TCP_msg tcp_msg;
+    memset(&tcp_msg, 0, sizeof(TCP_msg));
+    tcp_msg.from_server = true;
 
     // First, send the size of the message
-    sprintf(tcp_msg->size, "%lu", sizeof(TCP_msg));
-    send(client_sock, tcp_msg->size, MAX_DIGITS_TCP_MSG_LEN, 0);
+    sprintf(tcp_msg.size, "%lu", sizeof(TCP_msg));
+    send(client_sock, tcp_msg.size, MAX_DIGITS_TCP_MSG_LEN, 0);
 
     // Send the actual message
-    strcpy(tcp_msg->udp_msg.payload, buffer);
-    send(client_sock, (char *) tcp_msg, atoi(tcp_msg->size), 0);
+    strcpy(tcp_msg.udp_msg.payload, buffer);
+    send(client_sock, (char *) &tcp_msg, atoi(tcp_msg.size), 0);
+}
+
+
+void mem_charge(Client *owner, mem_kind kind, ssize_t delta)
+{
+    mem_stats.used          += delta;
+    mem_stats.by_kind[kind] += delta;
+    mem_stats.peak          = MAX(mem_stats.peak, mem_stats.used + atomic_load_explicit(&ingest.mem_used, memory_order_relaxed));
+    if (owner != NULL)
+        owner->mem_used += delta;
+}
+
+
+void *mem_alloc(Client *owner, mem_kind kind, size_t size)
+{
+    Mem_hdr *hdr = (Mem_hdr *) calloc(1, sizeof(Mem_hdr) + size);
+    if (hdr == NULL)
+    {
+        mem_stats.failed++;
+        return NULL;
+    }
+
+    hdr->size   = size;
+    hdr->owner  = owner;
+    hdr->kind   = kind;
+    mem_charge(owner, kind, sizeof(Mem_hdr) + size);
+    return hdr + 1;
+}
+
+
+void *mem_realloc(Client *owner, mem_kind kind, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return mem_alloc(owner, kind, size);
+
+    Mem_hdr *hdr = (Mem_hdr *) realloc((Mem_hdr *) ptr - 1, sizeof(Mem_hdr) + size);
+    if (hdr == NULL)
+    {
+        mem_stats.failed++;
+        return NULL;
+    }
+
+    mem_charge(hdr->owner, hdr->kind, (ssize_t) size - (ssize_t) hdr->size);
+    hdr->size = size;
+    return hdr + 1;
+}
+
+
+void mem_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    Mem_hdr *hdr = (Mem_hdr *) ptr - 1;
+    mem_charge(hdr->owner, hdr->kind, -(ssize_t) (sizeof(Mem_hdr) + hdr->size));
+    free(hdr);
+}
+
+
+bool mem_over_budget(size_t extra)
+{
+    // The ingest thread keeps its own counter (the TCP publishers)
+    size_t used = mem_stats.used + atomic_load_explicit(&ingest.mem_used, memory_order_relaxed);
+    return mem_stats.budget != 0 && used + extra > mem_stats.budget;
+}
+
+
+bool set_mem_budget(const char *text)
+{
+    char *end;
+    errno = 0;
+    unsigned long long budget = strtoull(text, &end, 10);
+    if (end == text || errno != 0)
+        return false;
+
+    // An optional unit (powers of 1024)
+    int shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift != 0)
+        end++;
+
+    if (*end != '\0' || budget > (SIZE_MAX >> shift))
+        return false;
+
+    mem_stats.budget = (size_t) budget << shift;
+    return true;
+}
+
+
+bool set_timeout(const char *key, const char *text)
+{
+    char *end;
+    double seconds = strtod(text, &end);
+    if (end == text || *end != '\0' || seconds < 0)
+        return false;
+
+    uint64_t ms = (uint64_t) (seconds * 1000);
+    if (strcmp(key, "heartbeat") == 0)
+        timeouts.heartbeat_ms = ms;
+    else if (strcmp(key, "idle-timeout") == 0)
+        timeouts.idle_ms = ms;
+    else if (strcmp(key, "sf-ttl") == 0)
+        timeouts.sf_ttl_ms = ms;
+    else
+        return false;
+
+    return true;
+}
+
+
+Shared_msg *new_shared_msg()
+{
+    Shared_msg *msg = (Shared_msg *) mem_alloc(NULL, MEM_MSGS, sizeof(Shared_msg));
+    if (msg == NULL)
+        return NULL;
+
+    msg->refs       = 1;
+    msg->formatted  = true;
+
+    return msg;
+}
+
+
+void put_shared_msg(Shared_msg *msg)
+{
+    if (--msg->refs > 0)
+        return;
+
+    // A sampled message is traced once all its writes are done
+    if (msg->trace.sampled)
+        trace_msg(&tracer, &msg->trace);
+    mem_free(msg);
+}
+
+
+/* Key of a queue in the SF heap: the order of its oldest message */
+static uint64_t sf_heap_key(Topic *topic)
+{
+    return topic->tcps[topic->first_tcp].stored;
+}
+
+
+/* Put a queue at position `idx` of the SF heap */
+static void sf_heap_set(int idx, Topic *topic)
+{
+    sf_heap.topics[idx] = topic;
+    topic->heap_idx     = idx;
+}
+
+
+/* Move the queue at `idx` up while it's older than its parent */
+static void sf_heap_sift_up(int idx)
+{
+    Topic *topic = sf_heap.topics[idx];
+    while (idx > 0 && sf_heap_key(sf_heap.topics[(idx - 1) / 2]) > sf_heap_key(topic))
+    {
+        sf_heap_set(idx, sf_heap.topics[(idx - 1) / 2]);
+        idx = (idx - 1) / 2;
+    }
+    sf_heap_set(idx, topic);
+}
+
+
+/* Move the queue at `idx` down while one of its children is older */
+static void sf_heap_sift_down(int idx)
+{
+    Topic *topic = sf_heap.topics[idx];
+    while (2 * idx + 1 < sf_heap.num)
+    {
+        int child = 2 * idx + 1;
+        if (child + 1 < sf_heap.num && sf_heap_key(sf_heap.topics[child + 1]) < sf_heap_key(sf_heap.topics[child]))
+            child++;
+        if (sf_heap_key(sf_heap.topics[child]) >= sf_heap_key(topic))
+            break;
+
+        sf_heap_set(idx, sf_heap.topics[child]);
+        idx = child;
+    }
+    sf_heap_set(idx, topic);
+}
+
+
+/* Make room in the SF heap for one more queue, return false without memory */
+static bool sf_heap_reserve()
+{
+    if (sf_heap.num < sf_heap.max)
+        return true;
+
+    int max         = sf_heap.max == 0 ? INITIAL_SF_HEAP : sf_heap.max * 2;
+    Topic **topics  = (Topic **) mem_alloc(NULL, MEM_QUEUES, max * sizeof(Topic *));
+    if (topics == NULL)
+        return false;
+
+    if (sf_heap.num > 0)
+        memcpy(topics, sf_heap.topics, sf_heap.num * sizeof(Topic *));
+    mem_free(sf_heap.topics);
+    sf_heap.topics  = topics;
+    sf_heap.max     = max;
+    return true;
+}
+
+
+/* Take a queue out of the SF heap (if it's in it) */
+static void sf_heap_remove(Topic *topic)
+{
+    int idx = topic->heap_idx;
+    if (idx < 0)
+        return;
+
+    topic->heap_idx = -1;
+    Topic *last     = sf_heap.topics[--sf_heap.num];
+    if (idx == sf_heap.num)
+        return;
+
+    // The last queue takes the free position, then goes where its age puts it
+    sf_heap_set(idx, last);
+    sf_heap_sift_up(idx);
+    sf_heap_sift_down(last->heap_idx);
+}
+
+
+/* The oldest messages of a queue were released: it moves down the SF heap (or leaves it once empty) */
+static void sf_heap_update(Topic *topic)
+{
+    if (topic->heap_idx < 0)
+        return;
+
+    if (topic->num_of_tcps == 0)
+        sf_heap_remove(topic);
+    else
+        sf_heap_sift_down(topic->heap_idx);
+}
+
+
+/* Release all the messages kept for a topic */
+static void drop_pending_msgs(Topic *topic)
+{
+    for (int k = 0; k < topic->num_of_tcps; ++k)
+        put_shared_msg(topic->tcps[(topic->first_tcp + k) % topic->max_tcps].msg);
+
+    topic->first_tcp    = 0;
+    topic->num_of_tcps  = 0;
+    sf_heap_remove(topic);
+}
+
+
+/* Release the messages of a topic with a sequence number up to `seq` */
+static void ack_pending_msgs(Topic *topic, uint32_t seq)
+{
+    while (topic->num_of_tcps > 0)
+    {
+        Pending_msg *pending = &topic->tcps[topic->first_tcp];
+
+        // Compare in the sequence space (numbers may wrap around)
+        if ((int32_t) (pending->seq - seq) > 0)
+            break;
+
+        put_shared_msg(pending->msg);
+        topic->first_tcp = (topic->first_tcp + 1) % topic->max_tcps;
+        topic->num_of_tcps--;
+    }
+
+    sf_heap_update(topic);
+}
+
+
+/* Timer of a topic: release its SF messages older than `sf_ttl_ms` */
+static void expire_sf_msgs(Timer *timer, void *arg)
+{
+    Topic *topic = container_of(timer, Topic, expiry);
+
+    while (topic->num_of_tcps > 0)
+    {
+        Pending_msg *pending = &topic->tcps[topic->first_tcp];
+        if (pending->stored_ms + timeouts.sf_ttl_ms > timers.now_ms)
+        {
+            // Fire again when the new oldest message expires
+            timer_add(&timers, timer, pending->stored_ms + timeouts.sf_ttl_ms);
+            break;
+        }
+
+        put_shared_msg(pending->msg);
+        topic->first_tcp = (topic->first_tcp + 1) % topic->max_tcps;
+        topic->num_of_tcps--;
+        timeouts.expired_msgs++;
+    }
+
+    sf_heap_update(topic);
+}
+
+
+/* Send a heartbeat to a client (it answers with `OP_HEARTBEAT`) */
+static void send_heartbeat(Client *client)
+{
+    // Without memory, the next tick tries again
+    Shared_msg *msg         = new_shared_msg();
+    if (msg == NULL)
+        return;
+
+    msg->msg.from_server    = true;
+    msg->msg.udp_msg.type   = HEARTBEAT;
+    sprintf(msg->msg.size, "%lu", sizeof(TCP_msg));
+    sprintf(msg->msg.udp_msg.payload, "%lu", timeouts.heartbeat_ms);
+
+    send_tcp_msg_to_conn_client(client, &msg, 0, LANE_HIGH);
+    put_shared_msg(msg);
+    timeouts.heartbeats++;
+}
+
+
+/**
+ * Arm the timer of a client at its nearest deadline: the next heartbeat (a quiet connection), or the idle timeout
+ * (the SF messages expire with the timers of their topics); without both, the timer isn't armed
+*/
+static void arm_client_deadline(Client *client, uint64_t now)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    if (timeouts.heartbeat_ms != 0)
+    {
+        deadline = MIN(client->last_rx_ms, client->last_tx_ms) + timeouts.heartbeat_ms;
+
+        // A heartbeat that wasn't answered is sent again after a full interval
+        if (deadline <= now)
+            deadline = now + timeouts.heartbeat_ms;
+    }
+    if (timeouts.idle_ms != 0)
+        deadline = MIN(deadline, client->last_rx_ms + timeouts.idle_ms);
+
+    if (deadline != UINT64_MAX)
+        timer_add(&timers, &client->timer, deadline);
+}
+
+
+/* Timer of a connected client: disconnect it if it's idle, or send it a heartbeat if the connection is quiet */
+static void client_timer(Timer *timer, void *arg)
+{
+    Client *client      = container_of(timer, Client, timer);
+    uint64_t now        = timers.now_ms;
+
+    if (timeouts.idle_ms != 0 && now - client->last_rx_ms >= timeouts.idle_ms)
+    {
+        printf("Client %s timed out.\n", client->id);
+        timeouts.idle_clients++;
+        disconnect_client(client->socket);
+        return;
+    }
+
+    if (timeouts.heartbeat_ms != 0
+        && (now - client->last_rx_ms >= timeouts.heartbeat_ms || now - client->last_tx_ms >= timeouts.heartbeat_ms))
+        send_heartbeat(client);
+
+    arm_client_deadline(client, now);
+}
+
+
+/* Start the timer of a (re)connected client (heartbeats and idle timeout) */
+static void arm_client_timer(Client *client)
+{
+    client->last_rx_ms = timer_now_ms();
+    client->last_tx_ms = client->last_rx_ms;
+
+    arm_client_deadline(client, client->last_rx_ms);
+}
+
+
+/* Unmap the shared ring of a client (if it has one) */
+static void release_shm_ring(Client *client)
+{
+    if (client->shm == NULL)
+        return;
+
+    mem_charge(client, MEM_QUEUES, -(ssize_t) client->shm->map_len);
+    shm_ring_destroy(client->shm);
+    mem_free(client->shm);
+    client->shm = NULL;
+}
+
+
+bool set_zerocopy(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < 0)
+        return false;
+
+    zerocopy.min_len = (size_t) value;
+    return true;
+}
+
+
+/* Set `SO_ZEROCOPY` on the socket of a (re)connected client (the kernel numbers its writes from 0) */
+static void enable_zerocopy(Client *client)
+{
+    int on = 1;
+    client->zc.enabled = zerocopy.min_len > 0 && setsockopt(client->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    client->zc.next_id = 0;
+}
+
+
+/* Release the references of the completed writes `lo`..`hi` (the counters wrap around) */
+static void complete_zc_writes(Zc_state *zc, uint32_t lo, uint32_t hi)
+{
+    for (int k = 0; k < zc->num; ++k)
+    {
+        Zc_ref *ref = &zc->refs[(zc->first + k) % zc->max];
+        if ((int32_t) (ref->id - hi) > 0)
+            break;
+
+        if ((int32_t) (ref->id - lo) >= 0 && ref->msg != NULL)
+        {
+            put_shared_msg(ref->msg);
+            ref->msg = NULL;
+        }
+    }
+
+    // The released references leave the list once the older ones are released too
+    while (zc->num > 0 && zc->refs[zc->first].msg == NULL)
+    {
+        zc->first = (zc->first + 1) % zc->max;
+        zc->num--;
+    }
+}
+
+
+/* Read the completions from the error queue of a socket, return the number of references still held */
+static int reap_zc_socket(int sock, Zc_state *zc)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+    while (zc->num > 0)
+    {
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control     = control;
+        hdr.msg_controllen  = sizeof(control);
+        if (recvmsg(sock, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+                continue;
+
+            struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                continue;
+
+            // A single notification covers the writes [`ee_info`, `ee_data`]
+            uint32_t count      = err->ee_data - err->ee_info + 1;
+            zerocopy.completed  += count;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zerocopy.copied += count;
+
+            complete_zc_writes(zc, err->ee_info, err->ee_data);
+        }
+    }
+
+    return zc->num;
+}
+
+
+/* Release every reference of a socket (the server stops, so the kernel's pages don't matter anymore) */
+static void drop_zc_refs(Zc_state *zc)
+{
+    for (int k = 0; k < zc->num; ++k)
+        if (zc->refs[(zc->first + k) % zc->max].msg != NULL)
+            put_shared_msg(zc->refs[(zc->first + k) % zc->max].msg);
+
+    mem_free(zc->refs);
+    memset(zc, 0, sizeof(Zc_state));
+}
+
+
+/* Timer of the orphans: close the sockets whose zero-copy writes completed */
+static void poll_zc_orphans(Timer *timer, void *arg)
+{
+    for (int i = zerocopy.num_orphans - 1; i >= 0; --i)
+    {
+        Zc_orphan *orphan = &zerocopy.orphans[i];
+        if (reap_zc_socket(orphan->socket, &orphan->zc) > 0)
+            continue;
+
+        close(orphan->socket);
+        mem_free(orphan->zc.refs);
+        *orphan = zerocopy.orphans[--zerocopy.num_orphans];
+    }
+
+    if (zerocopy.num_orphans > 0)
+        timer_add(&timers, timer, timers.now_ms + ZC_ORPHAN_POLL_MS);
+}
+
+
+/**
+ * Close the socket of a disconnected client, unless the kernel may still read the messages of its zero-copy writes:
+ * then it's shut down and kept open (with the references) until they complete
+*/
+static void close_client_socket(Client *client, int sock)
+{
+    if (reap_zc_socket(sock, &client->zc) == 0)
+    {
+        close(sock);
+        return;
+    }
+
+    // The unsent bytes are still sent (or dropped by a reset), then the writes complete
+    shutdown(sock, SHUT_RDWR);
+
+    if (zerocopy.num_orphans == zerocopy.max_orphans)
+    {
+        int max             = zerocopy.max_orphans == 0 ? INITIAL_MAX_ORPHANS : zerocopy.max_orphans * 2;
+        Zc_orphan *orphans  = (Zc_orphan *) mem_realloc(NULL, MEM_QUEUES, zerocopy.orphans, max * sizeof(Zc_orphan));
+
+        // Without memory, the messages are never released (they're still read by the kernel)
+        if (orphans == NULL)
+        {
+            close(sock);
+            mem_free(client->zc.refs);
+            memset(&client->zc, 0, sizeof(Zc_state));
+            return;
+        }
+
+        zerocopy.orphans        = orphans;
+        zerocopy.max_orphans    = max;
+    }
+
+    zerocopy.orphans[zerocopy.num_orphans++] = (Zc_orphan) {sock, client->zc};
+    memset(&client->zc, 0, sizeof(Zc_state));
+
+    if (!timer_pending(&zerocopy.timer))
+    {
+        timer_init(&zerocopy.timer, poll_zc_orphans);
+        timer_add(&timers, &zerocopy.timer, timer_now_ms() + ZC_ORPHAN_POLL_MS);
+    }
+}
+
+
+void print_zerocopy_stats(FILE *file)
+{
+    if (zerocopy.min_len == 0)
+        return;
+
+    fprintf(file, "Zero-copy writes: %lu (%lu messages), completed: %lu (%lu copied by the kernel), copied fallbacks: %lu, closed sockets waiting: %d\n",
+            zerocopy.writes, zerocopy.msgs, zerocopy.completed, zerocopy.copied, zerocopy.fallbacks, zerocopy.num_orphans);
+}
+
+
+/* FNV-1a hash of a name (a topic or a client ID) */
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+Client *get_client_by_id(const char *id)
+{
+    if (client_index.buckets == NULL)
+        return NULL;
+
+    size_t bucket = hash_name(id, strlen(id)) & (client_index.num_buckets - 1);
+    for (Client *client = client_index.buckets[bucket]; client != NULL; client = client->next_by_id)
+        if (strcmp(client->id, id) == 0)
+            return client;
+
+    return NULL;
+}
+
+
+Client *get_client_by_socket(int sock)
+{
+    // Only the connected clients own a watched socket
+    Conn_slot *slot = get_conn_slot(sock);
+    return slot != NULL && slot->kind == CONN_CLIENT ? (Client *) slot->ptr : NULL;
+}
+
+
+/* Add a client in its bucket of the client index */
+static void client_index_link(Client **buckets, size_t num_buckets, Client *client)
+{
+    size_t bucket       = hash_name(client->id, strlen(client->id)) & (num_buckets - 1);
+    client->next_by_id  = buckets[bucket];
+    buckets[bucket]     = client;
+}
+
+
+/* Make room in the client index for one more client, return false if it has no buckets (no memory) */
+static bool client_index_reserve()
+{
+    if (client_index.buckets == NULL)
+    {
+        client_index.buckets = (Client **) mem_alloc(NULL, MEM_CLIENTS, INITIAL_CLIENT_BUCKETS * sizeof(Client *));
+        if (client_index.buckets == NULL)
+            return false;
+        client_index.num_buckets = INITIAL_CLIENT_BUCKETS;
+    }
+
+    // Keep the load factor under 1 (without memory, the chains get longer)
+    if (subs_curr_cap < client_index.num_buckets)
+        return true;
+
+    size_t num_buckets  = client_index.num_buckets * 2;
+    Client **buckets    = (Client **) mem_alloc(NULL, MEM_CLIENTS, num_buckets * sizeof(Client *));
+    if (buckets == NULL)
+        return true;
+
+    for (int i = 0; i < subs_curr_cap; ++i)
+        client_index_link(buckets, num_buckets, subscribers[i]);
+
+    mem_free(client_index.buckets);
+    client_index.buckets        = buckets;
+    client_index.num_buckets    = num_buckets;
+    return true;
+}
+
+
+/* Resize the table of a client to `max` subscriptions, return false if it can't be resized */
+static bool resize_subs(Client *client, int max)
+{
+    Sub_table *table    = &client->subs;
+    uint32_t *keys      = (uint32_t *) mem_realloc(client, MEM_CLIENTS, table->keys, max * sizeof(uint32_t));
+    if (keys == NULL)
+        return false;
+    table->keys = keys;
+
+    // A failed growth leaves `keys` larger than `max`, it's harmless
+    Topic **topics = (Topic **) mem_realloc(client, MEM_CLIENTS, table->topics, max * sizeof(Topic *));
+    if (topics == NULL)
+        return false;
+    table->topics   = topics;
+    table->max      = max;
+    return true;
+}
+
+
+bool add_new_client(const char *id, int req_tcp_socket)
+{
+    // Over the budget, the server keeps serving the clients it has
+    if (mem_over_budget(sizeof(Client)))
+    {
+        mem_stats.rejected_clients++;
+        return false;
+    }
+
+    // Create a new client
+    Client *client = (Client *) mem_alloc(NULL, MEM_CLIENTS, sizeof(Client));
+    if (client == NULL)
+    {
+        mem_stats.rejected_clients++;
+        return false;
+    }
+
+    // Complete the client's fields
+    strcpy(client->id, id);
+    client->socket          = req_tcp_socket;
+    client->connected       = true;
+    client->resumed         = true;
+    timer_init(&client->timer, client_timer);
+    enable_zerocopy(client);
+
+    // Alloc memory for client's subscriptions
+    resize_subs(client, INITIAL_MAX_SUB_KEYS);
+
+    // Reallocate memory for the list of `subscribers` if needed
+    if (client->subs.max != 0 && subs_curr_cap == subs_max_cap)
+    {
+        Client **list = (Client **) mem_realloc(NULL, MEM_CLIENTS, subscribers, subs_max_cap * 2 * sizeof(Client *));
+        if (list != NULL)
+        {
+            subscribers     = list;
+            subs_max_cap    *= 2;
+        }
+    }
+
+    if (client->subs.max == 0 || subs_curr_cap == subs_max_cap || !client_index_reserve())
+    {
+        mem_free(client->subs.keys);
+        mem_free(client->subs.topics);
+        mem_free(client);
+        mem_stats.rejected_clients++;
+        return false;
+    }
+
+    // Add the new `client` in the `subscribers` list and in the index
+    client_index_link(client_index.buckets, client_index.num_buckets, client);
+    subscribers[subs_curr_cap++] = client;
+    set_fd_owner(req_tcp_socket, CONN_CLIENT, client);
+    arm_client_timer(client);
+    return true;
+}
+
+
+void reconnect_old_sub(Client *client, int req_tcp_socket)
+{
+    // Update the fields of the `client`
+    // The stored messages are replayed when the client sends `OP_RESUME`
+    // (until then, the new SF messages are only stored, to keep them in order)
+    client->socket      = req_tcp_socket;
+    client->connected   = true;
+    client->resumed     = false;
+    set_fd_owner(req_tcp_socket, CONN_CLIENT, client);
+    arm_client_timer(client);
+    enable_zerocopy(client);
+
+    // A new connection knows no alias yet
+    for (int i = 0; i < client->subs.num; ++i)
+        client->subs.topics[i]->alias_sent = false;
+}
+
+
+void disconnect_client(int sock)
+{
+    Client *client = get_client_by_socket(sock);
+    if (client == NULL)
+    {
+        // Not a client anymore (e.g. a connection closed during its handshake)
+        unwatch_fd(sock);
+        close(sock);
+        return;
+    }
+
+    printf("Client %s disconnected.\n", client->id);
+
+    // Disconnect the client (and drop its incomplete control frame and its queued messages)
+    // The unacknowledged SF messages stay stored, new ones are added to them
+    client->connected   = false;
+    client->rx_len      = 0;
+    drop_client_output(client);
+    timer_del(&timers, &client->timer);
+
+    // A reconnected client gets a new ring (if it asks for one, with a new token)
+    release_shm_ring(client);
+    client->shm_token[0] = '\0';
+
+    // Close the socket (once its zero-copy writes complete), the main loop stops watching it
+    unwatch_fd(sock);
+    close_client_socket(client, sock);
+}
+
+
+bool set_backlog(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < 1 || value > INT32_MAX)
+        return false;
+
+    listen_backlog = (int) value;
+    return true;
+}
+
+
+void event_loop_init()
+{
+    event_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    DIE(event_loop.epoll_fd < 0, "[ERROR]: Couldn't create the epoll instance!\n");
+}
+
+
+bool watch_fd(int fd, conn_kind kind, void *ptr)
+{
+    // Grow the table up to the descriptor
+    if (fd >= event_loop.max_slots)
+    {
+        int max_slots = MAX(event_loop.max_slots, INITIAL_MAX_CONN_SLOTS);
+        while (max_slots <= fd)
+            max_slots *= 2;
+
+        Conn_slot *slots = (Conn_slot *) mem_realloc(NULL, MEM_CLIENTS, event_loop.slots, max_slots * sizeof(Conn_slot));
+        if (slots == NULL)
+            return false;
+
+        memset(slots + event_loop.max_slots, 0, (max_slots - event_loop.max_slots) * sizeof(Conn_slot));
+        event_loop.slots        = slots;
+        event_loop.max_slots    = max_slots;
+    }
+
+    // A regular file can't be watched (`EPERM`)
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        DIE(errno != ENOMEM && errno != ENOSPC && errno != EPERM, "[ERROR]: Couldn't watch a descriptor!\n");
+        return false;
+    }
+
+    event_loop.slots[fd] = (Conn_slot) {kind, false, ptr};
+    return true;
+}
+
+
+void set_fd_owner(int fd, conn_kind kind, void *ptr)
+{
+    event_loop.slots[fd].kind   = kind;
+    event_loop.slots[fd].ptr    = ptr;
+}
+
+
+void watch_fd_output(int fd, bool on)
+{
+    Conn_slot *slot = get_conn_slot(fd);
+    if (slot == NULL || slot->writing == on)
+        return;
+
+    struct epoll_event event = {.events = EPOLLIN | (on ? EPOLLOUT : 0), .data.fd = fd};
+    int ret = epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    DIE(ret < 0, "[ERROR]: Couldn't change the events of a descriptor!\n");
+    slot->writing = on;
+}
+
+
+void unwatch_fd(int fd)
+{
+    if (get_conn_slot(fd) == NULL)
+        return;
+
+    epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    memset(&event_loop.slots[fd], 0, sizeof(Conn_slot));
+}
+
+
+Conn_slot *get_conn_slot(int fd)
+{
+    if (fd < 0 || fd >= event_loop.max_slots || event_loop.slots[fd].kind == CONN_NONE)
+        return NULL;
+
+    return &event_loop.slots[fd];
+}
+
+
+int event_loop_wait(struct epoll_event *events, int max_events, int timeout_ms)
+{
+    int ret = epoll_wait(event_loop.epoll_fd, events, max_events, timeout_ms);
+    DIE(ret < 0 && errno != EINTR, "[ERROR]: Couldn't wait for the sockets!\n");
+    return ret;
+}
+
+
+/* Timer of a handshake: the connection didn't send its ID in time */
+static void handshake_timeout(Timer *timer, void *arg)
+{
+    Handshake *handshake = container_of(timer, Handshake, timer);
+
+    end_handshake(handshake, true);
+    accept_stats.timeouts++;
+}
+
+
+void accept_connections(int listener, bool shm)
+{
+    // Drain the queue of the listener (a reconnect storm fills it at once)
+    for (int k = 0; k < ACCEPT_BURST; ++k)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len  = sizeof(addr);
+        int sock            = accept4(listener, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        // A connection aborted meanwhile is skipped, without descriptors (or memory) the others wait
+        if (sock < 0)
+        {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                return;
+            continue;
+        }
+
+        // Without memory for its handshake (or its slot), the connection is refused
+        Handshake *handshake = (Handshake *) mem_alloc(NULL, MEM_CLIENTS, sizeof(Handshake));
+        if (handshake == NULL || !watch_fd(sock, CONN_HANDSHAKE, handshake))
+        {
+            mem_free(handshake);
+            accept_stats.refused++;
+            close(sock);
+            continue;
+        }
+
+        if (!shm)
+        {
+            // Disable Nagle's algorithm
+            int opt = 1;
+            int ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &opt, sizeof(int));
+            DIE(ret < 0, "[ERROR]: Couldn't disable the Nagle's algorithm!\n");
+
+            // Keep little unsent data in the socket, so the lanes decide what is written next
+            opt = OUT_NOTSENT_LOWAT;
+            ret = setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *) &opt, sizeof(int));
+            DIE(ret < 0, "[ERROR]: Couldn't limit the unsent data of the socket!\n");
+        }
+
+        handshake->socket   = sock;
+        handshake->shm      = shm;
+        handshake->addr     = addr;
+        timer_init(&handshake->timer, handshake_timeout);
+        timer_add(&timers, &handshake->timer, timer_now_ms() + HANDSHAKE_TIMEOUT_MS);
+        accept_stats.accepted++;
+    }
+}
+
+
+int recv_handshake(Handshake *handshake)
+{
+    // Only the ID is read, the control frames that may follow belong to the client's stream
+    // (a ring request has nothing else than its token after the ID)
+    int ret;
+    if (handshake->len < ID_CLIENT_LEN)
+        ret = recv(handshake->socket, handshake->id + handshake->len, ID_CLIENT_LEN - handshake->len, 0);
+    else
+        ret = recv(handshake->socket, handshake->token + handshake->len - ID_CLIENT_LEN,
+                   ID_CLIENT_LEN + SHM_TOKEN_LEN - handshake->len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 1;
+    if (ret <= 0)
+        return 0;
+
+    handshake->len += ret;
+    if (handshake->len == ID_CLIENT_LEN)
+        handshake->id[ID_CLIENT_LEN - 1] = '\0';
+    if (handshake->len == ID_CLIENT_LEN + SHM_TOKEN_LEN)
+        handshake->token[SHM_TOKEN_LEN - 1] = '\0';
+
+    return handshake->len == ID_CLIENT_LEN + (handshake->shm ? SHM_TOKEN_LEN : 0) ? 2 : 1;
+}
+
+
+void end_handshake(Handshake *handshake, bool close_socket)
+{
+    timer_del(&timers, &handshake->timer);
+    if (close_socket)
+    {
+        unwatch_fd(handshake->socket);
+        close(handshake->socket);
+    }
+    else
+        set_fd_owner(handshake->socket, CONN_HANDSHAKE, NULL);
+    mem_free(handshake);
+}
+
+
+void print_accept_stats(FILE *file)
+{
+    fprintf(file, "Connections accepted: %lu, handshake timeouts: %lu, refused: %lu\n",
+            accept_stats.accepted, accept_stats.timeouts, accept_stats.refused);
+}
+
+
+/* Double the number of buckets of the topic index */
+static void grow_topic_index()
+{
+    // Without memory, the index keeps its buckets (the chains get longer)
+    size_t num_buckets      = topic_index.num_buckets * 2;
+    Topic_entry **buckets   = (Topic_entry **) mem_alloc(NULL, MEM_TOPICS, num_buckets * sizeof(Topic_entry *));
+    if (buckets == NULL)
+        return;
+
+    // Move every entry in its new bucket
+    for (size_t i = 0; i < topic_index.num_buckets; ++i)
+    {
+        Topic_entry *entry = topic_index.buckets[i];
+        while (entry != NULL)
+        {
+            Topic_entry *next   = entry->next;
+            size_t bucket       = entry->hash & (num_buckets - 1);
+            entry->next         = buckets[bucket];
+            buckets[bucket]     = entry;
+            entry               = next;
+        }
+    }
+
+    mem_free(topic_index.buckets);
+    topic_index.buckets     = buckets;
+    topic_index.num_buckets = num_buckets;
+}
+
+
+Topic_entry *topic_index_get(const char *name, size_t len, bool create)
+{
+    // Lazily create the buckets
+    if (topic_index.buckets == NULL)
+    {
+        if (!create)
+            return NULL;
+
+        topic_index.buckets     = (Topic_entry **) mem_alloc(NULL, MEM_TOPICS, INITIAL_TOPIC_BUCKETS * sizeof(Topic_entry *));
+        if (topic_index.buckets == NULL)
+            return NULL;
+        topic_index.num_buckets = INITIAL_TOPIC_BUCKETS;
+    }
+
+    uint32_t hash = hash_name(name, len);
+    for (Topic_entry *entry = topic_index.buckets[hash & (topic_index.num_buckets - 1)]; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && entry->name_len == len && memcmp(entry->name, name, len) == 0)
+            return entry;
+
+    if (!create)
+        return NULL;
+
+    // Keep the load factor under 1
+    if (topic_index.num_entries == topic_index.num_buckets)
+        grow_topic_index();
+
+    // Create a new entry for this topic
+    Topic_entry *entry = (Topic_entry *) mem_alloc(NULL, MEM_TOPICS, sizeof(Topic_entry));
+    if (entry == NULL)
+        return NULL;
+    memcpy(entry->name, name, len);
+    entry->name_len = len;
+    entry->hash     = hash;
+    entry->lane     = LANE_NORMAL;
+
+    size_t bucket   = hash & (topic_index.num_buckets - 1);
+    entry->next     = topic_index.buckets[bucket];
+    topic_index.buckets[bucket] = entry;
+    topic_index.num_entries++;
+
+    // The entries are never removed, so their count is the next ID
+    entry->alias    = topic_index.num_entries;
+
+    return entry;
+}
+
+
+/* Append the subscription (`client`, `topic`) to the fanout list of `entry`, return false if it can't grow */
+static bool fanout_list_add(Topic_entry *entry, Client *client, Topic *topic)
+{
+    if (entry->num_subs == entry->max_subs)
+    {
+        int max_subs        = entry->max_subs == 0 ? INITIAL_MAX_SUBS : entry->max_subs * 2;
+        Subscription *subs  = (Subscription *) mem_realloc(NULL, MEM_TOPICS, entry->subs, max_subs * sizeof(Subscription));
+        if (subs == NULL)
+            return false;
+
+        entry->subs     = subs;
+        entry->max_subs = max_subs;
+    }
+
+    topic->entry    = entry;
+    topic->sub_idx  = entry->num_subs;
+    entry->subs[entry->num_subs].client = client;
+    entry->subs[entry->num_subs].topic  = topic;
+    entry->num_subs++;
+    return true;
+}
+
+
+/* Remove the subscription of `topic` from the fanout list of its entry */
+static void fanout_list_del(Topic *topic)
+{
+    Topic_entry *entry = topic->entry;
+
+    // Move the last subscription in the freed position
+    Subscription *last          = &entry->subs[--entry->num_subs];
+    entry->subs[topic->sub_idx] = *last;
+    last->topic->sub_idx        = topic->sub_idx;
+}
+
+
+/**
+ * Add the subscription (`client`, `topic`) to `entry` (a multicast subscription is only counted)
+ * Return false if the fanout list can't grow
+*/
+static bool topic_entry_add_sub(Topic_entry *entry, Client *client, Topic *topic)
+{
+    topic->entry = entry;
+    if (topic->mcast)
+        entry->num_mcast_subs++;
+    else if (!fanout_list_add(entry, client, topic))
+        return false;
+
+    // The first subscriber makes this node interested in the topic
+    if (entry->num_subs + entry->num_mcast_subs == 1)
+        federation_local_interest(entry, true);
+    return true;
+}
+
+
+/* Remove the subscription of `topic` from its entry */
+static void topic_entry_del_sub(Topic *topic)
+{
+    Topic_entry *entry = topic->entry;
+    if (topic->mcast)
+        entry->num_mcast_subs--;
+    else
+        fanout_list_del(topic);
+
+    if (entry->num_subs + entry->num_mcast_subs == 0)
+        federation_local_interest(entry, false);
+}
+
+
+/* Tell if a subscription can be served by the multicast group of its topic (it has no per-subscriber state) */
+static bool mcast_delivery(Topic_entry *entry, Action *action)
+{
+    return entry->mcast && action->mcast && action->sf == 0 && action->rate == 0
+        && action->every <= 1 && !action->filter.active;
+}
+
+
+/* Tell a client on which multicast group it gets a topic (or that it gets it over TCP again) */
+static void announce_mcast(Client *client, Topic *topic)
+{
+    if (!client->connected)
+        return;
+
+    // Without memory, the notice is dropped (a resuming subscriber gets its groups again)
+    Topic_entry *entry      = topic->entry;
+    Shared_msg *msg         = new_shared_msg();
+    if (msg == NULL)
+    {
+        mem_stats.dropped_msgs++;
+        return;
+    }
+
+    msg->msg.from_server    = true;
+    msg->msg.udp_msg.type   = topic->mcast ? MCAST_JOIN : MCAST_LEAVE;
+    sprintf(msg->msg.size, "%lu", sizeof(TCP_msg));
+    memcpy(msg->msg.udp_msg.topic, entry->name, entry->name_len);
+
+    // The subscriber expects the messages after the current one
+    if (topic->mcast)
+        sprintf(msg->msg.udp_msg.payload, "%s %d %u", inet_ntoa(entry->mcast_addr.sin_addr),
+                ntohs(entry->mcast_addr.sin_port), entry->mcast_seq);
+
+    send_tcp_msg_to_conn_client(client, &msg, 0, LANE_HIGH);
+    put_shared_msg(msg);
+}
+
+
+/* Move a subscription between the fanout list and the multicast group of its topic, return true if it moved */
+static bool set_topic_delivery(Client *client, Topic *topic, bool mcast)
+{
+    if (topic->mcast == mcast)
+        return false;
+
+    // The number of subscriptions doesn't change, so the interest of this node stays the same
+    if (mcast)
+    {
+        fanout_list_del(topic);
+        topic->entry->num_mcast_subs++;
+    }
+    else
+    {
+        // Without room in the fanout list, the subscription stays on the multicast group
+        if (!fanout_list_add(topic->entry, client, topic))
+            return false;
+        topic->entry->num_mcast_subs--;
+    }
+
+    topic->mcast = mcast;
+    announce_mcast(client, topic);
+    return true;
+}
+
+
+int recv_ctrl_frames(Client *client)
+{
+    // Make room for a new chunk
+    if (client->rx_cap - client->rx_len < CTRL_RX_CHUNK)
+    {
+        // Without memory, the client is disconnected
+        size_t rx_cap   = MAX(client->rx_cap * 2, client->rx_len + CTRL_RX_CHUNK);
+        char *rx_buf    = (char *) mem_realloc(client, MEM_QUEUES, client->rx_buf, rx_cap);
+        if (rx_buf == NULL)
+            return 0;
+
+        client->rx_buf  = rx_buf;
+        client->rx_cap  = rx_cap;
+    }
+
+    // The completions of the zero-copy writes also make the socket readable
+    reap_zc_socket(client->socket, &client->zc);
+
+    // The socket is non-blocking, it may have nothing to read after all
+    int ret = recv(client->socket, client->rx_buf + client->rx_len, client->rx_cap - client->rx_len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 1;
+    DIE(ret < 0 && errno != ECONNRESET && errno != ETIMEDOUT, "[ERROR]: Couldn't receive the message from a connected client!\n");
+    if (ret <= 0)
+        return 0;
+    client->rx_len      += ret;
+    client->last_rx_ms  = timer_now_ms();
+
+    // Apply every complete frame
+    size_t off = 0;
+    while (client->rx_len - off >= sizeof(Ctrl_hdr))
+    {
+        Ctrl_hdr *hdr   = (Ctrl_hdr *) (client->rx_buf + off);
+        size_t len      = ntohl(hdr->len);
+        if (len < sizeof(Ctrl_hdr) - sizeof(hdr->len) || len > CTRL_MAX_FRAME)
+            return 0;
+
+        size_t frame_len = sizeof(hdr->len) + len;
+        if (client->rx_len - off < frame_len)
+            break;
+
+        apply_ctrl_frame(client, hdr->opcode, ntohs(hdr->count),
+                         client->rx_buf + off + sizeof(Ctrl_hdr), frame_len - sizeof(Ctrl_hdr));
+        off += frame_len;
+    }
+
+    // Keep only the incomplete frame
+    memmove(client->rx_buf, client->rx_buf + off, client->rx_len - off);
+    client->rx_len -= off;
+
+    return 1;
+}
+
+
+/* Decode the options of a topic record into `action` */
+static void decode_ctrl_opts(Action *action, const char *opts, size_t len)
+{
+    size_t off = 0;
+    while (len - off >= sizeof(Ctrl_opt))
+    {
+        Ctrl_opt *opt = (Ctrl_opt *) (opts + off);
+        if (len - off - sizeof(Ctrl_opt) < opt->len)
+            return;
+
+        const char *value = opts + off + sizeof(Ctrl_opt);
+        switch (opt->kind)
+        {
+            case OPT_SEQ:
+                if (opt->len == sizeof(uint32_t))
+                    action->seq = ntohl(*(uint32_t *) value);
+                break;
+
+            case OPT_RATE:
+                if (opt->len == sizeof(uint32_t))
+                    action->rate = ntohl(*(uint32_t *) value);
+                break;
+
+            case OPT_EVERY:
+                if (opt->len == sizeof(uint32_t))
+                    action->every = ntohl(*(uint32_t *) value);
+                break;
+
+            case OPT_ORIGIN:
+                if (opt->len == sizeof(uint32_t))
+                    action->origin = ntohl(*(uint32_t *) value);
+                break;
+
+            case OPT_VERSION:
+                if (opt->len == sizeof(uint32_t))
+                    action->version = ntohl(*(uint32_t *) value);
+                break;
+
+            case OPT_COUNT:
+                if (opt->len == sizeof(uint32_t))
+                    action->count = ntohl(*(uint32_t *) value);
+                break;
+
+            case OPT_MCAST:
+                action->mcast = true;
+                break;
+
+            case OPT_ALIAS:
+                action->alias = true;
+                break;
+
+            case OPT_FILTER:
+            {
+                // The predicate is compiled once, here
+                char text[FILTER_TEXT_LEN + 1];
+                if (opt->len > FILTER_TEXT_LEN)
+                {
+                    action->invalid = true;
+                    break;
+                }
+                memcpy(text, value, opt->len);
+                text[opt->len] = '\0';
+
+                if (!compile_filter(text, &action->filter))
+                    action->invalid = true;
+                break;
+            }
+
+            default:
+                // Unknown option, skip it
+                break;
+        }
+
+        off += sizeof(Ctrl_opt) + opt->len;
+    }
+}
+
+
+int decode_ctrl_records(int count, const char *body, size_t len, Action *actions)
+{
+    int num_actions = 0;
+    size_t off      = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (len - off < sizeof(Ctrl_rec))
+            break;
+
+        Ctrl_rec *rec   = (Ctrl_rec *) (body + off);
+        size_t rec_len  = sizeof(Ctrl_rec) + rec->topic_len + rec->opts_len;
+        if (len - off < rec_len)
+            break;
+
+        // Ignore the records with invalid topic names
+        if (rec->topic_len > 0 && rec->topic_len <= TOPIC_SIZE)
+        {
+            Action *action = &actions[num_actions++];
+            memcpy(action->topic, body + off + sizeof(Ctrl_rec), rec->topic_len);
+            action->topic_len   = rec->topic_len;
+            action->sf          = rec->sf;
+            decode_ctrl_opts(action, body + off + sizeof(Ctrl_rec) + rec->topic_len, rec->opts_len);
+        }
+
+        off += rec_len;
+    }
+
+    return num_actions;
+}
+
+
+void apply_ctrl_frame(Client *client, uint8_t opcode, int count, const char *body, size_t len)
+{
+    if (opcode < OP_SUBSCRIBE || opcode > OP_SHM_TOKEN)
+        return;
+
+    // The answer to a heartbeat has no records (receiving it is enough)
+    if (opcode == OP_HEARTBEAT)
+        return;
+
+    // A same-host subscriber is about to ask for a shared ring
+    if (opcode == OP_SHM_TOKEN)
+    {
+        send_shm_token(client);
+        return;
+    }
+
+    // The count is sent by the client: a frame that can't hold that many records is refused
+    // (before its records are allocated)
+    if (count > len / sizeof(Ctrl_rec))
+        return;
+
+    // Without memory for its records, the frame is rejected (as a refused subscription, or a lost ack)
+    Action *actions = (Action *) mem_alloc(NULL, MEM_QUEUES, MAX(count, 1) * sizeof(Action));
+    if (actions == NULL)
+    {
+        if (opcode == OP_SUBSCRIBE)
+            mem_stats.refused_subs += count;
+        return;
+    }
+
+    // Decode the topic records
+    int num_actions = decode_ctrl_records(count, body, len, actions);
+
+    switch (opcode)
+    {
+        case OP_SUBSCRIBE:
+            subscribe_to_topics(client, actions, num_actions);
+            break;
+
+        case OP_UNSUBSCRIBE:
+            unsubscribe_from_topics(client, actions, num_actions);
+            break;
+
+        case OP_ACK:
+            ack_topics(client, actions, num_actions);
+            break;
+
+        case OP_RESUME:
+            resume_client(client, actions, num_actions);
+            break;
+
+        case OP_MCAST_REPAIR:
+            repair_mcast_msgs(client, actions, num_actions);
+            break;
+    }
+
+    mem_free(actions);
+}
+
+
+/* Set the content filter of a subscription (the ingest thread defers the formatting of the filtered topics) */
+static void set_topic_filter(Topic *topic, Filter *filter)
+{
+    size_t slot = topic->entry->hash & (FILTERED_TOPIC_SLOTS - 1);
+    if (topic->filter.active)
+        atomic_fetch_sub_explicit(&filtered_topics[slot], 1, memory_order_relaxed);
+
+    topic->filter = *filter;
+    if (topic->filter.active)
+        atomic_fetch_add_explicit(&filtered_topics[slot], 1, memory_order_relaxed);
+}
+
+
+/* Set the rate limit and the sampling of a subscription (the bucket starts full) */
+static void set_topic_throttle(Topic *topic, Action *action)
+{
+    topic->rate         = action->rate;
+    topic->every        = action->every;
+    topic->every_count  = 0;
+    topic->tokens       = MAX((uint64_t) action->rate * 1000000, RATE_MSG_COST);
+    topic->refill_us    = 0;
+}
+
+
+/* Refuse a subscription, the memory budget is exceeded (or an allocation failed) */
+static void refuse_subscription(Client *client, const char *name, size_t len)
+{
+    mem_stats.refused_subs++;
+    if (verbose)
+    {
+        memset(buffer, 0, BUFF_LEN);
+        sprintf(buffer, "Subscription to topic %.*s refused: out of memory.\n", (int) len, name);
+        respose_with_err_msg(buffer, client->socket);
+    }
+}
+
+
+/* Position of the subscription of topic `id` in a client's table, or -1 - (its insertion point) if there's none */
+static int find_sub(Sub_table *table, uint32_t id)
+{
+    int lo = 0;
+    int hi = table->num - 1;
+    while (lo <= hi)
+    {
+        int mid         = lo + (hi - lo) / 2;
+        uint32_t mid_id = SUB_ID(table->keys[mid]);
+        if (mid_id == id)
+            return mid;
+
+        if (mid_id < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1 - lo;
+}
+
+
+/* Sequence number of a topic subscribed again (taken from `retired`), 1 for a topic never stored */
+static uint32_t take_retired_seq(Sub_table *table, uint32_t id)
+{
+    int lo = 0;
+    int hi = table->num_retired - 1;
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (table->retired[mid].id == id)
+        {
+            uint32_t next_seq = table->retired[mid].next_seq;
+            memmove(table->retired + mid, table->retired + mid + 1, (table->num_retired - mid - 1) * sizeof(Retired_seq));
+            table->num_retired--;
+            return next_seq;
+        }
+
+        if (table->retired[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return 1;
+}
+
+
+/* Keep the next sequence number of a removed SF subscription, return false without memory */
+static bool retire_seq(Client *client, Topic *topic)
+{
+    Sub_table *table = &client->subs;
+    if (topic->next_seq == 1)
+        return true;
+
+    if (table->num_retired == table->max_retired)
+    {
+        int max                 = table->max_retired == 0 ? INITIAL_MAX_RETIRED : table->max_retired * 2;
+        Retired_seq *retired    = (Retired_seq *) mem_realloc(client, MEM_CLIENTS, table->retired, max * sizeof(Retired_seq));
+        if (retired == NULL)
+            return false;
+
+        table->retired      = retired;
+        table->max_retired  = max;
+    }
+
+    // A topic is retired at most once (it's taken back when it's subscribed again)
+    int pos = 0;
+    while (pos < table->num_retired && table->retired[pos].id < topic->entry->alias)
+        pos++;
+
+    memmove(table->retired + pos + 1, table->retired + pos, (table->num_retired - pos) * sizeof(Retired_seq));
+    table->retired[pos] = (Retired_seq) {topic->entry->alias, topic->next_seq};
+    table->num_retired++;
+    return true;
+}
+
+
+// Counters of the removed subscriptions (`print_subscription_stats()`)
+static uint64_t removed_filtered;
+static uint64_t removed_throttled;
+
+/* Remove the dead subscriptions of a client, in a single pass (the table stays sorted), and shrink its table */
+static void compact_subs(Client *client)
+{
+    Sub_table *table    = &client->subs;
+    int live            = 0;
+    for (int i = 0; i < table->num; ++i)
+    {
+        Topic *topic = table->topics[i];
+
+        // Without memory for its sequence number, a dead SF subscription stays
+        if (!(table->keys[i] & SUB_DEAD) || !retire_seq(client, topic))
+        {
+            table->keys[live]   = table->keys[i];
+            table->topics[live] = topic;
+            live++;
+            continue;
+        }
+
+        removed_filtered    += topic->filtered;
+        removed_throttled   += topic->throttled;
+        timer_del(&timers, &topic->expiry);
+        mem_free(topic->tcps);
+        mem_free(topic);
+    }
+
+    table->num_dead -= table->num - live;
+    table->num      = live;
+
+    // A client that left most of its topics gives the memory back
+    if (table->max > INITIAL_MAX_SUB_KEYS && table->num < table->max / 4)
+        resize_subs(client, MAX(table->max / 2, INITIAL_MAX_SUB_KEYS));
+}
+
+
+/* A new subscription, waiting to be merged in the table */
+typedef struct new_sub {
+	uint32_t key;
+	Topic 	 *topic;
+} New_sub;
+
+/* Order of the new subscriptions (by topic ID) */
+static int cmp_new_subs(const void *a, const void *b)
+{
+    uint32_t id_a = SUB_ID(((const New_sub *) a)->key);
+    uint32_t id_b = SUB_ID(((const New_sub *) b)->key);
+    return id_a < id_b ? -1 : id_a > id_b;
+}
+
+
+/* Merge the new subscriptions (the table has room for them) into the sorted table, from its end */
+static void merge_new_subs(Sub_table *table, New_sub *added, int num_added)
+{
+    qsort(added, num_added, sizeof(New_sub), cmp_new_subs);
+
+    int i = table->num - 1;
+    int k = table->num + num_added - 1;
+    for (int j = num_added - 1; j >= 0; --k)
+    {
+        if (i >= 0 && SUB_ID(table->keys[i]) > SUB_ID(added[j].key))
+        {
+            table->keys[k]      = table->keys[i];
+            table->topics[k]    = table->topics[i];
+            i--;
+        }
+        else
+        {
+            table->keys[k]      = added[j].key;
+            table->topics[k]    = added[j].topic;
+            j--;
+        }
+    }
+
+    table->num += num_added;
+}
+
+
+void subscribe_to_topics(Client *client, Action *actions, int num_actions)
+{
+    // Without memory for the work lists, the whole frame is refused
+    Topic_entry **entries   = (Topic_entry **) mem_alloc(NULL, MEM_QUEUES, MAX(num_actions, 1) * sizeof(Topic_entry *));
+    New_sub *added          = (New_sub *) mem_alloc(NULL, MEM_QUEUES, MAX(num_actions, 1) * sizeof(New_sub));
+    if (entries == NULL || added == NULL)
+    {
+        for (int i = 0; i < num_actions; ++i)
+            refuse_subscription(client, actions[i].topic, actions[i].topic_len);
+        mem_free(entries);
+        mem_free(added);
+        return;
+    }
+
+    // Mark the entries of the requested topics
+
+    for (int i = 0; i < num_actions; ++i)
+    {
+        // Check `SF` value
+        if (actions[i].sf != 0 && actions[i].sf != 1)
+        {
+            if (verbose)
+                respose_with_err_msg("SF should be 0 or 1.\n", client->socket);
+            continue;
+        }
+
+        // Check the options
+        if (actions[i].invalid)
+        {
+            if (verbose)
+                respose_with_err_msg("Invalid subscription options.\n", client->socket);
+            continue;
+        }
+
+        // Over the budget, only the known topics can be subscribed
+        entries[i] = topic_index_get(actions[i].topic, actions[i].topic_len, !mem_over_budget(0));
+        if (entries[i] == NULL)
+        {
+            refuse_subscription(client, actions[i].topic, actions[i].topic_len);
+            continue;
+        }
+        entries[i]->pending = &actions[i];
+    }
+
+    // The subscriptions the client doesn't have yet are merged in the table at the end
+    Sub_table *table    = &client->subs;
+    int num_added       = 0;
+
+    // A binary search per marked topic (the last request of a topic is applied)
+    for (int i = 0; i < num_actions; ++i)
+    {
+        if (entries[i] == NULL || entries[i]->pending != &actions[i])
+            continue;
+        entries[i]->pending = NULL;
+
+        Action *action  = &actions[i];
+        int pos         = find_sub(table, entries[i]->alias);
+        if (pos >= 0)
+        {
+            Topic *topic = table->topics[pos];
+
+            memset(buffer, 0, BUFF_LEN);
+            if (table->keys[pos] & SUB_DEAD)
+            {
+                // Re-subscribe to a topic the client had unsubscribed from
+                topic->sf           = action->sf;
+                topic->mcast        = mcast_delivery(topic->entry, action);
+                topic->alias        = action->alias;
+                if (!topic_entry_add_sub(topic->entry, client, topic))
+                {
+                    refuse_subscription(client, topic->entry->name, topic->entry->name_len);
+                    continue;
+                }
+                table->keys[pos]    = SUB_KEY(topic->entry->alias, topic->sf ? SUB_SF : 0);
+                table->num_dead--;
+                set_topic_throttle(topic, action);
+                set_topic_filter(topic, &action->filter);
+                if (topic->mcast)
+                    announce_mcast(client, topic);
+                continue;
+            }
+
+            // The options of the last subscribe are kept
+            topic->alias = action->alias;
+            set_topic_throttle(topic, action);
+            set_topic_filter(topic, &action->filter);
+            bool moved = set_topic_delivery(client, topic, mcast_delivery(topic->entry, action));
+
+            // Check if the client wants to change the `SF` or re-subscribe with the same `SF`
+            if (topic->sf == action->sf)
+            {
+                // Only the delivery changed (e.g. the client couldn't join the multicast group)
+                if (moved)
+                    continue;
+                sprintf(buffer, "User %s already subscribed to topic %s.\n", client->id, topic->entry->name);
+            }
+            else
+            {
+                // Without SF, nothing is kept for the client anymore
+                if (action->sf == 0)
+                    drop_pending_msgs(topic);
+
+                topic->sf           = action->sf;
+                table->keys[pos]    = SUB_KEY(topic->entry->alias, topic->sf ? SUB_SF : 0);
+                sprintf(buffer, "User %s changed the SF of topic %s to %d.\n", client->id, topic->entry->name, topic->sf);
+            }
+
+            // Send a repsonse back to the client if `verbose` is enabled
+            if (verbose)
+                respose_with_err_msg(buffer, client->socket);
+            continue;
+        }
+
+        // Room in the table for this one (and the ones added before it)
+        if (table->num + num_added == table->max && !mem_over_budget(table->max * (sizeof(uint32_t) + sizeof(Topic *))))
+            resize_subs(client, table->max == 0 ? INITIAL_MAX_SUB_KEYS : table->max * 2);
+
+        // Create a new topic for this client (refused over the budget)
+        Topic *topic = NULL;
+        if (table->num + num_added < table->max && !mem_over_budget(sizeof(Topic)))
+            topic = (Topic *) mem_alloc(client, MEM_TOPICS, sizeof(Topic));
+        if (topic == NULL)
+        {
+            refuse_subscription(client, action->topic, action->topic_len);
+            continue;
+        }
+
+        // Set topic's fields (the name is kept by its entry, the numbers continue those of a removed subscription)
+        topic->sf           = action->sf;
+        topic->next_seq     = take_retired_seq(table, entries[i]->alias);
+        topic->tcps         = NULL;
+        topic->num_of_tcps  = 0;
+        topic->max_tcps     = 0;
+        topic->heap_idx     = -1;
+        topic->mcast        = mcast_delivery(entries[i], action);
+        topic->alias        = action->alias;
+        timer_init(&topic->expiry, expire_sf_msgs);
+        set_topic_throttle(topic, action);
+
+        // Add the topic to the fanout list of the topic
+        if (!topic_entry_add_sub(entries[i], client, topic))
+        {
+            if (topic->next_seq != 1)
+                retire_seq(client, topic);
+            mem_free(topic);
+            refuse_subscription(client, action->topic, action->topic_len);
+            continue;
+        }
+        added[num_added++] = (New_sub) {SUB_KEY(entries[i]->alias, topic->sf ? SUB_SF : 0), topic};
+        set_topic_filter(topic, &action->filter);
+        if (topic->mcast)
+            announce_mcast(client, topic);
+    }
+
+    merge_new_subs(table, added, num_added);
+    mem_free(added);
+
+    // A topic requested twice in the same frame leaves a stale mark
+    for (int i = 0; i < num_actions; ++i)
+        if (entries[i] != NULL)
+            entries[i]->pending = NULL;
+
+    mem_free(entries);
+}
+
+
+void unsubscribe_from_topics(Client *client, Action *actions, int num_actions)
+{
+    // Mark the entries of the requested topics (unknown topics can't be subscribed)
+    for (int i = 0; i < num_actions; ++i)
+    {
+        Topic_entry *entry = topic_index_get(actions[i].topic, actions[i].topic_len, false);
+        if (entry != NULL)
+            entry->pending = &actions[i];
+    }
+
+    // A binary search per marked topic
+    Sub_table *table = &client->subs;
+    for (int i = 0; i < num_actions; ++i)
+    {
+        Topic_entry *entry = topic_index_get(actions[i].topic, actions[i].topic_len, false);
+        if (entry == NULL || entry->pending != &actions[i])
+            continue;
+
+        int pos = find_sub(table, entry->alias);
+        if (pos < 0 || (table->keys[pos] & SUB_DEAD))
+            continue;
+
+        // The subscription is removed by the next compaction (or revived by a subscribe)
+        Topic *topic = table->topics[pos];
+        Filter no_filter = {0};
+        topic_entry_del_sub(topic);
+        topic->mcast = false;
+        drop_pending_msgs(topic);
+        set_topic_filter(topic, &no_filter);
+        table->keys[pos] |= SUB_DEAD;
+        table->num_dead++;
+
+        // Mark the action as applied
+        entry->pending          = NULL;
+        actions[i].topic_len    = 0;
+    }
+
+    // The dead subscriptions are removed once they're a quarter of the table
+    if (table->num_dead > 0 && table->num_dead * 4 >= table->num)
+        compact_subs(client);
+
+    // Clear the remaining marks and report the topics the client isn't subscribed to
+    for (int i = 0; i < num_actions; ++i)
+    {
+        if (actions[i].topic_len == 0)
+            continue;
+
+        Topic_entry *entry = topic_index_get(actions[i].topic, actions[i].topic_len, false);
+        if (entry != NULL)
+            entry->pending = NULL;
+
+        if (verbose)
+        {
+            memset(buffer, 0, BUFF_LEN);
+            sprintf(buffer, "User %s isn't subscribed to topic %s, so they can't unsubscribe from it.\n", client->id, actions[i].topic);
+            respose_with_err_msg(buffer, client->socket);
+        }
+    }
+}
+
+
+void ack_topics(Client *client, Action *actions, int num_actions)
+{
+    // A binary search per acknowledged topic (only the SF subscriptions keep messages)
+    Sub_table *table = &client->subs;
+    for (int i = 0; i < num_actions; ++i)
+    {
+        Topic_entry *entry = topic_index_get(actions[i].topic, actions[i].topic_len, false);
+        if (entry == NULL)
+            continue;
+
+        int pos = find_sub(table, entry->alias);
+        if (pos >= 0 && (table->keys[pos] & SUB_SF))
+            ack_pending_msgs(table->topics[pos], actions[i].seq);
+    }
+}
+
+
+void resume_client(Client *client, Action *actions, int num_actions)
+{
+    // Skip what the client already has
+    ack_topics(client, actions, num_actions);
+
+    // Send the unacknowledged messages, they are kept until the client acks them
+    Sub_table *table = &client->subs;
+    for (int i = 0; i < table->num; ++i)
+    {
+        if (table->keys[i] & SUB_DEAD)
+            continue;
+
+        Topic *topic = table->topics[i];
+        for (int k = 0; k < topic->num_of_tcps; ++k)
+        {
+            Pending_msg *pending = &topic->tcps[(topic->first_tcp + k) % topic->max_tcps];
+            send_topic_msg(client, topic, &pending->msg, pending->seq);
+        }
+
+        // A restarted subscriber joins its multicast groups again
+        if (topic->mcast)
+            announce_mcast(client, topic);
+    }
+
+    client->resumed = true;
+}
+
+
+void repair_mcast_msgs(Client *client, Action *actions, int num_actions)
+{
+    // Mark the entries of the requested topics
+    for (int i = 0; i < num_actions; ++i)
+    {
+        Topic_entry *entry = topic_index_get(actions[i].topic, actions[i].topic_len, false);
+        if (entry != NULL)
+            entry->pending = &actions[i];
+    }
+
+    // A binary search per marked topic, with its last request (only the multicast subscriptions are repaired)
+    Sub_table *table = &client->subs;
+    for (int i = 0; i < num_actions; ++i)
+    {
+        Topic_entry *entry = topic_index_get(actions[i].topic, actions[i].topic_len, false);
+        if (entry == NULL || entry->pending != &actions[i])
+            continue;
+        entry->pending = NULL;
+
+        int pos = find_sub(table, entry->alias);
+        if (pos < 0 || (table->keys[pos] & SUB_DEAD))
+            continue;
+
+        Topic *topic    = table->topics[pos];
+        Action *action  = &actions[i];
+        if (!topic->mcast || entry->mcast_window == NULL)
+            continue;
+
+        // The messages that left the window are lost
+        uint32_t count = MIN(action->count, MCAST_REPAIR_WINDOW);
+        for (uint32_t k = 0; k < count; ++k)
+        {
+            // (so are the ones that couldn't be kept in it)
+            uint32_t seq        = action->seq + k;
+            Shared_msg **slot   = &entry->mcast_window[seq & (MCAST_REPAIR_WINDOW - 1)];
+            if ((int32_t) (entry->mcast_seq - seq) < 0 || entry->mcast_seq - seq >= MCAST_REPAIR_WINDOW || *slot == NULL)
+                continue;
+
+            send_topic_msg(client, topic, slot, 0);
+            entry->mcast_repaired++;
+        }
+    }
+}
+
+
+int convert_to_int(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+{
+    // First byte from the payload is the `sign byte` (0/1)
+    if (udp_msg->payload[0] > 1)
+        return 0;
+
+    // Complete the `type`
+    tcp_msg->udp_msg.type = INT;
+    
+    // Let's check if the number is positive or negative
+    ll sign = 1;
+    if (udp_msg->payload[0])
+        sign = -1;
+    
+    // Write the `payload` on the TCP msg (remove the sign byte from the payload)
+    ll num_int = sign * ntohl(*(uint32_t *) (udp_msg->payload + 1));
+    sprintf(tcp_msg->udp_msg.payload, "%lld", num_int);
+
+    // Successfully completed the UDP msg payload
+    return 1;
+}
+
+
+void convert_to_short_real(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+{
+    // Complete the `type`
+    tcp_msg->udp_msg.type = SHORT_REAL;
+
+    // Write the `payload` on the TCP msg
+    double num_real = 1.0 * (ntohs(*(uint16_t *) (udp_msg->payload))) / 100;
+    sprintf(tcp_msg->udp_msg.payload, "%.2f", num_real);
+}
+
+
+int convert_to_float(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+{
+    // First byte from the payload is the `sign byte` (0/1)
+    if (udp_msg->payload[0] != 0 && udp_msg->payload[0] != 1)
+        return 0;
+
+    // Complete the `type`
+    tcp_msg->udp_msg.type = FLOAT;
+
+    // Let's check if the number is positive or negative
+    double sign_float = 1;
+    if (udp_msg->payload[0] == 1)
+        sign_float = -1;
+    
+    // Write the `payload` on the TCP msg
+    sign_float *= ntohl(*(uint32_t *) (udp_msg->payload + 1));
+    sign_float /= pow(10, (uint8_t) udp_msg->payload[5]);
+    sprintf(tcp_msg->udp_msg.payload, "%lf", sign_float);
+
+    // Successfully completed the UDP msg payload
+    return 1;
+}
+
+
+void convert_to_string(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+{
+    // Complete the `type`
+    tcp_msg->udp_msg.type = STRING;
+    
+    // Write the `payload` on the TCP msg
+    strcpy(tcp_msg->udp_msg.payload, udp_msg->payload);
+}
+
+
+/*
+    typedef struct udp_msg {
+        char 	topic[TOPIC_SIZE];
+        uint8_t type;                           // 0, 1, 2 or 3
+        char 	payload[PAYLOAD_SIZE];
+    } UDP_msg;
+
+
+    typedef struct tcp_msg {
+        char 	 size[MAX_DIGITS_TCP_MSG_LEN]; 	// Size of the message
+        char	 ip[IP_LEN];					// `IP_CLIENT_UDP`
+        uint16_t port;							// `PORT_CLIENT_UDP`
+        UDP_msg udp_msg;                        // Received msg from the UDP client with IP `ip` and PORT `port`
+    } TCP_msg;
+*/
+/* Tell if a datagram of `len` bytes is long enough for its type */
+static bool valid_datagram(UDP_msg *udp_msg, size_t len)
+{
+    // Minimum payload length of each type (0 - INT, 1 - SHORT_REAL, 2 - FLOAT, 3 - STRING)
+    static const size_t min_payload[] = {5, 2, 6, 0};
+
+    if (len < TOPIC_SIZE + 1 || udp_msg->type > 3)
+        return false;
+
+    return len - TOPIC_SIZE - 1 >= min_payload[udp_msg->type];
+}
+
+
+int UDP_to_TCP(UDP_msg *udp_msg, size_t len, struct sockaddr_in *udp_addr, TCP_msg *tcp_msg)
+{
+    if (!valid_datagram(udp_msg, len))
+        return 0;
+
+    // Set the `size`, `ip`, `port` and `sever_msg` fields of the TCP msg
+    // (`inet_ntop`, because `inet_ntoa` isn't thread-safe)
+    sprintf(tcp_msg->size, "%lu", sizeof(TCP_msg));
+    inet_ntop(AF_INET, &udp_addr->sin_addr, tcp_msg->ip, IP_LEN);
+    tcp_msg->port = ntohs(udp_addr->sin_port);
+    tcp_msg->from_server = false;
+
+    // Complete the `topic`
+    strncpy(tcp_msg->udp_msg.topic, udp_msg->topic, TOPIC_SIZE);
+
+    // We can have one of the following types (0 - INT, 1 - SHORT_REAL, 2 - FLOAT, 3 - STRING)
+    switch (udp_msg->type)
+    {
+        case 0:
+            return convert_to_int(udp_msg, tcp_msg);
+
+        case 1:
+            convert_to_short_real(udp_msg, tcp_msg);
+            break;
+
+        case 2:
+            return convert_to_float(udp_msg, tcp_msg);
+
+        case 3:
+            convert_to_string(udp_msg, tcp_msg);
+            break;
+    }
+
+    return 1;
+}
+
+
+bool compile_filter(const char *text, Filter *filter)
+{
+    char op[FILTER_TEXT_LEN + 1];
+    double a, b;
+    int num = sscanf(text, "%s %lf %lf", op, &a, &b);
+    if (num < 2)
+        return false;
+
+    // Every predicate is an interval (`!=` is the outside of [a, a])
+    memset(filter, 0, sizeof(Filter));
+    filter->active      = true;
+    filter->lo          = -INFINITY;
+    filter->hi          = INFINITY;
+
+    if (strcmp(op, "between") == 0 && num == 3)
+    {
+        filter->lo          = MIN(a, b);
+        filter->hi          = MAX(a, b);
+        filter->lo_closed   = true;
+        filter->hi_closed   = true;
+    }
+    else if (num != 2)
+        return false;
+    else if (strcmp(op, ">") == 0)
+        filter->lo = a;
+    else if (strcmp(op, ">=") == 0)
+    {
+        filter->lo          = a;
+        filter->lo_closed   = true;
+    }
+    else if (strcmp(op, "<") == 0)
+        filter->hi = a;
+    else if (strcmp(op, "<=") == 0)
+    {
+        filter->hi          = a;
+        filter->hi_closed   = true;
+    }
+    else if (strcmp(op, "==") == 0 || strcmp(op, "!=") == 0)
+    {
+        filter->lo          = filter->hi        = a;
+        filter->lo_closed   = filter->hi_closed = true;
+        filter->negate      = op[0] == '!';
+    }
+    else
+        return false;
+
+    return true;
+}
+
+
+bool filter_match(Filter *filter, Shared_msg *msg)
+{
+    // Decode the raw numeric payload (like the `convert_to_*` functions, without any formatting)
+    uint8_t *raw = msg->raw_value;
+    double value;
+    switch (msg->msg.udp_msg.type)
+    {
+        case INT:
+            if (raw[0] > 1)
+                return false;
+            value = (raw[0] ? -1.0 : 1.0) * ntohl(*(uint32_t *) (raw + 1));
+            break;
+
+        case SHORT_REAL:
+            value = ntohs(*(uint16_t *) raw) / 100.0;
+            break;
+
+        case FLOAT:
+            if (raw[0] > 1)
+                return false;
+            value = (raw[0] ? -1.0 : 1.0) * ntohl(*(uint32_t *) (raw + 1)) / pow(10, raw[5]);
+            break;
+
+        default:
+            return false;
+    }
+
+    bool inside = (value > filter->lo || (filter->lo_closed && value == filter->lo)) &&
+                  (value < filter->hi || (filter->hi_closed && value == filter->hi));
+    return inside != filter->negate;
+}
+
+
+int format_shared_msg(Shared_msg *msg)
+{
+    // The conversion can't be done in place (+1 for the null terminator of a `STRING` payload)
+    char raw[BUFF_LEN];
+    memcpy(raw, &msg->msg.udp_msg, msg->raw_len);
+    raw[msg->raw_len] = '\0';
+
+    memset(&msg->msg, 0, sizeof(TCP_msg));
+    msg->formatted = true;
+    return UDP_to_TCP((UDP_msg *) raw, msg->raw_len, &msg->from, &msg->msg);
+}
+
+
+/* Kernel receive timestamp of a datagram (0 if the kernel didn't give one) */
+static uint64_t rx_timestamp(struct msghdr *hdr)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec *ts = (struct timespec *) CMSG_DATA(cmsg);
+            return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Datagrams the kernel dropped on the socket until this one was queued (0 if it didn't give the counter) */
+static uint32_t rx_drops(struct msghdr *hdr)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+            return *(uint32_t *) CMSG_DATA(cmsg);
+
+    return 0;
+}
+
+
+/**
+ * Convert a message in the next slot of the ingest ring (`datagram` has the layout of an `UDP_msg` and a null
+ * terminator after its `len` bytes), waiting for room if the ring is full
+*/
+static void ingest_msg(Ingest *ingest, char *datagram, size_t len, struct sockaddr_in *from,
+                       struct msghdr *hdr, uint64_t recv_ns)
+{
+    // Wait for the fanout loop if the ring is full (the socket buffer absorbs the burst)
+    Shared_msg *slot;
+    while ((slot = (Shared_msg *) ring_reserve(&ingest->ring)) == NULL)
+    {
+        atomic_fetch_add_explicit(&ingest->ring_waits, 1, memory_order_relaxed);
+        ring_wake_consumer(&ingest->ring);
+        ring_wait_space(&ingest->ring);
+    }
+
+    // Invalid messages are dropped
+    UDP_msg *udp_msg = (UDP_msg *) datagram;
+    if (!valid_datagram(udp_msg, len))
+    {
+        atomic_fetch_add_explicit(&ingest->invalid_msgs, 1, memory_order_relaxed);
+        return;
+    }
+
+    memset(slot, 0, sizeof(Shared_msg));
+    memcpy(slot->raw_value, udp_msg->payload, RAW_VALUE_LEN);
+
+    // The topics with filtered subscriptions are formatted by the fanout, only if a subscriber gets them
+    uint32_t hash = hash_name(udp_msg->topic, strnlen(udp_msg->topic, TOPIC_SIZE));
+    if (atomic_load_explicit(&filtered_topics[hash & (FILTERED_TOPIC_SLOTS - 1)], memory_order_relaxed) > 0)
+    {
+        memcpy(&slot->msg.udp_msg, datagram, len);
+        slot->raw_len   = len;
+        slot->from      = *from;
+    }
+    else
+    {
+        slot->formatted = true;
+        if (!UDP_to_TCP(udp_msg, len, from, &slot->msg))
+        {
+            atomic_fetch_add_explicit(&ingest->invalid_msgs, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    if (trace_sample_next(&tracer))
+    {
+        slot->trace.sampled     = true;
+        slot->trace.recv_ns     = recv_ns;
+        slot->trace.decoded_ns  = now_ns();
+        slot->trace.rx_ns       = hdr != NULL ? rx_timestamp(hdr) : 0;
+    }
+
+    ring_push(&ingest->ring);
+}
+
+
+/* Tell if a datagram is a batched frame (`Batch_hdr` and its records) */
+static bool is_batch_frame(const char *datagram, size_t len)
+{
+    return len >= sizeof(Batch_hdr) && memcmp(datagram, BATCH_MAGIC, BATCH_MAGIC_LEN) == 0
+        && ((Batch_hdr *) datagram)->version == BATCH_VERSION;
+}
+
+
+/* Tell if the header of a record (of a batched datagram or of a publisher's stream) is valid */
+static bool valid_record(const Batch_rec *rec)
+{
+    return rec->topic_len > 0 && rec->topic_len <= TOPIC_SIZE && ntohs(rec->payload_len) <= PAYLOAD_SIZE - 1;
+}
+
+
+/**
+ * Convert the complete records at `data` (at most `*num` of them) in a single pass, stopping at a cut or invalid one
+ * Return the number of bytes converted (`*num` is set to the number of records)
+ * -> The records of a stream (no `hdr`) are captured as single datagrams, the replay must see them
+*/
+static size_t ingest_records(Ingest *ingest, char *data, size_t len, uint32_t *num, struct sockaddr_in *from,
+                             struct msghdr *hdr, uint64_t recv_ns)
+{
+    size_t off      = 0;
+    uint32_t done   = 0;
+
+    // Every record is rebuilt with the layout of an `UDP_msg` (+1 for the null terminator of a `STRING` payload)
+    char msg[BUFF_LEN];
+    for (; done < *num; ++done)
+    {
+        if (len - off < sizeof(Batch_rec))
+            break;
+
+        Batch_rec *rec          = (Batch_rec *) (data + off);
+        uint16_t payload_len    = ntohs(rec->payload_len);
+        size_t rec_len          = sizeof(Batch_rec) + rec->topic_len + payload_len;
+        if (!valid_record(rec) || len - off < rec_len)
+            break;
+
+        const char *topic = data + off + sizeof(Batch_rec);
+        memset(msg, 0, TOPIC_SIZE);
+        memcpy(msg, topic, rec->topic_len);
+        msg[offsetof(UDP_msg, type)] = rec->type;
+        memcpy(msg + offsetof(UDP_msg, payload), topic + rec->topic_len, payload_len);
+        msg[offsetof(UDP_msg, payload) + payload_len] = '\0';
+
+        if (hdr == NULL && capture.file != NULL)
+            capture_datagram(&capture, msg, offsetof(UDP_msg, payload) + payload_len, from, recv_ns);
+
+        ingest_msg(ingest, msg, offsetof(UDP_msg, payload) + payload_len, from, hdr, recv_ns);
+        off += rec_len;
+    }
+
+    *num = done;
+    return off;
+}
+
+
+/* Convert the records of a batched frame (a cut or invalid record ends the frame) */
+static void ingest_batch(Ingest *ingest, char *frame, size_t len, struct sockaddr_in *from,
+                         struct msghdr *hdr, uint64_t recv_ns)
+{
+    uint32_t count  = ntohs(((Batch_hdr *) frame)->count);
+    uint32_t done   = count;
+    ingest_records(ingest, frame + sizeof(Batch_hdr), len - sizeof(Batch_hdr), &done, from, hdr, recv_ns);
+
+    atomic_fetch_add_explicit(&ingest->batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ingest->batched_msgs, done, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ingest->invalid_msgs, count - done, memory_order_relaxed);
+}
+
+
+bool set_publish_port(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < 1 || value > UINT16_MAX)
+        return false;
+
+    ingest.pub_port = (uint16_t) value;
+    return true;
+}
+
+
+/* Charge the memory of the ingest thread (its counter is atomic, the main thread reads it) */
+static void ingest_charge(Ingest *ingest, ssize_t delta)
+{
+    atomic_fetch_add_explicit(&ingest->mem_used, (size_t) delta, memory_order_relaxed);
+}
+
+
+void open_publish_listener(Ingest *ingest)
+{
+    if (ingest->pub_port == 0)
+        return;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons(ingest->pub_port);
+    addr.sin_addr.s_addr    = INADDR_ANY;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(sock < 0, "[ERROR]: Couldn't create the publishers' socket!\n");
+
+    int ret = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+    DIE(ret < 0, "[ERROR]: Couldn't bind the publishers' socket!\n");
+
+    ret = listen(sock, listen_backlog);
+    DIE(ret < 0, "[ERROR]: Couldn't listen on the publishers' socket!\n");
+
+    // Room for the UDP socket and the listener
+    ingest->pollfds = (struct pollfd *) malloc(2 * sizeof(struct pollfd));
+    DIE(ingest->pollfds == NULL, "[ERROR]: Allocation error!\n");
+    ingest_charge(ingest, 2 * sizeof(struct pollfd));
+    ingest->pub_listener = sock;
+}
+
+
+/* Accept the pending TCP publishers (without memory, a publisher is closed) */
+static void accept_publishers(Ingest *ingest)
+{
+    for (int k = 0; k < ACCEPT_BURST; ++k)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len  = sizeof(addr);
+        int sock            = accept4(ingest->pub_listener, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+            return;
+
+        if (ingest->num_pubs == ingest->max_pubs)
+        {
+            // The ingest thread doesn't touch the memory accounting of the main thread, it charges its own counter
+            int max_pubs            = ingest->max_pubs == 0 ? INITIAL_MAX_PUBS : ingest->max_pubs * 2;
+            Publisher *pubs         = (Publisher *) realloc(ingest->pubs, max_pubs * sizeof(Publisher));
+            if (pubs != NULL)
+                ingest->pubs = pubs;
+            struct pollfd *pollfds  = (struct pollfd *) realloc(ingest->pollfds, (2 + max_pubs) * sizeof(struct pollfd));
+            if (pollfds != NULL)
+                ingest->pollfds = pollfds;
+
+            // A table that grew alone is charged once the other one grows too
+            if (pubs != NULL && pollfds != NULL)
+            {
+                ingest_charge(ingest, (max_pubs - ingest->max_pubs) * (sizeof(Publisher) + sizeof(struct pollfd)));
+                ingest->max_pubs = max_pubs;
+            }
+        }
+
+        char *buf = ingest->num_pubs < ingest->max_pubs ? (char *) malloc(PUB_BUF_LEN) : NULL;
+        if (buf == NULL)
+        {
+            close(sock);
+            continue;
+        }
+        ingest_charge(ingest, PUB_BUF_LEN);
+
+        ingest->pubs[ingest->num_pubs++] = (Publisher) {sock, addr, buf, 0};
+        atomic_fetch_add_explicit(&ingest->connected_pubs, 1, memory_order_relaxed);
+    }
+}
+
+
+/* Close a publisher, the last one takes its position */
+static void drop_publisher(Ingest *ingest, int idx)
+{
+    close(ingest->pubs[idx].socket);
+    free(ingest->pubs[idx].buf);
+    ingest_charge(ingest, -(ssize_t) PUB_BUF_LEN);
+
+    ingest->pubs[idx] = ingest->pubs[--ingest->num_pubs];
+    atomic_fetch_sub_explicit(&ingest->connected_pubs, 1, memory_order_relaxed);
+}
+
+
+/* Read what a publisher sent (a single read) and convert its complete records, return false if it must be closed */
+static bool recv_publisher(Ingest *ingest, Publisher *pub)
+{
+    ssize_t ret = recv(pub->socket, pub->buf + pub->len, PUB_BUF_LEN - pub->len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return true;
+    if (ret <= 0)
+        return false;
+    pub->len += ret;
+
+    uint64_t recv_ns    = tracer.sample > 0 || capture.file != NULL ? now_ns() : 0;
+    uint32_t num        = UINT32_MAX;
+    size_t used         = ingest_records(ingest, pub->buf, pub->len, &num, &pub->addr, NULL, recv_ns);
+    atomic_fetch_add_explicit(&ingest->stream_msgs, num, memory_order_relaxed);
+
+    // An invalid record can't be skipped, the rest of the stream has no boundaries
+    if (pub->len - used >= sizeof(Batch_rec) && !valid_record((Batch_rec *) (pub->buf + used)))
+    {
+        atomic_fetch_add_explicit(&ingest->invalid_msgs, 1, memory_order_relaxed);
+        return false;
+    }
+
+    // Keep the cut record
+    memmove(pub->buf, pub->buf + used, pub->len - used);
+    pub->len -= used;
+    return true;
+}
+
+
+/* Wait for the sockets of the ingest thread and handle the TCP publishers, return true if datagrams are waiting */
+static bool poll_ingest_sockets(Ingest *ingest)
+{
+    struct pollfd *fds = ingest->pollfds;
+    fds[0] = (struct pollfd) {ingest->udp_socket, POLLIN, 0};
+    fds[1] = (struct pollfd) {ingest->pub_listener, POLLIN, 0};
+    for (int i = 0; i < ingest->num_pubs; ++i)
+        fds[2 + i] = (struct pollfd) {ingest->pubs[i].socket, POLLIN, 0};
+
+    int ret = poll(fds, 2 + ingest->num_pubs, -1);
+    if (ret < 0 && errno == EINTR)
+        return false;
+    DIE(ret < 0, "[ERROR]: Couldn't poll the ingest sockets!\n");
+
+    // A single read per publisher, so a busy one doesn't starve the others
+    // (backwards: a closed publisher is replaced by the last one, which was already read)
+    for (int i = ingest->num_pubs - 1; i >= 0; --i)
+        if (fds[2 + i].revents != 0 && !recv_publisher(ingest, &ingest->pubs[i]))
+            drop_publisher(ingest, i);
+
+    // The new publishers grow `pollfds`, so they are accepted last
+    bool datagrams = fds[0].revents != 0;
+    if (fds[1].revents != 0)
+        accept_publishers(ingest);
+
+    if (capture.file != NULL)
+        capture_wake(&capture);
+    ring_wake_consumer(&ingest->ring);
+    return datagrams;
+}
+
+
+/* Body of the ingest thread: receive datagrams in batches and convert them in the ring's slots */
+static void *ingest_loop(void *arg)
+{
+    Ingest *ingest = (Ingest *) arg;
+
+    // The signals are handled by the main thread
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Buffers of a batch (+1 for the null terminator of a `STRING` payload)
+    char *raw = (char *) malloc(INGEST_BATCH * BUFF_LEN);
+    DIE(raw == NULL, "[ERROR]: Allocation error!\n");
+    ingest_charge(ingest, INGEST_BATCH * BUFF_LEN);
+
+    struct mmsghdr     msgs[INGEST_BATCH];
+    struct iovec       iovs[INGEST_BATCH];
+    struct sockaddr_in addrs[INGEST_BATCH];
+
+    // Room for the kernel receive timestamp and the drop counter of each datagram
+    char cmsgs[INGEST_BATCH][CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+
+    // The receive timestamps are needed for tracing and for the capture
+    bool timestamps = tracer.sample > 0 || capture.file != NULL;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int k = 0; k < INGEST_BATCH; ++k)
+    {
+        iovs[k].iov_base            = raw + k * BUFF_LEN;
+        iovs[k].iov_len             = BUFF_LEN - 1;
+        msgs[k].msg_hdr.msg_iov     = &iovs[k];
+        msgs[k].msg_hdr.msg_iovlen  = 1;
+        msgs[k].msg_hdr.msg_name    = &addrs[k];
+    }
+
+    while (1)
+    {
+        for (int k = 0; k < INGEST_BATCH; ++k)
+        {
+            msgs[k].msg_hdr.msg_namelen     = sizeof(struct sockaddr_in);
+            msgs[k].msg_hdr.msg_control     = cmsgs[k];
+            msgs[k].msg_hdr.msg_controllen  = sizeof(cmsgs[k]);
+        }
+
+        // Block for the first datagram, then take what's already queued
+        // (with TCP publishers, the thread waits for any socket and takes the datagrams without blocking)
+        int flags = MSG_WAITFORONE;
+        if (ingest->pub_listener >= 0)
+        {
+            if (!poll_ingest_sockets(ingest))
+                continue;
+            flags = MSG_DONTWAIT;
+        }
+
+        int n = recvmmsg(ingest->udp_socket, msgs, INGEST_BATCH, flags, NULL);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        DIE(n < 0, "[ERROR]: Couldn't receive data on UDP socket!\n");
+        uint64_t recv_ns = timestamps ? now_ns() : 0;
+
+        // The kernel's counter is cumulative, the newest datagram has the latest one
+        uint32_t drops = rx_drops(&msgs[n - 1].msg_hdr);
+        if (drops != 0)
+            atomic_store_explicit(&ingest->socket_drops, drops, memory_order_relaxed);
+
+        // Every datagram is captured, even the invalid ones (the replay must see the same stream)
+        if (capture.file != NULL)
+        {
+            for (int k = 0; k < n; ++k)
+            {
+                uint64_t rx_ns = rx_timestamp(&msgs[k].msg_hdr);
+                capture_datagram(&capture, raw + k * BUFF_LEN, msgs[k].msg_len, &addrs[k], rx_ns != 0 ? rx_ns : recv_ns);
+            }
+            capture_wake(&capture);
+        }
+
+        for (int k = 0; k < n; ++k)
+        {
+            char *datagram              = raw + k * BUFF_LEN;
+            datagram[msgs[k].msg_len]   = '\0';
+
+            // A batched frame carries several messages, the others a single `UDP_msg`
+            if (is_batch_frame(datagram, msgs[k].msg_len))
+                ingest_batch(ingest, datagram, msgs[k].msg_len, &addrs[k], &msgs[k].msg_hdr, recv_ns);
+            else
+                ingest_msg(ingest, datagram, msgs[k].msg_len, &addrs[k], &msgs[k].msg_hdr, recv_ns);
+        }
+
+        // A single wake up for the whole batch
+        ring_wake_consumer(&ingest->ring);
+    }
+
+    return NULL;
+}
+
+
+void start_ingest_thread(Ingest *ingest)
+{
+    ring_init(&ingest->ring, INGEST_RING_SLOTS, sizeof(Shared_msg));
+
+    // Ask the kernel for the number of datagrams it drops on a full socket buffer
+    int opt = 1;
+    int ret = setsockopt(ingest->udp_socket, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt));
+    DIE(ret < 0, "[ERROR]: Couldn't enable the drop counter!\n");
+
+    // Ask the kernel for the receive timestamps of the datagrams
+    if (tracer.sample > 0 || capture.file != NULL)
+    {
+        ret = setsockopt(ingest->udp_socket, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+        DIE(ret < 0, "[ERROR]: Couldn't enable the receive timestamps!\n");
+    }
+
+    ret = pthread_create(&ingest->thread, NULL, ingest_loop, ingest);
+    DIE(ret != 0, "[ERROR]: Couldn't create the ingest thread!\n");
+}
+
+
+void stop_ingest_thread(Ingest *ingest)
+{
+    // The thread is blocked in `recvmmsg` or `read`, both are cancellation points
+    pthread_cancel(ingest->thread);
+    pthread_join(ingest->thread, NULL);
+
+    for (int i = 0; i < ingest->num_pubs; ++i)
+    {
+        close(ingest->pubs[i].socket);
+        free(ingest->pubs[i].buf);
+    }
+    free(ingest->pubs);
+    free(ingest->pollfds);
+    atomic_store(&ingest->mem_used, 0);
+    if (ingest->pub_listener >= 0)
+        close(ingest->pub_listener);
+
+    close(ingest->udp_socket);
+    ring_destroy(&ingest->ring);
+}
+
+
+void fanout_ingested_msgs(Ingest *ingest)
+{
+    // At most one ring of messages, so the control frames aren't delayed
+    size_t count = 0;
+    Shared_msg *msg;
+    while (count <= ingest->ring.mask && (msg = (Shared_msg *) ring_peek(&ingest->ring)) != NULL)
+    {
+        if (msg->trace.sampled)
+            msg->trace.fanout_ns = now_ns();
+
+        federation_forward(msg, 0, 0, PEER_TTL, NULL);
+        send_tcp_msg(msg);
+        ring_pop(&ingest->ring);
+        count++;
+    }
+
+    if (count > 0)
+        ring_wake_producer(&ingest->ring);
+}
+
+
+void print_ingest_stats(Ingest *ingest, FILE *file)
+{
+    fprintf(file, "Batched datagrams: %lu (%lu messages), invalid messages: %lu\n",
+            atomic_load(&ingest->batches), atomic_load(&ingest->batched_msgs), atomic_load(&ingest->invalid_msgs));
+    fprintf(file, "Waits for a full ingest ring: %lu, datagrams dropped on a full socket buffer: %u\n",
+            atomic_load(&ingest->ring_waits), atomic_load(&ingest->socket_drops));
+    if (ingest->pub_listener >= 0)
+        fprintf(file, "TCP publishers: %d connected, %lu messages\n",
+                atomic_load(&ingest->connected_pubs), atomic_load(&ingest->stream_msgs));
+}
+
+
+bool set_topic_priority(const char *topic, const char *class)
+{
+    for (int lane = 0; lane < NUM_LANES; ++lane)
+    {
+        if (strcmp(class, lane_names[lane]) == 0)
+        {
+            // The entry is created now, the topic keeps its class when clients subscribe
+            Topic_entry *entry = topic_index_get(topic, strnlen(topic, TOPIC_SIZE), true);
+            if (entry == NULL)
+                return false;
+            entry->lane = lane;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool set_topic_multicast(const char *topic, const char *group)
+{
+    // `GROUP:PORT`, with a multicast group
+    const char *port = strrchr(group, ':');
+    if (port == NULL || port - group >= IP_LEN)
+        return false;
+
+    char addr[IP_LEN];
+    memcpy(addr, group, port - group);
+    addr[port - group] = '\0';
+
+    struct in_addr group_addr;
+    int port_number = atoi(port + 1);
+    if (inet_aton(addr, &group_addr) == 0 || !IN_MULTICAST(ntohl(group_addr.s_addr))
+        || port_number <= 0 || port_number > UINT16_MAX)
+        return false;
+
+    Topic_entry *entry = topic_index_get(topic, strnlen(topic, TOPIC_SIZE), true);
+    if (entry == NULL)
+        return false;
+    if (!entry->mcast)
+        mcast_egress.num_topics++;
+
+    entry->mcast                    = true;
+    entry->mcast_addr.sin_family    = AF_INET;
+    entry->mcast_addr.sin_port      = htons(port_number);
+    entry->mcast_addr.sin_addr      = group_addr;
+    return true;
+}
+
+
+bool set_multicast_iface(const char *addr)
+{
+    return inet_aton(addr, &mcast_egress.iface) != 0;
+}
+
+
+void open_mcast_socket()
+{
+    if (mcast_egress.num_topics == 0)
+        return;
+
+    mcast_egress.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(mcast_egress.socket < 0, "[ERROR]: Couldn't create the multicast socket!\n");
+
+    // Keep the datagrams on the LAN
+    unsigned char opt = MCAST_TTL;
+    int ret = setsockopt(mcast_egress.socket, IPPROTO_IP, IP_MULTICAST_TTL, &opt, sizeof(opt));
+    DIE(ret < 0, "[ERROR]: Couldn't set the TTL of the multicast datagrams!\n");
+
+    // The subscribers may run on this host (e.g. over loopback)
+    opt = 1;
+    ret = setsockopt(mcast_egress.socket, IPPROTO_IP, IP_MULTICAST_LOOP, &opt, sizeof(opt));
+    DIE(ret < 0, "[ERROR]: Couldn't enable the multicast loopback!\n");
+
+    if (mcast_egress.iface.s_addr != htonl(INADDR_ANY))
+    {
+        ret = setsockopt(mcast_egress.socket, IPPROTO_IP, IP_MULTICAST_IF, &mcast_egress.iface, sizeof(struct in_addr));
+        DIE(ret < 0, "[ERROR]: Couldn't set the multicast interface!\n");
+    }
+}
+
+
+void load_config(const char *file)
+{
+    FILE *config = fopen(file, "r");
+    DIE(config == NULL, "[ERROR]: Couldn't open the config file!\n");
+
+    char line[CONFIG_LINE_LEN];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), config) != NULL)
+    {
+        line_no++;
+
+        // Skip the comments and the empty lines
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        char *key = strtok(line, " \t\r\n");
+        if (key == NULL)
+            continue;
+
+        char *arg1  = strtok(NULL, " \t\r\n");
+        char *arg2  = strtok(NULL, " \t\r\n");
+        bool valid  = false;
+
+        if (strcmp(key, "backlog") == 0)
+            valid = arg1 != NULL && arg2 == NULL && set_backlog(arg1);
+        else if (strcmp(key, "publish-port") == 0)
+            valid = arg1 != NULL && arg2 == NULL && set_publish_port(arg1);
+        else if (strcmp(key, "zerocopy") == 0)
+            valid = arg1 != NULL && arg2 == NULL && set_zerocopy(arg1);
+        else if (strcmp(key, "priority") == 0)
+            valid = arg1 != NULL && arg2 != NULL && set_topic_priority(arg1, arg2);
+        else if (strcmp(key, "peer") == 0)
+            valid = arg1 != NULL && arg2 == NULL && federation_add_peer_addr(arg1);
+        else if (strcmp(key, "multicast") == 0)
+            valid = arg1 != NULL && arg2 != NULL && set_topic_multicast(arg1, arg2);
+        else if (strcmp(key, "multicast-if") == 0)
+            valid = arg1 != NULL && arg2 == NULL && set_multicast_iface(arg1);
+        else if (strcmp(key, "mem-budget") == 0)
+            valid = arg1 != NULL && arg2 == NULL && set_mem_budget(arg1);
+        else if (strcmp(key, "heartbeat") == 0 || strcmp(key, "idle-timeout") == 0 || strcmp(key, "sf-ttl") == 0)
+            valid = arg1 != NULL && arg2 == NULL && set_timeout(key, arg1);
+
+        if (!valid)
+        {
+            fprintf(stderr, "[ERROR]: Invalid setting at %s:%d\n", file, line_no);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(config);
+}
+
+
+/**
+ * Return a message that can be kept in a queue (a borrowed message is replaced with a copy)
+ * Return NULL without memory for the copy (`*msg` stays borrowed)
+*/
+static Shared_msg *own_shared_msg(Shared_msg **msg)
+{
+    if ((*msg)->refs == 0)
+    {
+        Shared_msg *copy = new_shared_msg();
+        if (copy == NULL)
+            return NULL;
+
+        *copy       = **msg;
+        copy->refs  = 1;
+        *msg        = copy;
+    }
+
+    return *msg;
+}
+
+
+/**
+ * Write `num` messages (without the first `off` bytes) in a socket, without blocking
+ * With `*zc`, the write is zero-copy (`*zc` is cleared if the kernel refused it and the bytes were copied)
+ * Return the number of bytes written, or -1 if the connection is broken
+*/
+static ssize_t write_out_msgs(int sock, Out_msg *msgs, int num, size_t off, bool *zc)
+{
+    struct iovec iov[OUT_BATCH * 4];
+    int num_iov = 0;
+
+    // Headers of the aliased messages (rebuilt the same way if a write is resumed)
+    Alias_hdr hdrs[OUT_BATCH];
+
+    for (int k = 0; k < num; ++k)
+    {
+        char *tcp_msg   = (char *) &msgs[k].msg->msg;
+        size_t seq_off  = offsetof(TCP_msg, seq);
+        struct iovec parts[4];
+        int num_parts;
+
+        if (msgs[k].alias == 0 && msgs[k].seq == msgs[k].msg->msg.seq)
+        {
+            // [size][message] (all the bytes are in the shared message)
+            parts[0]    = (struct iovec) {tcp_msg, MAX_DIGITS_TCP_MSG_LEN};
+            parts[1]    = (struct iovec) {tcp_msg, sizeof(TCP_msg)};
+            num_parts   = 2;
+        }
+        else if (msgs[k].alias == 0)
+        {
+            // [size][message until `seq`][seq of this client][rest of the message]
+            parts[0]    = (struct iovec) {tcp_msg,                              MAX_DIGITS_TCP_MSG_LEN};
+            parts[1]    = (struct iovec) {tcp_msg,                              seq_off};
+            parts[2]    = (struct iovec) {&msgs[k].seq,                         sizeof(uint32_t)};
+            parts[3]    = (struct iovec) {tcp_msg + seq_off + sizeof(uint32_t), sizeof(TCP_msg) - seq_off - sizeof(uint32_t)};
+            num_parts   = 4;
+        }
+        else
+        {
+            // [size][header with the alias][payload until its terminator]
+            // (the header is kept in the shared message if every subscriber gets the same one)
+            UDP_msg *udp_msg    = &msgs[k].msg->msg.udp_msg;
+            size_t payload_len  = strnlen(udp_msg->payload, PAYLOAD_SIZE - 1) + 1;
+            bool shared         = msgs[k].seq == msgs[k].msg->msg.seq;
+            Alias_hdr *hdr      = shared ? &msgs[k].msg->alias_hdr : &hdrs[k];
+
+            if (!shared || hdr->size[0] == '\0')
+            {
+                memset(hdr->size, 0, MAX_DIGITS_TCP_MSG_LEN);
+                sprintf(hdr->size, "%lu", sizeof(Alias_hdr) + payload_len);
+                memcpy(hdr->ip, tcp_msg + offsetof(TCP_msg, ip), seq_off - offsetof(TCP_msg, ip));
+                hdr->seq    = msgs[k].seq;
+                hdr->marker = '\0';
+                hdr->alias  = msgs[k].alias;
+                hdr->type   = udp_msg->type;
+            }
+
+            parts[0]    = (struct iovec) {hdr->size,        MAX_DIGITS_TCP_MSG_LEN};
+            parts[1]    = (struct iovec) {hdr,              sizeof(Alias_hdr)};
+            parts[2]    = (struct iovec) {udp_msg->payload, payload_len};
+            num_parts   = 3;
+        }
+
+        for (int p = 0; p < num_parts; ++p)
+        {
+            // Skip what was already written
+            if (off >= parts[p].iov_len)
+            {
+                off -= parts[p].iov_len;
+                continue;
+            }
+
+            iov[num_iov].iov_base  = (char *) parts[p].iov_base + off;
+            iov[num_iov].iov_len   = parts[p].iov_len - off;
+            num_iov++;
+            off = 0;
+        }
+    }
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov     = iov;
+    hdr.msg_iovlen  = num_iov;
+
+    ssize_t ret = sendmsg(sock, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL | (*zc ? MSG_ZEROCOPY : 0));
+
+    // Too many zero-copy writes in flight (`optmem_max`), this one is copied
+    if (ret < 0 && errno == ENOBUFS && *zc)
+    {
+        *zc = false;
+        zerocopy.fallbacks++;
+        ret = sendmsg(sock, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    if (ret < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    return ret;
+}
+
+
+/* Number of bytes of a message on the wire */
+static size_t out_msg_len(Out_msg *out)
+{
+    if (out->alias == 0)
+        return OUT_MSG_LEN;
+
+    return MAX_DIGITS_TCP_MSG_LEN + sizeof(Alias_hdr) + strnlen(out->msg->msg.udp_msg.payload, PAYLOAD_SIZE - 1) + 1;
+}
+
+
+/* Tell if all the bytes of a message are in the shared message (so it may be written with zero-copy) */
+static bool zc_candidate(Client *client, Out_msg *out)
+{
+    return client->zc.enabled && out->seq == out->msg->msg.seq;
+}
+
+
+/* Make room for `num` more zero-copy references, return false if the list can't grow */
+static bool reserve_zc_refs(Client *client, int num)
+{
+    Zc_state *zc = &client->zc;
+    if (zc->max - zc->num >= num)
+        return true;
+
+    int max = MAX(zc->max == 0 ? INITIAL_MAX_ZC_REFS : zc->max * 2, zc->num + num);
+    if (mem_over_budget(max * sizeof(Zc_ref)))
+        return false;
+
+    Zc_ref *refs = (Zc_ref *) mem_alloc(client, MEM_QUEUES, max * sizeof(Zc_ref));
+    if (refs == NULL)
+        return false;
+
+    // Unwrap the circular list
+    for (int k = 0; k < zc->num; ++k)
+        refs[k] = zc->refs[(zc->first + k) % zc->max];
+
+    mem_free(zc->refs);
+    zc->refs    = refs;
+    zc->first   = 0;
+    zc->max     = max;
+    return true;
+}
+
+
+/**
+ * Write messages of a client like `write_out_msgs()`, with zero-copy if the write is large enough
+ * and its messages are owned (a ring slot is reused) and whole: each one is then referenced until the write completes
+*/
+static ssize_t write_client_msgs(Client *client, Out_msg *msgs, int num, size_t off)
+{
+    bool zc     = zerocopy.min_len > 0;
+    size_t len  = 0;
+    for (int k = 0; zc && k < num; ++k)
+    {
+        zc  = zc_candidate(client, &msgs[k]) && msgs[k].msg->refs > 0;
+        len += out_msg_len(&msgs[k]);
+    }
+    zc = zc && len - off >= zerocopy.min_len && reserve_zc_refs(client, num);
+
+    ssize_t ret = write_out_msgs(client->socket, msgs, num, off, &zc);
+    if (!zc || ret <= 0)
+        return ret;
+
+    // The kernel numbers only the writes that sent something (`off` is inside the first message)
+    Zc_state *zc_state  = &client->zc;
+    size_t start        = 0;
+    for (int k = 0; k < num && start < off + ret; ++k)
+    {
+        msgs[k].msg->refs++;
+        zc_state->refs[(zc_state->first + zc_state->num++) % zc_state->max] = (Zc_ref) {zc_state->next_id, msgs[k].msg};
+        zerocopy.msgs++;
+        start += out_msg_len(&msgs[k]);
+    }
+    zc_state->next_id++;
+    zerocopy.writes++;
+
+    return ret;
+}
+
+
+/* Tell if a client has messages waiting to be written */
+static bool has_client_output(Client *client)
+{
+    if (client->tx_len > 0)
+        return true;
+
+    for (int lane = 0; lane < NUM_LANES; ++lane)
+        if (client->lanes[lane].num > 0)
+            return true;
+
+    return false;
+}
+
+
+/* Move the next messages from the lanes of a client to its `tx` batch */
+static void fill_tx_batch(Client *client)
+{
+    while (client->tx_len < OUT_BATCH)
+    {
+        // The highest waiting lane, unless a lower one was skipped too many times
+        int next = -1;
+        for (int lane = 0; lane < NUM_LANES; ++lane)
+        {
+            if (client->lanes[lane].num == 0)
+                continue;
+
+            if (next == -1 || client->lanes[lane].skipped >= LANE_STARVATION_LIMIT)
+                next = lane;
+            if (client->lanes[lane].skipped >= LANE_STARVATION_LIMIT)
+                break;
+        }
+
+        if (next == -1)
+            return;
+
+        for (int lane = 0; lane < NUM_LANES; ++lane)
+            if (lane != next && client->lanes[lane].num > 0)
+                client->lanes[lane].skipped++;
+
+        Out_lane *out = &client->lanes[next];
+        client->tx[client->tx_len++] = out->msgs[out->first];
+        out->first      = (out->first + 1) % out->max;
+        out->skipped    = 0;
+        out->num--;
+    }
+}
+
+
+/* Copy a message in the shared ring of a client, return false if the ring is full */
+static bool write_shm_msg(Shm_ring *ring, Out_msg *out)
+{
+    TCP_msg *slot = (TCP_msg *) shm_ring_reserve(ring);
+    if (slot == NULL)
+        return false;
+
+    // A slot holds the message (with the seq of this client), the size isn't needed
+    memcpy(slot, &out->msg->msg, sizeof(TCP_msg));
+    slot->seq = out->seq;
+    shm_ring_push(ring);
+
+    if (out->msg->trace.sampled)
+        trace_write(&tracer, &out->msg->trace);
+    return true;
+}
+
+
+/* Write the queued messages of a client in its shared ring, until the ring is full */
+static void flush_shm_output(Client *client)
+{
+    while (1)
+    {
+        if (client->tx_len == 0)
+            fill_tx_batch(client);
+        if (client->tx_len == 0)
+            break;
+
+        int done = 0;
+        while (done < client->tx_len && write_shm_msg(client->shm, &client->tx[done]))
+            put_shared_msg(client->tx[done++].msg);
+
+        memmove(client->tx, client->tx + done, (client->tx_len - done) * sizeof(Out_msg));
+        client->tx_len -= done;
+
+        // The ring is full, the subscriber wakes the server when it frees a slot
+        if (client->tx_len > 0)
+        {
+            if (shm_ring_prepare_wait(client->shm))
+            {
+                client->shm_waiting = true;
+                break;
+            }
+        }
+    }
+
+    shm_ring_wake_reader(client->shm);
+}
+
+
+/* Send (or queue) a message to a connected client, return false if it was dropped */
+static bool send_out_msg(Client *client, Shared_msg **msg, Out_msg out, int lane)
+{
+    client->last_tx_ms = timers.now_ms;
+
+    // A same-host subscriber reads its messages from the shared ring (it waits in a lane if the ring is full)
+    if (client->shm != NULL && !has_client_output(client))
+    {
+        if (write_shm_msg(client->shm, &out))
+        {
+            shm_ring_wake_reader(client->shm);
+            return true;
+        }
+
+        if (!shm_ring_prepare_wait(client->shm))
+        {
+            // The subscriber freed a slot meanwhile
+            write_shm_msg(client->shm, &out);
+            shm_ring_wake_reader(client->shm);
+            return true;
+        }
+        client->shm_waiting = true;
+    }
+    // Nothing is waiting, so the message can be written directly
+    else if (!has_client_output(client))
+    {
+        // A zero-copy write needs a message that outlives its ring slot (copied once for all the subscribers)
+        // Without memory for the copy, the borrowed message is written with a plain copy
+        if (zerocopy.min_len > 0 && out_msg_len(&out) >= zerocopy.min_len && zc_candidate(client, &out)
+            && own_shared_msg(msg) != NULL)
+            out.msg = *msg;
+
+        ssize_t ret = write_client_msgs(client, &out, 1, 0);
+        if (ret < 0)
+            return true;
+        if (ret == out_msg_len(&out))
+        {
+            if (out.msg->trace.sampled)
+                trace_write(&tracer, &out.msg->trace);
+            return true;
+        }
+
+        // Finish it when the socket has room again
+        // (without memory to keep the rest, the stream can't go on: the main loop sees the connection closed)
+        if (own_shared_msg(msg) == NULL)
+        {
+            mem_stats.dropped_msgs++;
+            shutdown(client->socket, SHUT_RDWR);
+            return false;
+        }
+
+        out.msg = *msg;
+        out.msg->refs++;
+        client->tx[0]   = out;
+        client->tx_len  = 1;
+        client->tx_off  = ret;
+        watch_fd_output(client->socket, true);
+        return true;
+    }
+
+    Out_lane *queue = &client->lanes[lane];
+    if (queue->num == queue->max)
+    {
+        // Double the capacity (a slow client's lane doesn't grow over the budget, the message is dropped)
+        int max         = queue->max == 0 ? INITIAL_MAX_OUT_MSGS : queue->max * 2;
+        Out_msg *msgs   = NULL;
+        if (!mem_over_budget(max * sizeof(Out_msg)))
+            msgs = (Out_msg *) mem_alloc(client, MEM_QUEUES, max * sizeof(Out_msg));
+        if (msgs == NULL)
+        {
+            mem_stats.dropped_msgs++;
+            return false;
+        }
+
+        // Unwrap the circular list
+        for (int k = 0; k < queue->num; ++k)
+            msgs[k] = queue->msgs[(queue->first + k) % queue->max];
+
+        mem_free(queue->msgs);
+        queue->msgs     = msgs;
+        queue->first    = 0;
+        queue->max      = max;
+    }
+
+    // Without memory for a copy of a borrowed message, it's dropped like on a full lane
+    if (own_shared_msg(msg) == NULL)
+    {
+        mem_stats.dropped_msgs++;
+        return false;
+    }
+
+    out.msg = *msg;
+    out.msg->refs++;
+    queue->msgs[(queue->first + queue->num++) % queue->max] = out;
+    return true;
 }
 
 
-Client *get_client_by_id(const char *id)
+bool send_tcp_msg_to_conn_client(Client *client, Shared_msg **msg, uint32_t seq, int lane)
 {
-    for (int i = 0; i < subs_curr_cap; ++i)
-        if (strcmp(subscribers[i]->id, id) == 0)
-            return subscribers[i];
+    Out_msg out = {*msg, htonl(seq), 0};
+    return send_out_msg(client, msg, out, lane);
+}
 
-    return NULL;
+
+/* Tell a client the alias of a topic (in the lane of the topic, so it comes before the aliased messages) */
+static bool announce_alias(Client *client, Topic *topic)
+{
+    // Without memory, the messages keep their topic name
+    Topic_entry *entry      = topic->entry;
+    Shared_msg *msg         = new_shared_msg();
+    if (msg == NULL)
+        return false;
+
+    msg->msg.from_server    = true;
+    msg->msg.udp_msg.type   = TOPIC_ALIAS;
+    sprintf(msg->msg.size, "%lu", sizeof(TCP_msg));
+    memcpy(msg->msg.udp_msg.topic, entry->name, entry->name_len);
+    sprintf(msg->msg.udp_msg.payload, "%u", entry->alias);
+
+    bool sent = send_tcp_msg_to_conn_client(client, &msg, 0, entry->lane);
+    put_shared_msg(msg);
+    return sent;
 }
 
 
-Client *get_client_by_socket(int sock)
+bool send_topic_msg(Client *client, Topic *topic, Shared_msg **msg, uint32_t seq)
 {
-    for (int i = 0; i < subs_curr_cap; ++i)
-        if (subscribers[i]->socket == sock)
-            return subscribers[i];
+    // The slots of a shared ring hold whole messages, so the aliases only shorten the TCP stream
+    Out_msg out = {*msg, htonl(seq), 0};
+    if (topic->alias && client->shm == NULL)
+    {
+        if (!topic->alias_sent)
+            topic->alias_sent = announce_alias(client, topic);
+        if (topic->alias_sent)
+            out.alias = htonl(topic->entry->alias);
+    }
 
-    return NULL;
+    return send_out_msg(client, msg, out, topic->entry->lane);
 }
 
 
-void add_new_client(const char *id, int req_tcp_socket)
+void flush_client_output(Client *client)
 {
-    // Create a new client
-    Client *client = (Client *) calloc(1, sizeof(Client));
-    DIE(client == NULL, "[ERROR]: Allocation error!\n");
+    if (client->shm != NULL)
+    {
+        flush_shm_output(client);
+        return;
+    }
 
-    // Complete the client's fields
-    strcpy(client->id, id);
-    client->socket          = req_tcp_socket;
-    client->connected       = true;
-    client->num_of_topics   = 0;
-    client->max_topics      = INITIAL_MAX_TOPICS;
+    while (1)
+    {
+        if (client->tx_len == 0)
+            fill_tx_batch(client);
+        if (client->tx_len == 0)
+            break;
+
+        ssize_t ret = write_client_msgs(client, client->tx, client->tx_len, client->tx_off);
+        if (ret < 0)
+        {
+            // The connection is broken, the client is disconnected when its socket is read
+            drop_client_output(client);
+            return;
+        }
 
-    // Alloc memory for client's topics
-    client->topics = (Topic **) calloc(client->max_topics, sizeof(Topic *));
-    DIE(client->topics == NULL, "[ERROR]: Allocation error!\n");
+        // Release the messages written completely
+        size_t written  = client->tx_off + ret;
+        int done        = 0;
+        while (done < client->tx_len && written >= out_msg_len(&client->tx[done]))
+        {
+            written -= out_msg_len(&client->tx[done]);
+            if (client->tx[done].msg->trace.sampled)
+                trace_write(&tracer, &client->tx[done].msg->trace);
+            put_shared_msg(client->tx[done++].msg);
+        }
 
-    // Reallocate memory for the list of `subscribers` if needed
-    if (subs_curr_cap == subs_max_cap)
-    {
-        subs_max_cap *= 2;
-        subscribers   = (Client **) realloc(subscribers, subs_max_cap * sizeof(Client *));
-        DIE(subscribers == NULL, "[ERROR]: Reallocation error!\n");
+        memmove(client->tx, client->tx + done, (client->tx_len - done) * sizeof(Out_msg));
+        client->tx_len -= done;
+        client->tx_off  = written;
+
+        // The socket is full
+        if (client->tx_len > 0)
+            break;
     }
 
-    // Add the new `client` in the `subscribers` list
-    subscribers[subs_curr_cap++] = client;
+    if (!has_client_output(client))
+        watch_fd_output(client->socket, false);
 }
 
 
-void reconnect_old_sub(Client *client, int req_tcp_socket)
+void send_shm_token(Client *client)
 {
-    // Update the fields of the `client`
-    client->socket      = req_tcp_socket;
-    client->connected   = true;
+    // Without randomness there is no token, a ring request is refused (the client keeps TCP)
+    uint64_t value;
+    if (getrandom(&value, sizeof(value), 0) != sizeof(value))
+        return;
+
+    Shared_msg *msg         = new_shared_msg();
+    if (msg == NULL)
+        return;
+
+    msg->msg.from_server    = true;
+    msg->msg.udp_msg.type   = SHM_TOKEN;
+    sprintf(msg->msg.size, "%lu", sizeof(TCP_msg));
+    sprintf(client->shm_token, "%016lx", value);
+    strcpy(msg->msg.udp_msg.payload, client->shm_token);
 
-    // Send all the stored messaged (from UDP clients) while
-    // the TCP `client` was disconnected from the server
-    for (int i = 0; i < client->num_of_topics; ++i)
+    send_tcp_msg_to_conn_client(client, &msg, 0, LANE_HIGH);
+    put_shared_msg(msg);
+}
+
+
+bool attach_shm_ring(Client *client, const char *token, int sock, int space_efd)
+{
+    // Only the owner of the TCP connection knows the token (a request with a wrong one uses it up)
+    bool allowed = client != NULL && client->shm_token[0] != '\0' && strcmp(client->shm_token, token) == 0;
+    if (client != NULL)
+        client->shm_token[0] = '\0';
+
+    // The ring is used from the start of the client's stream, or not at all
+    char status = 0;
+    Shm_ring *ring = NULL;
+    if (allowed && client->connected && client->shm == NULL && !has_client_output(client))
     {
-        for (int j = 0; j < client->topics[i]->num_of_tcps; ++j)
+        // The ring is refused over the budget (the client keeps TCP)
+        ring = (Shm_ring *) mem_alloc(client, MEM_QUEUES, sizeof(Shm_ring));
+        if (ring != NULL && shm_ring_create(ring, SHM_RING_SLOTS, sizeof(TCP_msg)))
         {
-            TCP_msg *msg = client->topics[i]->tcps[j];
-            // Send the size of the `msg` first and then the actual `msg`
-            send(req_tcp_socket, msg->size, MAX_DIGITS_TCP_MSG_LEN, 0);
-            send(req_tcp_socket, msg, atoi(msg->size), 0);
+            if (!mem_over_budget(ring->map_len))
+                status = 1;
+            else
+                shm_ring_destroy(ring);
+        }
+
+        if (status == 0)
+        {
+            mem_free(ring);
+            ring = NULL;
         }
     }
 
-    // Deallocate the memory for stored TCP messages 
-    for (int i = 0; i < client->num_of_topics; ++i)
+    // [status] with the memfd, `data_efd` and `space_efd` of the ring (if it was created)
+    struct iovec iov = {&status, sizeof(status)};
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov     = &iov;
+    hdr.msg_iovlen  = 1;
+
+    if (ring != NULL)
     {
-        for (int j = 0; j < client->topics[i]->num_of_tcps; ++j)
-            free(client->topics[i]->tcps[j]);
+        hdr.msg_control     = control.buf;
+        hdr.msg_controllen  = sizeof(control.buf);
+
+        struct cmsghdr *cmsg    = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level        = SOL_SOCKET;
+        cmsg->cmsg_type         = SCM_RIGHTS;
+        cmsg->cmsg_len          = CMSG_LEN(3 * sizeof(int));
+        int fds[3]              = {ring->memfd, ring->data_efd, space_efd};
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
 
-        free(client->topics[i]->tcps);
-        client->topics[i]->num_of_tcps  = 0;
-        client->topics[i]->max_tcps     = INITIAL_MAX_TOPICS;
+    if (sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0 && ring != NULL)
+    {
+        shm_ring_destroy(ring);
+        mem_free(ring);
+        return false;
     }
+
+    if (ring == NULL)
+        return false;
+
+    // Both sides map the ring now
+    close(ring->memfd);
+    ring->memfd = -1;
+    client->shm = ring;
+    mem_charge(client, MEM_QUEUES, ring->map_len);
+    return true;
 }
 
 
-void disconnect_client(int sock)
+void flush_shm_clients()
 {
-    // Iterate through the list of subscribers
     for (int i = 0; i < subs_curr_cap; ++i)
     {
-        if (subscribers[i]->socket == sock)
-        {
-            Client *client = subscribers[i];
-            printf("Client %s disconnected.\n", client->id);
-            
-            // Disconnect the client
-            client->connected = false;
-
-            // Alloc space for storing messages while the client will be disconnected
-            for (int j = 0; j < client->num_of_topics; ++j)
-            {
-                if (client->topics[j]->sf == 1)
-                {
-                    client->topics[j]->tcps = (TCP_msg **) calloc(INITIAL_MAX_TCPS, sizeof(TCP_msg *));
-                    DIE(client->topics[j]->tcps == NULL, "[ERROR]: Allocation error!\n");
-                    client->topics[j]->num_of_tcps  = 0;
-                    client->topics[j]->max_tcps     = INITIAL_MAX_TCPS; 
-                }
-            }
+        Client *client = subscribers[i];
+        if (client->shm == NULL || !client->shm_waiting)
+            continue;
 
-            // Close the socket
-            close(sock);
-            return;
-        }
+        client->shm_waiting = false;
+        shm_ring_finish_wait(client->shm);
+        flush_shm_output(client);
     }
 }
 
 
-int check_already_sub_topic(Action *action, int sock)
+void drop_client_output(Client *client)
 {
-    // `client` shouldn't be NULL if the implementation
-    // is correct, but for safety, we can check this
-    Client *client = get_client_by_socket(sock);
-    if (client == NULL)
-        return 1;
+    for (int k = 0; k < client->tx_len; ++k)
+        put_shared_msg(client->tx[k].msg);
+    client->tx_len = 0;
+    client->tx_off = 0;
 
-    // Clear the buffer
-    memset(buffer, 0, BUFF_LEN);
-
-    // Iterate through client's subscribed topics
-    for (int i = 0; i < client->num_of_topics; ++i)
+    for (int lane = 0; lane < NUM_LANES; ++lane)
     {
-        if ((strcmp(client->topics[i]->name, action->topic) == 0))
-        {
-            // Check if the client wants to change the `SF` or re-subscribe with the same `SF`
-            if (client->topics[i]->sf == action->sf && client->topics[i]->subscribed)
-                sprintf(buffer, "User %s already subscribed to topic %s.\n", client->id, client->topics[i]->name);
-            else if (client->topics[i]->sf != action->sf && client->topics[i]->subscribed)
-            {
-                if (action->sf != 0 && action->sf != 1)
-                    strcpy(buffer, "SF should be 0 or 1.\n");
-                else
-                {
-                    client->topics[i]->sf = action->sf;
-                    sprintf(buffer, "User %s changed the SF of topic %s to %d.\n", client->id, client->topics[i]->name, client->topics[i]->sf);
-                }
-            }
-
-            // Send a repsonse back to the client if `verbose` is enabled
-            if (verbose)
-                respose_with_err_msg(buffer, client->socket);
+        Out_lane *queue = &client->lanes[lane];
+        for (int k = 0; k < queue->num; ++k)
+            put_shared_msg(queue->msgs[(queue->first + k) % queue->max].msg);
 
-            return 1;
-        }
+        queue->first    = 0;
+        queue->num      = 0;
+        queue->skipped  = 0;
     }
-    
-    return 0;
+
+    watch_fd_output(client->socket, false);
 }
 
 
-void subscribe_to_topic(Action *action, int sock)
+/* Evict the oldest SF messages (of all the clients) until the memory used is under the low water mark */
+static void evict_sf_msgs()
 {
-    if (check_already_sub_topic(action, sock))
-        return;
-
-    // Chech `SF` value
-    if (action->sf != 0 && action->sf != 1)
+    // The root of the heap holds the oldest stored message (of all the clients)
+    // A shared message is freed only when its last holder evicts it, the usage is checked after each one
+    while (mem_stats.used > MEM_LOW_WATER(mem_stats.budget) && sf_heap.num > 0)
     {
-        memset(buffer, 0, BUFF_LEN);
-        strcpy(buffer, "SF should be 0 or 1.\n");
-        if (verbose)
-            respose_with_err_msg(buffer, sock);
-        return;
+        Topic *oldest = sf_heap.topics[0];
+        put_shared_msg(oldest->tcps[oldest->first_tcp].msg);
+        oldest->first_tcp = (oldest->first_tcp + 1) % oldest->max_tcps;
+        oldest->num_of_tcps--;
+        mem_stats.evicted_msgs++;
+        sf_heap_update(oldest);
     }
-
-    // Create a new topic for this client identified by socket `sock`
-    Topic *topic = (Topic *) calloc(1, sizeof(Topic));
-    DIE(topic == NULL, "[ERROR]: Allocation error!\n");
-
-    // Set topic's fields
-    strcpy(topic->name, action->topic);
-    topic->subscribed    = true;
-    topic->sf           = action->sf;
-    topic->tcps         = NULL;
-    topic->num_of_tcps  = 0;
-    topic->max_tcps     = INITIAL_MAX_TCPS;
+}
 
 
-    // Iterate through subscribers
-    for (int i = 0; i < subs_curr_cap; ++i)
+uint32_t store_tcp_msg(Client *client, Topic *topic, Shared_msg *msg)
+{
+    // A message that couldn't be copied (NULL) is sent but not kept
+    if (msg == NULL)
     {
-        // Found the subscriber
-        if (subscribers[i]->socket == sock)
-        {
+        mem_stats.evicted_msgs++;
+        return 0;
+    }
 
-            if (subscribers[i]->num_of_topics == subscribers[i]->max_topics)
-            {
-                // Reallocate memory for topics list
-                subscribers[i]->max_topics     *= 2;
-                subscribers[i]->topics          = (Topic **) realloc(subscribers[i]->topics, subscribers[i]->max_topics * sizeof(Topic *));
-                DIE(subscribers[i]->topics == NULL, "[ERROR]: Reallocation error!\n");
-            }
+    // Over the budget, the oldest SF messages make room for the new ones
+    if (mem_over_budget(0))
+        evict_sf_msgs();
 
-            // Add the topic to client
-            subscribers[i]->topics[subscribers[i]->num_of_topics++] = topic;
-            return;
-        }
+    // An empty queue enters the heap of the evictions with this message (without room, it isn't kept)
+    if (topic->num_of_tcps == 0 && !sf_heap_reserve())
+    {
+        mem_stats.evicted_msgs++;
+        return 0;
     }
-}
 
-
-void unsubscribe_from_topic(Action *action, int sock)
-{
-    Client *client = get_client_by_socket(sock);
-    // Iterate through the client's topics
-    bool found_topic = false;
-    for (int i = 0; i < client->num_of_topics; ++i)
+    // Reallocate memory for client TCP messages if needed
+    if (topic->num_of_tcps == topic->max_tcps)
     {
-        if ((strcmp(client->topics[i]->name, action->topic) == 0) && (client->topics[i]->subscribed))
+        // Double the capacity (without memory, the message is sent but not kept)
+        int max_tcps        = topic->max_tcps == 0 ? INITIAL_MAX_TCPS : topic->max_tcps * 2;
+        Pending_msg *tcps   = (Pending_msg *) mem_alloc(client, MEM_QUEUES, max_tcps * sizeof(Pending_msg));
+        if (tcps == NULL)
         {
-            found_topic = true;
-            client->topics[i]->subscribed = false;
-            break;
+            mem_stats.evicted_msgs++;
+            return 0;
         }
+
+        // Unwrap the circular list
+        for (int k = 0; k < topic->num_of_tcps; ++k)
+            tcps[k] = topic->tcps[(topic->first_tcp + k) % topic->max_tcps];
+
+        mem_free(topic->tcps);
+        topic->tcps         = tcps;
+        topic->first_tcp    = 0;
+        topic->max_tcps     = max_tcps;
     }
 
-    if (!found_topic && verbose)
+    // Add the msg to the client's list of TCP messages (until it's acknowledged)
+    Pending_msg *pending = &topic->tcps[(topic->first_tcp + topic->num_of_tcps++) % topic->max_tcps];
+    pending->seq        = topic->next_seq++;
+    pending->stored     = num_stored++;
+    pending->stored_ms  = timers.now_ms;
+    pending->msg        = msg;
+    msg->refs++;
+
+    if (topic->heap_idx < 0)
     {
-        memset(buffer, 0, BUFF_LEN);
-        sprintf(buffer, "User %s isn't subscribe to topic %s, so he can't unsubscribe from it.\n", client->id, action->topic);
-        respose_with_err_msg(buffer, sock);
+        sf_heap_set(sf_heap.num++, topic);
+        sf_heap_sift_up(topic->heap_idx);
     }
-}
 
+    // The oldest message of the topic expires first (its timer is re-armed for the next one)
+    if (timeouts.sf_ttl_ms != 0 && !timer_pending(&topic->expiry))
+        timer_add(&timers, &topic->expiry, topic->tcps[topic->first_tcp].stored_ms + timeouts.sf_ttl_ms);
 
-int convert_to_int(UDP_msg *udp_msg, TCP_msg *tcp_msg)
-{
-    // First byte from the payload is the `sign byte` (0/1)
-    if (udp_msg->payload[0] > 1)
-        return 0;
-
-    // Complete the `type`
-    tcp_msg->udp_msg.type = INT;
-    
-    // Let's check if the number is positive or negative
-    ll sign = 1;
-    if (udp_msg->payload[0])
-        sign = -1;
-    
-    // Write the `payload` on the TCP msg (remove the sign byte from the payload)
-    ll num_int = sign * ntohl(*(uint32_t *) (udp_msg->payload + 1));
-    sprintf(tcp_msg->udp_msg.payload, "%lld", num_int);
+    // 0 is reserved for the streams without SF
+    if (topic->next_seq == 0)
+        topic->next_seq = 1;
 
-    // Successfully completed the UDP msg payload
-    return 1;
+    return pending->seq;
 }
 
 
-void convert_to_short_real(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+/* Return the current CLOCK_MONOTONIC time in microseconds */
+static uint64_t now_us()
 {
-    // Complete the `type`
-    tcp_msg->udp_msg.type = SHORT_REAL;
-
-    // Write the `payload` on the TCP msg
-    double num_real = 1.0 * (ntohs(*(uint16_t *) (udp_msg->payload))) / 100;
-    sprintf(tcp_msg->udp_msg.payload, "%.2f", num_real);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
 
 
-int convert_to_float(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+/* Tell if a message must be dropped by the rate limit or the sampling of a subscription (`now` is read lazily) */
+static bool throttle_msg(Topic *topic, uint64_t *now)
 {
-    // First byte from the payload is the `sign byte` (0/1)
-    if (udp_msg->payload[0] != 0 && udp_msg->payload[0] != 1)
-        return 0;
+    // Sampling: 1 message in `every`
+    if (topic->every > 1)
+    {
+        uint32_t count      = topic->every_count;
+        topic->every_count  = count + 1 == topic->every ? 0 : count + 1;
+        if (count != 0)
+        {
+            topic->throttled++;
+            return true;
+        }
+    }
 
-    // Complete the `type`
-    tcp_msg->udp_msg.type = FLOAT;
+    if (topic->rate == 0)
+        return false;
 
-    // Let's check if the number is positive or negative
-    double sign_float = 1;
-    if (udp_msg->payload[0] == 1)
-        sign_float = -1;
-    
-    // Write the `payload` on the TCP msg
-    sign_float *= ntohl(*(uint32_t *) (udp_msg->payload + 1));
-    sign_float /= pow(10, (uint8_t) udp_msg->payload[5]);
-    sprintf(tcp_msg->udp_msg.payload, "%lf", sign_float);
+    // Refill the bucket (it holds at most 1 second of messages, but at least one message)
+    if (*now == 0)
+        *now = now_us();
 
-    // Successfully completed the UDP msg payload
-    return 1;
+    if (topic->refill_us != 0)
+    {
+        uint64_t idle   = MIN(*now - topic->refill_us, RATE_MAX_IDLE_US);
+        topic->tokens   = MIN(topic->tokens + idle * topic->rate, MAX((uint64_t) topic->rate * 1000000, RATE_MSG_COST));
+    }
+    topic->refill_us = *now;
+
+    if (topic->tokens < RATE_MSG_COST)
+    {
+        topic->throttled++;
+        return true;
+    }
+
+    topic->tokens -= RATE_MSG_COST;
+    return false;
 }
 
 
-void convert_to_string(UDP_msg *udp_msg, TCP_msg *tcp_msg)
+/* Send a message on the multicast group of its topic and keep it in the repair window (a borrowed `*msg` is copied) */
+static void send_mcast_msg(Topic_entry *entry, Shared_msg **msg)
 {
-    // Complete the `type`
-    tcp_msg->udp_msg.type = STRING;
-    
-    // Write the `payload` on the TCP msg
-    strcpy(tcp_msg->udp_msg.payload, udp_msg->payload);
-}
+    // Without memory for the window, the lost messages can't be repaired
+    if (entry->mcast_window == NULL)
+        entry->mcast_window = (Shared_msg **) mem_alloc(NULL, MEM_QUEUES, MCAST_REPAIR_WINDOW * sizeof(Shared_msg *));
 
+    // The oldest message leaves the window
+    entry->mcast_seq++;
+    if (entry->mcast_window != NULL)
+    {
+        // Without memory for a copy of a borrowed message, this one can't be repaired
+        Shared_msg **slot = &entry->mcast_window[entry->mcast_seq & (MCAST_REPAIR_WINDOW - 1)];
+        if (*slot != NULL)
+            put_shared_msg(*slot);
+        *slot = own_shared_msg(msg);
+        if (*slot != NULL)
+            (*slot)->refs++;
+    }
 
-/*
-    typedef struct udp_msg {
-        char 	topic[TOPIC_SIZE];
-        uint8_t type;                           // 0, 1, 2 or 3
-        char 	payload[PAYLOAD_SIZE];
-    } UDP_msg;
+    // [sequence number][message until the end of its payload]
+    Mcast_hdr hdr;
+    hdr.seq = htonl(entry->mcast_seq);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = &(*msg)->msg;
+    iov[1].iov_len  = offsetof(TCP_msg, udp_msg) + offsetof(UDP_msg, payload)
+                    + strnlen((*msg)->msg.udp_msg.payload, PAYLOAD_SIZE - 1) + 1;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name     = &entry->mcast_addr;
+    mh.msg_namelen  = sizeof(entry->mcast_addr);
+    mh.msg_iov      = iov;
+    mh.msg_iovlen   = 2;
+
+    // A lost datagram is repaired at the subscriber's request
+    if (sendmsg(mcast_egress.socket, &mh, MSG_DONTWAIT) < 0)
+        mcast_egress.errors++;
+    else
+        entry->mcast_sent++;
+}
 
 
-    typedef struct tcp_msg {
-        char 	 size[MAX_DIGITS_TCP_MSG_LEN]; 	// Size of the message
-        char	 ip[IP_LEN];					// `IP_CLIENT_UDP`
-        uint16_t port;							// `PORT_CLIENT_UDP`
-        UDP_msg udp_msg;                        // Received msg from the UDP client with IP `ip` and PORT `port`
-    } TCP_msg;
-*/
-TCP_msg *UDP_to_TCP(UDP_msg *udp_msg, struct sockaddr_in udp_addr)
+void send_tcp_msg(Shared_msg *msg)
 {
-    if (udp_msg->type < 0 || udp_msg->type > 3)
-        return NULL;
+    TCP_msg *tcp_msg    = &msg->msg;
 
-    // Create a new TCP message
-    TCP_msg *tcp_msg = (TCP_msg *) calloc(1, sizeof(TCP_msg));
-    DIE(tcp_msg == NULL, "[ERROR]: Allocation error!\n");
+    // A borrowed message is replaced with a copy once a queue keeps it
+    Shared_msg *shared  = msg;
 
-    // Set the `size`, `ip`, `port` and `sever_msg` fields of the TCP msg
-    sprintf(tcp_msg->size, "%lu", sizeof(TCP_msg));
-    strcpy(tcp_msg->ip, inet_ntoa(udp_addr.sin_addr));
-    tcp_msg->port = ntohs(udp_addr.sin_port);
-    tcp_msg->from_server = false;
+    // Read only if a subscription is rate limited
+    uint64_t now        = 0;
 
-    // Complete the `topic`
-    strncpy(tcp_msg->udp_msg.topic, udp_msg->topic, TOPIC_SIZE);
-    tcp_msg->udp_msg.topic[TOPIC_SIZE] = '\0';
+    // Only the subscribers of this topic are visited
+    Topic_entry *entry = topic_index_get(tcp_msg->udp_msg.topic, strnlen(tcp_msg->udp_msg.topic, TOPIC_SIZE), false);
+    if (msg->trace.sampled && entry != NULL)
+        msg->trace.topic_hash = entry->hash;
 
-    // We can have one of the following types (0 - INT, 1 - SHORT_REAL, 2 - FLOAT, 3 - STRING)
-    switch (udp_msg->type)
+    // A single datagram for all the subscribers served by the multicast group
+    if (entry != NULL && entry->num_mcast_subs > 0 && (msg->formatted || format_shared_msg(msg)))
+        send_mcast_msg(entry, &shared);
+
+    for (int i = 0; entry != NULL && i < entry->num_subs; ++i)
     {
-        case 0:
-            if (convert_to_int(udp_msg, tcp_msg) == 0)
-                return NULL;
-            break;
+        Client *client  = entry->subs[i].client;
+        Topic  *topic   = entry->subs[i].topic;
 
-        case 1:
-            convert_to_short_real(udp_msg, tcp_msg);
-            break;
+        // The filter is evaluated on the raw payload
+        if (topic->filter.active && !filter_match(&topic->filter, msg))
+        {
+            topic->filtered++;
+            continue;
+        }
 
-        case 2:
-            if (convert_to_float(udp_msg, tcp_msg) == 0)
-                return NULL;
-            break;
+        // Most subscriptions have no limits, so only two fields are checked
+        if ((topic->rate != 0 || topic->every > 1) && throttle_msg(topic, &now))
+            continue;
 
-        case 3:
-            convert_to_string(udp_msg, tcp_msg);
+        // Formatted only when the first subscriber gets it (invalid datagrams are dropped)
+        if (!msg->formatted && !format_shared_msg(msg))
             break;
+
+        if (topic->sf == 1)
+        {
+            // Keep it until it's acknowledged, a reconnected client gets it when it resumes
+            uint32_t seq = store_tcp_msg(client, topic, own_shared_msg(&shared));
+            if (client->connected && client->resumed)
+                send_topic_msg(client, topic, &shared, seq);
+        }
+        else if (client->connected)
+            send_topic_msg(client, topic, &shared, 0);
     }
 
-    return tcp_msg;
+    // The queues hold their own references, the last one traces the message (with the writes done later)
+    if (shared != msg)
+        put_shared_msg(shared);
+    else if (msg->trace.sampled && msg->refs == 0)
+        trace_msg(&tracer, &msg->trace);
 }
 
 
-void send_tcp_msg_to_conn_client(Client *client, TCP_msg *tcp_msg)
+void print_subscription_stats(FILE *file)
 {
-    // First, send the size of the message
-    send(client->socket, tcp_msg->size, MAX_DIGITS_TCP_MSG_LEN, 0);
+    uint64_t filtered   = removed_filtered;
+    uint64_t throttled  = removed_throttled;
+    for (int i = 0; i < subs_curr_cap; ++i)
+    {
+        for (int j = 0; j < subscribers[i]->subs.num; ++j)
+        {
+            Topic *topic = subscribers[i]->subs.topics[j];
+            if (topic->filtered == 0 && topic->throttled == 0)
+                continue;
+
+            fprintf(file, "Client %s, topic %s: %lu filtered, %lu throttled messages.\n",
+                    subscribers[i]->id, topic->entry->name, topic->filtered, topic->throttled);
+            filtered    += topic->filtered;
+            throttled   += topic->throttled;
+        }
+    }
 
-    // Send the actual message
-    send(client->socket, (char *) tcp_msg, atoi(tcp_msg->size), 0);
-}
+    fprintf(file, "Filtered messages: %lu\n", filtered);
+    fprintf(file, "Throttled messages: %lu\n", throttled);
 
+    if (mcast_egress.num_topics == 0)
+        return;
 
-void store_tcp_msg_to_unconn_client(Client *client, int topic_idx, TCP_msg *tcp_msg)
-{
-    // Reallocate memory for client TCP messages if needed
-    if (client->topics[topic_idx]->num_of_tcps == client->topics[topic_idx]->max_tcps)
+    for (size_t i = 0; i < topic_index.num_buckets; ++i)
     {
-        // Double the capacity
-        client->topics[topic_idx]->max_tcps *= 2;
-        client->topics[topic_idx]->tcps      = (TCP_msg **) realloc(client->topics[topic_idx]->tcps,
-                                                                    client->topics[topic_idx]->max_tcps * sizeof(TCP_msg *));
-        DIE(client->topics[topic_idx]->tcps == NULL, "[ERROR]: Reallocation error!\n");
-    }
+        for (Topic_entry *entry = topic_index.buckets[i]; entry != NULL; entry = entry->next)
+        {
+            if (!entry->mcast)
+                continue;
 
-    // Add the msg to the client's list of TCP messages (when it's disconnected)
-    client->topics[topic_idx]->tcps[client->topics[topic_idx]->num_of_tcps++] = tcp_msg;
+            fprintf(file, "Topic %s, group %s:%d: %d subscriptions, %lu sent, %lu repaired messages.\n",
+                    entry->name, inet_ntoa(entry->mcast_addr.sin_addr), ntohs(entry->mcast_addr.sin_port),
+                    entry->num_mcast_subs, entry->mcast_sent, entry->mcast_repaired);
+        }
+    }
+    fprintf(file, "Multicast send errors: %lu\n", mcast_egress.errors);
 }
 
 
-void send_tcp_msg(TCP_msg *tcp_msg)
+void print_mem_stats(FILE *file)
 {
-    // Iterate through subscribers
+    static const char *kind_names[NUM_MEM_KINDS] = {"clients", "topics", "messages", "queues", "peers"};
+
+    size_t ingest_used  = atomic_load_explicit(&ingest.mem_used, memory_order_relaxed);
+    size_t used         = mem_stats.used + ingest_used;
+    mem_stats.peak      = MAX(mem_stats.peak, used);
+    if (mem_stats.budget != 0)
+        fprintf(file, "Memory: %zu bytes used (peak %zu), budget %zu bytes\n", used, mem_stats.peak, mem_stats.budget);
+    else
+        fprintf(file, "Memory: %zu bytes used (peak %zu), no budget\n", used, mem_stats.peak);
+
+    for (int kind = 0; kind < NUM_MEM_KINDS; ++kind)
+        fprintf(file, "Memory of the %s: %zu bytes\n", kind_names[kind], mem_stats.by_kind[kind]);
+    fprintf(file, "Memory of the ingest thread: %zu bytes\n", ingest_used);
+    fprintf(file, "Preallocated memory (outside the budget): %zu bytes\n", mem_stats.fixed);
+
     for (int i = 0; i < subs_curr_cap; ++i)
-    {
-        // Iterate through each subscriber's topic
-        for (int j = 0; j < subscribers[i]->num_of_topics; ++j)
-        {
-            // Found the topic
-            if (strcmp(subscribers[i]->topics[j]->name, tcp_msg->udp_msg.topic) == 0)
-            {
-                if (subscribers[i]->connected == true)
-                {
-                    send_tcp_msg_to_conn_client(subscribers[i], tcp_msg);
-                    break;
-                }
-                else if (subscribers[i]->connected == false && subscribers[i]->topics[j]->sf == 1)
-                {
-                    store_tcp_msg_to_unconn_client(subscribers[i], j, tcp_msg);
-                    break;
-                }
-            }
-        }
-    }
+        fprintf(file, "Client %s: %zu bytes.\n", subscribers[i]->id, subscribers[i]->mem_used);
+
+    fprintf(file, "Rejected clients: %lu\n", mem_stats.rejected_clients);
+    fprintf(file, "Refused subscriptions: %lu\n", mem_stats.refused_subs);
+    fprintf(file, "Evicted SF messages: %lu\n", mem_stats.evicted_msgs);
+    fprintf(file, "Dropped messages: %lu\n", mem_stats.dropped_msgs);
+    fprintf(file, "Failed allocations: %lu\n", mem_stats.failed);
+}
+
+
+void print_timeout_stats(FILE *file)
+{
+    fprintf(file, "Heartbeats sent: %lu\n", timeouts.heartbeats);
+    fprintf(file, "Idle clients disconnected: %lu\n", timeouts.idle_clients);
+    fprintf(file, "Expired SF messages: %lu\n", timeouts.expired_msgs);
 }
 
 
@@ -450,25 +3794,71 @@ void dealloc_memory()
     for (int i = 0; i < subs_curr_cap; ++i)
     {
         // Iterate through each topic
-        for (int j = 0; j < subscribers[i]->num_of_topics; ++j)
+        Sub_table *table = &subscribers[i]->subs;
+        for (int j = 0; j < table->num; ++j)
         {
             // Free each stored TCP msg
-            for (int k = 0; k < subscribers[i]->topics[j]->num_of_tcps; ++k)
-                free(subscribers[i]->topics[j]->tcps[k]);
-            free (subscribers[i]->topics[j]->tcps);
-            free(subscribers[i]->topics[j]);
+            drop_pending_msgs(table->topics[j]);
+            mem_free(table->topics[j]->tcps);
+            mem_free(table->topics[j]);
+        }
+        mem_free(table->keys);
+        mem_free(table->topics);
+        mem_free(table->retired);
+        mem_free(subscribers[i]->rx_buf);
+
+        // Free the queued messages, the zero-copy references and the shared ring
+        drop_client_output(subscribers[i]);
+        drop_zc_refs(&subscribers[i]->zc);
+        release_shm_ring(subscribers[i]);
+        for (int lane = 0; lane < NUM_LANES; ++lane)
+            mem_free(subscribers[i]->lanes[lane].msgs);
+        mem_free(subscribers[i]);
+    }
+    mem_free(subscribers);
+    mem_free(sf_heap.topics);
+
+    // Close the sockets that waited for their zero-copy writes
+    for (int i = 0; i < zerocopy.num_orphans; ++i)
+    {
+        close(zerocopy.orphans[i].socket);
+        drop_zc_refs(&zerocopy.orphans[i].zc);
+    }
+    mem_free(zerocopy.orphans);
+
+    // Free the topic index
+    for (size_t i = 0; i < topic_index.num_buckets; ++i)
+    {
+        Topic_entry *entry = topic_index.buckets[i];
+        while (entry != NULL)
+        {
+            Topic_entry *next = entry->next;
+            mem_free(entry->subs);
+            mem_free(entry->interests);
+
+            // Release the repair window
+            for (int k = 0; entry->mcast_window != NULL && k < MCAST_REPAIR_WINDOW; ++k)
+                if (entry->mcast_window[k] != NULL)
+                    put_shared_msg(entry->mcast_window[k]);
+            mem_free(entry->mcast_window);
+            mem_free(entry);
+            entry = next;
         }
-        free(subscribers[i]->topics);
-        free(subscribers[i]);
     }
-    free(subscribers);
+    mem_free(topic_index.buckets);
+    mem_free(client_index.buckets);
 }
 
 
-void close_sockets(int fdmax, fd_set read_fds)
+void close_sockets()
 {
-    // Close all opened sockets
-    for (int i = 2; i <= fdmax; ++i)
-        if (FD_ISSET(i, &read_fds))
+    // Close all watched sockets (but STDIN)
+    for (int i = STDERR_FILENO + 1; i < event_loop.max_slots; ++i)
+        if (event_loop.slots[i].kind != CONN_NONE)
             close(i);
+    mem_free(event_loop.slots);
+    close(event_loop.epoll_fd);
+
+    if (mcast_egress.socket >= 0)
+        close(mcast_egress.socket);
 }